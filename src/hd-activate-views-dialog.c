@@ -261,32 +261,27 @@ hd_activate_views_dialog_init (HDActivateViewsDialog *dialog)
   /* Append views */
   for (i = 1; i <= HD_DESKTOP_VIEWS; i++)
     {
-      gchar *bg_image;
       GdkPixbuf *pixbuf;
       GtkTreeIter iter;
       GtkTreePath *path;
+      guint view = i - 1;
 
       if (hd_change_background_dialog_is_portrait () 
             && hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
-        bg_image = g_strdup_printf ("%s/.backgrounds/background_portrait-%u.png",
-                                    g_get_home_dir (),
-                                    i);
-      else
-        bg_image = g_strdup_printf ("%s/.backgrounds/background-%u.png",
-                                    g_get_home_dir (),
-                                    i);        
+        view += HD_DESKTOP_VIEWS;
 
-      pixbuf = gdk_pixbuf_new_from_file_at_scale (bg_image, 125, 75, TRUE, &error);
+      pixbuf = hd_backgrounds_load_cached_image_at_scale (hd_backgrounds_get (),
+                                                          view,
+                                                          125, 75,
+                                                          &error);
 
       if (error)
         {
-          g_warning ("Could not get background image for view %u, '%s'. %s",
-                     i, bg_image, error->message);
+          g_warning ("Could not get background image for view %u. %s",
+                     i, error->message);
           g_clear_error (&error);
         }
 
-      g_free (bg_image);
-
       if (!pixbuf)
         {
           pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
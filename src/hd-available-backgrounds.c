@@ -24,6 +24,8 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+
 #include <glib/gi18n.h>
 
 #include "hd-backgrounds.h"
@@ -40,7 +42,6 @@
 struct _HDAvailableBackgroundsPrivate
 {
   GtkListStore *backgrounds_store;
-  GtkTreeModel *sorted_model;
   GtkTreeModel *filter_model;
 
   guint current_view;
@@ -48,6 +49,12 @@ struct _HDAvailableBackgroundsPrivate
 
   GFile *user_background;
   GtkTreePath *user_path;
+
+  /* Cancelled when the backgrounds are disposed */
+  GCancellable *cancellable;
+
+  /* GtkTreeIter of the HDBackground rows, list store iters persist */
+  GHashTable *row_iters;
 };
 
 static void hd_available_backgrounds_dispose (GObject *object);
@@ -92,127 +99,91 @@ hd_available_backgrounds_class_init (HDAvailableBackgroundsClass *klass)
                                               G_TYPE_POINTER);
 }
 
-static gboolean
-is_user_path_iter (HDAvailableBackgrounds *backgrounds,
-                   GtkTreeIter            *sort_iter)
-{
-  HDAvailableBackgroundsPrivate *priv = backgrounds->priv;
-  GtkTreePath *path;
-  gboolean result = FALSE;
-
-  if (!priv->user_path)
-    return result;
-
-  path = gtk_tree_model_get_path (GTK_TREE_MODEL (priv->backgrounds_store),
-                                  sort_iter);
-
-  result = (gtk_tree_path_compare (path, priv->user_path) == 0);
-
-  gtk_tree_path_free (path);
-
-  return result;
-}
-
 static guint
 get_priority (HDAvailableBackgrounds *backgrounds,
-              GtkTreeModel           *model,
-              GtkTreeIter            *iter)
+              HDBackground           *background,
+              gboolean                is_ovi)
 {
   HDAvailableBackgroundsPrivate *priv = backgrounds->priv;
-  guint priority = 0;
-  gboolean is_ovi = FALSE;
+  guint priority = 2;
 
-  gtk_tree_model_get (model,
-                      iter,
-                      HD_BACKGROUND_COL_OVI, &is_ovi,
-                      -1);
   if (is_ovi)
-    return 4;
-
-  if (!is_user_path_iter (backgrounds,
-                          iter))
+    priority = 4;
+  /* The current or the user selected file, see user_path. The sorted store
+   * moves rows with a binary search, so paths cannot be compared here. */
+  else if (HD_IS_FILE_BACKGROUND (background))
+    priority = 0;
+  else if (background)
     {
-      HDBackground *background;
-
-      priority = 2;
+      GFile *image_file;
 
-      gtk_tree_model_get (model,
-                          iter,
-                          HD_BACKGROUND_COL_OBJECT, &background,
-                          -1);
-
-      if (background)
-        {
-          GFile *image_file;
-
-          image_file = hd_background_get_image_file_for_view (background,
-                                                              priv->current_view);
+      image_file = hd_background_get_image_file_for_view (background,
+                                                          priv->current_view);
 
-
-          if (g_file_equal (priv->current_background,
-                            image_file))
-            priority = 1;
-          else if (HD_IS_THEME_BACKGROUND (background))
-            priority = 3;
-
-          g_object_unref (background);
-        }
+      if (priv->current_background &&
+          g_file_equal (priv->current_background,
+                        image_file))
+        priority = 1;
+      else if (HD_IS_THEME_BACKGROUND (background))
+        priority = 3;
     }
 
   return priority;
 }
 
+/*
+ * Returns the HD_BACKGROUND_COL_SORT_KEY of a row, the priority digit
+ * followed by the collation key of the label. The keys are compared with
+ * strcmp, so the sort does not look at the background objects.
+ */
 static char *
-get_name (GtkTreeModel *model,
-          GtkTreeIter *iter)
+get_sort_key (HDAvailableBackgrounds *backgrounds,
+              HDBackground           *background,
+              gboolean                is_ovi,
+              const char             *label)
 {
-  char *name;
+  char *collate_key, *sort_key;
 
-  gtk_tree_model_get (model,
-                      iter,
-                      HD_BACKGROUND_COL_LABEL, &name,
-                      -1);
+  collate_key = label ? g_utf8_collate_key (label, -1) : g_strdup ("");
 
-  return name;
+  sort_key = g_strdup_printf ("%u%s",
+                              get_priority (backgrounds,
+                                            background,
+                                            is_ovi),
+                              collate_key);
+
+  g_free (collate_key);
+
+  return sort_key;
 }
 
 static gint
-backgrounds_iter_cmp (GtkTreeModel           *model,
-                      GtkTreeIter            *a,
-                      GtkTreeIter            *b,
-                      HDAvailableBackgrounds *backgrounds)
+backgrounds_iter_cmp (GtkTreeModel *model,
+                      GtkTreeIter  *a,
+                      GtkTreeIter  *b,
+                      gpointer      data)
 {
-  guint priority_a, priority_b;
+  char *sort_key_a, *sort_key_b;
+  gint result;
 
-  priority_a = get_priority (backgrounds,
-                             model,
-                             a);
-  priority_b = get_priority (backgrounds,
-                             model,
-                             b);
+  gtk_tree_model_get (model,
+                      a,
+                      HD_BACKGROUND_COL_SORT_KEY, &sort_key_a,
+                      -1);
+  gtk_tree_model_get (model,
+                      b,
+                      HD_BACKGROUND_COL_SORT_KEY, &sort_key_b,
+                      -1);
 
-  if (priority_a != priority_b)
-    {
-      return priority_a - priority_b;
-    }
+  if (sort_key_a && sort_key_b)
+    result = strcmp (sort_key_a, sort_key_b);
   else
-    {
-      char *name_a, *name_b;
-      gint result;
+    result = sort_key_a && !sort_key_b ? 1 : -1;
 
-      name_a = get_name (model, a);
-      name_b = get_name (model, b);
+  g_free (sort_key_a);
+  g_free (sort_key_b);
 
-      if (name_a && name_b)
-        result = g_utf8_collate (name_a, name_b);
-      else
-        result = name_a && !name_b ? 1 : -1;
-
-      g_free (name_a);
-      g_free (name_b);
-
-      return result;
-    }
+  return result;
 }
 
 static void
@@ -227,21 +198,30 @@ hd_available_backgrounds_init (HDAvailableBackgrounds *backgrounds)
                                                 GDK_TYPE_PIXBUF,
                                                 HD_TYPE_BACKGROUND,
                                                 G_TYPE_BOOLEAN,
-                                                G_TYPE_BOOLEAN);
+                                                G_TYPE_BOOLEAN,
+                                                G_TYPE_STRING);
 
-  priv->sorted_model = gtk_tree_model_sort_new_with_model (GTK_TREE_MODEL (priv->backgrounds_store));
-  gtk_tree_sortable_set_default_sort_func (GTK_TREE_SORTABLE (priv->sorted_model),
-                                           (GtkTreeIterCompareFunc) backgrounds_iter_cmp,
-                                           backgrounds,
+  /* Sort the store itself, it inserts rows with a binary search while a
+   * GtkTreeModelSort compares them with all rows of the level */
+  gtk_tree_sortable_set_default_sort_func (GTK_TREE_SORTABLE (priv->backgrounds_store),
+                                           backgrounds_iter_cmp,
+                                           NULL,
                                            NULL);
-  gtk_tree_sortable_set_sort_column_id (GTK_TREE_SORTABLE (priv->sorted_model),
+  gtk_tree_sortable_set_sort_column_id (GTK_TREE_SORTABLE (priv->backgrounds_store),
                                         GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID,
                                         GTK_SORT_ASCENDING);
 
-  priv->filter_model = gtk_tree_model_filter_new (priv->sorted_model,
+  priv->filter_model = gtk_tree_model_filter_new (GTK_TREE_MODEL (priv->backgrounds_store),
                                                   NULL);
   gtk_tree_model_filter_set_visible_column (GTK_TREE_MODEL_FILTER (priv->filter_model),
                                             HD_BACKGROUND_COL_VISIBLE);
+
+  priv->cancellable = g_cancellable_new ();
+
+  priv->row_iters = g_hash_table_new_full (g_direct_hash,
+                                           g_direct_equal,
+                                           NULL,
+                                           (GDestroyNotify) gtk_tree_iter_free);
 }
 
 static void
@@ -250,14 +230,21 @@ hd_available_backgrounds_dispose (GObject *object)
   HDAvailableBackgrounds *available_backgrounds = HD_AVAILABLE_BACKGROUNDS (object);
   HDAvailableBackgroundsPrivate *priv = available_backgrounds->priv;
 
+  if (priv->cancellable)
+    {
+      g_cancellable_cancel (priv->cancellable);
+      priv->cancellable = (g_object_unref (priv->cancellable), NULL);
+    }
+
   if (priv->user_path)
     priv->user_path = (gtk_tree_path_free (priv->user_path), NULL);
 
+  if (priv->row_iters)
+    priv->row_iters = (g_hash_table_destroy (priv->row_iters), NULL);
+
   if (priv->backgrounds_store)
     priv->backgrounds_store = (g_object_unref (priv->backgrounds_store), NULL);
 
-  if (priv->sorted_model)
-    priv->sorted_model = (g_object_unref (priv->sorted_model), NULL);
 
   if (priv->filter_model)
     priv->filter_model = (g_object_unref (priv->filter_model), NULL);
@@ -277,6 +264,18 @@ hd_available_backgrounds_get_model (HDAvailableBackgrounds *backgrounds)
   return priv->filter_model;
 }
 
+/*
+ * Returns the cancellable of the asynchronous operations adding rows, it is
+ * cancelled when backgrounds is disposed.
+ */
+GCancellable *
+hd_available_backgrounds_get_cancellable (HDAvailableBackgrounds *backgrounds)
+{
+  g_return_val_if_fail (HD_IS_AVAILABLE_BACKGROUNDS (backgrounds), NULL);
+
+  return backgrounds->priv->cancellable;
+}
+
 static void
 check_current_background (HDAvailableBackgrounds *backgrounds,
                           HDBackground           *background)
@@ -306,6 +305,26 @@ check_current_background (HDAvailableBackgrounds *backgrounds,
     } 
 }
 
+/* Finds the row of background, imagesets from the catalog are added again
+ * when their .desktop file changed */
+static gboolean
+find_background_iter (HDAvailableBackgrounds *backgrounds,
+                      HDBackground           *background,
+                      GtkTreeIter            *iter)
+{
+  HDAvailableBackgroundsPrivate *priv = backgrounds->priv;
+  GtkTreeIter *row_iter;
+
+  row_iter = g_hash_table_lookup (priv->row_iters,
+                                  background);
+  if (!row_iter)
+    return FALSE;
+
+  *iter = *row_iter;
+
+  return TRUE;
+}
+
 void
 hd_available_backgrounds_add_with_file (HDAvailableBackgrounds *backgrounds,
                                         HDBackground           *background,
@@ -314,24 +333,43 @@ hd_available_backgrounds_add_with_file (HDAvailableBackgrounds *backgrounds,
 {
   HDAvailableBackgroundsPrivate *priv;
   GtkTreeIter iter;
+  char *sort_key;
   
   g_return_if_fail (HD_IS_AVAILABLE_BACKGROUNDS (backgrounds));
 
   priv = backgrounds->priv;
 
-  gtk_list_store_insert_with_values (priv->backgrounds_store,
-                                     &iter,
-                                     -1,
-                                     HD_BACKGROUND_COL_LABEL, label,
-                                     HD_BACKGROUND_COL_OBJECT, background,
-                                     HD_BACKGROUND_COL_VISIBLE, TRUE,
-                                     HD_BACKGROUND_COL_OVI, FALSE,
-                                     -1);
+  sort_key = get_sort_key (backgrounds, background, FALSE, label);
+
+  if (find_background_iter (backgrounds, background, &iter))
+    gtk_list_store_set (priv->backgrounds_store,
+                        &iter,
+                        HD_BACKGROUND_COL_LABEL, label,
+                        HD_BACKGROUND_COL_SORT_KEY, sort_key,
+                        -1);
+  else
+    {
+      gtk_list_store_insert_with_values (priv->backgrounds_store,
+                                         &iter,
+                                         -1,
+                                         HD_BACKGROUND_COL_LABEL, label,
+                                         HD_BACKGROUND_COL_OBJECT, background,
+                                         HD_BACKGROUND_COL_VISIBLE, TRUE,
+                                         HD_BACKGROUND_COL_OVI, FALSE,
+                                         HD_BACKGROUND_COL_SORT_KEY, sort_key,
+                                         -1);
+      g_hash_table_insert (priv->row_iters,
+                           background,
+                           gtk_tree_iter_copy (&iter));
+    }
+
+  g_free (sort_key);
 
   hd_background_set_thumbnail_from_file (HD_BACKGROUND (background),
                                          GTK_TREE_MODEL (priv->backgrounds_store),
                                          &iter,
-                                         image_file);
+                                         image_file,
+                                         priv->cancellable);
 
   check_current_background (backgrounds,
                             background);
@@ -345,32 +383,71 @@ hd_available_backgrounds_add_with_icon (HDAvailableBackgrounds *backgrounds,
 {
   HDAvailableBackgroundsPrivate *priv;
   GtkTreeIter iter;
+  char *sort_key;
   
   g_return_if_fail (HD_IS_AVAILABLE_BACKGROUNDS (backgrounds));
 
   priv = backgrounds->priv;
 
-  gtk_list_store_insert_with_values (priv->backgrounds_store,
-                                     &iter,
-                                     -1,
-                                     HD_BACKGROUND_COL_LABEL, label,
-                                     HD_BACKGROUND_COL_THUMBNAIL, icon,
-                                     HD_BACKGROUND_COL_OBJECT, background,
-                                     HD_BACKGROUND_COL_VISIBLE, TRUE,
-                                     HD_BACKGROUND_COL_OVI, FALSE,
-                                     -1);
+  sort_key = get_sort_key (backgrounds, background, FALSE, label);
+
+  if (find_background_iter (backgrounds, background, &iter))
+    gtk_list_store_set (priv->backgrounds_store,
+                        &iter,
+                        HD_BACKGROUND_COL_LABEL, label,
+                        HD_BACKGROUND_COL_THUMBNAIL, icon,
+                        HD_BACKGROUND_COL_SORT_KEY, sort_key,
+                        -1);
+  else
+    {
+      gtk_list_store_insert_with_values (priv->backgrounds_store,
+                                         &iter,
+                                         -1,
+                                         HD_BACKGROUND_COL_LABEL, label,
+                                         HD_BACKGROUND_COL_THUMBNAIL, icon,
+                                         HD_BACKGROUND_COL_OBJECT, background,
+                                         HD_BACKGROUND_COL_VISIBLE, TRUE,
+                                         HD_BACKGROUND_COL_OVI, FALSE,
+                                         HD_BACKGROUND_COL_SORT_KEY, sort_key,
+                                         -1);
+      g_hash_table_insert (priv->row_iters,
+                           background,
+                           gtk_tree_iter_copy (&iter));
+    }
+
+  g_free (sort_key);
 
   check_current_background (backgrounds,
                             background);
 }
 
+void
+hd_available_backgrounds_remove (HDAvailableBackgrounds *backgrounds,
+                                 HDBackground           *background)
+{
+  HDAvailableBackgroundsPrivate *priv;
+  GtkTreeIter iter;
+
+  g_return_if_fail (HD_IS_AVAILABLE_BACKGROUNDS (backgrounds));
+
+  priv = backgrounds->priv;
+
+  if (find_background_iter (backgrounds, background, &iter))
+    {
+      g_hash_table_remove (priv->row_iters,
+                           background);
+      gtk_list_store_remove (priv->backgrounds_store,
+                             &iter);
+    }
+}
+
 void
 hd_available_backgrounds_run (HDAvailableBackgrounds *backgrounds,
                               guint                   current_view)
 {
   HDAvailableBackgroundsPrivate *priv;
   HDBackground *background;
-  char *label;
+  char *label, *sort_key;
   GFile *image_file;
   GtkIconTheme *icon_theme;
   GdkPixbuf *ovi_icon = NULL;
@@ -390,6 +467,7 @@ hd_available_backgrounds_run (HDAvailableBackgrounds *backgrounds,
     background = hd_file_background_new (priv->current_background);
     
     label = hd_file_background_get_label (HD_FILE_BACKGROUND (background));
+    sort_key = get_sort_key (backgrounds, background, FALSE, label);
     gtk_list_store_insert_with_values (priv->backgrounds_store,
 				       &iter,
 				       -1,
@@ -397,13 +475,16 @@ hd_available_backgrounds_run (HDAvailableBackgrounds *backgrounds,
 				       HD_BACKGROUND_COL_OBJECT, background,
 				       HD_BACKGROUND_COL_VISIBLE, TRUE,
 				       HD_BACKGROUND_COL_OVI, FALSE,
+				       HD_BACKGROUND_COL_SORT_KEY, sort_key,
 				       -1);
+    g_free (sort_key);
     
     image_file = hd_file_background_get_image_file (HD_FILE_BACKGROUND (background));
     hd_background_set_thumbnail_from_file (background,
 					   GTK_TREE_MODEL (priv->backgrounds_store),
 					   &iter,
-					   image_file);
+					   image_file,
+					   priv->cancellable);
     g_object_unref (background);
     priv->user_path = gtk_tree_model_get_path (GTK_TREE_MODEL (priv->backgrounds_store),
 					       &iter);
@@ -420,6 +501,8 @@ hd_available_backgrounds_run (HDAvailableBackgrounds *backgrounds,
                                          60, GTK_ICON_LOOKUP_NO_SVG,
                                          NULL);
 
+  sort_key = get_sort_key (backgrounds, NULL, TRUE,
+                           dgettext (GETTEXT_PACKAGE, "home_li_get_ovi"));
   gtk_list_store_insert_with_values (priv->backgrounds_store,
                                      NULL,
                                      10000,
@@ -428,7 +511,9 @@ hd_available_backgrounds_run (HDAvailableBackgrounds *backgrounds,
                                      HD_BACKGROUND_COL_OBJECT, NULL,
                                      HD_BACKGROUND_COL_VISIBLE, TRUE,
                                      HD_BACKGROUND_COL_OVI, TRUE,
+                                     HD_BACKGROUND_COL_SORT_KEY, sort_key,
                                      -1);
+  g_free (sort_key);
 }
 
 void
@@ -437,9 +522,9 @@ hd_available_backgrounds_set_user_selected (HDAvailableBackgrounds *backgrounds,
 {
   HDAvailableBackgroundsPrivate *priv;
   HDBackground *background;
-  char *label;
+  char *label, *sort_key;
   GFile *image_file;
-  GtkTreeIter iter, sort_iter, filter_iter;
+  GtkTreeIter iter, filter_iter;
   g_return_if_fail (HD_IS_AVAILABLE_BACKGROUNDS (backgrounds));
 
   priv = backgrounds->priv;
@@ -461,26 +546,32 @@ hd_available_backgrounds_set_user_selected (HDAvailableBackgrounds *backgrounds,
   background = hd_file_background_new (priv->user_background);
 
   label = hd_file_background_get_label (HD_FILE_BACKGROUND (background));
+  sort_key = get_sort_key (backgrounds, background, FALSE, label);
   gtk_list_store_set (priv->backgrounds_store,
                       &iter,
                       HD_BACKGROUND_COL_LABEL, label,
                       HD_BACKGROUND_COL_OBJECT, background,
                       HD_BACKGROUND_COL_VISIBLE, TRUE,
+                      HD_BACKGROUND_COL_SORT_KEY, sort_key,
                       -1);
+  g_free (sort_key);
+
+  /* The store moved the row when it was sorted */
+  gtk_tree_path_free (priv->user_path);
+  priv->user_path = gtk_tree_model_get_path (GTK_TREE_MODEL (priv->backgrounds_store),
+                                             &iter);
 
   image_file = hd_file_background_get_image_file (HD_FILE_BACKGROUND (background));
   hd_background_set_thumbnail_from_file (background,
                                          GTK_TREE_MODEL (priv->backgrounds_store),
                                          &iter,
-                                         image_file);
+                                         image_file,
+                                         priv->cancellable);
   g_object_unref (background);
 
-  gtk_tree_model_sort_convert_child_iter_to_iter (GTK_TREE_MODEL_SORT (priv->sorted_model),
-                                                  &sort_iter,
-                                                  &iter);
   gtk_tree_model_filter_convert_child_iter_to_iter (GTK_TREE_MODEL_FILTER (priv->filter_model),
                                                     &filter_iter,
-                                                    &sort_iter);
+                                                    &iter);
 
   g_signal_emit (backgrounds,
                  signals [SELECTION_CHANGED],
@@ -55,6 +55,7 @@ GType                   hd_available_backgrounds_get_type      (void);
 HDAvailableBackgrounds *hd_available_backgrounds_new           (void);
 
 GtkTreeModel           *hd_available_backgrounds_get_model     (HDAvailableBackgrounds *background);
+GCancellable           *hd_available_backgrounds_get_cancellable (HDAvailableBackgrounds *backgrounds);
 
 void                    hd_available_backgrounds_add_with_file (HDAvailableBackgrounds *backgrounds,
                                                                 HDBackground           *background,
@@ -64,6 +65,8 @@ void                    hd_available_backgrounds_add_with_icon (HDAvailableBackg
                                                                 HDBackground           *background,
                                                                 const char             *label,
                                                                 GdkPixbuf              *icon);
+void                    hd_available_backgrounds_remove        (HDAvailableBackgrounds *backgrounds,
+                                                                HDBackground           *background);
 
 void                    hd_available_backgrounds_run (HDAvailableBackgrounds *backgrounds,
                                                       guint                   current_view);
@@ -0,0 +1,589 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Runs the background image pipeline (load scaled and cropped, load at
+ * size and save) over a corpus of images outside of the desktop and
+ * reports the wall time, peak RSS and bytes written of each stage.
+ *
+ * Without --corpus a corpus of JPEG and PNG images of several sizes and
+ * EXIF orientations is generated in a temporary directory.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "hd-desktop.h"
+#include "hd-pixbuf-utils.h"
+
+/* Compression of the cached images, see hd-backgrounds.c */
+#define SAVE_COMPRESSION 1
+
+typedef struct
+{
+  int width;
+  int height;
+  const char *type;
+  guint orientation;
+} CorpusImage;
+
+static const CorpusImage corpus_images[] = {
+  /* Screen sized */
+  { HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT, "jpeg", 1 },
+  { HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT, "png", 1 },
+  /* Camera sizes, 3 MP to 8 MP, with the rotations of the camera */
+  { 2048, 1536, "jpeg", 1 },
+  { 2048, 1536, "jpeg", 6 },
+  { 2592, 1944, "jpeg", 1 },
+  { 2592, 1944, "jpeg", 3 },
+  { 2592, 1944, "jpeg", 8 },
+  { 3264, 2448, "jpeg", 1 },
+  { 2048, 1536, "png", 1 },
+  /* Wallpaper panorama */
+  { HD_DESKTOP_VIEWS * HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT, "jpeg", 1 },
+  { HD_DESKTOP_VIEWS * HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT, "png", 1 }
+};
+
+typedef struct
+{
+  guint n;
+  gdouble min;
+  gdouble total;
+  glong peak_rss;
+  goffset bytes;
+  gboolean failed;
+} StageResult;
+
+static gchar *corpus_dir = NULL;
+static gint iterations = 3;
+static gboolean machine_readable = FALSE;
+static gboolean keep_corpus = FALSE;
+
+static GOptionEntry entries[] =
+{
+  { "corpus", 'c', 0, G_OPTION_ARG_FILENAME, &corpus_dir, "Use the images in DIR instead of a generated corpus", "DIR" },
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Run each stage N times (default 3)", "N" },
+  { "machine-readable", 'm', 0, G_OPTION_ARG_NONE, &machine_readable, "Print tab separated values", NULL },
+  { "keep", 'k', 0, G_OPTION_ARG_NONE, &keep_corpus, "Keep the generated corpus", NULL },
+  { NULL }
+};
+
+/*
+ * Resets the peak resident set size of the process to the current one,
+ * so the peak of each stage is measured instead of the lifetime peak.
+ * Returns FALSE if the kernel does not support it (before Linux 4.0).
+ */
+static gboolean
+reset_peak_rss (void)
+{
+  FILE *clear_refs;
+  gboolean result;
+
+  clear_refs = fopen ("/proc/self/clear_refs", "w");
+  if (!clear_refs)
+    return FALSE;
+
+  result = fputs ("5", clear_refs) >= 0;
+
+  return fclose (clear_refs) == 0 && result;
+}
+
+/* Peak resident set size in kB since the last reset_peak_rss () */
+static glong
+get_peak_rss (void)
+{
+  struct rusage usage;
+  gchar *status, *hwm;
+  glong peak_rss = -1;
+
+  if (g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    {
+      hwm = strstr (status, "VmHWM:");
+      if (hwm)
+        peak_rss = strtol (hwm + strlen ("VmHWM:"), NULL, 10);
+      g_free (status);
+    }
+
+  if (peak_rss >= 0)
+    return peak_rss;
+
+  /* Lifetime peak of the process */
+  if (getrusage (RUSAGE_SELF, &usage) < 0)
+    return -1;
+
+  return usage.ru_maxrss;
+}
+
+static goffset
+get_file_size (GFile *file)
+{
+  GFileInfo *info;
+  goffset size;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE,
+                            NULL,
+                            NULL);
+  if (!info)
+    return -1;
+
+  size = g_file_info_get_size (info);
+  g_object_unref (info);
+
+  return size;
+}
+
+/* Gradients with some noise, so the images do not compress too well */
+static GdkPixbuf *
+create_test_pixbuf (int width,
+                    int height)
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  int rowstride, x, y;
+  guint32 seed = 1;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y = 0; y < height; y++)
+    {
+      guchar *p = pixels + y * rowstride;
+
+      for (x = 0; x < width; x++, p += 3)
+        {
+          seed = seed * 1103515245 + 12345;
+
+          p[0] = (x * 255 / width + (seed >> 28)) & 0xff;
+          p[1] = (y * 255 / height + (seed >> 24)) & 0xff;
+          p[2] = ((x + y) * 127 / (width + height) + (seed >> 26)) & 0xff;
+        }
+    }
+
+  return pixbuf;
+}
+
+/*
+ * Inserts an APP1 EXIF segment with the orientation tag after the SOI
+ * marker of the JPEG image in buffer.
+ */
+static gchar *
+insert_exif_orientation (const gchar *buffer,
+                         gsize        length,
+                         guint        orientation,
+                         gsize       *new_length)
+{
+  static const guchar exif_template[] = {
+    0xff, 0xe1, 0x00, 0x22,                  /* APP1, length 34 */
+    'E', 'x', 'i', 'f', 0x00, 0x00,
+    'M', 'M', 0x00, 0x2a,                    /* big endian TIFF header */
+    0x00, 0x00, 0x00, 0x08,                  /* offset of IFD0 */
+    0x00, 0x01,                              /* one entry */
+    0x01, 0x12, 0x00, 0x03,                  /* orientation, SHORT */
+    0x00, 0x00, 0x00, 0x01,                  /* count */
+    0x00, 0x00, 0x00, 0x00,                  /* value */
+    0x00, 0x00, 0x00, 0x00                   /* no next IFD */
+  };
+  gchar *result;
+
+  *new_length = length + sizeof (exif_template);
+  result = g_malloc (*new_length);
+
+  memcpy (result, buffer, 2);
+  memcpy (result + 2, exif_template, sizeof (exif_template));
+  result[2 + 29] = orientation;
+  memcpy (result + 2 + sizeof (exif_template), buffer + 2, length - 2);
+
+  return result;
+}
+
+static gboolean
+write_corpus_image (const char         *dir,
+                    const CorpusImage  *image,
+                    GError            **error)
+{
+  GdkPixbuf *pixbuf;
+  gchar *buffer = NULL, *filename, *path;
+  gsize length;
+  gboolean result;
+
+  pixbuf = create_test_pixbuf (image->width, image->height);
+
+  if (g_str_equal (image->type, "jpeg"))
+    result = gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &length,
+                                        "jpeg", error,
+                                        "quality", "90",
+                                        NULL);
+  else
+    result = gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &length,
+                                        "png", error,
+                                        NULL);
+
+  g_object_unref (pixbuf);
+
+  if (!result)
+    return FALSE;
+
+  if (image->orientation != 1)
+    {
+      gchar *exif_buffer;
+
+      exif_buffer = insert_exif_orientation (buffer,
+                                             length,
+                                             image->orientation,
+                                             &length);
+      g_free (buffer);
+      buffer = exif_buffer;
+    }
+
+  filename = g_strdup_printf ("%dx%d-%u.%s",
+                              image->width,
+                              image->height,
+                              image->orientation,
+                              g_str_equal (image->type, "jpeg") ? "jpg" : "png");
+  path = g_build_filename (dir, filename, NULL);
+
+  result = g_file_set_contents (path, buffer, length, error);
+
+  g_free (path);
+  g_free (filename);
+  g_free (buffer);
+
+  return result;
+}
+
+static gchar *
+generate_corpus (GError **error)
+{
+  gchar *dir;
+  guint i;
+
+  dir = g_build_filename (g_get_tmp_dir (),
+                          "hd-background-benchmark-XXXXXX",
+                          NULL);
+  if (!mkdtemp (dir))
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errno),
+                   "Could not create directory %s: %s",
+                   dir,
+                   g_strerror (errno));
+      g_free (dir);
+      return NULL;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (corpus_images); i++)
+    {
+      if (!write_corpus_image (dir, &corpus_images[i], error))
+        {
+          g_free (dir);
+          return NULL;
+        }
+    }
+
+  return dir;
+}
+
+static void
+remove_dir (const char *path)
+{
+  GDir *dir;
+  const char *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  while (dir && (name = g_dir_read_name (dir)))
+    {
+      gchar *file = g_build_filename (path, name, NULL);
+      g_unlink (file);
+      g_free (file);
+    }
+
+  if (dir)
+    g_dir_close (dir);
+
+  g_rmdir (path);
+}
+
+static void
+stage_add (StageResult *stage,
+           gdouble      elapsed)
+{
+  if (!stage->n || elapsed < stage->min)
+    stage->min = elapsed;
+  stage->total += elapsed;
+  stage->n++;
+  stage->peak_rss = MAX (stage->peak_rss, get_peak_rss ());
+}
+
+static void
+stage_failed (StageResult *stage,
+              const char  *name,
+              const char  *path,
+              GError      *error)
+{
+  if (!stage->failed)
+    g_printerr ("%s %s: %s\n", name, path, error->message);
+
+  stage->failed = TRUE;
+  g_error_free (error);
+}
+
+static void
+print_header (void)
+{
+  if (machine_readable)
+    g_print ("file\tstage\titerations\tmin_ms\tmean_ms\tpeak_rss_kb\tbytes\n");
+  else
+    g_print ("%-28s %-20s %10s %10s %12s %10s\n",
+             "file", "stage", "min ms", "mean ms", "peak RSS kB", "bytes");
+}
+
+static void
+print_stage (const char  *file,
+             const char  *name,
+             StageResult *stage)
+{
+  if (machine_readable)
+    {
+      if (stage->failed || !stage->n)
+        g_print ("%s\t%s\t0\t\t\t\t\n", file, name);
+      else
+        g_print ("%s\t%s\t%u\t%.3f\t%.3f\t%ld\t%" G_GINT64_FORMAT "\n",
+                 file,
+                 name,
+                 stage->n,
+                 stage->min * 1000,
+                 stage->total / stage->n * 1000,
+                 stage->peak_rss,
+                 (gint64) stage->bytes);
+    }
+  else
+    {
+      if (stage->failed || !stage->n)
+        g_print ("%-28s %-20s %10s\n", file, name, "failed");
+      else
+        g_print ("%-28s %-20s %10.1f %10.1f %12ld %10" G_GINT64_FORMAT "\n",
+                 file,
+                 name,
+                 stage->min * 1000,
+                 stage->total / stage->n * 1000,
+                 stage->peak_rss,
+                 (gint64) stage->bytes);
+    }
+}
+
+static gint
+compare_paths (gconstpointer a,
+               gconstpointer b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+static void
+run_pipeline (const char *path,
+              const char *output_path)
+{
+  HDImageSize screen_size = {HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT};
+  StageResult scaled = { 0, }, at_size = { 0, }, save = { 0, };
+  GFile *file, *output_file;
+  GdkPixbuf *pixbuf;
+  GTimer *timer;
+  gchar *basename;
+  int width, height, i;
+
+  file = g_file_new_for_path (path);
+  output_file = g_file_new_for_path (output_path);
+  timer = g_timer_new ();
+
+  if (!gdk_pixbuf_get_file_info (path, &width, &height))
+    {
+      g_printerr ("Unknown image format %s\n", path);
+      goto cleanup;
+    }
+
+  for (i = 0; i < iterations; i++)
+    {
+      HDImageSize image_size = {width, height};
+      GError *error = NULL;
+
+      /* Load scaled and cropped to the screen, like the file backgrounds */
+      reset_peak_rss ();
+      g_timer_start (timer);
+      pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (file,
+                                                        &screen_size,
+                                                        NULL,
+                                                        NULL,
+                                                        &error);
+      g_timer_stop (timer);
+
+      if (!pixbuf)
+        {
+          stage_failed (&scaled, "load_scaled_and_cropped", path, error);
+          continue;
+        }
+      stage_add (&scaled, g_timer_elapsed (timer, NULL));
+
+      /* Save the result as cached image */
+      reset_peak_rss ();
+      g_timer_start (timer);
+      if (hd_pixbuf_utils_save (output_file,
+                                pixbuf,
+                                "png",
+                                SAVE_COMPRESSION,
+                                NULL,
+                                &error))
+        {
+          g_timer_stop (timer);
+          stage_add (&save, g_timer_elapsed (timer, NULL));
+          save.bytes = get_file_size (output_file);
+        }
+      else
+        stage_failed (&save, "save", path, error);
+
+      g_object_unref (pixbuf);
+
+      /* Load at the full size, like the wallpaper backgrounds */
+      reset_peak_rss ();
+      g_timer_start (timer);
+      pixbuf = hd_pixbuf_utils_load_at_size (file,
+                                             &image_size,
+                                             NULL,
+                                             NULL,
+                                             &error);
+      g_timer_stop (timer);
+
+      if (!pixbuf)
+        {
+          stage_failed (&at_size, "load_at_size", path, error);
+          continue;
+        }
+      stage_add (&at_size, g_timer_elapsed (timer, NULL));
+
+      g_object_unref (pixbuf);
+    }
+
+  basename = g_path_get_basename (path);
+  print_stage (basename, "load_scaled_and_cropped", &scaled);
+  print_stage (basename, "save", &save);
+  print_stage (basename, "load_at_size", &at_size);
+  g_free (basename);
+
+cleanup:
+  g_file_delete (output_file, NULL, NULL);
+
+  g_timer_destroy (timer);
+  g_object_unref (output_file);
+  g_object_unref (file);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GDir *dir;
+  GPtrArray *paths;
+  const char *name;
+  gchar *output_path;
+  gboolean generated = FALSE;
+  guint i;
+  GError *error = NULL;
+
+  g_type_init ();
+
+  context = g_option_context_new ("- benchmark the background image pipeline");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (context);
+
+  if (iterations < 1)
+    iterations = 1;
+
+  if (!corpus_dir)
+    {
+      corpus_dir = generate_corpus (&error);
+      if (!corpus_dir)
+        {
+          g_printerr ("Could not generate corpus. %s\n", error->message);
+          return 1;
+        }
+      generated = TRUE;
+    }
+
+  dir = g_dir_open (corpus_dir, 0, &error);
+  if (!dir)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  /* Sorted for comparable output across runs */
+  paths = g_ptr_array_new ();
+  while ((name = g_dir_read_name (dir)))
+    g_ptr_array_add (paths, g_build_filename (corpus_dir, name, NULL));
+  g_dir_close (dir);
+  g_ptr_array_sort (paths, compare_paths);
+
+  output_path = g_build_filename (g_get_tmp_dir (),
+                                  "hd-background-benchmark-output.png",
+                                  NULL);
+
+  print_header ();
+
+  for (i = 0; i < paths->len; i++)
+    run_pipeline (g_ptr_array_index (paths, i), output_path);
+
+  for (i = 0; i < paths->len; i++)
+    g_free (g_ptr_array_index (paths, i));
+  g_ptr_array_free (paths, TRUE);
+  g_free (output_path);
+
+  if (generated)
+    {
+      if (keep_corpus)
+        g_printerr ("Corpus kept in %s\n", corpus_dir);
+      else
+        remove_dir (corpus_dir);
+    }
+
+  g_free (corpus_dir);
+
+  return 0;
+}
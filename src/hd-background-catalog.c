@@ -0,0 +1,668 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "hd-backgrounds.h"
+#include "hd-delayed-write.h"
+
+#include "hd-background-catalog.h"
+
+/* catalog keyfile */
+#define CATALOG_GROUP "Catalog"
+#define CATALOG_KEY_VERSION "Version"
+#define CATALOG_KEY_PORTRAIT "Portrait"
+#define CATALOG_VERSION 2
+
+/* Group of a folder listing, followed by the folder URI. The modification
+ * time is stored in microseconds. */
+#define CATALOG_FOLDER_GROUP_PREFIX "Folder "
+#define CATALOG_KEY_MTIME "Mtime"
+
+/* Listings of folders modified less than this many microseconds before
+ * they were enumerated are not stored. The modification time of some file
+ * systems (FAT) has a resolution of 2 seconds, so the folder could still
+ * change without changing it. */
+#define CATALOG_MTIME_RESOLUTION (2 * G_USEC_PER_SEC)
+#define CATALOG_KEY_CHILDREN "Children"
+
+/* Group of an imageset, followed by the .desktop file URI. Entries
+ * without a name are .desktop files which are no valid imagesets. */
+#define CATALOG_IMAGESET_GROUP_PREFIX "Imageset "
+#define CATALOG_KEY_ETAG "Etag"
+#define CATALOG_KEY_NAME "Name"
+#define CATALOG_KEY_FILES "Files"
+
+/* Number of files enumerated at once */
+#define LIST_FOLDER_BATCH_SIZE 32
+
+typedef struct
+{
+  GFile                        *folder;
+  guint64                       mtime;
+  gboolean                      store;
+  char                         *group;
+  GFileEnumerator              *enumerator;
+  GCancellable                 *cancellable;
+  HDBackgroundCatalogFilesFunc  files_func;
+  gpointer                      user_data;
+
+  /* URIs of the files enumerated so far, NULL terminated when stored */
+  GPtrArray                    *uris;
+} ListFolderData;
+
+static void write_catalog (gpointer data);
+
+static GKeyFile *catalog = NULL;
+static HDDelayedWrite delayed_write = { write_catalog, NULL, 0, FALSE };
+
+static inline char *
+get_catalog_path (void)
+{
+  return g_build_filename (g_get_home_dir (),
+                           ".backgrounds",
+                           "catalog.index",
+                           NULL);
+}
+
+static void
+reset_catalog (gboolean portrait)
+{
+  if (catalog)
+    g_key_file_free (catalog);
+
+  catalog = g_key_file_new ();
+
+  g_key_file_set_integer (catalog,
+                          CATALOG_GROUP,
+                          CATALOG_KEY_VERSION,
+                          CATALOG_VERSION);
+  g_key_file_set_boolean (catalog,
+                          CATALOG_GROUP,
+                          CATALOG_KEY_PORTRAIT,
+                          portrait);
+}
+
+static void
+load_catalog (gboolean portrait)
+{
+  char *path;
+  GError *error = NULL;
+
+  catalog = g_key_file_new ();
+
+  path = get_catalog_path ();
+  g_key_file_load_from_file (catalog,
+                             path,
+                             G_KEY_FILE_NONE,
+                             &error);
+  g_free (path);
+
+  if (error)
+    {
+      g_debug ("%s. Could not load catalog index. %s",
+               __FUNCTION__,
+               error->message);
+      g_error_free (error);
+
+      reset_catalog (portrait);
+      return;
+    }
+
+  if (g_key_file_get_integer (catalog,
+                              CATALOG_GROUP,
+                              CATALOG_KEY_VERSION,
+                              NULL) != CATALOG_VERSION)
+    reset_catalog (portrait);
+}
+
+static GKeyFile *
+get_catalog (void)
+{
+  gboolean portrait;
+
+  portrait = hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ());
+
+  if (G_UNLIKELY (!catalog))
+    load_catalog (portrait);
+
+  /* The image files of the imagesets depend on the portrait setting */
+  if (g_key_file_get_boolean (catalog,
+                              CATALOG_GROUP,
+                              CATALOG_KEY_PORTRAIT,
+                              NULL) != portrait)
+    {
+      reset_catalog (portrait);
+      hd_delayed_write_schedule (&delayed_write);
+    }
+
+  return catalog;
+}
+
+static char *
+get_group (const char *prefix,
+           GFile      *file)
+{
+  char *uri, *group;
+
+  uri = g_file_get_uri (file);
+  group = g_strconcat (prefix, uri, NULL);
+  g_free (uri);
+
+  return group;
+}
+
+/* Removes the imagesets of the .desktop files in folder */
+static void
+remove_folder_imagesets (GKeyFile *key_file,
+                         GFile    *folder)
+{
+  char *folder_prefix, **groups;
+  gsize prefix_length;
+  guint i;
+
+  folder_prefix = get_group (CATALOG_IMAGESET_GROUP_PREFIX, folder);
+  prefix_length = strlen (folder_prefix);
+
+  groups = g_key_file_get_groups (key_file, NULL);
+
+  for (i = 0; groups[i]; i++)
+    {
+      const char *name;
+
+      if (!g_str_has_prefix (groups[i], folder_prefix))
+        continue;
+
+      name = groups[i] + prefix_length;
+      if (name[0] == '/' && !strchr (name + 1, '/'))
+        g_key_file_remove_group (key_file, groups[i], NULL);
+    }
+
+  g_strfreev (groups);
+  g_free (folder_prefix);
+}
+
+static HDObjectVector *
+get_folder_listing (GKeyFile   *key_file,
+                    const char *group,
+                    guint64     mtime)
+{
+  HDObjectVector *children = NULL;
+  char *value, **uris;
+  guint i;
+
+  value = g_key_file_get_string (key_file,
+                                 group,
+                                 CATALOG_KEY_MTIME,
+                                 NULL);
+  if (!value || g_ascii_strtoull (value, NULL, 10) != mtime)
+    goto cleanup;
+
+  uris = g_key_file_get_string_list (key_file,
+                                     group,
+                                     CATALOG_KEY_CHILDREN,
+                                     NULL,
+                                     NULL);
+  if (!uris)
+    goto cleanup;
+
+  children = hd_object_vector_new ();
+
+  for (i = 0; uris[i]; i++)
+    {
+      GFile *child = g_file_new_for_uri (uris[i]);
+
+      hd_object_vector_push_back (children, child);
+
+      g_object_unref (child);
+    }
+
+  g_strfreev (uris);
+
+cleanup:
+  g_free (value);
+
+  return children;
+}
+
+static void
+list_folder_data_free (ListFolderData *data)
+{
+  g_object_unref (data->folder);
+  g_free (data->group);
+  if (data->enumerator)
+    g_object_unref (data->enumerator);
+  if (data->cancellable)
+    g_object_unref (data->cancellable);
+  g_ptr_array_foreach (data->uris, (GFunc) g_free, NULL);
+  g_ptr_array_free (data->uris, TRUE);
+
+  g_slice_free (ListFolderData, data);
+}
+
+/* Stores the listing once the folder is enumerated completely */
+static void
+store_folder_listing (ListFolderData *data)
+{
+  GKeyFile *key_file = get_catalog ();
+  char *mtime_value;
+
+  mtime_value = g_strdup_printf ("%" G_GUINT64_FORMAT, data->mtime);
+  g_ptr_array_add (data->uris, NULL);
+
+  g_key_file_set_string (key_file,
+                         data->group,
+                         CATALOG_KEY_MTIME,
+                         mtime_value);
+  g_key_file_set_string_list (key_file,
+                              data->group,
+                              CATALOG_KEY_CHILDREN,
+                              (const gchar * const *) data->uris->pdata,
+                              data->uris->len - 1);
+
+  g_free (mtime_value);
+
+  hd_delayed_write_schedule (&delayed_write);
+}
+
+static void
+list_folder_error (ListFolderData *data,
+                   GError         *error)
+{
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      char *path = g_file_get_path (data->folder);
+      g_warning ("%s. Could not enumerate folder %s. %s",
+                 __FUNCTION__,
+                 path,
+                 error->message);
+      g_free (path);
+    }
+
+  g_error_free (error);
+}
+
+static void
+next_files_cb (GFileEnumerator *enumerator,
+               GAsyncResult    *result,
+               ListFolderData  *data)
+{
+  HDObjectVector *children;
+  GList *infos, *l;
+  GError *error = NULL;
+
+  infos = g_file_enumerator_next_files_finish (enumerator,
+                                               result,
+                                               &error);
+
+  if (error)
+    {
+      list_folder_error (data, error);
+      goto cleanup;
+    }
+
+  /* End of the folder */
+  if (!infos)
+    {
+      if (data->store)
+        store_folder_listing (data);
+      goto cleanup;
+    }
+
+  children = hd_object_vector_new ();
+
+  for (l = infos; l; l = l->next)
+    {
+      GFileInfo *info = l->data;
+      GFile *child = g_file_get_child (data->folder,
+                                       g_file_info_get_name (info));
+
+      hd_object_vector_push_back (children, child);
+      g_ptr_array_add (data->uris, g_file_get_uri (child));
+
+      g_object_unref (child);
+      g_object_unref (info);
+    }
+
+  g_list_free (infos);
+
+  data->files_func (children, data->user_data);
+
+  g_object_unref (children);
+
+  if (g_cancellable_is_cancelled (data->cancellable))
+    goto cleanup;
+
+  g_file_enumerator_next_files_async (enumerator,
+                                      LIST_FOLDER_BATCH_SIZE,
+                                      G_PRIORITY_DEFAULT,
+                                      data->cancellable,
+                                      (GAsyncReadyCallback) next_files_cb,
+                                      data);
+  return;
+
+cleanup:
+  list_folder_data_free (data);
+}
+
+static void
+enumerate_children_cb (GFile          *folder,
+                       GAsyncResult   *result,
+                       ListFolderData *data)
+{
+  GError *error = NULL;
+
+  data->enumerator = g_file_enumerate_children_finish (folder,
+                                                       result,
+                                                       &error);
+
+  if (error)
+    {
+      list_folder_error (data, error);
+      list_folder_data_free (data);
+      return;
+    }
+
+  g_file_enumerator_next_files_async (data->enumerator,
+                                      LIST_FOLDER_BATCH_SIZE,
+                                      G_PRIORITY_DEFAULT,
+                                      data->cancellable,
+                                      (GAsyncReadyCallback) next_files_cb,
+                                      data);
+}
+
+/*
+ * Lists the files in folder and calls files_func with them. The listing is
+ * taken from the catalog at once when the modification time of folder did
+ * not change since it was stored. Otherwise the imagesets of the folder are
+ * removed from the catalog and the folder is enumerated asynchronously,
+ * files_func is called for each batch of files. Folders modified within
+ * the last CATALOG_MTIME_RESOLUTION are enumerated again next time.
+ */
+void
+hd_background_catalog_list_folder_async (GFile                        *folder,
+                                         GCancellable                 *cancellable,
+                                         HDBackgroundCatalogFilesFunc  files_func,
+                                         gpointer                      user_data)
+{
+  GKeyFile *key_file;
+  GFileInfo *info;
+  GTimeVal now;
+  guint64 mtime;
+  char *group;
+  HDObjectVector *children;
+  ListFolderData *data;
+  GError *error = NULL;
+
+  g_return_if_fail (G_IS_FILE (folder));
+  g_return_if_fail (files_func != NULL);
+
+  info = g_file_query_info (folder,
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            &error);
+
+  if (error)
+    {
+      char *path = g_file_get_path (folder);
+      g_warning ("%s. Could not query folder %s. %s",
+                 __FUNCTION__,
+                 path,
+                 error->message);
+      g_free (path);
+      g_error_free (error);
+      return;
+    }
+
+  mtime = g_file_info_get_attribute_uint64 (info,
+                                            G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+          g_file_info_get_attribute_uint32 (info,
+                                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+  g_object_unref (info);
+
+  key_file = get_catalog ();
+  group = get_group (CATALOG_FOLDER_GROUP_PREFIX, folder);
+
+  children = get_folder_listing (key_file, group, mtime);
+  if (children)
+    {
+      files_func (children, user_data);
+
+      g_object_unref (children);
+      g_free (group);
+      return;
+    }
+
+  remove_folder_imagesets (key_file, folder);
+  g_key_file_remove_group (key_file, group, NULL);
+  hd_delayed_write_schedule (&delayed_write);
+
+  data = g_slice_new0 (ListFolderData);
+  data->folder = g_object_ref (folder);
+  data->mtime = mtime;
+  g_get_current_time (&now);
+  data->store = mtime + CATALOG_MTIME_RESOLUTION <= (guint64) now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+  data->group = group;
+  if (cancellable)
+    data->cancellable = g_object_ref (cancellable);
+  data->files_func = files_func;
+  data->user_data = user_data;
+  data->uris = g_ptr_array_new ();
+
+  g_file_enumerate_children_async (folder,
+                                   G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                   G_FILE_QUERY_INFO_NONE,
+                                   G_PRIORITY_DEFAULT,
+                                   cancellable,
+                                   (GAsyncReadyCallback) enumerate_children_cb,
+                                   data);
+}
+
+/*
+ * Looks up the imageset of desktop_file. Returns FALSE if the catalog does
+ * not contain it. Otherwise etag is set to the etag of the .desktop file
+ * the entry was created from and name and image_files are set to the
+ * imageset, or to NULL when the .desktop file is no valid imageset.
+ */
+gboolean
+hd_background_catalog_lookup_imageset (GFile           *desktop_file,
+                                       char           **etag,
+                                       char           **name,
+                                       HDObjectVector **image_files)
+{
+  GKeyFile *key_file;
+  char *group, **uris;
+  guint i;
+
+  g_return_val_if_fail (G_IS_FILE (desktop_file), FALSE);
+
+  key_file = get_catalog ();
+  group = get_group (CATALOG_IMAGESET_GROUP_PREFIX, desktop_file);
+
+  *etag = g_key_file_get_string (key_file,
+                                 group,
+                                 CATALOG_KEY_ETAG,
+                                 NULL);
+  *name = NULL;
+  *image_files = NULL;
+
+  if (!*etag)
+    goto cleanup;
+
+  *name = g_key_file_get_string (key_file,
+                                 group,
+                                 CATALOG_KEY_NAME,
+                                 NULL);
+  if (!*name)
+    goto cleanup;
+
+  *image_files = hd_object_vector_new ();
+
+  uris = g_key_file_get_string_list (key_file,
+                                     group,
+                                     CATALOG_KEY_FILES,
+                                     NULL,
+                                     NULL);
+  for (i = 0; uris && uris[i]; i++)
+    {
+      GFile *image_file = g_file_new_for_uri (uris[i]);
+
+      hd_object_vector_push_back (*image_files, image_file);
+
+      g_object_unref (image_file);
+    }
+
+  g_strfreev (uris);
+
+cleanup:
+  g_free (group);
+
+  return *etag != NULL;
+}
+
+/*
+ * Stores the imageset of desktop_file with the etag it was parsed from.
+ * Pass NULL for name and image_files if the .desktop file is no valid
+ * imageset.
+ */
+void
+hd_background_catalog_add_imageset (GFile          *desktop_file,
+                                    const char     *etag,
+                                    const char     *name,
+                                    HDObjectVector *image_files)
+{
+  GKeyFile *key_file;
+  char *group;
+
+  g_return_if_fail (G_IS_FILE (desktop_file));
+  g_return_if_fail (etag != NULL);
+
+  key_file = get_catalog ();
+  group = get_group (CATALOG_IMAGESET_GROUP_PREFIX, desktop_file);
+
+  g_key_file_remove_group (key_file, group, NULL);
+
+  g_key_file_set_string (key_file,
+                         group,
+                         CATALOG_KEY_ETAG,
+                         etag);
+
+  if (name)
+    {
+      gsize n_files = image_files ? hd_object_vector_size (image_files) : 0;
+      char **uris;
+      guint i;
+
+      g_key_file_set_string (key_file,
+                             group,
+                             CATALOG_KEY_NAME,
+                             name);
+
+      uris = g_new0 (char *, n_files + 1);
+      for (i = 0; i < n_files; i++)
+        uris[i] = g_file_get_uri (hd_object_vector_at (image_files, i));
+
+      g_key_file_set_string_list (key_file,
+                                  group,
+                                  CATALOG_KEY_FILES,
+                                  (const gchar * const *) uris,
+                                  n_files);
+
+      g_strfreev (uris);
+    }
+
+  g_free (group);
+
+  hd_delayed_write_schedule (&delayed_write);
+}
+
+void
+hd_background_catalog_remove_imageset (GFile *desktop_file)
+{
+  GKeyFile *key_file;
+  char *group;
+
+  g_return_if_fail (G_IS_FILE (desktop_file));
+
+  key_file = get_catalog ();
+  group = get_group (CATALOG_IMAGESET_GROUP_PREFIX, desktop_file);
+
+  if (g_key_file_has_group (key_file, group))
+    {
+      g_key_file_remove_group (key_file, group, NULL);
+      hd_delayed_write_schedule (&delayed_write);
+    }
+
+  g_free (group);
+}
+
+/* Writes pending changes of the catalog */
+void
+hd_background_catalog_flush (void)
+{
+  hd_delayed_write_flush (&delayed_write);
+}
+
+static void
+write_catalog (gpointer data)
+{
+  GFile *catalog_file;
+  char *path, *contents;
+  gsize length;
+  GError *error = NULL;
+
+  contents = g_key_file_to_data (catalog,
+                                 &length,
+                                 NULL);
+
+  path = get_catalog_path ();
+  catalog_file = g_file_new_for_path (path);
+  g_free (path);
+
+  g_file_replace_contents (catalog_file,
+                           contents,
+                           length,
+                           NULL,
+                           FALSE,
+                           G_FILE_CREATE_NONE,
+                           NULL,
+                           NULL,
+                           &error);
+
+  if (error)
+    {
+      g_warning ("%s. Could not write catalog index. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+    }
+
+  g_free (contents);
+  g_object_unref (catalog_file);
+}
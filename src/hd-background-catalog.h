@@ -0,0 +1,64 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_BACKGROUND_CATALOG_H__
+#define __HD_BACKGROUND_CATALOG_H__
+
+#include <gio/gio.h>
+
+#include "hd-object-vector.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Index of the available imagesets and themes, stored in
+ * ~/.backgrounds/catalog.index. Folder listings are valid as long as the
+ * modification time of the folder does not change, imageset entries as long
+ * as the etag of the .desktop file does not change and their image files
+ * exist.
+ */
+
+/* Called with the files of a folder listing */
+typedef void (*HDBackgroundCatalogFilesFunc) (HDObjectVector *files,
+                                              gpointer        user_data);
+
+void            hd_background_catalog_list_folder_async (GFile                        *folder,
+                                                         GCancellable                 *cancellable,
+                                                         HDBackgroundCatalogFilesFunc  files_func,
+                                                         gpointer                      user_data);
+
+gboolean        hd_background_catalog_lookup_imageset  (GFile           *desktop_file,
+                                                        char           **etag,
+                                                        char           **name,
+                                                        HDObjectVector **image_files);
+void            hd_background_catalog_add_imageset     (GFile           *desktop_file,
+                                                        const char      *etag,
+                                                        const char      *name,
+                                                        HDObjectVector  *image_files);
+void            hd_background_catalog_remove_imageset  (GFile           *desktop_file);
+
+void            hd_background_catalog_flush            (void);
+
+G_END_DECLS
+
+#endif
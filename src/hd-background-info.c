@@ -24,17 +24,36 @@
 #include <config.h>
 #endif
 
+#include "hd-delayed-write.h"
 #include "hd-desktop.h"
 #include "hd-object-vector.h"
 
 #include "hd-background-info.h"
+#include "hd-background-stats.h"
 #include "hd-backgrounds.h"
 
 /* background info keyfile */
 #define BACKGROUND_INFO_GROUP "Background-Info"
 #define BACKGROUND_INFO_KEY_VERSION "Version"
+#define BACKGROUND_INFO_KEY_COMPATIBLE_VERSION "Compatible-Version"
+
+/* Version 2 stores each view in an own group, so keys can be added without
+ * changing the version. The compatible version is the oldest version able to
+ * read the file and only needs to be raised for incompatible changes. */
+#define BACKGROUND_INFO_VERSION 2
+#define BACKGROUND_INFO_COMPATIBLE_VERSION 2
+#define BACKGROUND_INFO_VIEW_GROUP_FMT "View-%u"
+#define BACKGROUND_INFO_KEY_FILE "File"
+#define BACKGROUND_INFO_KEY_ETAG "Etag"
+#define BACKGROUND_INFO_KEY_FORMAT "Format"
+#define BACKGROUND_INFO_KEY_CHECKSUM "Checksum"
+#define BACKGROUND_INFO_KEY_PENDING "Pending"
+
+/* Version 1 keys in the Background-Info group */
 #define BACKGROUND_INFO_KEY_FILE_FMT "File-%u"
 #define BACKGROUND_INFO_KEY_ETAG_FMT "Etag-%u"
+#define BACKGROUND_INFO_KEY_FORMAT_FMT "Format-%u"
+#define BACKGROUND_INFO_KEY_CHECKSUM_FMT "Checksum-%u"
 
 #define HD_BACKGROUND_INFO_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_BACKGROUND_INFO, HDBackgroundInfoPrivate))
@@ -43,6 +62,17 @@ struct _HDBackgroundInfoPrivate
 {
   GPtrArray *etags;
   HDObjectVector *files;
+
+  /* Files the cached images should be created from, but which were not
+   * created yet (portrait views are created on demand) */
+  HDObjectVector *pending_files;
+  HDCachedImageFormat formats[HD_DESKTOP_VIEWS * 2];
+
+  /* XXH32 checksums of the cached images */
+  guint32 checksums[HD_DESKTOP_VIEWS * 2];
+  gboolean has_checksum[HD_DESKTOP_VIEWS * 2];
+
+  HDDelayedWrite delayed_write;
 };
 
 static void hd_background_info_dispose (GObject *object);
@@ -58,17 +88,37 @@ static gboolean load_background_info_from_key_file (HDBackgroundInfo  *info,
 static guint get_background_info_key_file_version (GKeyFile  *keyfile,
                                                    GError   **error);
 static void load_backgrounds_from_key_file (HDBackgroundInfo *info,
-                                            GKeyFile         *key_file);
+                                            GKeyFile         *key_file,
+                                            guint             version);
 static void load_background_from_key_file (HDBackgroundInfo *info,
                                            GKeyFile         *key_file,
+                                           guint             version,
                                            guint             desktop);
+static char *get_string_from_key_file (GKeyFile   *key_file,
+                                       guint       version,
+                                       guint       i,
+                                       const char *key,
+                                       const char *key_v1_fmt);
 static GFile *get_file_from_key_file (GKeyFile *key_file,
+                                      guint     version,
                                       guint     i);
+static GFile *get_pending_file_from_key_file (GKeyFile *key_file,
+                                              guint     version,
+                                              guint     i);
 static char *get_etag_from_key_file (GKeyFile *key_file,
+                                     guint     version,
                                      guint     i);
+static HDCachedImageFormat get_format_from_key_file (GKeyFile *key_file,
+                                                     guint     version,
+                                                     guint     i);
+static gboolean get_checksum_from_key_file (GKeyFile *key_file,
+                                            guint     version,
+                                            guint     i,
+                                            guint32  *checksum);
 static void load_background_info_legacy (HDBackgroundInfo *info,
                                          char             *file_contents,
                                          gsize             file_size);
+static void write_background_info (HDBackgroundInfo *info);
 static void save_background_info_file (HDBackgroundInfo *info);
 
 G_DEFINE_TYPE (HDBackgroundInfo, hd_background_info, G_TYPE_OBJECT);
@@ -97,6 +147,11 @@ hd_background_info_init (HDBackgroundInfo *info)
   g_ptr_array_set_size (priv->etags, max);
 
   priv->files = hd_object_vector_new_at_size (max, NULL);
+  priv->pending_files = hd_object_vector_new_at_size (max, NULL);
+
+  hd_delayed_write_init (&priv->delayed_write,
+                         (HDDelayedWriteFunc) write_background_info,
+                         info);
 }
 
 HDBackgroundInfo *
@@ -230,14 +285,33 @@ load_background_info_from_key_file (HDBackgroundInfo  *info,
       goto cleanup;
     }
 
-  if (version != 1)
+  if (version > 1)
+    {
+      guint compatible_version;
+
+      /* Files without compatible version can only be read by the same version */
+      compatible_version = g_key_file_get_integer (key_file,
+                                                   BACKGROUND_INFO_GROUP,
+                                                   BACKGROUND_INFO_KEY_COMPATIBLE_VERSION,
+                                                   NULL);
+      if (!compatible_version)
+        compatible_version = version;
+
+      if (compatible_version > BACKGROUND_INFO_VERSION)
+        {
+          g_debug ("%s. Version %u is not supported.", __FUNCTION__, version);
+          goto cleanup;
+        }
+    }
+  else if (version != 1)
     {
       g_debug ("%s. Version %u is not supported.", __FUNCTION__, version);
       goto cleanup;
     }
 
   load_backgrounds_from_key_file (info,
-                                  key_file);
+                                  key_file,
+                                  version);
 
 cleanup:
   g_key_file_free (key_file);
@@ -257,7 +331,8 @@ get_background_info_key_file_version (GKeyFile  *keyfile,
 
 static void
 load_backgrounds_from_key_file (HDBackgroundInfo *info,
-                                GKeyFile         *key_file)
+                                GKeyFile         *key_file,
+                                guint             version)
 {
   guint i;
   guint max = HD_DESKTOP_VIEWS;
@@ -269,6 +344,7 @@ load_backgrounds_from_key_file (HDBackgroundInfo *info,
     {
       load_background_from_key_file (info,
                                      key_file,
+                                     version,
                                      i);
     }
 }
@@ -276,42 +352,124 @@ load_backgrounds_from_key_file (HDBackgroundInfo *info,
 static void
 load_background_from_key_file (HDBackgroundInfo *info,
                                GKeyFile         *key_file,
+                               guint             version,
                                guint             desktop)
 {
   HDBackgroundInfoPrivate *priv = info->priv;
   GFile *file;
-  char *etag;
 
   file = get_file_from_key_file (key_file,
-                                 desktop);
-  etag = get_etag_from_key_file (key_file,
+                                 version,
                                  desktop);
 
   hd_object_vector_set_at (priv->files,
                            desktop,
                            file);
-  g_object_unref (file);
-  g_ptr_array_index (priv->etags, desktop) = etag;
+  if (file)
+    g_object_unref (file);
+
+  file = get_pending_file_from_key_file (key_file,
+                                         version,
+                                         desktop);
+
+  hd_object_vector_set_at (priv->pending_files,
+                           desktop,
+                           file);
+  if (file)
+    g_object_unref (file);
+
+  g_free (g_ptr_array_index (priv->etags, desktop));
+  g_ptr_array_index (priv->etags, desktop) = get_etag_from_key_file (key_file,
+                                                                     version,
+                                                                     desktop);
+  priv->formats[desktop] = get_format_from_key_file (key_file,
+                                                     version,
+                                                     desktop);
+  priv->has_checksum[desktop] = get_checksum_from_key_file (key_file,
+                                                            version,
+                                                            desktop,
+                                                            &priv->checksums[desktop]);
+}
+
+static char *
+get_string_from_key_file (GKeyFile   *key_file,
+                          guint       version,
+                          guint       i,
+                          const char *key,
+                          const char *key_v1_fmt)
+{
+  char *group, *value;
+
+  if (version == 1)
+    {
+      char *key_v1;
+
+      if (!key_v1_fmt)
+        return NULL;
+
+      key_v1 = g_strdup_printf (key_v1_fmt, i);
+
+      value = g_key_file_get_string (key_file,
+                                     BACKGROUND_INFO_GROUP,
+                                     key_v1,
+                                     NULL);
+
+      g_free (key_v1);
+
+      return value;
+    }
+
+  group = g_strdup_printf (BACKGROUND_INFO_VIEW_GROUP_FMT, i);
+  value = g_key_file_get_string (key_file,
+                                 group,
+                                 key,
+                                 NULL);
+
+  g_free (group);
+
+  return value;
 }
 
 static GFile*
 get_file_from_key_file (GKeyFile *key_file,
+                        guint     version,
                         guint     i)
 {
   GFile *file = NULL;
-  char *key;
   char *uri;
 
-  key = g_strdup_printf (BACKGROUND_INFO_KEY_FILE_FMT, i);
-  uri = g_key_file_get_string (key_file,
-                               BACKGROUND_INFO_GROUP,
-                               key,
-                               NULL);
+  uri = get_string_from_key_file (key_file,
+                                  version,
+                                  i,
+                                  BACKGROUND_INFO_KEY_FILE,
+                                  BACKGROUND_INFO_KEY_FILE_FMT);
+
+  if (uri)
+    file = g_file_new_for_uri (uri);
+
+  g_free (uri);
+
+  return file;
+}
+
+/* Pending files were added with version 2 */
+static GFile*
+get_pending_file_from_key_file (GKeyFile *key_file,
+                                guint     version,
+                                guint     i)
+{
+  GFile *file = NULL;
+  char *uri;
+
+  uri = get_string_from_key_file (key_file,
+                                  version,
+                                  i,
+                                  BACKGROUND_INFO_KEY_PENDING,
+                                  NULL);
 
   if (uri)
     file = g_file_new_for_uri (uri);
 
-  g_free (key);
   g_free (uri);
 
   return file;
@@ -319,20 +477,60 @@ get_file_from_key_file (GKeyFile *key_file,
 
 static char*
 get_etag_from_key_file (GKeyFile *key_file,
+                        guint     version,
                         guint     i)
 {
-  char *key;
-  char *etag;
+  return get_string_from_key_file (key_file,
+                                   version,
+                                   i,
+                                   BACKGROUND_INFO_KEY_ETAG,
+                                   BACKGROUND_INFO_KEY_ETAG_FMT);
+}
+
+static HDCachedImageFormat
+get_format_from_key_file (GKeyFile *key_file,
+                          guint     version,
+                          guint     i)
+{
+  HDCachedImageFormat format;
+  char *name;
+
+  name = get_string_from_key_file (key_file,
+                                   version,
+                                   i,
+                                   BACKGROUND_INFO_KEY_FORMAT,
+                                   BACKGROUND_INFO_KEY_FORMAT_FMT);
+
+  /* Cache info files without format were written for PNG images */
+  if (!name || !hd_cached_image_format_from_name (name, &format))
+    format = HD_CACHED_IMAGE_FORMAT_PNG;
+
+  g_free (name);
+
+  return format;
+}
+
+static gboolean
+get_checksum_from_key_file (GKeyFile *key_file,
+                            guint     version,
+                            guint     i,
+                            guint32  *checksum)
+{
+  char *value;
+  char *end = NULL;
+
+  value = get_string_from_key_file (key_file,
+                                    version,
+                                    i,
+                                    BACKGROUND_INFO_KEY_CHECKSUM,
+                                    BACKGROUND_INFO_KEY_CHECKSUM_FMT);
 
-  key = g_strdup_printf (BACKGROUND_INFO_KEY_ETAG_FMT, i);
-  etag = g_key_file_get_string (key_file,
-                                BACKGROUND_INFO_GROUP,
-                                key,
-                                NULL);
+  if (value)
+    *checksum = g_ascii_strtoull (value, &end, 16);
 
-  g_free (key);
+  g_free (value);
 
-  return etag;
+  return end && *end == '\0';
 }
 
 static void
@@ -384,14 +582,21 @@ hd_background_info_dispose (GObject *object)
 {
   HDBackgroundInfoPrivate *priv = HD_BACKGROUND_INFO (object)->priv;
 
+  if (priv->files)
+    hd_background_info_flush (HD_BACKGROUND_INFO (object));
+
   if (priv->etags)
     {
-      g_ptr_array_free (priv->etags, FALSE);
+      g_ptr_array_foreach (priv->etags, (GFunc) g_free, NULL);
+      g_ptr_array_free (priv->etags, TRUE);
       priv->etags = NULL;
     }
 
   if (priv->files)
     priv->files = (g_object_unref (priv->files), NULL);
+
+  if (priv->pending_files)
+    priv->pending_files = (g_object_unref (priv->pending_files), NULL);
   
   G_OBJECT_CLASS (hd_background_info_parent_class)->dispose (object);
 }
@@ -424,13 +629,48 @@ hd_background_info_get_etag (HDBackgroundInfo *info,
                             desktop);
 }
 
+HDCachedImageFormat
+hd_background_info_get_format (HDBackgroundInfo *info,
+                               guint             desktop)
+{
+  HDBackgroundInfoPrivate *priv;
+
+  g_return_val_if_fail (HD_IS_BACKGROUND_INFO (info), HD_CACHED_IMAGE_FORMAT_PNG);
+  g_return_val_if_fail (desktop < HD_DESKTOP_VIEWS * 2, HD_CACHED_IMAGE_FORMAT_PNG);
+
+  priv = HD_BACKGROUND_INFO (info)->priv;
+
+  return priv->formats[desktop];
+}
+
+gboolean
+hd_background_info_get_checksum (HDBackgroundInfo *info,
+                                 guint             desktop,
+                                 guint32          *checksum)
+{
+  HDBackgroundInfoPrivate *priv;
+
+  g_return_val_if_fail (HD_IS_BACKGROUND_INFO (info), FALSE);
+  g_return_val_if_fail (desktop < HD_DESKTOP_VIEWS * 2, FALSE);
+
+  priv = HD_BACKGROUND_INFO (info)->priv;
+
+  if (priv->has_checksum[desktop] && checksum)
+    *checksum = priv->checksums[desktop];
+
+  return priv->has_checksum[desktop];
+}
+
 void
-hd_background_info_set (HDBackgroundInfo *info,
-                        guint             desktop,
-                        GFile            *file,
-                        const char       *etag)
+hd_background_info_set (HDBackgroundInfo    *info,
+                        guint                desktop,
+                        GFile               *file,
+                        const char          *etag,
+                        HDCachedImageFormat  format,
+                        guint32              checksum)
 {
   HDBackgroundInfoPrivate *priv;
+  GFile *pending_file;
 
   g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
 
@@ -439,10 +679,110 @@ hd_background_info_set (HDBackgroundInfo *info,
   hd_object_vector_set_at (priv->files,
                            desktop,
                            file);
+  g_free (g_ptr_array_index (priv->etags, desktop));
   g_ptr_array_index (priv->etags,
                      desktop) = g_strdup (etag);
+  priv->formats[desktop] = format;
+  priv->checksums[desktop] = checksum;
+  priv->has_checksum[desktop] = TRUE;
+
+  pending_file = hd_object_vector_at (priv->pending_files, desktop);
+  if (pending_file && g_file_equal (pending_file, file))
+    hd_object_vector_set_at (priv->pending_files, desktop, NULL);
+
+  hd_delayed_write_schedule (&priv->delayed_write);
+}
 
+/*
+ * Sets the file the cached image of desktop should be created from later,
+ * or unsets it with NULL. The pending file is kept separately from the file
+ * of the valid cached image until hd_background_info_set is called for it.
+ */
+void
+hd_background_info_set_pending (HDBackgroundInfo *info,
+                                guint             desktop,
+                                GFile            *file)
+{
+  HDBackgroundInfoPrivate *priv;
+  GFile *pending_file;
+
+  g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
+
+  priv = HD_BACKGROUND_INFO (info)->priv;
+
+  pending_file = hd_object_vector_at (priv->pending_files, desktop);
+  if (pending_file == file ||
+      (pending_file && file && g_file_equal (pending_file, file)))
+    return;
+
+  hd_object_vector_set_at (priv->pending_files,
+                           desktop,
+                           file);
+
+  hd_delayed_write_schedule (&priv->delayed_write);
+}
+
+GFile *
+hd_background_info_get_pending (HDBackgroundInfo *info,
+                                guint             desktop)
+{
+  HDBackgroundInfoPrivate *priv;
+
+  g_return_val_if_fail (HD_IS_BACKGROUND_INFO (info), NULL);
+
+  priv = HD_BACKGROUND_INFO (info)->priv;
+
+  return hd_object_vector_at (priv->pending_files,
+                              desktop);
+}
+
+void
+hd_background_info_flush (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv;
+
+  g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
+
+  priv = HD_BACKGROUND_INFO (info)->priv;
+
+  hd_delayed_write_flush (&priv->delayed_write);
+}
+
+/*
+ * Holds back the delayed write of the changes until
+ * hd_background_info_resume_flush () is called as often, so the changes of
+ * a batch which may be rolled back are not written in between.
+ */
+void
+hd_background_info_suspend_flush (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv;
+
+  g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
+
+  priv = HD_BACKGROUND_INFO (info)->priv;
+
+  hd_delayed_write_suspend (&priv->delayed_write);
+}
+
+void
+hd_background_info_resume_flush (HDBackgroundInfo *info)
+{
+  HDBackgroundInfoPrivate *priv;
+
+  g_return_if_fail (HD_IS_BACKGROUND_INFO (info));
+
+  priv = HD_BACKGROUND_INFO (info)->priv;
+
+  hd_delayed_write_resume (&priv->delayed_write);
+}
+
+static void
+write_background_info (HDBackgroundInfo *info)
+{
+  hd_background_stats_push (HD_BACKGROUND_STAGE_CACHE_INFO);
   save_background_info_file (info);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_CACHE_INFO);
 }
 
 static void
@@ -459,7 +799,11 @@ save_background_info_file (HDBackgroundInfo *info)
   g_key_file_set_integer (key_file,
                           BACKGROUND_INFO_GROUP,
                           BACKGROUND_INFO_KEY_VERSION,
-                          1);
+                          BACKGROUND_INFO_VERSION);
+  g_key_file_set_integer (key_file,
+                          BACKGROUND_INFO_GROUP,
+                          BACKGROUND_INFO_KEY_COMPATIBLE_VERSION,
+                          BACKGROUND_INFO_COMPATIBLE_VERSION);
 
   guint max = HD_DESKTOP_VIEWS;
   if(hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
@@ -469,39 +813,74 @@ save_background_info_file (HDBackgroundInfo *info)
     {
       GFile *file;
       const char *etag;
+      char *group;
+
+      group = g_strdup_printf (BACKGROUND_INFO_VIEW_GROUP_FMT, desktop);
 
       file = hd_object_vector_at (priv->files, desktop);
 
       if (file)
         {
-          char *key, *value;
+          char *value;
 
-          key = g_strdup_printf (BACKGROUND_INFO_KEY_FILE_FMT, desktop);
           value = g_file_get_uri (file);
 
           g_key_file_set_string (key_file,
-                                 BACKGROUND_INFO_GROUP,
-                                 key,
+                                 group,
+                                 BACKGROUND_INFO_KEY_FILE,
                                  value);
 
-          g_free (key);
           g_free (value);
         }
 
       etag = g_ptr_array_index (priv->etags, desktop);
       if (etag)
         {
-          char *key;
+          g_key_file_set_string (key_file,
+                                 group,
+                                 BACKGROUND_INFO_KEY_ETAG,
+                                 etag);
+        }
+
+      if (file || etag)
+        {
+          g_key_file_set_string (key_file,
+                                 group,
+                                 BACKGROUND_INFO_KEY_FORMAT,
+                                 hd_cached_image_format_get_name (priv->formats[desktop]));
+        }
+
+      file = hd_object_vector_at (priv->pending_files, desktop);
 
-          key = g_strdup_printf (BACKGROUND_INFO_KEY_ETAG_FMT, desktop);
+      if (file)
+        {
+          char *value;
+
+          value = g_file_get_uri (file);
 
           g_key_file_set_string (key_file,
-                                 BACKGROUND_INFO_GROUP,
-                                 key,
-                                 etag);
+                                 group,
+                                 BACKGROUND_INFO_KEY_PENDING,
+                                 value);
 
-          g_free (key);
+          g_free (value);
         }
+
+      if (priv->has_checksum[desktop])
+        {
+          char *value;
+
+          value = g_strdup_printf ("%08x", priv->checksums[desktop]);
+
+          g_key_file_set_string (key_file,
+                                 group,
+                                 BACKGROUND_INFO_KEY_CHECKSUM,
+                                 value);
+
+          g_free (value);
+        }
+
+      g_free (group);
     }
 
   contents = g_key_file_to_data (key_file,
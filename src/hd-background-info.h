@@ -25,6 +25,8 @@
 
 #include <gio/gio.h>
 
+#include "hd-backgrounds.h"
+
 G_BEGIN_DECLS
 
 #define HD_TYPE_BACKGROUND_INFO            (hd_background_info_get_type ())
@@ -67,12 +69,29 @@ GFile            *hd_background_info_get_file (HDBackgroundInfo *info,
 const char       *hd_background_info_get_etag (HDBackgroundInfo *info,
                                                guint             desktop);
 
-void              hd_background_info_set      (HDBackgroundInfo *info,
-                                               guint             desktop,
-                                               GFile            *file,
-                                               const char       *etag);
-
-
+HDCachedImageFormat hd_background_info_get_format (HDBackgroundInfo *info,
+                                                 guint             desktop);
+
+gboolean          hd_background_info_get_checksum (HDBackgroundInfo *info,
+                                                   guint             desktop,
+                                                   guint32          *checksum);
+
+void              hd_background_info_set      (HDBackgroundInfo    *info,
+                                               guint                desktop,
+                                               GFile               *file,
+                                               const char          *etag,
+                                               HDCachedImageFormat  format,
+                                               guint32              checksum);
+
+void              hd_background_info_set_pending (HDBackgroundInfo *info,
+                                                  guint             desktop,
+                                                  GFile            *file);
+GFile            *hd_background_info_get_pending (HDBackgroundInfo *info,
+                                                  guint             desktop);
+
+void              hd_background_info_flush    (HDBackgroundInfo    *info);
+void              hd_background_info_suspend_flush (HDBackgroundInfo *info);
+void              hd_background_info_resume_flush  (HDBackgroundInfo *info);
 
 G_END_DECLS
 
@@ -0,0 +1,320 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <time.h>
+
+#include "hd-background-stats.h"
+
+/* Bucket i counts the samples below 2^i ms, the last one all others */
+#define N_BUCKETS 16
+
+/* Maximal nesting of stages */
+#define MAX_DEPTH 8
+
+typedef struct
+{
+  guint count;
+  guint64 total;
+  guint64 max;
+  guint buckets[N_BUCKETS];
+} Histogram;
+
+typedef struct
+{
+  /* Set on threads which run other work, like the thumbnails */
+  gboolean disabled;
+
+  gboolean in_job;
+  guint64 job_start;
+
+  /* Time accounted to the stages since the job began */
+  guint64 times[HD_BACKGROUND_N_STAGES];
+  guint touched;
+
+  HDBackgroundStage stack[MAX_DEPTH];
+  guint depth;
+  guint64 segment_start;
+} ThreadStats;
+
+static const char *stage_names[HD_BACKGROUND_N_STAGES] = {
+  "queue",
+  "read",
+  "decode",
+  "scale",
+  "encode",
+  "write",
+  "cache-info",
+  "gconf",
+  "total"
+};
+
+static Histogram histograms[HD_BACKGROUND_N_STAGES];
+static GStaticMutex histograms_mutex = G_STATIC_MUTEX_INIT;
+
+static GStaticPrivate thread_stats = G_STATIC_PRIVATE_INIT;
+
+/* Returns the monotonic time in microseconds */
+guint64
+hd_background_stats_get_time (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return (guint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+#endif
+
+  {
+    GTimeVal tv;
+
+    g_get_current_time (&tv);
+
+    return (guint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+  }
+}
+
+static ThreadStats *
+get_thread_stats (void)
+{
+  ThreadStats *stats;
+
+  stats = g_static_private_get (&thread_stats);
+  if (G_UNLIKELY (!stats))
+    {
+      stats = g_new0 (ThreadStats, 1);
+      g_static_private_set (&thread_stats, stats, g_free);
+    }
+
+  return stats;
+}
+
+static void
+histogram_add (Histogram *histogram,
+               guint64    time)
+{
+  guint64 ms = time / 1000;
+  guint bucket = 0;
+
+  while (bucket < N_BUCKETS - 1 && ms >= ((guint64) 1 << bucket))
+    bucket++;
+
+  histogram->count++;
+  histogram->total += time;
+  histogram->max = MAX (histogram->max, time);
+  histogram->buckets[bucket]++;
+}
+
+/* Adds the stage times of the thread as one sample each */
+static void
+flush_thread_stats (ThreadStats *stats)
+{
+  guint i;
+
+  if (!stats->touched)
+    return;
+
+  g_static_mutex_lock (&histograms_mutex);
+
+  for (i = 0; i < HD_BACKGROUND_N_STAGES; i++)
+    {
+      if (stats->touched & (1 << i))
+        histogram_add (&histograms[i], stats->times[i]);
+    }
+
+  g_static_mutex_unlock (&histograms_mutex);
+
+  memset (stats->times, 0, sizeof (stats->times));
+  stats->touched = 0;
+}
+
+/* Accounts the time since the last push or pop to the innermost stage */
+static guint64
+account_segment (ThreadStats *stats)
+{
+  guint64 now = hd_background_stats_get_time ();
+
+  if (stats->depth > 0 && stats->depth <= MAX_DEPTH)
+    {
+      HDBackgroundStage stage = stats->stack[stats->depth - 1];
+
+      stats->times[stage] += now - stats->segment_start;
+    }
+
+  stats->segment_start = now;
+
+  return now;
+}
+
+/*
+ * Begins a job on the calling thread. The stages until
+ * hd_background_stats_job_end () are added as one sample per job.
+ * queued_time is the time the job was queued or 0.
+ */
+void
+hd_background_stats_job_begin (guint64 queued_time)
+{
+  ThreadStats *stats = get_thread_stats ();
+
+  if (stats->disabled)
+    return;
+
+  flush_thread_stats (stats);
+
+  stats->in_job = TRUE;
+  stats->job_start = hd_background_stats_get_time ();
+
+  if (queued_time && queued_time <= stats->job_start)
+    {
+      stats->times[HD_BACKGROUND_STAGE_QUEUE] = stats->job_start - queued_time;
+      stats->touched |= 1 << HD_BACKGROUND_STAGE_QUEUE;
+    }
+}
+
+void
+hd_background_stats_job_end (void)
+{
+  ThreadStats *stats = get_thread_stats ();
+
+  if (!stats->in_job)
+    return;
+
+  stats->times[HD_BACKGROUND_STAGE_TOTAL] = account_segment (stats) - stats->job_start;
+  stats->touched |= 1 << HD_BACKGROUND_STAGE_TOTAL;
+
+  flush_thread_stats (stats);
+
+  stats->in_job = FALSE;
+}
+
+void
+hd_background_stats_push (HDBackgroundStage stage)
+{
+  ThreadStats *stats = get_thread_stats ();
+
+  g_return_if_fail (stage < HD_BACKGROUND_N_STAGES);
+
+  if (stats->disabled)
+    return;
+
+  account_segment (stats);
+
+  if (stats->depth < MAX_DEPTH)
+    stats->stack[stats->depth] = stage;
+  stats->depth++;
+
+  stats->touched |= 1 << stage;
+}
+
+void
+hd_background_stats_pop (HDBackgroundStage stage)
+{
+  ThreadStats *stats = get_thread_stats ();
+
+  if (stats->disabled)
+    return;
+
+  g_return_if_fail (stats->depth > 0);
+
+  account_segment (stats);
+
+  if (stats->depth <= MAX_DEPTH &&
+      stats->stack[stats->depth - 1] != stage)
+    g_warning ("%s. Popped stage %s, expected %s",
+               __FUNCTION__,
+               stage_names[stage],
+               stage_names[stats->stack[stats->depth - 1]]);
+
+  stats->depth--;
+
+  /* Stages outside of jobs, like the cache info updates in the main
+   * thread, are added when the outermost stage ends */
+  if (!stats->in_job && !stats->depth)
+    flush_thread_stats (stats);
+}
+
+/*
+ * Enables or disables the recording on the calling thread, for work which
+ * uses the same image functions but is no cached background job. Threads
+ * of non exclusive thread pools are shared, so the recording should be
+ * enabled again when the work is done. Call outside of any stage.
+ */
+void
+hd_background_stats_set_thread_enabled (gboolean enabled)
+{
+  ThreadStats *stats = get_thread_stats ();
+
+  stats->disabled = !enabled;
+}
+
+/*
+ * Returns the histograms as text, one line per stage with the count,
+ * mean and maximum in ms and the non empty buckets.
+ */
+gchar *
+hd_background_stats_to_string (void)
+{
+  GString *string;
+  guint i, j;
+
+  string = g_string_new ("stage       count    mean ms     max ms  histogram\n");
+
+  g_static_mutex_lock (&histograms_mutex);
+
+  for (i = 0; i < HD_BACKGROUND_N_STAGES; i++)
+    {
+      Histogram *histogram = &histograms[i];
+
+      g_string_append_printf (string,
+                              "%-10s %6u %10.1f %10.1f ",
+                              stage_names[i],
+                              histogram->count,
+                              histogram->count ?
+                              histogram->total / 1000.0 / histogram->count : 0.0,
+                              histogram->max / 1000.0);
+
+      for (j = 0; j < N_BUCKETS; j++)
+        {
+          if (!histogram->buckets[j])
+            continue;
+
+          if (j < N_BUCKETS - 1)
+            g_string_append_printf (string, " <%u:%u",
+                                    1 << j,
+                                    histogram->buckets[j]);
+          else
+            g_string_append_printf (string, " >=%u:%u",
+                                    1 << (j - 1),
+                                    histogram->buckets[j]);
+        }
+
+      g_string_append_c (string, '\n');
+    }
+
+  g_static_mutex_unlock (&histograms_mutex);
+
+  return g_string_free (string, FALSE);
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_BACKGROUND_STATS_H__
+#define __HD_BACKGROUND_STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Histograms of the time spent in the stages of the cached background
+ * image jobs. Stages are pushed and popped per thread, the time is
+ * accounted to the innermost stage only, so the time of the read stage
+ * inside the decode stage is not counted twice.
+ */
+
+typedef enum
+{
+  HD_BACKGROUND_STAGE_QUEUE,
+  HD_BACKGROUND_STAGE_READ,
+  HD_BACKGROUND_STAGE_DECODE,
+  HD_BACKGROUND_STAGE_SCALE,
+  HD_BACKGROUND_STAGE_ENCODE,
+  HD_BACKGROUND_STAGE_WRITE,
+  HD_BACKGROUND_STAGE_CACHE_INFO,
+  HD_BACKGROUND_STAGE_GCONF,
+  HD_BACKGROUND_STAGE_TOTAL,
+  HD_BACKGROUND_N_STAGES
+} HDBackgroundStage;
+
+guint64  hd_background_stats_get_time  (void);
+
+void     hd_background_stats_job_begin (guint64           queued_time);
+void     hd_background_stats_job_end   (void);
+
+void     hd_background_stats_push      (HDBackgroundStage stage);
+void     hd_background_stats_pop       (HDBackgroundStage stage);
+
+void     hd_background_stats_set_thread_enabled (gboolean enabled);
+
+gchar   *hd_background_stats_to_string (void);
+
+G_END_DECLS
+
+#endif
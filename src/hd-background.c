@@ -24,72 +24,35 @@
 #include <config.h>
 #endif
 
-#ifdef HAVE_THUMBNAILS
-#include <hildon-thumbnail-factory.h>
-#endif
+#include "hd-thumbnailer.h"
 
 #include "hd-background.h"
 
-#define HD_BACKGROUND_GET_PRIVATE(object) \
-  (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_BACKGROUND, HDBackgroundPrivate))
-
-
-struct _HDBackgroundPrivate
-{
-#ifdef HAVE_THUMBNAILS
-  HildonThumbnailFactory *thumbnail_factory;
-#endif
-};
+/* Size of the thumbnails in the change background dialog */
+#define THUMBNAIL_WIDTH 80
+#define THUMBNAIL_HEIGHT 60
 
 G_DEFINE_ABSTRACT_TYPE (HDBackground, hd_background, G_TYPE_OBJECT);
 
-static void
-hd_background_dispose (GObject *object)
-{
-#ifdef HAVE_THUMBNAILS
-  HDBackgroundPrivate *priv = HD_BACKGROUND (object)->priv;
-
-  if (priv->thumbnail_factory)
-    priv->thumbnail_factory = (g_object_unref (priv->thumbnail_factory), NULL);
-#endif
-
-  G_OBJECT_CLASS (hd_background_parent_class)->dispose (object);
-}
-
 static void
 hd_background_class_init (HDBackgroundClass *klass)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
-
-  object_class->dispose = hd_background_dispose;
-
-  g_type_class_add_private (klass, sizeof (HDBackgroundPrivate));
 }
 
 static void
 hd_background_init (HDBackground *background)
 {
-  HDBackgroundPrivate *priv = HD_BACKGROUND_GET_PRIVATE (background);
-
-  background->priv = priv;
-
-#ifdef HAVE_THUMBNAILS
-  priv->thumbnail_factory = hildon_thumbnail_factory_get_instance ();
-#endif
 }
 
-#ifdef HAVE_THUMBNAILS
 static void
-image_set_thumbnail_callback (HildonThumbnailFactory *self,
-                              GdkPixbuf              *thumbnail,
-                              GError                 *error,
-                              gpointer                user_data)
+image_set_thumbnail_callback (GdkPixbuf *thumbnail,
+                              gpointer   user_data)
 {
   GtkTreeRowReference *reference = user_data;
   GtkTreeModel *model = gtk_tree_row_reference_get_model (reference);
   GtkTreePath *path = gtk_tree_row_reference_get_path (reference);
 
-  if (path && thumbnail)
+  if (path)
     {
       GtkTreeIter iter;
 
@@ -104,39 +67,34 @@ image_set_thumbnail_callback (HildonThumbnailFactory *self,
       gtk_tree_path_free (path);
     }
 }
-#endif
 
+/*
+ * Sets the thumbnail of the row at iter to a thumbnail of file, once it
+ * is loaded from the thumbnail cache or created. Pending thumbnails are
+ * dropped when cancellable is cancelled.
+ */
 void
 hd_background_set_thumbnail_from_file (HDBackground *background,
                                        GtkTreeModel *model,
                                        GtkTreeIter  *iter,
-                                       GFile        *file)
+                                       GFile        *file,
+                                       GCancellable *cancellable)
 {
-#ifdef HAVE_THUMBNAILS
-  HDBackgroundPrivate *priv = background->priv;
-#endif
+  HDImageSize size = {THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT};
   GtkTreePath *path;
   GtkTreeRowReference *reference;
-  char *uri;
 
   path = gtk_tree_model_get_path (model, iter);
   reference = gtk_tree_row_reference_new (model, path);
 
-  uri = g_file_get_uri (file);
-
-#ifdef HAVE_THUMBNAILS
-  hildon_thumbnail_factory_request_pixbuf (priv->thumbnail_factory,
-                                           uri,
-                                           80, 60,
-                                           FALSE,
-                                           NULL,
-                                           image_set_thumbnail_callback,
-                                           reference,
-                                           (GDestroyNotify) gtk_tree_row_reference_free);
-#endif
+  hd_thumbnailer_request (file,
+                          &size,
+                          cancellable,
+                          image_set_thumbnail_callback,
+                          reference,
+                          (GDestroyNotify) gtk_tree_row_reference_free);
 
   gtk_tree_path_free (path);
-  g_free (uri);
 }
 
 void
@@ -160,6 +118,22 @@ hd_background_get_image_file_for_view (HDBackground *background,
   return NULL;
 }
 
+/*
+ * Speculatively creates the cached image of background for view at low
+ * priority, so hd_background_set_for_current_view () is fast when it is
+ * chosen. Backgrounds which cannot be prerendered ignore this.
+ */
+void
+hd_background_prerender_for_view (HDBackground *background,
+                                  guint         view,
+                                  GCancellable *cancellable)
+{
+  if (HD_BACKGROUND_GET_CLASS (background)->prerender_for_view)
+    HD_BACKGROUND_GET_CLASS (background)->prerender_for_view (background,
+                                                              view,
+                                                              cancellable);
+}
+
 /*
 const gchar *
 hd_background_get_title (HDBackground *background)
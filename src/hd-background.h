@@ -45,6 +45,7 @@ enum
   HD_BACKGROUND_COL_OBJECT,
   HD_BACKGROUND_COL_VISIBLE,
   HD_BACKGROUND_COL_OVI,
+  HD_BACKGROUND_COL_SORT_KEY,
   HD_BACKGROUND_NUM_COLS
 };
 
@@ -65,6 +66,10 @@ struct _HDBackgroundClass
 
   GFile *(*get_image_file_for_view) (HDBackground *background,
                                      guint         view);
+
+  void (*prerender_for_view) (HDBackground   *background,
+                              guint           view,
+                              GCancellable   *cancellable);
 };
 
 GType hd_background_get_type      (void);
@@ -72,7 +77,8 @@ GType hd_background_get_type      (void);
 void  hd_background_set_thumbnail_from_file (HDBackground *background,
                                              GtkTreeModel *model,
                                              GtkTreeIter  *iter,
-                                             GFile        *file);
+                                             GFile        *file,
+                                             GCancellable *cancellable);
 
 void hd_background_set_for_current_view (HDBackground   *background,
                                          guint           view,
@@ -81,6 +87,10 @@ void hd_background_set_for_current_view (HDBackground   *background,
 GFile *hd_background_get_image_file_for_view (HDBackground *background,
                                               guint         view);
 
+void hd_background_prerender_for_view (HDBackground   *background,
+                                       guint           view,
+                                       GCancellable   *cancellable);
+
 G_END_DECLS
 
 #endif
@@ -38,22 +38,49 @@
 
 #include <libgnomevfs/gnome-vfs.h>
 
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "hd-background-info.h"
+#include "hd-background-stats.h"
+#include "hd-cache-output-stream.h"
+#include "hd-cache-store.h"
+#include "hd-checksum.h"
 #include "hd-command-thread-pool.h"
 #include "hd-desktop.h"
 #include "hd-file-background.h"
+#include "hd-image-writer.h"
 #include "hd-pixbuf-utils.h"
+#include "hd-raw-image.h"
 
 #include "hd-backgrounds.h"
 
 #define CACHED_DIR        ".backgrounds"
 #define BACKGROUND_CACHED_PNG CACHED_DIR "/background-%u.png"
 #define BACKGROUND_CACHED_PNG_PORTRAIT CACHED_DIR "/background_portrait-%u.png"
+#define BACKGROUND_CACHED_RAW CACHED_DIR "/background-%u.raw"
+#define BACKGROUND_CACHED_RAW_PORTRAIT CACHED_DIR "/background_portrait-%u.raw"
+
+/* Image prerendered for the cache store, keeps the newest store entry
+ * which is not linked to a view alive */
+#define PRERENDERED_CACHED_PNG CACHED_DIR "/prerendered.png"
+#define PRERENDERED_CACHED_RAW CACHED_DIR "/prerendered.raw"
 
 #define GCONF_KEY_PORTRAIT_WALLPAPER "/apps/osso/hildon-desktop/portrait_wallpaper"
 
+/* Number of threads used to create the cached images, 0 for one per core */
+#define GCONF_KEY_BACKGROUND_THREADS "/apps/osso/hildon-desktop/background_threads"
+
+/* Format of the cached images: png (default), argb32 or rgb565 */
+#define GCONF_KEY_BACKGROUND_CACHE_FORMAT "/apps/osso/hildon-desktop/background_cache_format"
+
+/* zlib compression level (0-9) of PNG cached images, -1 for the libpng
+ * default. Cached images can be recreated, so speed matters more than
+ * size by default. */
+#define GCONF_KEY_BACKGROUND_CACHE_COMPRESSION "/apps/osso/hildon-desktop/background_cache_compression"
+#define DEFAULT_CACHE_COMPRESSION 1
+
 /* Background GConf key */
 #define GCONF_DIR                 "/apps/osso/hildon-desktop/views"
 #define GCONF_BACKGROUND_KEY      GCONF_DIR "/%u/bg-image"
@@ -71,24 +98,126 @@
 #define HD_BACKGROUNDS_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_BACKGROUNDS, HDBackgroundsPrivate))
 
+#define VIEW_MASK(view) (1u << (view))
+#define LANDSCAPE_VIEWS_MASK (VIEW_MASK (HD_DESKTOP_VIEWS) - 1)
+
+/* Priorities of the requests in the thread pool */
+#define REQUEST_PRIORITY_CURRENT_VIEW G_PRIORITY_HIGH
+#define REQUEST_PRIORITY_OTHER_VIEW   G_PRIORITY_DEFAULT
+#define REQUEST_PRIORITY_PRERENDER    G_PRIORITY_LOW
+
+/* Deferred portrait requests are started after this many seconds without
+ * new requests, once the queued commands are done */
+#define DEFERRED_REQUESTS_DELAY 30
+
+/* Changes of the GConf background keys are collected for this many
+ * milliseconds after the last one and then handled together */
+#define GCONF_NOTIFY_DELAY 200
+
+/* Unused cache store entries are removed this many seconds after the last
+ * change of a cached image */
+#define STORE_GC_DELAY 10
+
+/* Number of queued requests whose sources are prefetched when a request
+ * starts */
+#define PREFETCH_REQUESTS 2
+
 typedef struct
 {
   GFile *file;
   gboolean error_dialogs;
+
+  /* Views the request creates cached images for, 0 for prerender
+   * requests which only add the image to the cache store */
+  guint32 views;
+  guint64 serial;
+
+  /* Cancelled when the request is replaced by a newer one for the same
+   * views or when the cancellable of the caller is cancelled */
   GCancellable *cancellable;
+  GCancellable *caller_cancellable;
+  gulong caller_cancelled_id;
+
+  HDCachedImageCommand command;
+  gpointer data;
+  GDestroyNotify destroy_data;
+
+  /* Cache store keys claimed by the request, per view. Protected by
+   * requests_mutex */
+  GHashTable *store_keys;
+
+  /* Time the request was pushed to the thread pool, for the queue wait
+   * in the stage statistics */
+  guint64 queued_time;
+
+  /* State in the thread pool, protected by requests_mutex */
+  gboolean queued;
+  gboolean started;
+  gboolean prefetched;
 } CacheImageRequestData;
 
+/* Cache state of one view, validated at startup */
+typedef struct
+{
+  GFile *image_file;
+
+  /* Etag and checksum from the cache info, only set when the cached image
+   * was created from image_file */
+  char *etag;
+  char *cached_image_path;
+  guint32 checksum;
+
+  /* Etag of image_file, queried by the validation */
+  char *source_etag;
+
+  gboolean stale;
+  gboolean update_gconf;
+} ValidateViewData;
+
+typedef struct
+{
+  guint n_views;
+  guint current_view;
+  ValidateViewData views[HD_DESKTOP_VIEWS * 2];
+} ValidateCacheData;
+
+struct _HDCachedImageWriter
+{
+  guint view;
+  HDCachedImageFormat format;
+  gboolean error_dialogs;
+
+  GOutputStream *stream;
+  HDImageWriter *image_writer;
+};
+
 struct _HDBackgroundsPrivate
 {
   GConfClient *gconf_client;
 
   /* GConf notify handlers */
   guint bg_image_notify[HD_DESKTOP_VIEWS*2];
+  guint current_view_notify;
 
-  /* Data used for the thread which creates the cached images */
+  /* Views whose GConf background key changed since the last
+   * gconf_notify_timeout_cb */
+  guint32 changed_views;
+  guint gconf_notify_id;
+
+  /* Data used for the threads which create the cached images */
   HDCommandThreadPool *thread_pool;
 
+  /* Serialize saving of the cached image of one view and GConf access */
+  GMutex *view_mutex[HD_DESKTOP_VIEWS*2];
+  GMutex *gconf_mutex;
+
+  /* Pending cache image requests. Changed only in the main thread,
+   * protected by requests_mutex for the access from the commands */
   GPtrArray *requests;
+  GMutex *requests_mutex;
+  guint64 next_request_serial;
+  /* Serial of the newest request for each view */
+  guint64 view_serial[HD_DESKTOP_VIEWS*2];
 
   /* background info */
   HDBackgroundInfo *info;
@@ -101,23 +230,235 @@ struct _HDBackgroundsPrivate
   GnomeVFSVolumeMonitor *volume_monitor2;
 
   gboolean portrait_wallpaper;
+
+  HDCachedImageFormat cache_format;
+  gint cache_compression;
+
+  /* Requests for the portrait views are deferred until the screen is
+   * rotated the first time or the system is idle */
+  CacheImageRequestData *deferred_requests[HD_DESKTOP_VIEWS];
+  guint deferred_requests_id;
+  gboolean portrait_shown;
+
+  /* Cache store keys of the images being created, mapped to the request
+   * which creates them. Protected by requests_mutex, store_cond is
+   * signalled when keys are released. */
+  GHashTable *store_keys_in_flight;
+  GCond *store_cond;
+  guint store_gc_id;
+
+  /* Serializes writing the prerendered image and adding it to the store */
+  GMutex *prerender_mutex;
+
+  /* CPU time spent in commands of requests which were cancelled while
+   * running, in microseconds. Protected by requests_mutex */
+  guint n_cancelled_requests;
+  guint64 cancelled_cpu_time;
+};
+
+static const char *cached_image_format_names[] = {
+  "png",
+  "argb32",
+  "rgb565"
 };
 
-static CacheImageRequestData *cache_image_request_data_new (GFile        *file,
-                                                            gboolean      error_dialogs,
-                                                            GCancellable *cancellable);
+static CacheImageRequestData *cache_image_request_data_new (GFile                *file,
+                                                            guint32               views,
+                                                            gboolean              error_dialogs,
+                                                            GCancellable         *cancellable,
+                                                            HDCachedImageCommand  command,
+                                                            gpointer              data,
+                                                            GDestroyNotify        destroy_data);
 static void cache_image_request_data_free (CacheImageRequestData *data);
 
+static void cache_image_request_execute (CacheImageRequestData *request);
 static gboolean remove_request (CacheImageRequestData *request);
 
+static void push_request (HDBackgrounds         *backgrounds,
+                          CacheImageRequestData *request);
+static gboolean defer_portrait_request (HDBackgrounds         *backgrounds,
+                                        guint                  view,
+                                        CacheImageRequestData *request);
+static void push_deferred_request (HDBackgrounds *backgrounds,
+                                   guint          view);
+static gboolean push_deferred_requests (HDBackgrounds *backgrounds);
+static void update_request_priorities (HDBackgrounds *backgrounds);
+static void gconf_current_view_notify (GConfClient   *client,
+                                       guint          cnxn_id,
+                                       GConfEntry    *entry,
+                                       HDBackgrounds *backgrounds);
+static gboolean deferred_requests_timeout_cb (HDBackgrounds *backgrounds);
+static gboolean is_screen_portrait (GdkScreen *screen);
+static void screen_size_changed_cb (GdkScreen     *screen,
+                                    HDBackgrounds *backgrounds);
+
+static void schedule_store_gc (HDBackgrounds *backgrounds);
+static void release_store_keys (HDBackgrounds         *backgrounds,
+                                CacheImageRequestData *request);
+static void add_cached_image_to_store (HDBackgrounds *backgrounds,
+                                       GCancellable  *cancellable,
+                                       guint          view,
+                                       const char    *filename);
+
 G_DEFINE_TYPE (HDBackgrounds, hd_backgrounds, G_TYPE_OBJECT);
 
+static char *
+get_cached_image_path (guint               view,
+                       HDCachedImageFormat format)
+{
+  if (format == HD_CACHED_IMAGE_FORMAT_PNG)
+    {
+      if (view >= HD_DESKTOP_VIEWS)
+        return g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
+                                g_get_home_dir (),
+                                (view - HD_DESKTOP_VIEWS) + 1);
+      else
+        return g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG,
+                                g_get_home_dir (),
+                                view + 1);
+    }
+  else
+    {
+      if (view >= HD_DESKTOP_VIEWS)
+        return g_strdup_printf ("%s/" BACKGROUND_CACHED_RAW_PORTRAIT,
+                                g_get_home_dir (),
+                                (view - HD_DESKTOP_VIEWS) + 1);
+      else
+        return g_strdup_printf ("%s/" BACKGROUND_CACHED_RAW,
+                                g_get_home_dir (),
+                                view + 1);
+    }
+}
+
+/*
+ * Checks the cached image at path against the expected checksum, to catch
+ * files torn by a crash. Can be called from any thread.
+ */
+static gboolean
+is_cached_image_file_valid (const char *path,
+                            guint32     expected)
+{
+  guint32 checksum;
+  gboolean result;
+  GError *error = NULL;
+
+  result = hd_checksum_file (path, &checksum, NULL, &error);
+
+  if (error)
+    {
+      g_debug ("%s. Could not read cached image '%s'. %s",
+               __FUNCTION__,
+               path,
+               error->message);
+      g_error_free (error);
+    }
+  else if (checksum != expected)
+    {
+      g_debug ("%s. Checksum mismatch of cached image '%s'",
+               __FUNCTION__,
+               path);
+      result = FALSE;
+    }
+
+  return result;
+}
+
+/*
+ * Checks the cached image of view against the checksum in the cache info.
+ * Files without checksum are trusted.
+ */
+static gboolean
+is_cached_image_valid (HDBackgrounds *backgrounds,
+                       guint          view)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint32 expected;
+  char *path;
+  gboolean result;
+
+  if (!hd_background_info_get_checksum (priv->info, view, &expected))
+    return TRUE;
+
+  path = get_cached_image_path (view,
+                                hd_background_info_get_format (priv->info, view));
+
+  result = is_cached_image_file_valid (path, expected);
+
+  g_free (path);
+
+  return result;
+}
+
 static void
-create_cached_background (HDBackgrounds *backgrounds,
-                          GFile         *image_file,
-                          guint          view,
-                          gboolean       error_dialogs,
-                          gboolean       update_gconf)
+create_cached_background_for_view (HDBackgrounds *backgrounds,
+                                   GFile         *image_file,
+                                   guint          view,
+                                   gboolean       error_dialogs,
+                                   gboolean       update_gconf)
+{
+  HDBackground *background;
+  GCancellable *cancellable = g_cancellable_new ();
+
+  background = hd_file_background_new (image_file);
+
+  hd_file_background_set_for_view_full (HD_FILE_BACKGROUND (background),
+                                        view,
+                                        cancellable,
+                                        error_dialogs,
+                                        update_gconf);
+
+  g_object_unref (cancellable);
+}
+
+/*
+ * Returns the etag of file or NULL if it could not be queried. If etags
+ * is not NULL, the etags are cached there, so the etag of a file used by
+ * several views is only queried once.
+ */
+static char *
+get_etag (GFile      *file,
+          GHashTable *etags)
+{
+  GFileInfo *info;
+  char *etag = NULL;
+  GError *error = NULL;
+
+  if (etags && g_hash_table_lookup_extended (etags, file, NULL, (gpointer *) &etag))
+    return g_strdup (etag);
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_ETAG_VALUE,
+                            G_FILE_QUERY_INFO_NONE,
+                            NULL,
+                            &error);
+
+  if (error)
+    {
+      g_debug ("%s. Could not get etag value. %s",
+               __FUNCTION__,
+               error->message);
+      g_error_free (error);
+    }
+
+  if (info)
+    {
+      etag = g_strdup (g_file_info_get_etag (info));
+      g_object_unref (info);
+    }
+
+  if (etags)
+    g_hash_table_insert (etags, g_object_ref (file), g_strdup (etag));
+
+  return etag;
+}
+
+static void
+create_cached_background_full (HDBackgrounds *backgrounds,
+                               GFile         *image_file,
+                               guint          view,
+                               gboolean       error_dialogs,
+                               gboolean       update_gconf,
+                               GHashTable    *etags)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
   GFile *current_file;
@@ -134,49 +475,183 @@ create_cached_background (HDBackgrounds *backgrounds,
       g_file_equal (current_file,
                     image_file))
     {
-      GFileInfo *info;
-      const char *etag;
-      GError *error = NULL;
+      char *etag;
 
-      info = g_file_query_info (image_file,
-                                G_FILE_ATTRIBUTE_ETAG_VALUE,
-                                G_FILE_QUERY_INFO_NONE,
-                                NULL,
-                                &error);
+      etag = get_etag (image_file, etags);
 
-      if (error)
+      if (etag)
+        create_cached_background = g_strcmp0 (current_etag, etag) != 0 ||
+                                   !is_cached_image_valid (backgrounds, view);
+
+      g_free (etag);
+    }
+
+  if (create_cached_background)
+    create_cached_background_for_view (backgrounds,
+                                       image_file,
+                                       view,
+                                       error_dialogs,
+                                       update_gconf);
+}
+
+static void
+create_cached_background (HDBackgrounds *backgrounds,
+                          GFile         *image_file,
+                          guint          view,
+                          gboolean       error_dialogs,
+                          gboolean       update_gconf)
+{
+  create_cached_background_full (backgrounds,
+                                 image_file,
+                                 view,
+                                 error_dialogs,
+                                 update_gconf,
+                                 NULL);
+}
+
+static void
+validate_cache_data_free (ValidateCacheData *data)
+{
+  guint i;
+
+  for (i = 0; i < data->n_views; i++)
+    {
+      ValidateViewData *view = &data->views[i];
+
+      if (view->image_file)
+        g_object_unref (view->image_file);
+      g_free (view->etag);
+      g_free (view->source_etag);
+      g_free (view->cached_image_path);
+    }
+
+  g_slice_free (ValidateCacheData, data);
+}
+
+/*
+ * Runs in a worker thread. Queries the etag of each background image once,
+ * even when it is used by several views, and checksums the cached images
+ * of the views whose etag is unchanged.
+ */
+static void
+validate_cached_backgrounds_thread (GSimpleAsyncResult *result,
+                                    GObject            *object,
+                                    GCancellable       *cancellable)
+{
+  ValidateCacheData *data = g_simple_async_result_get_op_res_gpointer (result);
+  guint i, j;
+
+  for (i = 0; i < data->n_views; i++)
+    {
+      ValidateViewData *view = &data->views[i];
+      GError *error = NULL;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, &error))
         {
-          g_debug ("%s. Could not get etag value. %s",
-                   __FUNCTION__,
-                   error->message);
+          g_simple_async_result_set_from_error (result, error);
           g_error_free (error);
+          return;
         }
 
-      if (info)
+      if (!view->image_file || view->stale)
+        continue;
+
+      for (j = 0; j < i; j++)
+        {
+          ValidateViewData *other = &data->views[j];
+
+          if (other->source_etag &&
+              g_file_equal (other->image_file, view->image_file))
+            {
+              view->source_etag = g_strdup (other->source_etag);
+              break;
+            }
+        }
+
+      if (!view->source_etag)
         {
-          etag = g_file_info_get_etag (info);
+          GFileInfo *info;
+
+          info = g_file_query_info (view->image_file,
+                                    G_FILE_ATTRIBUTE_ETAG_VALUE,
+                                    G_FILE_QUERY_INFO_NONE,
+                                    cancellable,
+                                    &error);
+
+          if (error)
+            {
+              g_debug ("%s. Could not get etag value. %s",
+                       __FUNCTION__,
+                       error->message);
+              g_error_free (error);
 
-          create_cached_background = g_strcmp0 (current_etag, etag) != 0;
+              view->stale = TRUE;
+              continue;
+            }
 
+          view->source_etag = g_strdup (g_file_info_get_etag (info));
           g_object_unref (info);
         }
+
+      view->stale = g_strcmp0 (view->etag, view->source_etag) != 0;
+
+      /* A torn file is shared with its cache store entry */
+      if (!view->stale &&
+          view->cached_image_path &&
+          !is_cached_image_file_valid (view->cached_image_path,
+                                       view->checksum))
+        {
+          hd_cache_store_forget (view->cached_image_path);
+          view->stale = TRUE;
+        }
     }
+}
 
-  if (create_cached_background)
-    {
-      HDBackground *background;
-      GCancellable *cancellable = g_cancellable_new ();
+/*
+ * Validates the cached images of all views against the cache info in
+ * one batch in a worker thread, so slow storage does not block the main
+ * loop. Takes ownership of data.
+ */
+static void
+validate_cached_backgrounds_async (HDBackgrounds       *backgrounds,
+                                   ValidateCacheData   *data,
+                                   GCancellable        *cancellable,
+                                   GAsyncReadyCallback  callback,
+                                   gpointer             user_data)
+{
+  GSimpleAsyncResult *result;
+
+  result = g_simple_async_result_new (G_OBJECT (backgrounds),
+                                      callback,
+                                      user_data,
+                                      validate_cached_backgrounds_async);
+  g_simple_async_result_set_op_res_gpointer (result,
+                                             data,
+                                             (GDestroyNotify) validate_cache_data_free);
+
+  g_simple_async_result_run_in_thread (result,
+                                       validate_cached_backgrounds_thread,
+                                       G_PRIORITY_DEFAULT,
+                                       cancellable);
+
+  g_object_unref (result);
+}
 
-      background = hd_file_background_new (image_file);
+static ValidateCacheData *
+validate_cached_backgrounds_finish (HDBackgrounds  *backgrounds,
+                                    GAsyncResult   *result,
+                                    GError        **error)
+{
+  g_return_val_if_fail (g_simple_async_result_is_valid (result,
+                                                        G_OBJECT (backgrounds),
+                                                        validate_cached_backgrounds_async),
+                        NULL);
 
-      hd_file_background_set_for_view_full (HD_FILE_BACKGROUND (background),
-                                            view,
-                                            cancellable,
-                                            error_dialogs,
-                                            update_gconf);
+  if (g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (result),
+                                             error))
+    return NULL;
 
-      g_object_unref (cancellable);
-    }
+  return g_simple_async_result_get_op_res_gpointer (G_SIMPLE_ASYNC_RESULT (result));
 }
 
 static gboolean
@@ -319,6 +794,94 @@ get_background_for_view (HDBackgrounds *backgrounds,
   return bg_image;
 }
 
+/* Stores file as the background of view in GConf. Can be called from the
+ * commands. */
+static void
+set_background_in_gconf (HDBackgrounds *backgrounds,
+                         guint          view,
+                         GFile         *file)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gchar *gconf_key, *path;
+  GError *error = NULL;
+
+  path = g_file_get_path (file);
+
+  /* Store background to GConf */
+  gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_GCONF);
+  g_mutex_lock (priv->gconf_mutex);
+  gconf_client_set_string (priv->gconf_client,
+                           gconf_key,
+                           path,
+                           &error);
+  g_mutex_unlock (priv->gconf_mutex);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_GCONF);
+
+  if (error)
+    {
+      g_debug ("%s. Could not set background in GConf for view %u. %s",
+               __FUNCTION__,
+               view,
+               error->message);
+      g_clear_error (&error);
+    }
+
+  g_free (gconf_key);
+  g_free (path);
+}
+
+/*
+ * Creates the cached images of the views whose GConf key changed in the
+ * last window. Several writes to the same key are handled once and the
+ * etag of an image used by several views is queried once.
+ */
+static gboolean
+gconf_notify_timeout_cb (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GHashTable *etags;
+  guint32 changed_views;
+  guint view;
+
+  priv->gconf_notify_id = 0;
+
+  changed_views = priv->changed_views;
+  priv->changed_views = 0;
+
+  etags = g_hash_table_new_full (g_file_hash,
+                                 (GEqualFunc) g_file_equal,
+                                 g_object_unref,
+                                 g_free);
+
+  for (view = 0; changed_views; view++, changed_views >>= 1)
+    {
+      GFile *bg_image;
+
+      if (!(changed_views & 1))
+        continue;
+
+      bg_image = get_background_for_view (backgrounds,
+                                          view);
+      if (bg_image)
+        {
+          create_cached_background_full (backgrounds,
+                                         bg_image,
+                                         view,
+                                         TRUE,
+                                         FALSE,
+                                         etags);
+
+          g_object_unref (bg_image);
+        }
+    }
+
+  g_hash_table_destroy (etags);
+
+  return FALSE;
+}
+
 static void 
 gconf_bgimage_notify (GConfClient *client,
                       guint        cnxn_id,
@@ -326,20 +889,65 @@ gconf_bgimage_notify (GConfClient *client,
                       gpointer     user_data)
 {
   HDBackgrounds *backgrounds = hd_backgrounds_get ();
-  GFile *bg_image;
+  HDBackgroundsPrivate *priv = backgrounds->priv;
 
-  bg_image = get_background_for_view (backgrounds,
-                                      GPOINTER_TO_UINT (user_data));
-  if (bg_image)
+  /* Collect the changes of tools which write the keys of all views */
+  priv->changed_views |= 1 << GPOINTER_TO_UINT (user_data);
+
+  if (priv->gconf_notify_id)
+    g_source_remove (priv->gconf_notify_id);
+  priv->gconf_notify_id = gdk_threads_add_timeout (GCONF_NOTIFY_DELAY,
+                                                   (GSourceFunc) gconf_notify_timeout_cb,
+                                                   backgrounds);
+}
+
+static void
+cached_backgrounds_validated (HDBackgrounds *backgrounds,
+                              GAsyncResult  *result,
+                              gpointer       user_data)
+{
+  ValidateCacheData *data;
+  ValidateViewData *view;
+  guint i;
+  GError *error = NULL;
+
+  data = validate_cached_backgrounds_finish (backgrounds,
+                                             result,
+                                             &error);
+
+  if (error)
     {
-      create_cached_background (backgrounds,
-                                bg_image,
-                                GPOINTER_TO_UINT (user_data),
-                                TRUE,
-                                FALSE);
+      g_warning ("%s. Could not validate cached backgrounds. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+      return;
+    }
+
+  /* Update cache for current view */
+  view = &data->views[data->current_view];
+  if (view->stale)
+    create_cached_background_for_view (backgrounds,
+                                       view->image_file,
+                                       data->current_view,
+                                       FALSE,
+                                       view->update_gconf);
 
-      g_object_unref (bg_image);
+  /* Update cache for other views */
+  for (i = 0; i < data->n_views; i++)
+    {
+      view = &data->views[i];
+
+      if (i != data->current_view && view->stale)
+        create_cached_background_for_view (backgrounds,
+                                           view->image_file,
+                                           i,
+                                           FALSE,
+                                           view->update_gconf);
     }
+
+  /* Remove the store entries of cached images replaced while not running */
+  schedule_store_gc (backgrounds);
 }
 
 static void
@@ -348,8 +956,8 @@ background_info_loaded (HDBackgroundInfo *info,
                         HDBackgrounds *backgrounds)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
+  ValidateCacheData *data;
   guint current_view, i;
-  GFile *bg_image;
   GError *error = NULL;
 
   hd_background_info_init_finish (info,
@@ -384,47 +992,87 @@ background_info_loaded (HDBackgroundInfo *info,
 
   current_view = CLAMP (current_view, 0, max - 1);
 
-  /* Update cache for current view */
-  bg_image = get_background_for_view (backgrounds,
-                                      current_view);
-  if (bg_image)
-    {
-      create_cached_background (backgrounds,
-                                bg_image,
-                                current_view,
-                                FALSE,
-                                FALSE);
-      g_object_unref (bg_image);
-    }
+  data = g_slice_new0 (ValidateCacheData);
+  data->n_views = max;
+  data->current_view = current_view;
 
-  /* Update cache for other views */
   for (i = 0; i < max; i++)
     {
-      if (i != current_view)
+      ValidateViewData *view = &data->views[i];
+      GFile *current_file, *pending_file;
+      const char *current_etag;
+
+      /* Portrait images which were not created before the last shutdown.
+       * GConf is only updated when they are created. */
+      pending_file = hd_background_info_get_pending (priv->info,
+                                                     i);
+      if (pending_file)
         {
-          bg_image = get_background_for_view (backgrounds,
-                                              i);
-          if (bg_image)
-            {
-              create_cached_background (backgrounds,
-                                        bg_image,
-                                        i,
-                                        FALSE,
-                                        FALSE);
-              g_object_unref (bg_image);
-            }
+          view->image_file = g_object_ref (pending_file);
+          view->stale = TRUE;
+          view->update_gconf = TRUE;
+          continue;
         }
-    }
-}
 
-static gboolean
+      view->image_file = get_background_for_view (backgrounds,
+                                                  i);
+      if (!view->image_file)
+        continue;
+
+      current_file = hd_background_info_get_file (priv->info,
+                                                  i);
+      current_etag = hd_background_info_get_etag (priv->info,
+                                                  i);
+
+      if (current_file &&
+          current_etag &&
+          g_file_equal (current_file,
+                        view->image_file))
+        {
+          view->etag = g_strdup (current_etag);
+
+          if (hd_background_info_get_checksum (priv->info,
+                                               i,
+                                               &view->checksum))
+            view->cached_image_path =
+              get_cached_image_path (i,
+                                     hd_background_info_get_format (priv->info, i));
+        }
+      else
+        view->stale = TRUE;
+    }
+
+  validate_cached_backgrounds_async (backgrounds,
+                                     data,
+                                     NULL,
+                                     (GAsyncReadyCallback) cached_backgrounds_validated,
+                                     NULL);
+}
+
+static gboolean
 restart_hildon_home (gpointer data)
 {
+  /* The cache info updates of the theme were queued before */
+  hd_backgrounds_flush_cache_info (HD_BACKGROUNDS (data));
+
   gtk_main_quit ();
 
   return FALSE;
 }
 
+void
+hd_backgrounds_flush_cache_info (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv;
+
+  g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
+
+  priv = backgrounds->priv;
+
+  if (priv->info)
+    hd_background_info_flush (priv->info);
+}
+
 static char *
 get_current_theme (void)
 {
@@ -443,35 +1091,18 @@ get_current_theme (void)
   return current_theme;
 }
 
-static void
-update_backgrounds_from_theme (HDBackgrounds *backgrounds,
-                               const gchar   *backgrounds_desktop)
+/*
+ * Reads the backgrounds of the views from the theme backgrounds desktop
+ * file. Views which are not defined by the theme are set to NULL.
+ */
+static gboolean
+get_backgrounds_from_theme (const gchar  *backgrounds_desktop,
+                            GFile       **bg_image,
+                            guint         n_views)
 {
-  HDBackgroundsPrivate *priv = backgrounds->priv;
   GKeyFile *key_file;
-  gchar *current_theme;
-  gint current_view;
   guint i;
   GError *error = NULL;
-  gint max_value = HD_DESKTOP_VIEWS;
-
-  if(hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
-    max_value += HD_DESKTOP_VIEWS;
-
-  GFile *bg_image[max_value];
-
-
-  current_theme = get_current_theme ();
-  if (g_strcmp0 (priv->current_theme, current_theme) == 0)
-    {
-      g_free (current_theme);
-      return;
-    }
-  else
-    {
-      g_free (priv->current_theme);
-      priv->current_theme = current_theme;
-    }
 
   key_file = g_key_file_new ();
   if (!g_key_file_load_from_file (key_file,
@@ -485,15 +1116,18 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
                error->message);
       g_error_free (error);
       g_key_file_free (key_file);
-      return;
+      return FALSE;
     }
 
-  for (i = 0; i < HD_DESKTOP_VIEWS; i++)
+  for (i = 0; i < n_views; i++)
     {
       gchar *key;
       gchar *path;
 
-      key = g_strdup_printf (BACKGROUNDS_DESKTOP_KEY_FILE, i + 1);
+      if (i >= HD_DESKTOP_VIEWS)
+        key = g_strdup_printf (BACKGROUNDS_DESKTOP_KEY_FILE_PORTRAIT, i + 1 - HD_DESKTOP_VIEWS);
+      else
+        key = g_strdup_printf (BACKGROUNDS_DESKTOP_KEY_FILE, i + 1);
 
       path = g_key_file_get_string (key_file,
                                     G_KEY_FILE_DESKTOP_GROUP,
@@ -502,58 +1136,112 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
 
       if (error)
         {
-          g_debug ("%s. Could not load background defintion for theme %s. %s",
+          g_debug ("%s. No background for view %u in theme %s. %s",
                    __FUNCTION__,
+                   i,
                    backgrounds_desktop,
                    error->message);
           g_clear_error (&error);
-          g_free (key);
-          g_key_file_free (key_file);
-          return;
         }
 
-      if (path)
-        bg_image[i] = g_file_new_for_path (path);
+      bg_image[i] = path ? g_file_new_for_path (path) : NULL;
 
       g_free (path);
       g_free (key);
     }
 
-  if(hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ())) {
-    for (i = 0; i < HD_DESKTOP_VIEWS; i++)
-      {
-        gchar *key;
-        gchar *path;
+  g_key_file_free (key_file);
+
+  return TRUE;
+}
+
+/* Returns TRUE if the background of view in GConf is file */
+static gboolean
+is_background_in_gconf (HDBackgrounds *backgrounds,
+                        guint          view,
+                        GFile         *file)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gchar *gconf_key, *gconf_path, *path;
+  gboolean result;
 
-        key = g_strdup_printf (BACKGROUNDS_DESKTOP_KEY_FILE_PORTRAIT, i + 1);
+  gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
+  gconf_path = gconf_client_get_string (priv->gconf_client,
+                                        gconf_key,
+                                        NULL);
+  path = g_file_get_path (file);
 
-        path = g_key_file_get_string (key_file,
-                                      G_KEY_FILE_DESKTOP_GROUP,
-                                      key,
-                                      &error);
+  result = g_strcmp0 (gconf_path, path) == 0;
 
-        if (error)
-          {
-            g_debug ("%s. Could not load background defintion for theme %s. %s",
-                     __FUNCTION__,
-                     backgrounds_desktop,
-                     error->message);
-            g_clear_error (&error);
-            g_free (key);
-            g_key_file_free (key_file);
-            return;
-          }
+  g_free (gconf_key);
+  g_free (gconf_path);
+  g_free (path);
 
-        if (path)
-          bg_image[HD_DESKTOP_VIEWS + i] = g_file_new_for_path (path);
+  return result;
+}
 
-        g_free (path);
-        g_free (key);
-      }
+/*
+ * Only views whose background differs from the cached one are created
+ * again. Views which are not defined by the theme keep their background.
+ * The etags and checksums of the kept cached images are checked by the
+ * validation after the restart.
+ */
+static void
+update_backgrounds_from_theme (HDBackgrounds *backgrounds,
+                               const gchar   *backgrounds_desktop)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gchar *current_theme;
+  gint current_view;
+  guint i;
+  GError *error = NULL;
+  gint max_value = HD_DESKTOP_VIEWS;
+  gboolean changed[HD_DESKTOP_VIEWS * 2];
+
+  if(hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
+    max_value += HD_DESKTOP_VIEWS;
+
+  GFile *bg_image[max_value];
+
+
+  current_theme = get_current_theme ();
+  if (g_strcmp0 (priv->current_theme, current_theme) == 0)
+    {
+      g_free (current_theme);
+      return;
+    }
+  else
+    {
+      g_free (priv->current_theme);
+      priv->current_theme = current_theme;
     }
 
+  if (!get_backgrounds_from_theme (backgrounds_desktop,
+                                   bg_image,
+                                   max_value))
+    return;
 
-  g_key_file_free (key_file);
+  for (i = 0; i < max_value; i++)
+    {
+      GFile *cached_file;
+
+      changed[i] = FALSE;
+
+      if (!bg_image[i])
+        continue;
+
+      cached_file = hd_backgrounds_get_background (backgrounds, i);
+
+      if (cached_file && g_file_equal (cached_file, bg_image[i]))
+        {
+          /* Keep the cached image, the background may still be a custom
+           * one in GConf */
+          if (!is_background_in_gconf (backgrounds, i, bg_image[i]))
+            set_background_in_gconf (backgrounds, i, bg_image[i]);
+        }
+      else
+        changed[i] = TRUE;
+    }
 
   current_view = gconf_client_get_int (priv->gconf_client,
                                        GCONF_CURRENT_DESKTOP_KEY,
@@ -573,7 +1261,7 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
   /* Set to 0..HD_DESKTOP_VIEWS */
   current_view--;
 
-  if (current_view >= 0 && current_view < max_value)
+  if (current_view >= 0 && current_view < max_value && changed[current_view])
     create_cached_background (backgrounds,
                               bg_image[current_view],
                               current_view,
@@ -585,7 +1273,7 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
   /* Update cache for other views */
   for (i = 0; i < max_value; i++)
     {
-      if (i != current_view)
+      if (i != current_view && changed[i])
         {
           create_cached_background (backgrounds,
                                     bg_image[i],
@@ -596,12 +1284,13 @@ update_backgrounds_from_theme (HDBackgrounds *backgrounds,
     }
 
   for (i = 0; i < max_value; i++)
-    g_object_unref (bg_image[i]);
+    if (bg_image[i])
+      g_object_unref (bg_image[i]);
 
   hd_command_thread_pool_push_idle (priv->thread_pool,
                                     G_PRIORITY_HIGH_IDLE,
                                     restart_hildon_home,
-                                    NULL,
+                                    backgrounds,
                                     NULL);
 }
 
@@ -714,6 +1403,22 @@ hd_backgrounds_startup (HDBackgrounds *backgrounds)
       g_free (gconf_key);
     }
 
+  /* Requests for the newly shown view jump the queue */
+  priv->current_view_notify = gconf_client_notify_add (priv->gconf_client,
+                                                       GCONF_CURRENT_DESKTOP_KEY,
+                                                       (GConfClientNotifyFunc) gconf_current_view_notify,
+                                                       backgrounds,
+                                                       NULL,
+                                                       &error);
+  if (error)
+    {
+      g_warning ("%s. Could not add notification to GConf %s. %s",
+                 __FUNCTION__,
+                 GCONF_CURRENT_DESKTOP_KEY,
+                 error->message);
+      g_clear_error (&error);
+    }
+
   /* When separate wallpapers for portrait mode are enabled */
   /* HD_DESKTOP_VIEWS..HD_DESKTOP_VIEWS * 2 are fake views, used to store informations */
   /* about wallpapers (for portrait mode). For example: */
@@ -742,6 +1447,16 @@ hd_backgrounds_startup (HDBackgrounds *backgrounds)
         g_free (gconf_key);
       }
 
+  /* Portrait images are created when the screen is rotated the first time */
+  if (hd_backgrounds_is_portrait_wallpaper_enabled (backgrounds))
+    {
+      GdkScreen *screen = gdk_screen_get_default ();
+
+      priv->portrait_shown = is_screen_portrait (screen);
+      g_signal_connect (screen, "size-changed",
+                        G_CALLBACK (screen_size_changed_cb), backgrounds);
+    }
+
   /* Load cache info file */
   priv->info = hd_background_info_new ();
   hd_background_info_init_async (priv->info,
@@ -840,6 +1555,9 @@ static void
 hd_backgrounds_init (HDBackgrounds *backgrounds)
 {
   HDBackgroundsPrivate *priv;
+  gchar *format_name;
+  GConfValue *value;
+  guint i;
 
   backgrounds->priv = HD_BACKGROUNDS_GET_PRIVATE (backgrounds);
   priv = backgrounds->priv;
@@ -847,8 +1565,23 @@ hd_backgrounds_init (HDBackgrounds *backgrounds)
   priv->gconf_client = gconf_client_get_default ();
 
   priv->requests = g_ptr_array_new ();
+  priv->requests_mutex = g_mutex_new ();
+
+  priv->store_keys_in_flight = g_hash_table_new_full (g_str_hash,
+                                                      g_str_equal,
+                                                      g_free,
+                                                      NULL);
+  priv->store_cond = g_cond_new ();
+  priv->prerender_mutex = g_mutex_new ();
+
+  priv->thread_pool =
+    hd_command_thread_pool_new_with_max_threads (gconf_client_get_int (priv->gconf_client,
+                                                                       GCONF_KEY_BACKGROUND_THREADS,
+                                                                       NULL));
 
-  priv->thread_pool = hd_command_thread_pool_new ();
+  for (i = 0; i < G_N_ELEMENTS (priv->view_mutex); i++)
+    priv->view_mutex[i] = g_mutex_new ();
+  priv->gconf_mutex = g_mutex_new ();
 
   priv->volume_monitor = g_volume_monitor_get ();
   g_signal_connect (priv->volume_monitor, "mount-pre-unmount",
@@ -860,6 +1593,24 @@ hd_backgrounds_init (HDBackgrounds *backgrounds)
 
   priv->portrait_wallpaper = gconf_client_get_bool (priv->gconf_client, GCONF_KEY_PORTRAIT_WALLPAPER, NULL);
 
+  format_name = gconf_client_get_string (priv->gconf_client,
+                                         GCONF_KEY_BACKGROUND_CACHE_FORMAT,
+                                         NULL);
+  if (!format_name ||
+      !hd_cached_image_format_from_name (format_name, &priv->cache_format))
+    priv->cache_format = HD_CACHED_IMAGE_FORMAT_PNG;
+  g_free (format_name);
+
+  value = gconf_client_get (priv->gconf_client,
+                            GCONF_KEY_BACKGROUND_CACHE_COMPRESSION,
+                            NULL);
+  if (value && value->type == GCONF_VALUE_INT)
+    priv->cache_compression = gconf_value_get_int (value);
+  else
+    priv->cache_compression = DEFAULT_CACHE_COMPRESSION;
+  if (value)
+    gconf_value_free (value);
+
 }
 
 static void
@@ -882,6 +1633,9 @@ hd_backgrounds_dipose (GObject *object)
             priv->bg_image_notify[i] = (gconf_client_notify_remove (priv->gconf_client,
                                                                     priv->bg_image_notify[i]), 0);
         }
+      if (priv->current_view_notify)
+        priv->current_view_notify = (gconf_client_notify_remove (priv->gconf_client,
+                                                                 priv->current_view_notify), 0);
       priv->gconf_client = (g_object_unref (priv->gconf_client), NULL);
     }
 
@@ -894,17 +1648,49 @@ hd_backgrounds_dipose (GObject *object)
   if (priv->set_theme_idle_id)
     priv->set_theme_idle_id = (g_source_remove (priv->set_theme_idle_id), 0);
 
+  if (priv->deferred_requests_id)
+    priv->deferred_requests_id = (g_source_remove (priv->deferred_requests_id), 0);
+
+  if (priv->store_gc_id)
+    priv->store_gc_id = (g_source_remove (priv->store_gc_id), 0);
+
+  if (priv->gconf_notify_id)
+    priv->gconf_notify_id = (g_source_remove (priv->gconf_notify_id), 0);
+
+  g_signal_handlers_disconnect_by_func (gdk_screen_get_default (),
+                                        screen_size_changed_cb,
+                                        object);
+
   priv->current_theme = (g_free (priv->current_theme), NULL);
 
   G_OBJECT_CLASS (hd_backgrounds_parent_class)->dispose (object);
 }
 
+static void
+hd_backgrounds_finalize (GObject *object)
+{
+  HDBackgroundsPrivate *priv = HD_BACKGROUNDS (object)->priv;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (priv->view_mutex); i++)
+    g_mutex_free (priv->view_mutex[i]);
+  g_mutex_free (priv->gconf_mutex);
+  g_mutex_free (priv->requests_mutex);
+
+  g_cond_free (priv->store_cond);
+  g_mutex_free (priv->prerender_mutex);
+  g_hash_table_destroy (priv->store_keys_in_flight);
+
+  G_OBJECT_CLASS (hd_backgrounds_parent_class)->finalize (object);
+}
+
 static void
 hd_backgrounds_class_init (HDBackgroundsClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->dispose = hd_backgrounds_dipose;
+  object_class->finalize = hd_backgrounds_finalize;
 
   g_type_class_add_private (klass, sizeof (HDBackgroundsPrivate));
 }
@@ -923,6 +1709,10 @@ hd_backgrounds_get (void)
   return backgrounds;
 }
 
+/*
+ * Calls done_callback once all requests added before are done. Deferred
+ * portrait requests are not waited for.
+ */
 void
 hd_backgrounds_add_done_cb (HDBackgrounds *backgrounds,
                             GSourceFunc    done_callback,
@@ -953,102 +1743,662 @@ hd_backgrounds_get_background (HDBackgrounds *backgrounds,
 
   priv = backgrounds->priv;
 
+  /* Portrait images which are not created yet */
+  if (hd_background_info_get_pending (priv->info, view))
+    return hd_background_info_get_pending (priv->info, view);
+
   return hd_background_info_get_file (priv->info,
                                       view);
 }
 
+/* Returns the mask of the views currently shown: the landscape view and,
+ * while the screen is portrait, the portrait view */
+static guint32
+get_current_views_mask (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  gint current_view;
+  GError *error = NULL;
+
+  current_view = gconf_client_get_int (priv->gconf_client,
+                                       GCONF_CURRENT_DESKTOP_KEY,
+                                       &error) - 1;
+
+  if (error)
+    {
+      g_debug ("%s. Could not get current view. %s",
+               __FUNCTION__,
+               error->message);
+      g_error_free (error);
+      return 0;
+    }
+
+  if (current_view < 0 || current_view >= HD_DESKTOP_VIEWS)
+    return 0;
+
+  if (hd_backgrounds_is_portrait_wallpaper_enabled (backgrounds) &&
+      is_screen_portrait (gdk_screen_get_default ()))
+    return VIEW_MASK (current_view) | VIEW_MASK (current_view + HD_DESKTOP_VIEWS);
+
+  return VIEW_MASK (current_view);
+}
+
+static gint
+get_request_priority (CacheImageRequestData *request,
+                      guint32                current_views)
+{
+  if (!request->views)
+    return REQUEST_PRIORITY_PRERENDER;
+  else if (request->views & current_views)
+    return REQUEST_PRIORITY_CURRENT_VIEW;
+  else
+    return REQUEST_PRIORITY_OTHER_VIEW;
+}
+
+static gint
+request_priority_func (HDCommandCallback  command,
+                       gpointer           data,
+                       gint               priority,
+                       guint32           *current_views)
+{
+  /* Other commands keep their priority */
+  if (command != (HDCommandCallback) cache_image_request_execute)
+    return priority;
+
+  return get_request_priority (data, *current_views);
+}
+
+/* Sorts the queued requests again after the shown views changed */
+static void
+update_request_priorities (HDBackgrounds *backgrounds)
+{
+  guint32 current_views = get_current_views_mask (backgrounds);
+
+  hd_command_thread_pool_reprioritize (backgrounds->priv->thread_pool,
+                                       (HDCommandPriorityFunc) request_priority_func,
+                                       &current_views);
+}
+
+static void
+gconf_current_view_notify (GConfClient   *client,
+                           guint          cnxn_id,
+                           GConfEntry    *entry,
+                           HDBackgrounds *backgrounds)
+{
+  update_request_priorities (backgrounds);
+}
+
+/*
+ * Adds a request to create the cached image(s) for view. view can be
+ * HD_BACKGROUNDS_ALL_VIEWS if command creates the cached images for all
+ * landscape views.
+ *
+ * A request replaces all older requests for the same view(s), these are
+ * cancelled. Requests for the currently shown view are executed first.
+ */
 void
-hd_backgrounds_add_create_cached_image (HDBackgrounds     *backgrounds,
-                                        GFile             *source_file,
-                                        gboolean           error_dialogs,
-                                        GCancellable      *cancellable,
-                                        HDCommandCallback  command,
-                                        gpointer           data,
-                                        GDestroyNotify     destroy_data)
+hd_backgrounds_add_create_cached_image (HDBackgrounds        *backgrounds,
+                                        GFile                *source_file,
+                                        guint                 view,
+                                        gboolean              error_dialogs,
+                                        GCancellable         *cancellable,
+                                        HDCachedImageCommand  command,
+                                        gpointer              data,
+                                        GDestroyNotify        destroy_data)
 {
   HDBackgroundsPrivate *priv;
   CacheImageRequestData *request;
+  guint32 views;
+  guint i;
 
   g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
+  g_return_if_fail (view == HD_BACKGROUNDS_ALL_VIEWS ||
+                    view < HD_DESKTOP_VIEWS * 2);
 
   priv = backgrounds->priv;
 
+  if (view == HD_BACKGROUNDS_ALL_VIEWS)
+    views = LANDSCAPE_VIEWS_MASK;
+  else
+    views = VIEW_MASK (view);
+
   request = cache_image_request_data_new (source_file,
+                                          views,
                                           error_dialogs,
-                                          cancellable);
+                                          cancellable,
+                                          command,
+                                          data,
+                                          destroy_data);
+
+  g_mutex_lock (priv->requests_mutex);
+
+  request->serial = ++priv->next_request_serial;
+
+  /* Cancel older requests which are completely replaced by this one. A
+   * prerender request may create the image this one links to. */
+  for (i = 0; i < priv->requests->len; i++)
+    {
+      CacheImageRequestData *older = g_ptr_array_index (priv->requests, i);
+
+      if (older->views &&
+          (older->views & ~views) == 0)
+        g_cancellable_cancel (older->cancellable);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (priv->view_serial); i++)
+    {
+      if (views & VIEW_MASK (i))
+        priv->view_serial[i] = request->serial;
+    }
+
   g_ptr_array_add (priv->requests,
                    request);
 
-  hd_command_thread_pool_push (priv->thread_pool,
-                               command,
-                               data,
-                               destroy_data);
+  g_mutex_unlock (priv->requests_mutex);
 
-  hd_command_thread_pool_push_idle (priv->thread_pool,
-                                    G_PRIORITY_HIGH_IDLE,
-                                    (GSourceFunc) remove_request,
-                                    request,
-                                    (GDestroyNotify) cache_image_request_data_free);
+  if (view != HD_BACKGROUNDS_ALL_VIEWS &&
+      view >= HD_DESKTOP_VIEWS &&
+      defer_portrait_request (backgrounds, view, request))
+    return;
+
+  push_request (backgrounds, request);
 }
 
-static gboolean
-remove_request (CacheImageRequestData *request)
+static void
+push_request (HDBackgrounds         *backgrounds,
+              CacheImageRequestData *request)
 {
-  HDBackgrounds *backgrounds = hd_backgrounds_get ();
   HDBackgroundsPrivate *priv = backgrounds->priv;
+  gint priority;
 
-  g_ptr_array_remove_fast (priv->requests,
-                           request);
+  g_mutex_lock (priv->requests_mutex);
+  request->queued = TRUE;
+  g_mutex_unlock (priv->requests_mutex);
 
-  return FALSE;
-}
+  request->queued_time = hd_background_stats_get_time ();
 
-typedef struct
-{
-  HDBackgrounds *backgrounds;
-  guint view;
-  GFile *file;
-  char *etag;
-} UpdateCacheInfoData;
+  priority = get_request_priority (request,
+                                   get_current_views_mask (backgrounds));
 
+  hd_command_thread_pool_push_with_priority (priv->thread_pool,
+                                             priority,
+                                             (HDCommandCallback) cache_image_request_execute,
+                                             request,
+                                             NULL);
+}
+
+/*
+ * Most sessions never rotate the screen, so the portrait images are only
+ * created on the first rotation or when the system is idle. Until then the
+ * source file is kept as pending in the cache info. Returns TRUE if the
+ * request was deferred.
+ */
 static gboolean
-update_cache_info_file_idle (UpdateCacheInfoData *data)
+defer_portrait_request (HDBackgrounds         *backgrounds,
+                        guint                  view,
+                        CacheImageRequestData *request)
 {
-  HDBackgrounds *backgrounds = data->backgrounds;
   HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint i = view - HD_DESKTOP_VIEWS;
 
-  hd_background_info_set (priv->info,
-                          data->view,
-                          data->file,
-                          data->etag);
+  /* The older deferred request was cancelled by this one, let it be
+   * removed the normal way */
+  if (priv->deferred_requests[i])
+    {
+      push_request (backgrounds, priv->deferred_requests[i]);
+      priv->deferred_requests[i] = NULL;
+    }
 
-  g_object_unref (data->file);
-  g_free (data->etag);
+  if (priv->portrait_shown)
+    {
+      hd_background_info_set_pending (priv->info, view, NULL);
+      return FALSE;
+    }
 
-  g_slice_free (UpdateCacheInfoData, data);
+  priv->deferred_requests[i] = request;
+  hd_background_info_set_pending (priv->info, view, request->file);
 
-  return FALSE;
+  if (priv->deferred_requests_id)
+    g_source_remove (priv->deferred_requests_id);
+  priv->deferred_requests_id = gdk_threads_add_timeout_seconds (DEFERRED_REQUESTS_DELAY,
+                                                                (GSourceFunc) deferred_requests_timeout_cb,
+                                                                backgrounds);
+
+  return TRUE;
 }
 
+/* Starts the deferred request of the portrait view, if any */
 static void
-update_cache_info_file (HDBackgrounds *backgrounds,
-                        guint          view,
-                        GFile         *file,
-                        const char    *etag)
+push_deferred_request (HDBackgrounds *backgrounds,
+                       guint          view)
 {
-  UpdateCacheInfoData *data = g_slice_new0 (UpdateCacheInfoData);
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint i = view - HD_DESKTOP_VIEWS;
 
-  data->backgrounds = backgrounds;
-  data->view = view;
-  data->file = g_object_ref (file);
-  data->etag = g_strdup (etag);
+  if (priv->deferred_requests[i])
+    {
+      push_request (backgrounds, priv->deferred_requests[i]);
+      priv->deferred_requests[i] = NULL;
+    }
+}
 
-  gdk_threads_add_idle_full (G_PRIORITY_HIGH_IDLE,
-                             (GSourceFunc) update_cache_info_file_idle,
+static gboolean
+push_deferred_requests (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint i;
+
+  if (priv->deferred_requests_id)
+    priv->deferred_requests_id = (g_source_remove (priv->deferred_requests_id), 0);
+
+  for (i = 0; i < G_N_ELEMENTS (priv->deferred_requests); i++)
+    push_deferred_request (backgrounds, i + HD_DESKTOP_VIEWS);
+
+  return FALSE;
+}
+
+static gboolean
+deferred_requests_timeout_cb (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  priv->deferred_requests_id = 0;
+
+  /* Wait until the queued requests are done */
+  hd_command_thread_pool_push_idle (priv->thread_pool,
+                                    G_PRIORITY_LOW,
+                                    (GSourceFunc) push_deferred_requests,
+                                    backgrounds,
+                                    NULL);
+
+  return FALSE;
+}
+
+static gboolean
+is_screen_portrait (GdkScreen *screen)
+{
+  return gdk_screen_get_height (screen) > gdk_screen_get_width (screen);
+}
+
+static void
+screen_size_changed_cb (GdkScreen     *screen,
+                        HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  /* The portrait view of the current view is shown or hidden */
+  update_request_priorities (backgrounds);
+
+  if (priv->portrait_shown || !is_screen_portrait (screen))
+    return;
+
+  priv->portrait_shown = TRUE;
+
+  push_deferred_requests (backgrounds);
+}
+
+/* Returns the CPU time used by the calling thread in microseconds */
+static guint64
+get_thread_cpu_time (void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    return (guint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+#endif
+
+  return 0;
+}
+
+/* Accounts the CPU time of a command which was cancelled while running */
+static void
+add_cancelled_cpu_time (HDBackgrounds *backgrounds,
+                        guint64        cpu_time)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  g_mutex_lock (priv->requests_mutex);
+
+  priv->n_cancelled_requests++;
+  priv->cancelled_cpu_time += cpu_time;
+
+  g_debug ("%s. Cancelled request used %" G_GUINT64_FORMAT " us CPU time, "
+           "%u cancelled requests used %" G_GUINT64_FORMAT " us in total",
+           __FUNCTION__,
+           cpu_time,
+           priv->n_cancelled_requests,
+           priv->cancelled_cpu_time);
+
+  g_mutex_unlock (priv->requests_mutex);
+}
+
+/* Asks the kernel to read file into the page cache in the background */
+static void
+prefetch_file (GFile *file)
+{
+#ifdef HAVE_POSIX_FADVISE
+  char *path;
+  int fd;
+
+  path = g_file_get_path (file);
+  if (!path)
+    return;
+
+  fd = open (path, O_RDONLY);
+  if (fd >= 0)
+    {
+      posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+      close (fd);
+    }
+
+  g_free (path);
+#endif
+}
+
+/*
+ * Prefetches the sources of the next queued requests, so reading them
+ * overlaps with the decoding of the current one on slow storage.
+ */
+static void
+prefetch_queued_requests (HDBackgrounds         *backgrounds,
+                          CacheImageRequestData *current)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GFile *files[PREFETCH_REQUESTS];
+  guint i, n_files = 0;
+
+  g_mutex_lock (priv->requests_mutex);
+
+  current->started = TRUE;
+  current->prefetched = TRUE;
+
+  for (i = 0; i < priv->requests->len && n_files < PREFETCH_REQUESTS; i++)
+    {
+      CacheImageRequestData *request = g_ptr_array_index (priv->requests, i);
+
+      if (request->queued &&
+          !request->started &&
+          !request->prefetched &&
+          !g_cancellable_is_cancelled (request->cancellable))
+        {
+          request->prefetched = TRUE;
+          files[n_files++] = g_object_ref (request->file);
+        }
+    }
+
+  g_mutex_unlock (priv->requests_mutex);
+
+  for (i = 0; i < n_files; i++)
+    {
+      prefetch_file (files[i]);
+      g_object_unref (files[i]);
+    }
+}
+
+static void
+cache_image_request_execute (CacheImageRequestData *request)
+{
+  /* Skip requests which were cancelled or replaced while queued */
+  if (!g_cancellable_is_cancelled (request->cancellable))
+    {
+      guint64 start;
+
+      prefetch_queued_requests (hd_backgrounds_get (),
+                                request);
+
+      start = get_thread_cpu_time ();
+
+      hd_background_stats_job_begin (request->queued_time);
+
+      request->command (request->data,
+                        request->cancellable);
+
+      hd_background_stats_job_end ();
+
+      if (g_cancellable_is_cancelled (request->cancellable))
+        add_cancelled_cpu_time (hd_backgrounds_get (),
+                                get_thread_cpu_time () - start);
+    }
+
+  release_store_keys (hd_backgrounds_get (),
+                      request);
+
+  if (request->destroy_data)
+    request->destroy_data (request->data);
+  request->data = NULL;
+  request->destroy_data = NULL;
+
+  gdk_threads_add_idle_full (G_PRIORITY_HIGH_IDLE,
+                             (GSourceFunc) remove_request,
+                             request,
+                             (GDestroyNotify) cache_image_request_data_free);
+}
+
+static gboolean
+remove_request (CacheImageRequestData *request)
+{
+  HDBackgrounds *backgrounds = hd_backgrounds_get ();
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  g_mutex_lock (priv->requests_mutex);
+  g_ptr_array_remove_fast (priv->requests,
+                           request);
+  g_mutex_unlock (priv->requests_mutex);
+
+  return FALSE;
+}
+
+/* Returns the request which was passed cancellable, called with
+ * requests_mutex locked */
+static CacheImageRequestData *
+find_request (HDBackgrounds *backgrounds,
+              GCancellable  *cancellable)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  guint i;
+
+  for (i = 0; i < priv->requests->len; i++)
+    {
+      CacheImageRequestData *request = g_ptr_array_index (priv->requests, i);
+
+      if (request->cancellable == cancellable)
+        return request;
+    }
+
+  return NULL;
+}
+
+/* Checks if the request which was passed cancellable is still the newest
+ * for view. Called from the commands. */
+static gboolean
+is_request_current_for_view (HDBackgrounds *backgrounds,
+                             GCancellable  *cancellable,
+                             guint          view)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  CacheImageRequestData *request;
+  gboolean result = TRUE;
+
+  if (!cancellable)
+    return TRUE;
+
+  g_mutex_lock (priv->requests_mutex);
+
+  request = find_request (backgrounds, cancellable);
+  if (request)
+    result = request->serial >= priv->view_serial[view];
+
+  g_mutex_unlock (priv->requests_mutex);
+
+  return result;
+}
+
+/*
+ * Cached images can be recreated from their source, so they are written
+ * without fsync. The checksum is stored in the cache info to detect files
+ * torn by a crash.
+ */
+static gboolean
+save_cached_image_file (const char          *filename,
+                        GdkPixbuf           *pixbuf,
+                        HDCachedImageFormat  format,
+                        gint                 compression,
+                        guint32             *checksum,
+                        GCancellable        *cancellable,
+                        GError             **error)
+{
+  GOutputStream *stream;
+  gboolean result;
+
+  stream = hd_cache_output_stream_new (filename, error);
+  if (!stream)
+    return FALSE;
+
+  switch (format)
+    {
+      case HD_CACHED_IMAGE_FORMAT_ARGB32:
+        result = hd_raw_image_save_to_stream (stream,
+                                              pixbuf,
+                                              HD_RAW_IMAGE_FORMAT_ARGB32,
+                                              cancellable,
+                                              error);
+        break;
+      case HD_CACHED_IMAGE_FORMAT_RGB565:
+        result = hd_raw_image_save_to_stream (stream,
+                                              pixbuf,
+                                              HD_RAW_IMAGE_FORMAT_RGB565,
+                                              cancellable,
+                                              error);
+        break;
+      default:
+        result = hd_pixbuf_utils_save_to_stream (stream,
+                                                 pixbuf,
+                                                 "png",
+                                                 compression,
+                                                 cancellable,
+                                                 error);
+        break;
+    }
+
+  if (result)
+    {
+      hd_background_stats_push (HD_BACKGROUND_STAGE_WRITE);
+      result = hd_cache_output_stream_commit (HD_CACHE_OUTPUT_STREAM (stream),
+                                              checksum,
+                                              cancellable,
+                                              error);
+      hd_background_stats_pop (HD_BACKGROUND_STAGE_WRITE);
+    }
+  else
+    g_output_stream_close (stream, NULL, NULL);
+
+  g_object_unref (stream);
+
+  return result;
+}
+
+typedef struct
+{
+  HDBackgrounds *backgrounds;
+  guint view;
+  GFile *file;
+  char *etag;
+  HDCachedImageFormat format;
+  guint32 checksum;
+} UpdateCacheInfoData;
+
+static gboolean
+update_cache_info_file_idle (UpdateCacheInfoData *data)
+{
+  HDBackgrounds *backgrounds = data->backgrounds;
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_CACHE_INFO);
+  hd_background_info_set (priv->info,
+                          data->view,
+                          data->file,
+                          data->etag,
+                          data->format,
+                          data->checksum);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_CACHE_INFO);
+
+  /* The replaced cached image may have been the last link to a store
+   * entry */
+  schedule_store_gc (backgrounds);
+
+  g_object_unref (data->file);
+  g_free (data->etag);
+
+  g_slice_free (UpdateCacheInfoData, data);
+
+  return FALSE;
+}
+
+static void
+update_cache_info_file (HDBackgrounds       *backgrounds,
+                        guint                view,
+                        GFile               *file,
+                        const char          *etag,
+                        HDCachedImageFormat  format,
+                        guint32              checksum)
+{
+  UpdateCacheInfoData *data = g_slice_new0 (UpdateCacheInfoData);
+
+  data->backgrounds = backgrounds;
+  data->view = view;
+  data->file = g_object_ref (file);
+  data->etag = g_strdup (etag);
+  data->format = format;
+  data->checksum = checksum;
+
+  gdk_threads_add_idle_full (G_PRIORITY_HIGH_IDLE,
+                             (GSourceFunc) update_cache_info_file_idle,
                              data,
                              NULL);
 }
 
+static void
+report_cached_image_error (const GError *error,
+                           gboolean      error_dialogs)
+{
+  /* Display not enough space notification banner */
+  if (error_dialogs &&
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+    {
+      show_banner (dgettext ("hildon-common-strings",
+                             "sfil_ni_not_enough_memory"));
+    }
+
+  g_warning ("%s. Could not save cached image. %s",
+             __FUNCTION__,
+             error->message);
+}
+
+/* Called with the view mutex locked after the cached image is replaced */
+static void
+cached_image_saved (HDBackgrounds       *backgrounds,
+                    guint                view,
+                    GFile               *source_file,
+                    const char          *source_etag,
+                    HDCachedImageFormat  format,
+                    guint32              checksum,
+                    gboolean             update_gconf)
+{
+  update_cache_info_file (backgrounds,
+                          view,
+                          source_file,
+                          source_etag,
+                          format,
+                          checksum);
+
+  /* Update GConf if requested */
+  if (update_gconf)
+    set_background_in_gconf (backgrounds,
+                             view,
+                             source_file);
+}
+
 gboolean
 hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                   GdkPixbuf      *pixbuf,
@@ -1061,82 +2411,660 @@ hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                   GError        **error)
 {
   HDBackgroundsPrivate *priv = backgrounds->priv;
-  char *dest_filename;
-  GFile *dest_file;
-  GError *local_error = NULL;
+  char *dest_filename;
+  guint32 checksum;
+  gboolean result = TRUE;
+  GError *local_error = NULL;
+
+  g_return_val_if_fail (view < G_N_ELEMENTS (priv->view_mutex), FALSE);
+
+  /* Do not overwrite the cached image of a newer request */
+  if (!is_request_current_for_view (backgrounds, cancellable, view))
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_CANCELLED,
+                           "Replaced by a newer request");
+      return FALSE;
+    }
+
+  dest_filename = get_cached_image_path (view, priv->cache_format);
+
+  /* Cached images are created in parallel. Make sure the cached image and
+   * the cache info update of one view are not interleaved with another
+   * command for the same view */
+  g_mutex_lock (priv->view_mutex[view]);
+
+  /* Create the cached background image */
+  if (!save_cached_image_file (dest_filename,
+                               pixbuf,
+                               priv->cache_format,
+                               priv->cache_compression,
+                               &checksum,
+                               cancellable,
+                               &local_error))
+    {
+      g_mutex_unlock (priv->view_mutex[view]);
+
+      report_cached_image_error (local_error,
+                                 error_dialogs);
+
+      g_propagate_error (error,
+                         local_error);
+
+      result = FALSE;
+      goto cleanup;
+    }
+
+  cached_image_saved (backgrounds,
+                      view,
+                      source_file,
+                      source_etag,
+                      priv->cache_format,
+                      checksum,
+                      update_gconf);
+
+  add_cached_image_to_store (backgrounds,
+                             cancellable,
+                             view,
+                             dest_filename);
+
+  g_mutex_unlock (priv->view_mutex[view]);
+
+cleanup:
+  g_free (dest_filename);
+
+  return result;
+}
+
+/*
+ * Creates a writer for the cached image of view, for callers which produce
+ * the image in blocks of rows. The image is written to a temporary file and
+ * only replaces the cached image in hd_backgrounds_commit_cached_image_writer.
+ * Fails with G_IO_ERROR_NOT_SUPPORTED if the cache format cannot be written
+ * in rows, callers should use hd_backgrounds_save_cached_image then.
+ */
+HDCachedImageWriter *
+hd_backgrounds_create_cached_image_writer (HDBackgrounds  *backgrounds,
+                                           guint           view,
+                                           int             width,
+                                           int             height,
+                                           int             n_channels,
+                                           gboolean        error_dialogs,
+                                           GCancellable   *cancellable,
+                                           GError        **error)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  HDCachedImageWriter *writer;
+  char *dest_filename;
+  GError *local_error = NULL;
+
+  g_return_val_if_fail (view < G_N_ELEMENTS (priv->view_mutex), NULL);
+
+  if (!hd_image_writer_supports_format (priv->cache_format))
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_SUPPORTED,
+                           "Cached image format cannot be written in rows");
+      return NULL;
+    }
+
+  writer = g_slice_new0 (HDCachedImageWriter);
+  writer->view = view;
+  writer->format = priv->cache_format;
+  writer->error_dialogs = error_dialogs;
+
+  dest_filename = get_cached_image_path (view, priv->cache_format);
+  writer->stream = hd_cache_output_stream_new (dest_filename, &local_error);
+  g_free (dest_filename);
+
+  if (writer->stream)
+    writer->image_writer = hd_image_writer_new (writer->stream,
+                                                priv->cache_format,
+                                                width,
+                                                height,
+                                                n_channels,
+                                                priv->cache_compression,
+                                                cancellable,
+                                                &local_error);
+
+  if (local_error)
+    {
+      report_cached_image_error (local_error,
+                                 error_dialogs);
+      g_propagate_error (error,
+                         local_error);
+      hd_cached_image_writer_free (writer);
+      return NULL;
+    }
+
+  return writer;
+}
+
+gboolean
+hd_cached_image_writer_write_rows (HDCachedImageWriter  *writer,
+                                   const guchar         *pixels,
+                                   int                   rowstride,
+                                   int                   n_rows,
+                                   GError              **error)
+{
+  GError *local_error = NULL;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+
+  if (!hd_image_writer_write_rows (writer->image_writer,
+                                   pixels,
+                                   rowstride,
+                                   n_rows,
+                                   &local_error))
+    {
+      report_cached_image_error (local_error,
+                                 writer->error_dialogs);
+      g_propagate_error (error,
+                         local_error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Replaces the cached image with the written one and updates the cache
+ * info and GConf like hd_backgrounds_save_cached_image. The writer still
+ * needs to be freed.
+ */
+gboolean
+hd_backgrounds_commit_cached_image_writer (HDBackgrounds        *backgrounds,
+                                           HDCachedImageWriter  *writer,
+                                           GFile                *source_file,
+                                           const char           *source_etag,
+                                           gboolean              update_gconf,
+                                           GCancellable         *cancellable,
+                                           GError              **error)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  char *dest_filename;
+  guint32 checksum;
+  gboolean result;
+  GError *local_error = NULL;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+
+  /* Do not overwrite the cached image of a newer request */
+  if (!is_request_current_for_view (backgrounds, cancellable, writer->view))
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_CANCELLED,
+                           "Replaced by a newer request");
+      return FALSE;
+    }
+
+  if (!hd_image_writer_finish (writer->image_writer,
+                               &local_error))
+    goto error;
+
+  g_mutex_lock (priv->view_mutex[writer->view]);
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_WRITE);
+  result = hd_cache_output_stream_commit (HD_CACHE_OUTPUT_STREAM (writer->stream),
+                                          &checksum,
+                                          cancellable,
+                                          &local_error);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_WRITE);
+
+  if (!result)
+    {
+      g_mutex_unlock (priv->view_mutex[writer->view]);
+      goto error;
+    }
+
+  cached_image_saved (backgrounds,
+                      writer->view,
+                      source_file,
+                      source_etag,
+                      writer->format,
+                      checksum,
+                      update_gconf);
+
+  dest_filename = get_cached_image_path (writer->view, writer->format);
+  add_cached_image_to_store (backgrounds,
+                             cancellable,
+                             writer->view,
+                             dest_filename);
+  g_free (dest_filename);
+
+  g_mutex_unlock (priv->view_mutex[writer->view]);
+
+  return TRUE;
+
+error:
+  report_cached_image_error (local_error,
+                             writer->error_dialogs);
+  g_propagate_error (error,
+                     local_error);
+
+  return FALSE;
+}
+
+/* Frees writer, discarding the written image if it was not committed */
+void
+hd_cached_image_writer_free (HDCachedImageWriter *writer)
+{
+  if (!writer)
+    return;
+
+  hd_image_writer_free (writer->image_writer);
+
+  if (writer->stream)
+    {
+      g_output_stream_close (writer->stream, NULL, NULL);
+      g_object_unref (writer->stream);
+    }
+
+  g_slice_free (HDCachedImageWriter, writer);
+}
+
+/*
+ * Claims the cache store key for the request which was passed cancellable
+ * until it is done, after a concurrent request which creates the same image
+ * released it. slot is the view the image is created for or
+ * HD_BACKGROUNDS_ALL_VIEWS for a prerendered image.
+ */
+static void
+claim_store_key (HDBackgrounds *backgrounds,
+                 GCancellable  *cancellable,
+                 guint          slot,
+                 const char    *key)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  CacheImageRequestData *request;
+
+  g_mutex_lock (priv->requests_mutex);
+
+  request = find_request (backgrounds, cancellable);
+
+  /* Wait until a concurrent request created the same image */
+  for (;;)
+    {
+      CacheImageRequestData *owner;
+
+      owner = g_hash_table_lookup (priv->store_keys_in_flight, key);
+      if (!owner || owner == request)
+        break;
+
+      g_cond_wait (priv->store_cond, priv->requests_mutex);
+    }
+
+  /* Claim the key until the request is done */
+  if (request)
+    {
+      if (!request->store_keys)
+        request->store_keys = g_hash_table_new_full (g_direct_hash,
+                                                     g_direct_equal,
+                                                     NULL,
+                                                     g_free);
+      g_hash_table_insert (request->store_keys,
+                           GUINT_TO_POINTER (slot),
+                           g_strdup (key));
+      g_hash_table_insert (priv->store_keys_in_flight,
+                           g_strdup (key),
+                           request);
+    }
+
+  g_mutex_unlock (priv->requests_mutex);
+}
+
+/*
+ * Replaces the cached image of view with the image created before from
+ * source_file with the same geometry, if it is in the cache store. Returns
+ * TRUE if the command does not need to create the cached image. Otherwise
+ * the image created by the command is added to the store. Commands which
+ * create the same image concurrently wait for each other.
+ */
+gboolean
+hd_backgrounds_link_stored_cached_image (HDBackgrounds *backgrounds,
+                                         guint          view,
+                                         GFile         *source_file,
+                                         const char    *geometry,
+                                         gboolean       update_gconf,
+                                         GCancellable  *cancellable)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GFileInfo *info;
+  char *etag, *key, *dest_filename;
+  guint32 checksum;
+  gboolean result = FALSE;
+  GError *error = NULL;
+
+  g_return_val_if_fail (view < G_N_ELEMENTS (priv->view_mutex), FALSE);
+
+  /* Errors are reported when the source is loaded */
+  info = g_file_query_info (source_file,
+                            G_FILE_ATTRIBUTE_ETAG_VALUE,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            NULL);
+  if (!info)
+    return FALSE;
+
+  etag = g_strdup (g_file_info_get_etag (info));
+  g_object_unref (info);
+
+  key = hd_cache_store_get_key (source_file,
+                                etag,
+                                geometry,
+                                hd_cached_image_format_get_name (priv->cache_format));
+
+  claim_store_key (backgrounds,
+                   cancellable,
+                   view,
+                   key);
+
+  /* Do not overwrite the cached image of a newer request */
+  if (!is_request_current_for_view (backgrounds, cancellable, view))
+    {
+      result = TRUE;
+      goto cleanup;
+    }
+
+  dest_filename = get_cached_image_path (view, priv->cache_format);
+
+  g_mutex_lock (priv->view_mutex[view]);
+
+  if (hd_cache_store_link (key,
+                           dest_filename,
+                           &checksum,
+                           cancellable,
+                           &error))
+    {
+      cached_image_saved (backgrounds,
+                          view,
+                          source_file,
+                          etag,
+                          priv->cache_format,
+                          checksum,
+                          update_gconf);
+      result = TRUE;
+    }
+
+  g_mutex_unlock (priv->view_mutex[view]);
+
+  if (error)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("%s. Could not link stored cached image. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+    }
+
+  g_free (dest_filename);
+
+cleanup:
+  g_free (key);
+  g_free (etag);
+
+  return result;
+}
+
+/* Called with the view mutex locked after the cached image of view was
+ * created by the request which was passed cancellable */
+static void
+add_cached_image_to_store (HDBackgrounds *backgrounds,
+                           GCancellable  *cancellable,
+                           guint          view,
+                           const char    *filename)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  CacheImageRequestData *request;
+  char *key = NULL;
+  GError *error = NULL;
+
+  g_mutex_lock (priv->requests_mutex);
+
+  request = find_request (backgrounds, cancellable);
+  if (request && request->store_keys)
+    key = g_strdup (g_hash_table_lookup (request->store_keys,
+                                         GUINT_TO_POINTER (view)));
+
+  g_mutex_unlock (priv->requests_mutex);
+
+  if (!key)
+    return;
+
+  if (!hd_cache_store_add (key, filename, &error))
+    {
+      g_debug ("%s. Could not add cached image to store. %s",
+               __FUNCTION__,
+               error->message);
+      g_error_free (error);
+    }
+
+  g_free (key);
+}
+
+static void
+prerender_cached_image_command (GFile        *file,
+                                GCancellable *cancellable)
+{
+  HDBackgrounds *backgrounds = hd_backgrounds_get ();
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  HDImageSize screen_size = {HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT};
+  GdkPixbuf *pixbuf = NULL;
+  char *etag, *key, *filename = NULL;
+  guint32 checksum;
+  GError *error = NULL;
+
+  if (g_cancellable_is_cancelled (cancellable))
+    return;
+
+  etag = get_etag (file, NULL);
+  key = hd_cache_store_get_key (file,
+                                etag,
+                                HD_CACHED_IMAGE_GEOMETRY_SCREEN,
+                                hd_cached_image_format_get_name (priv->cache_format));
+
+  /* Requests for the same image wait until it is in the store */
+  claim_store_key (backgrounds,
+                   cancellable,
+                   HD_BACKGROUNDS_ALL_VIEWS,
+                   key);
+
+  if (hd_cache_store_contains (key))
+    goto cleanup;
+
+  pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (file,
+                                                    &screen_size,
+                                                    NULL,
+                                                    cancellable,
+                                                    &error);
+  if (!pixbuf)
+    goto cleanup;
+
+  if (priv->cache_format == HD_CACHED_IMAGE_FORMAT_PNG)
+    filename = g_build_filename (g_get_home_dir (),
+                                 PRERENDERED_CACHED_PNG,
+                                 NULL);
+  else
+    filename = g_build_filename (g_get_home_dir (),
+                                 PRERENDERED_CACHED_RAW,
+                                 NULL);
+
+  /* The prerendered image of the previous request is replaced, its store
+   * entry is collected with the next garbage collection */
+  g_mutex_lock (priv->prerender_mutex);
+
+  if (save_cached_image_file (filename,
+                              pixbuf,
+                              priv->cache_format,
+                              priv->cache_compression,
+                              &checksum,
+                              cancellable,
+                              &error))
+    hd_cache_store_add (key,
+                        filename,
+                        &error);
+
+  g_mutex_unlock (priv->prerender_mutex);
+
+cleanup:
+  /* Errors are reported when the background is set */
+  if (error)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("%s. Could not prerender cached image. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+    }
+
+  if (pixbuf)
+    g_object_unref (pixbuf);
+  g_free (filename);
+  g_free (key);
+  g_free (etag);
+}
+
+/*
+ * Adds a low priority request which creates the cached image of
+ * source_file, scaled and cropped to the screen, in the cache store
+ * without replacing the cached image of a view. Setting source_file as
+ * background later only links the stored image, see
+ * hd_backgrounds_link_stored_cached_image (), or waits for the running
+ * prerender. A prerender request replaces the older ones, callers cancel
+ * cancellable when the image is not needed anymore.
+ */
+void
+hd_backgrounds_add_prerender_cached_image (HDBackgrounds *backgrounds,
+                                           GFile         *source_file,
+                                           GCancellable  *cancellable)
+{
+  HDBackgroundsPrivate *priv;
+  CacheImageRequestData *request;
+  guint i;
+
+  g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
+  g_return_if_fail (G_IS_FILE (source_file));
+
+  priv = backgrounds->priv;
+
+  request = cache_image_request_data_new (source_file,
+                                          0,
+                                          FALSE,
+                                          cancellable,
+                                          (HDCachedImageCommand) prerender_cached_image_command,
+                                          g_object_ref (source_file),
+                                          (GDestroyNotify) g_object_unref);
+
+  g_mutex_lock (priv->requests_mutex);
+
+  request->serial = ++priv->next_request_serial;
+
+  for (i = 0; i < priv->requests->len; i++)
+    {
+      CacheImageRequestData *older = g_ptr_array_index (priv->requests, i);
+
+      if (!older->views)
+        g_cancellable_cancel (older->cancellable);
+    }
+
+  g_ptr_array_add (priv->requests,
+                   request);
+
+  g_mutex_unlock (priv->requests_mutex);
+
+  push_request (backgrounds, request);
+}
+
+/* Releases the cache store keys claimed by request, when it is done */
+static void
+release_store_keys (HDBackgrounds         *backgrounds,
+                    CacheImageRequestData *request)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GHashTableIter iter;
+  gpointer key;
 
-  /* Create the file objects for the cached background image */
-  if(view >= HD_DESKTOP_VIEWS)
-    dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG_PORTRAIT,
-                                     g_get_home_dir (),
-                                     (view - HD_DESKTOP_VIEWS) + 1);
-  else
-    dest_filename = g_strdup_printf ("%s/" BACKGROUND_CACHED_PNG,
-                                     g_get_home_dir (),
-                                     view + 1);
-  dest_file = g_file_new_for_path (dest_filename);
+  g_mutex_lock (priv->requests_mutex);
 
-  /* Create the cached background image */
-  if (!hd_pixbuf_utils_save (dest_file,
-                             pixbuf,
-                             "png",
-                             cancellable,
-                             &local_error))
+  if (request->store_keys)
     {
-      /* Display not enough space notification banner */
-      if (error_dialogs &&
-          g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+      g_hash_table_iter_init (&iter, request->store_keys);
+      while (g_hash_table_iter_next (&iter, NULL, &key))
         {
-          show_banner (dgettext ("hildon-common-strings",
-                                 "sfil_ni_not_enough_memory"));
+          if (g_hash_table_lookup (priv->store_keys_in_flight, key) == request)
+            g_hash_table_remove (priv->store_keys_in_flight, key);
         }
 
-      g_warning ("%s. Could not save cached image. %s",
-                 __FUNCTION__,
-                 local_error->message);
-
-      g_propagate_error (error,
-                         local_error);
+      g_hash_table_remove_all (request->store_keys);
 
-      return FALSE;
+      g_cond_broadcast (priv->store_cond);
     }
 
-  g_free (dest_filename);
-  g_object_unref (dest_file);
+  g_mutex_unlock (priv->requests_mutex);
+}
 
-  update_cache_info_file (backgrounds,
-                          view,
-                          source_file,
-                          source_etag);
+static void
+collect_store_garbage_command (gpointer data)
+{
+  hd_cache_store_collect_garbage ();
+}
 
-  /* Update GConf if requested */
-  if (update_gconf)
-    {
-      gchar *gconf_key, *path;
+static gboolean
+store_gc_timeout_cb (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
 
-      path = g_file_get_path (source_file);
+  priv->store_gc_id = 0;
 
-      /* Store background to GConf */
-      gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, view + 1);
-      gconf_client_set_string (priv->gconf_client,
-                               gconf_key,
-                               path,
-                               &local_error);
+  hd_command_thread_pool_push_with_priority (priv->thread_pool,
+                                             G_PRIORITY_LOW,
+                                             collect_store_garbage_command,
+                                             NULL,
+                                             NULL);
 
-      if (local_error)
-        {
-          g_debug ("%s. Could not set background in GConf for view %u. %s",
-                   __FUNCTION__,
-                   view,
-                   local_error->message);
-          g_clear_error (&local_error);
-        }
+  return FALSE;
+}
 
-      g_free (gconf_key);
-      g_free (path);
-    }
+static void
+schedule_store_gc (HDBackgrounds *backgrounds)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
 
-  return TRUE;
+  if (priv->store_gc_id)
+    g_source_remove (priv->store_gc_id);
+
+  priv->store_gc_id = gdk_threads_add_timeout_seconds (STORE_GC_DELAY,
+                                                       (GSourceFunc) store_gc_timeout_cb,
+                                                       backgrounds);
+}
+
+/*
+ * Returns the number of requests which were cancelled while their command
+ * was running and the CPU time in microseconds their commands used, which
+ * is wasted.
+ */
+void
+hd_backgrounds_get_cancelled_stats (HDBackgrounds *backgrounds,
+                                    guint         *n_requests,
+                                    guint64       *cpu_time)
+{
+  HDBackgroundsPrivate *priv;
+
+  g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
+
+  priv = backgrounds->priv;
+
+  g_mutex_lock (priv->requests_mutex);
+
+  if (n_requests)
+    *n_requests = priv->n_cancelled_requests;
+  if (cpu_time)
+    *cpu_time = priv->cancelled_cpu_time;
+
+  g_mutex_unlock (priv->requests_mutex);
 }
 
 void
@@ -1150,34 +3078,71 @@ hd_backgrounds_report_corrupt_image (const GError *error)
     }
 }
 
+static void
+caller_cancelled_cb (GCancellable          *caller_cancellable,
+                     CacheImageRequestData *request)
+{
+  g_cancellable_cancel (request->cancellable);
+}
+
 static CacheImageRequestData *
-cache_image_request_data_new (GFile        *file,
-                              gboolean      error_dialogs,
-                              GCancellable *cancellable)
+cache_image_request_data_new (GFile                *file,
+                              guint32               views,
+                              gboolean              error_dialogs,
+                              GCancellable         *cancellable,
+                              HDCachedImageCommand  command,
+                              gpointer              data,
+                              GDestroyNotify        destroy_data)
 {
-  CacheImageRequestData *data = g_slice_new0 (CacheImageRequestData);
+  CacheImageRequestData *request = g_slice_new0 (CacheImageRequestData);
+
+  request->file = g_object_ref (file);
+  request->views = views;
+  request->error_dialogs = error_dialogs;
+  request->cancellable = g_cancellable_new ();
+  request->command = command;
+  request->data = data;
+  request->destroy_data = destroy_data;
 
-  data->file = g_object_ref (file);
-  data->error_dialogs = error_dialogs;
   if (cancellable)
-    data->cancellable = g_object_ref (cancellable);
+    {
+      request->caller_cancellable = g_object_ref (cancellable);
+      request->caller_cancelled_id = g_signal_connect (cancellable, "cancelled",
+                                                       G_CALLBACK (caller_cancelled_cb),
+                                                       request);
+      if (g_cancellable_is_cancelled (cancellable))
+        g_cancellable_cancel (request->cancellable);
+    }
 
-  return data;
+  return request;
 }
 
 static void
-cache_image_request_data_free (CacheImageRequestData *data)
+cache_image_request_data_free (CacheImageRequestData *request)
 {
-  if (!data)
+  if (!request)
     return;
 
-  if (data->file)
-    g_object_unref (data->file);
+  if (request->file)
+    g_object_unref (request->file);
 
-  if (data->cancellable)
-    g_object_unref (data->cancellable);
+  if (request->caller_cancellable)
+    {
+      g_signal_handler_disconnect (request->caller_cancellable,
+                                   request->caller_cancelled_id);
+      g_object_unref (request->caller_cancellable);
+    }
+
+  if (request->cancellable)
+    g_object_unref (request->cancellable);
+
+  if (request->destroy_data)
+    request->destroy_data (request->data);
 
-  g_slice_free (CacheImageRequestData, data);
+  if (request->store_keys)
+    g_hash_table_destroy (request->store_keys);
+
+  g_slice_free (CacheImageRequestData, request);
 }
 
 void
@@ -1222,6 +3187,394 @@ hd_backgrounds_set_current_background (HDBackgrounds *backgrounds,
   g_object_unref (image_file);
 }
 
+typedef struct
+{
+  guint n_views;
+  guint views[2 * HD_DESKTOP_VIEWS];
+  GFile *files[2 * HD_DESKTOP_VIEWS];
+
+  /* Sources of the views before the batch, to roll back a failed batch */
+  GFile *previous_files[2 * HD_DESKTOP_VIEWS];
+
+  /* Number of files found to be regular files so far */
+  guint n_checked;
+} SetBackgroundsData;
+
+static void
+set_backgrounds_data_free (SetBackgroundsData *data)
+{
+  guint i;
+
+  for (i = 0; i < data->n_views; i++)
+    {
+      g_object_unref (data->files[i]);
+      if (data->previous_files[i])
+        g_object_unref (data->previous_files[i]);
+    }
+
+  g_slice_free (SetBackgroundsData, data);
+}
+
+/* Checks the views of the batch, the files are checked asynchronously by
+ * check_next_background_file () */
+static gboolean
+validate_views (HDBackgrounds  *backgrounds,
+                guint           n_views,
+                const guint    *views,
+                GError        **error)
+{
+  guint max = HD_DESKTOP_VIEWS;
+  guint32 views_mask = 0;
+  guint i;
+
+  if (hd_backgrounds_is_portrait_wallpaper_enabled (backgrounds))
+    max += HD_DESKTOP_VIEWS;
+
+  if (!n_views)
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_INVALID_ARGUMENT,
+                           "No backgrounds");
+      return FALSE;
+    }
+
+  for (i = 0; i < n_views; i++)
+    {
+      if (views[i] >= max)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid view %u",
+                       views[i]);
+          return FALSE;
+        }
+
+      if (views_mask & (1 << views[i]))
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_ARGUMENT,
+                       "View %u is set more than once",
+                       views[i]);
+          return FALSE;
+        }
+      views_mask |= 1 << views[i];
+    }
+
+  return TRUE;
+}
+
+/* Stores the backgrounds of the batch in GConf with one change set */
+static void
+commit_backgrounds_to_gconf (HDBackgrounds      *backgrounds,
+                             SetBackgroundsData *data)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  GConfChangeSet *change_set;
+  guint i;
+  GError *error = NULL;
+
+  change_set = gconf_change_set_new ();
+
+  for (i = 0; i < data->n_views; i++)
+    {
+      gchar *gconf_key, *path;
+
+      path = g_file_get_path (data->files[i]);
+      gconf_key = g_strdup_printf (GCONF_BACKGROUND_KEY, data->views[i] + 1);
+
+      if (path)
+        gconf_change_set_set_string (change_set,
+                                     gconf_key,
+                                     path);
+
+      g_free (gconf_key);
+      g_free (path);
+    }
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_GCONF);
+  g_mutex_lock (priv->gconf_mutex);
+  gconf_client_commit_change_set (priv->gconf_client,
+                                  change_set,
+                                  FALSE,
+                                  &error);
+  g_mutex_unlock (priv->gconf_mutex);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_GCONF);
+
+  if (error)
+    {
+      g_warning ("%s. Could not set backgrounds in GConf. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+    }
+
+  gconf_change_set_unref (change_set);
+}
+
+static gboolean
+resume_info_flush_cb (HDBackgrounds *backgrounds)
+{
+  hd_background_info_resume_flush (backgrounds->priv->info);
+
+  return FALSE;
+}
+
+/*
+ * Called when all requests of the batch are finished. The cache info
+ * updates of the requests are queued before, so it has the result of each
+ * view.
+ */
+static gboolean
+set_backgrounds_done_cb (GSimpleAsyncResult *result)
+{
+  HDBackgrounds *backgrounds;
+  HDBackgroundsPrivate *priv;
+  SetBackgroundsData *data;
+  guint i, n_failed = 0;
+
+  backgrounds = HD_BACKGROUNDS (g_async_result_get_source_object (G_ASYNC_RESULT (result)));
+  priv = backgrounds->priv;
+  data = g_simple_async_result_get_op_res_gpointer (result);
+
+  /* Compare with the cached files, pending portrait files are not done */
+  for (i = 0; i < data->n_views; i++)
+    {
+      GFile *file = hd_background_info_get_file (priv->info,
+                                                 data->views[i]);
+
+      if (!file || !g_file_equal (file, data->files[i]))
+        n_failed++;
+    }
+
+  if (n_failed)
+    {
+      /* Restore the views which were already replaced */
+      for (i = 0; i < data->n_views; i++)
+        {
+          GFile *file = hd_background_info_get_file (priv->info,
+                                                     data->views[i]);
+
+          if (data->previous_files[i] &&
+              file &&
+              g_file_equal (file, data->files[i]) &&
+              !g_file_equal (file, data->previous_files[i]))
+            create_cached_background (backgrounds,
+                                      data->previous_files[i],
+                                      data->views[i],
+                                      FALSE,
+                                      FALSE);
+        }
+
+      g_simple_async_result_set_error (result,
+                                       G_IO_ERROR,
+                                       G_IO_ERROR_FAILED,
+                                       "Could not set the background of %u of %u views",
+                                       n_failed,
+                                       data->n_views);
+
+      /* Write the cache info once the views are restored */
+      hd_backgrounds_add_done_cb (backgrounds,
+                                  (GSourceFunc) resume_info_flush_cb,
+                                  backgrounds,
+                                  NULL);
+    }
+  else
+    {
+      commit_backgrounds_to_gconf (backgrounds,
+                                   data);
+      hd_background_info_resume_flush (priv->info);
+      hd_background_info_flush (priv->info);
+    }
+
+  g_simple_async_result_complete (result);
+
+  g_object_unref (backgrounds);
+
+  return FALSE;
+}
+
+/* Starts the requests of the batch once all files are checked */
+static void
+start_set_backgrounds (GSimpleAsyncResult *result)
+{
+  HDBackgrounds *backgrounds;
+  SetBackgroundsData *data;
+  guint i;
+
+  backgrounds = HD_BACKGROUNDS (g_async_result_get_source_object (G_ASYNC_RESULT (result)));
+  data = g_simple_async_result_get_op_res_gpointer (result);
+
+  for (i = 0; i < data->n_views; i++)
+    {
+      GFile *previous_file = hd_backgrounds_get_background (backgrounds,
+                                                            data->views[i]);
+
+      if (previous_file)
+        data->previous_files[i] = g_object_ref (previous_file);
+    }
+
+  /* The cache info is written in set_backgrounds_done_cb (), after the
+   * batch succeeded or was rolled back */
+  hd_background_info_suspend_flush (backgrounds->priv->info);
+
+  /* GConf is updated for the whole batch when it is done */
+  for (i = 0; i < data->n_views; i++)
+    create_cached_background (backgrounds,
+                              data->files[i],
+                              data->views[i],
+                              TRUE,
+                              FALSE);
+
+  /* The batch is only done once its portrait images are created */
+  for (i = 0; i < data->n_views; i++)
+    if (data->views[i] >= HD_DESKTOP_VIEWS)
+      push_deferred_request (backgrounds, data->views[i]);
+
+  hd_backgrounds_add_done_cb (backgrounds,
+                              (GSourceFunc) set_backgrounds_done_cb,
+                              g_object_ref (result),
+                              (GDestroyNotify) g_object_unref);
+
+  g_object_unref (backgrounds);
+}
+
+static void check_next_background_file (GSimpleAsyncResult *result);
+
+static void
+background_file_checked (GFile              *file,
+                         GAsyncResult       *res,
+                         GSimpleAsyncResult *result)
+{
+  SetBackgroundsData *data;
+  GFileInfo *info;
+
+  data = g_simple_async_result_get_op_res_gpointer (result);
+
+  info = g_file_query_info_finish (file,
+                                   res,
+                                   NULL);
+
+  if (!info || g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR)
+    {
+      char *uri = g_file_get_uri (file);
+
+      g_simple_async_result_set_error (result,
+                                       G_IO_ERROR,
+                                       G_IO_ERROR_NOT_FOUND,
+                                       "Background image %s of view %u not found",
+                                       uri,
+                                       data->views[data->n_checked]);
+      g_simple_async_result_complete (result);
+      g_object_unref (result);
+
+      g_free (uri);
+      if (info)
+        g_object_unref (info);
+      return;
+    }
+
+  g_object_unref (info);
+
+  data->n_checked++;
+  check_next_background_file (result);
+}
+
+/* Takes the reference of result */
+static void
+check_next_background_file (GSimpleAsyncResult *result)
+{
+  SetBackgroundsData *data;
+
+  data = g_simple_async_result_get_op_res_gpointer (result);
+
+  if (data->n_checked == data->n_views)
+    {
+      start_set_backgrounds (result);
+      g_object_unref (result);
+      return;
+    }
+
+  g_file_query_info_async (data->files[data->n_checked],
+                           G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                           G_FILE_QUERY_INFO_NONE,
+                           G_PRIORITY_DEFAULT,
+                           NULL,
+                           (GAsyncReadyCallback) background_file_checked,
+                           result);
+}
+
+/*
+ * Sets the backgrounds of several views as one batch. The views are
+ * validated together and their cached images are created in parallel.
+ * GConf and the cache info file are written once when all views
+ * succeeded, otherwise the views already replaced are restored.
+ */
+void
+hd_backgrounds_set_backgrounds_async (HDBackgrounds        *backgrounds,
+                                      guint                 n_views,
+                                      const guint          *views,
+                                      GFile               **files,
+                                      GAsyncReadyCallback   callback,
+                                      gpointer              user_data)
+{
+  GSimpleAsyncResult *result;
+  SetBackgroundsData *data;
+  guint i;
+  GError *error = NULL;
+
+  g_return_if_fail (HD_IS_BACKGROUNDS (backgrounds));
+
+  result = g_simple_async_result_new (G_OBJECT (backgrounds),
+                                      callback,
+                                      user_data,
+                                      hd_backgrounds_set_backgrounds_async);
+
+  if (!validate_views (backgrounds,
+                       n_views,
+                       views,
+                       &error))
+    {
+      g_simple_async_result_set_from_error (result, error);
+      g_error_free (error);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
+    }
+
+  data = g_slice_new0 (SetBackgroundsData);
+  data->n_views = n_views;
+
+  for (i = 0; i < n_views; i++)
+    {
+      data->views[i] = views[i];
+      data->files[i] = g_object_ref (files[i]);
+    }
+
+  g_simple_async_result_set_op_res_gpointer (result,
+                                             data,
+                                             (GDestroyNotify) set_backgrounds_data_free);
+
+  /* Check that the files exist without blocking the main loop */
+  check_next_background_file (result);
+}
+
+gboolean
+hd_backgrounds_set_backgrounds_finish (HDBackgrounds  *backgrounds,
+                                       GAsyncResult   *result,
+                                       GError        **error)
+{
+  g_return_val_if_fail (g_simple_async_result_is_valid (result,
+                                                        G_OBJECT (backgrounds),
+                                                        hd_backgrounds_set_backgrounds_async),
+                        FALSE);
+
+  return !g_simple_async_result_propagate_error (G_SIMPLE_ASYNC_RESULT (result),
+                                                 error);
+}
+
 gboolean
 hd_backgrounds_is_portrait_wallpaper_enabled (HDBackgrounds *backgrounds)
 {
@@ -1229,3 +3582,66 @@ hd_backgrounds_is_portrait_wallpaper_enabled (HDBackgrounds *backgrounds)
 
   return priv->portrait_wallpaper;
 }
+
+/*
+ * Loads the cached image of view in the format recorded in the cache
+ * info, fit into width x height. Raw images are read from a mapping.
+ */
+GdkPixbuf *
+hd_backgrounds_load_cached_image_at_scale (HDBackgrounds  *backgrounds,
+                                           guint           view,
+                                           int             width,
+                                           int             height,
+                                           GError        **error)
+{
+  HDBackgroundsPrivate *priv = backgrounds->priv;
+  HDCachedImageFormat format;
+  char *path;
+  GdkPixbuf *pixbuf;
+
+  format = hd_background_info_get_format (priv->info, view);
+  path = get_cached_image_path (view, format);
+
+  if (format == HD_CACHED_IMAGE_FORMAT_PNG)
+    pixbuf = gdk_pixbuf_new_from_file_at_scale (path,
+                                                width,
+                                                height,
+                                                TRUE,
+                                                error);
+  else
+    pixbuf = hd_raw_image_load_at_scale (path,
+                                         width,
+                                         height,
+                                         TRUE,
+                                         error);
+
+  g_free (path);
+
+  return pixbuf;
+}
+
+const char *
+hd_cached_image_format_get_name (HDCachedImageFormat format)
+{
+  g_return_val_if_fail (format < G_N_ELEMENTS (cached_image_format_names), NULL);
+
+  return cached_image_format_names[format];
+}
+
+gboolean
+hd_cached_image_format_from_name (const char          *name,
+                                  HDCachedImageFormat *format)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (cached_image_format_names); i++)
+    {
+      if (g_strcmp0 (name, cached_image_format_names[i]) == 0)
+        {
+          *format = i;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
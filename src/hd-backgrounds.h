@@ -52,6 +52,29 @@ struct _HDBackgroundsClass
   GObjectClass parent_class;
 };
 
+/* Formats of the cached background images */
+typedef enum
+{
+  HD_CACHED_IMAGE_FORMAT_PNG,
+  HD_CACHED_IMAGE_FORMAT_ARGB32,
+  HD_CACHED_IMAGE_FORMAT_RGB565
+} HDCachedImageFormat;
+
+/* Cached image written in blocks of rows */
+typedef struct _HDCachedImageWriter HDCachedImageWriter;
+
+/* View passed for requests which create the cached images of all views */
+#define HD_BACKGROUNDS_ALL_VIEWS G_MAXUINT
+
+/* Geometry of the cached images which are scaled and cropped to the screen
+ * size, see hd_backgrounds_link_stored_cached_image () */
+#define HD_CACHED_IMAGE_GEOMETRY_SCREEN "scaled-and-cropped"
+
+/* Command creating a cached image. Should use cancellable instead of an own
+ * one, it gets cancelled when the request is replaced by a newer one. */
+typedef void (*HDCachedImageCommand) (gpointer      data,
+                                      GCancellable *cancellable);
+
 GType          hd_backgrounds_get_type        (void);
 
 HDBackgrounds *hd_backgrounds_get             (void);
@@ -63,13 +86,18 @@ void           hd_backgrounds_add_done_cb     (HDBackgrounds  *backgrounds,
                                                gpointer        cb_data,
                                                GDestroyNotify  destroy_data);
 
-void           hd_backgrounds_add_create_cached_image (HDBackgrounds      *backgrounds,
-                                                       GFile              *source_file,
-                                                       gboolean            error_dialogs,
-                                                       GCancellable       *cancellable,
-                                                       HDCommandCallback   command,
-                                                       gpointer            data,
-                                                       GDestroyNotify      destroy_data);
+void           hd_backgrounds_add_create_cached_image (HDBackgrounds        *backgrounds,
+                                                       GFile                *source_file,
+                                                       guint                 view,
+                                                       gboolean              error_dialogs,
+                                                       GCancellable         *cancellable,
+                                                       HDCachedImageCommand  command,
+                                                       gpointer              data,
+                                                       GDestroyNotify        destroy_data);
+
+void           hd_backgrounds_add_prerender_cached_image (HDBackgrounds *backgrounds,
+                                                          GFile         *source_file,
+                                                          GCancellable  *cancellable);
 
 void           hd_backgrounds_add_update_current_files (HDBackgrounds  *backgrounds,
                                                         GFile         **files,
@@ -80,6 +108,22 @@ GFile         *hd_backgrounds_get_background  (HDBackgrounds  *backgrounds,
 void           hd_backgrounds_set_current_background (HDBackgrounds *backgrounds,
                                                       const char    *uri);
 
+void           hd_backgrounds_set_backgrounds_async  (HDBackgrounds        *backgrounds,
+                                                      guint                 n_views,
+                                                      const guint          *views,
+                                                      GFile               **files,
+                                                      GAsyncReadyCallback   callback,
+                                                      gpointer              user_data);
+gboolean       hd_backgrounds_set_backgrounds_finish (HDBackgrounds        *backgrounds,
+                                                      GAsyncResult         *result,
+                                                      GError              **error);
+
+void           hd_backgrounds_flush_cache_info (HDBackgrounds  *backgrounds);
+
+void           hd_backgrounds_get_cancelled_stats (HDBackgrounds *backgrounds,
+                                                   guint         *n_requests,
+                                                   guint64       *cpu_time);
+
 /* The following functions can be called from the command callback */
 gboolean       hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                                  GdkPixbuf      *pixbuf,
@@ -91,9 +135,47 @@ gboolean       hd_backgrounds_save_cached_image (HDBackgrounds  *backgrounds,
                                                  GCancellable   *cancellable,
                                                  GError        **error);
 void hd_backgrounds_report_corrupt_image        (const GError   *error);
+gboolean       hd_backgrounds_link_stored_cached_image (HDBackgrounds  *backgrounds,
+                                                        guint           view,
+                                                        GFile          *source_file,
+                                                        const char     *geometry,
+                                                        gboolean        update_gconf,
+                                                        GCancellable   *cancellable);
+
+HDCachedImageWriter *hd_backgrounds_create_cached_image_writer (HDBackgrounds        *backgrounds,
+                                                                guint                 view,
+                                                                int                   width,
+                                                                int                   height,
+                                                                int                   n_channels,
+                                                                gboolean              error_dialogs,
+                                                                GCancellable         *cancellable,
+                                                                GError              **error);
+gboolean             hd_cached_image_writer_write_rows         (HDCachedImageWriter  *writer,
+                                                                const guchar         *pixels,
+                                                                int                   rowstride,
+                                                                int                   n_rows,
+                                                                GError              **error);
+gboolean             hd_backgrounds_commit_cached_image_writer (HDBackgrounds        *backgrounds,
+                                                                HDCachedImageWriter  *writer,
+                                                                GFile                *source_file,
+                                                                const char           *source_etag,
+                                                                gboolean              update_gconf,
+                                                                GCancellable         *cancellable,
+                                                                GError              **error);
+void                 hd_cached_image_writer_free               (HDCachedImageWriter  *writer);
 
 gboolean hd_backgrounds_is_portrait_wallpaper_enabled (HDBackgrounds *backgrounds);
 
+GdkPixbuf *hd_backgrounds_load_cached_image_at_scale (HDBackgrounds  *backgrounds,
+                                                      guint           view,
+                                                      int             width,
+                                                      int             height,
+                                                      GError        **error);
+
+const char *hd_cached_image_format_get_name  (HDCachedImageFormat  format);
+gboolean    hd_cached_image_format_from_name (const char          *name,
+                                              HDCachedImageFormat *format);
+
 G_END_DECLS
 
 #endif /* __HD_BACKGROUNDS_H__ */
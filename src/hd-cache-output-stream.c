@@ -0,0 +1,281 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* For O_TMPFILE and linkat */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "hd-checksum.h"
+#include "hd-file-utils.h"
+
+#include "hd-cache-output-stream.h"
+
+/*
+ * Output stream for files which can always be recreated, like the cached
+ * backgrounds. The file is written to an unnamed (O_TMPFILE) or temporary
+ * file which replaces filename on commit, so readers never see partial
+ * files. Unlike g_file_replace there is no fsync, a file lost or torn by
+ * a crash is detected by its checksum and recreated.
+ */
+
+#define HD_CACHE_OUTPUT_STREAM_GET_PRIVATE(object) \
+  (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_CACHE_OUTPUT_STREAM, HDCacheOutputStreamPrivate))
+
+/* Permissions of the created files */
+#define CACHE_FILE_MODE 0644
+
+struct _HDCacheOutputStreamPrivate
+{
+  char *filename;
+
+  /* Name of the temporary file, NULL for an unnamed O_TMPFILE file */
+  char *tmp_filename;
+  int fd;
+
+  gboolean committed;
+
+  HDChecksum checksum;
+};
+
+G_DEFINE_TYPE (HDCacheOutputStream, hd_cache_output_stream, G_TYPE_OUTPUT_STREAM);
+
+static gssize
+hd_cache_output_stream_write (GOutputStream  *stream,
+                              const void     *buffer,
+                              gsize           count,
+                              GCancellable   *cancellable,
+                              GError        **error)
+{
+  HDCacheOutputStreamPrivate *priv = HD_CACHE_OUTPUT_STREAM (stream)->priv;
+  gssize written;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  do
+    written = write (priv->fd, buffer, count);
+  while (written < 0 && errno == EINTR);
+
+  if (written < 0)
+    {
+      hd_file_utils_set_error_from_errno (error, errno, "Error writing to file", priv->filename);
+      return -1;
+    }
+
+  hd_checksum_update (&priv->checksum, buffer, written);
+
+  return written;
+}
+
+static gboolean
+hd_cache_output_stream_close (GOutputStream  *stream,
+                              GCancellable   *cancellable,
+                              GError        **error)
+{
+  HDCacheOutputStreamPrivate *priv = HD_CACHE_OUTPUT_STREAM (stream)->priv;
+
+  if (priv->fd >= 0)
+    {
+      close (priv->fd);
+      priv->fd = -1;
+    }
+
+  /* Closed without commit, discard the file */
+  if (!priv->committed && priv->tmp_filename)
+    g_unlink (priv->tmp_filename);
+
+  return TRUE;
+}
+
+static void
+hd_cache_output_stream_finalize (GObject *object)
+{
+  HDCacheOutputStreamPrivate *priv = HD_CACHE_OUTPUT_STREAM (object)->priv;
+
+  g_free (priv->filename);
+  g_free (priv->tmp_filename);
+
+  G_OBJECT_CLASS (hd_cache_output_stream_parent_class)->finalize (object);
+}
+
+static void
+hd_cache_output_stream_class_init (HDCacheOutputStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GOutputStreamClass *stream_class = G_OUTPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = hd_cache_output_stream_finalize;
+
+  stream_class->write_fn = hd_cache_output_stream_write;
+  stream_class->close_fn = hd_cache_output_stream_close;
+
+  g_type_class_add_private (klass, sizeof (HDCacheOutputStreamPrivate));
+}
+
+static void
+hd_cache_output_stream_init (HDCacheOutputStream *stream)
+{
+  stream->priv = HD_CACHE_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  stream->priv->fd = -1;
+  hd_checksum_init (&stream->priv->checksum);
+}
+
+/*
+ * Creates a stream for filename. The file is replaced when the stream is
+ * committed with hd_cache_output_stream_commit, closing the stream
+ * without commit keeps the current file.
+ */
+GOutputStream *
+hd_cache_output_stream_new (const char  *filename,
+                            GError     **error)
+{
+  HDCacheOutputStream *stream;
+  HDCacheOutputStreamPrivate *priv;
+
+  stream = g_object_new (HD_TYPE_CACHE_OUTPUT_STREAM, NULL);
+  priv = stream->priv;
+
+  priv->filename = g_strdup (filename);
+
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+  {
+    char *dirname = g_path_get_dirname (filename);
+
+    /* Fails with older kernels and file systems without support */
+    priv->fd = open (dirname, O_TMPFILE | O_WRONLY, CACHE_FILE_MODE);
+
+    g_free (dirname);
+  }
+#endif
+
+  if (priv->fd < 0)
+    {
+      priv->tmp_filename = g_strdup_printf ("%s.XXXXXX", filename);
+      priv->fd = g_mkstemp (priv->tmp_filename);
+
+      if (priv->fd < 0)
+        {
+          hd_file_utils_set_error_from_errno (error, errno, "Could not create temporary file for", filename);
+          g_free (priv->tmp_filename);
+          priv->tmp_filename = NULL;
+          g_object_unref (stream);
+          return NULL;
+        }
+
+      fchmod (priv->fd, CACHE_FILE_MODE);
+    }
+
+  return G_OUTPUT_STREAM (stream);
+}
+
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+static gboolean
+link_tmpfile (HDCacheOutputStreamPrivate  *priv,
+              GError                     **error)
+{
+  char *proc_path;
+  guint i;
+
+  proc_path = g_strdup_printf ("/proc/self/fd/%d", priv->fd);
+
+  /* linkat can not replace a file, so link it to a temporary name first */
+  for (i = 0; i < 10; i++)
+    {
+      priv->tmp_filename = g_strdup_printf ("%s.%08x",
+                                            priv->filename,
+                                            g_random_int ());
+
+      if (linkat (AT_FDCWD, proc_path,
+                  AT_FDCWD, priv->tmp_filename,
+                  AT_SYMLINK_FOLLOW) == 0)
+        break;
+
+      g_free (priv->tmp_filename);
+      priv->tmp_filename = NULL;
+
+      if (errno != EEXIST)
+        break;
+    }
+
+  if (!priv->tmp_filename)
+    hd_file_utils_set_error_from_errno (error, errno, "Could not link", priv->filename);
+
+  g_free (proc_path);
+
+  return priv->tmp_filename != NULL;
+}
+#endif
+
+/*
+ * Replaces the file with the written data and closes stream. Returns the
+ * checksum of the written data in checksum.
+ */
+gboolean
+hd_cache_output_stream_commit (HDCacheOutputStream  *stream,
+                               guint32              *checksum,
+                               GCancellable         *cancellable,
+                               GError              **error)
+{
+  HDCacheOutputStreamPrivate *priv;
+
+  g_return_val_if_fail (HD_IS_CACHE_OUTPUT_STREAM (stream), FALSE);
+
+  priv = stream->priv;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto error;
+
+#if defined(O_TMPFILE) && defined(HAVE_LINKAT)
+  if (!priv->tmp_filename && !link_tmpfile (priv, error))
+    goto error;
+#endif
+
+  if (g_rename (priv->tmp_filename, priv->filename) != 0)
+    {
+      hd_file_utils_set_error_from_errno (error, errno, "Could not replace", priv->filename);
+      goto error;
+    }
+
+  priv->committed = TRUE;
+
+  if (checksum)
+    *checksum = hd_checksum_digest (&priv->checksum);
+
+  return g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, error);
+
+error:
+  g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, NULL);
+
+  return FALSE;
+}
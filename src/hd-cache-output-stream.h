@@ -0,0 +1,65 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_CACHE_OUTPUT_STREAM_H__
+#define __HD_CACHE_OUTPUT_STREAM_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define HD_TYPE_CACHE_OUTPUT_STREAM            (hd_cache_output_stream_get_type ())
+#define HD_CACHE_OUTPUT_STREAM(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), HD_TYPE_CACHE_OUTPUT_STREAM, HDCacheOutputStream))
+#define HD_CACHE_OUTPUT_STREAM_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass),  HD_TYPE_CACHE_OUTPUT_STREAM, HDCacheOutputStreamClass))
+#define HD_IS_CACHE_OUTPUT_STREAM(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), HD_TYPE_CACHE_OUTPUT_STREAM))
+#define HD_IS_CACHE_OUTPUT_STREAM_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass),  HD_TYPE_CACHE_OUTPUT_STREAM))
+#define HD_CACHE_OUTPUT_STREAM_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj),  HD_TYPE_CACHE_OUTPUT_STREAM, HDCacheOutputStreamClass))
+
+typedef struct _HDCacheOutputStream        HDCacheOutputStream;
+typedef struct _HDCacheOutputStreamClass   HDCacheOutputStreamClass;
+typedef struct _HDCacheOutputStreamPrivate HDCacheOutputStreamPrivate;
+
+struct _HDCacheOutputStream
+{
+  GOutputStream parent;
+
+  HDCacheOutputStreamPrivate *priv;
+};
+
+struct _HDCacheOutputStreamClass
+{
+  GOutputStreamClass parent_class;
+};
+
+GType          hd_cache_output_stream_get_type (void);
+
+GOutputStream *hd_cache_output_stream_new      (const char           *filename,
+                                                GError              **error);
+
+gboolean       hd_cache_output_stream_commit   (HDCacheOutputStream  *stream,
+                                                guint32              *checksum,
+                                                GCancellable         *cancellable,
+                                                GError              **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "hd-checksum.h"
+#include "hd-file-utils.h"
+
+#include "hd-cache-store.h"
+
+#define STORE_DIR ".backgrounds/store"
+
+/* Suffix of the temporary links, see link_replace () */
+#define TMP_SUFFIX ".tmp"
+
+static volatile gint tmp_counter = 0;
+
+static char *
+get_store_dir (void)
+{
+  return g_build_filename (g_get_home_dir (), STORE_DIR, NULL);
+}
+
+static char *
+get_entry_path (const char *key)
+{
+  return g_build_filename (g_get_home_dir (), STORE_DIR, key, NULL);
+}
+
+/* Atomically replaces dest with a hardlink to source */
+static gboolean
+link_replace (const char  *source,
+              const char  *dest,
+              GError     **error)
+{
+  char *tmp_filename;
+  gboolean result = TRUE;
+
+  /* Several threads may link to the same store entry */
+  tmp_filename = g_strdup_printf ("%s.%d.%d" TMP_SUFFIX,
+                                  dest,
+                                  getpid (),
+                                  g_atomic_int_exchange_and_add (&tmp_counter, 1));
+
+  if (link (source, tmp_filename) < 0)
+    {
+      hd_file_utils_set_error_from_errno (error, errno, "Could not link file", source);
+      result = FALSE;
+    }
+  else
+    {
+      if (g_rename (tmp_filename, dest) < 0)
+        {
+          hd_file_utils_set_error_from_errno (error, errno, "Could not rename file", tmp_filename);
+          result = FALSE;
+        }
+
+      /* rename () does nothing if dest already is a link to source, the
+       * temporary link would keep the entry from being collected */
+      g_unlink (tmp_filename);
+    }
+
+  g_free (tmp_filename);
+
+  return result;
+}
+
+/*
+ * Returns the store key of the cached image created from source_file with
+ * the etag source_etag. geometry describes how the source is scaled and
+ * cropped and format is the name of the cached image format.
+ */
+char *
+hd_cache_store_get_key (GFile      *source_file,
+                        const char *source_etag,
+                        const char *geometry,
+                        const char *format)
+{
+  char *uri, *description, *key;
+
+  uri = g_file_get_uri (source_file);
+  description = g_strdup_printf ("%s\n%s\n%s\n%s",
+                                 uri,
+                                 source_etag ? source_etag : "",
+                                 geometry,
+                                 format);
+
+  key = g_compute_checksum_for_string (G_CHECKSUM_SHA1,
+                                       description,
+                                       -1);
+
+  g_free (uri);
+  g_free (description);
+
+  return key;
+}
+
+/*
+ * Replaces filename with the store entry of key and returns the checksum
+ * of the entry. Fails with G_IO_ERROR_NOT_FOUND if there is no entry.
+ */
+gboolean
+hd_cache_store_link (const char    *key,
+                     const char    *filename,
+                     guint32       *checksum,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  char *entry_path;
+  gboolean result;
+
+  entry_path = get_entry_path (key);
+
+  result = hd_checksum_file (entry_path,
+                             checksum,
+                             cancellable,
+                             error) &&
+           link_replace (entry_path, filename, error);
+
+  g_free (entry_path);
+
+  return result;
+}
+
+/* Adds the cached image filename to the store as the entry of key */
+gboolean
+hd_cache_store_add (const char  *key,
+                    const char  *filename,
+                    GError     **error)
+{
+  char *store_dir, *entry_path;
+  gboolean result;
+
+  store_dir = get_store_dir ();
+  if (g_mkdir_with_parents (store_dir,
+                            S_IRUSR | S_IWUSR | S_IXUSR |
+                            S_IRGRP | S_IXGRP |
+                            S_IROTH | S_IXOTH))
+    {
+      hd_file_utils_set_error_from_errno (error, errno, "Could not make dir", store_dir);
+      g_free (store_dir);
+      return FALSE;
+    }
+  g_free (store_dir);
+
+  entry_path = get_entry_path (key);
+
+  result = link_replace (filename, entry_path, error);
+
+  g_free (entry_path);
+
+  return result;
+}
+
+/* Checks if the store has an entry for key */
+gboolean
+hd_cache_store_contains (const char *key)
+{
+  char *entry_path;
+  gboolean result;
+
+  entry_path = get_entry_path (key);
+
+  result = g_file_test (entry_path, G_FILE_TEST_IS_REGULAR);
+
+  g_free (entry_path);
+
+  return result;
+}
+
+/*
+ * Removes the store entries which are linked to filename, when it is
+ * found to be corrupt.
+ */
+void
+hd_cache_store_forget (const char *filename)
+{
+  struct stat file_stat;
+  char *store_dir;
+  GDir *dir;
+  const char *name;
+
+  if (g_stat (filename, &file_stat) < 0 || file_stat.st_nlink < 2)
+    return;
+
+  store_dir = get_store_dir ();
+
+  dir = g_dir_open (store_dir, 0, NULL);
+  while (dir && (name = g_dir_read_name (dir)))
+    {
+      char *entry_path = g_build_filename (store_dir, name, NULL);
+      struct stat entry_stat;
+
+      if (g_lstat (entry_path, &entry_stat) == 0 &&
+          entry_stat.st_dev == file_stat.st_dev &&
+          entry_stat.st_ino == file_stat.st_ino)
+        g_unlink (entry_path);
+
+      g_free (entry_path);
+    }
+
+  if (dir)
+    g_dir_close (dir);
+  g_free (store_dir);
+}
+
+/*
+ * Removes the store entries which are not linked to a cached image of any
+ * view anymore, including left over temporary links.
+ */
+void
+hd_cache_store_collect_garbage (void)
+{
+  char *store_dir;
+  GDir *dir;
+  const char *name;
+
+  store_dir = get_store_dir ();
+
+  dir = g_dir_open (store_dir, 0, NULL);
+  while (dir && (name = g_dir_read_name (dir)))
+    {
+      char *entry_path = g_build_filename (store_dir, name, NULL);
+      struct stat entry_stat;
+
+      if (g_lstat (entry_path, &entry_stat) == 0 &&
+          S_ISREG (entry_stat.st_mode) &&
+          entry_stat.st_nlink < 2)
+        {
+          g_debug ("%s. Remove unused entry %s",
+                   __FUNCTION__,
+                   name);
+          g_unlink (entry_path);
+        }
+
+      g_free (entry_path);
+    }
+
+  if (dir)
+    g_dir_close (dir);
+  g_free (store_dir);
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_CACHE_STORE_H__
+#define __HD_CACHE_STORE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Content addressed store of cached background images. Entries are keyed
+ * by the source and the parameters of the cached image and are hardlinked
+ * to the cached image files of the views, so identical images are only
+ * created and stored once.
+ */
+
+char     *hd_cache_store_get_key         (GFile         *source_file,
+                                          const char    *source_etag,
+                                          const char    *geometry,
+                                          const char    *format);
+
+gboolean  hd_cache_store_link            (const char    *key,
+                                          const char    *filename,
+                                          guint32       *checksum,
+                                          GCancellable  *cancellable,
+                                          GError       **error);
+gboolean  hd_cache_store_add             (const char    *key,
+                                          const char    *filename,
+                                          GError       **error);
+gboolean  hd_cache_store_contains        (const char    *key);
+void      hd_cache_store_forget          (const char    *filename);
+
+void      hd_cache_store_collect_garbage (void);
+
+G_END_DECLS
+
+#endif
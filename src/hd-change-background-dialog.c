@@ -67,6 +67,10 @@ struct _HDChangeBackgroundDialogPrivate
   guint scroll_to_selected_id;
 
   GCancellable *cancellable;
+
+  /* Cancelled when the selection moves away from the prerendered
+   * background */
+  GCancellable *prerender_cancellable;
 };
 
 G_DEFINE_TYPE (HDChangeBackgroundDialog, hd_change_background_dialog, GTK_TYPE_DIALOG);
@@ -108,15 +112,44 @@ backgrounds_selection_changed (HDAvailableBackgrounds   *backgrounds,
                                                       dialog);
 }
 
+/* Returns the view whose background is changed by the dialog */
+static guint
+get_background_view (HDChangeBackgroundDialog *dialog)
+{
+  HDChangeBackgroundDialogPrivate *priv = dialog->priv;
+
+  if (hd_change_background_dialog_is_portrait ()
+        && hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
+    return priv->current_view + HD_DESKTOP_VIEWS;
+  else
+    return priv->current_view;
+}
+
+static void
+cancel_prerender (HDChangeBackgroundDialog *dialog)
+{
+  HDChangeBackgroundDialogPrivate *priv = dialog->priv;
+
+  if (priv->prerender_cancellable)
+    {
+      g_cancellable_cancel (priv->prerender_cancellable);
+      priv->prerender_cancellable = (g_object_unref (priv->prerender_cancellable), NULL);
+    }
+}
+
 static void
 _hd_background_selector_changed (HildonTouchSelector* widget,
                                  gint column,
                                  HDChangeBackgroundDialog *dialog)
 {
+  HDChangeBackgroundDialogPrivate *priv = dialog->priv;
   GtkTreeModel *model = NULL;
   GtkTreeIter iter;
+  HDBackground *background = NULL;
   gboolean is_ovi = FALSE;
 
+  cancel_prerender (dialog);
+
   model = hildon_touch_selector_get_model (widget, column);
   if (!model ||
       !hildon_touch_selector_get_selected (widget, column, &iter))
@@ -127,11 +160,24 @@ _hd_background_selector_changed (HildonTouchSelector* widget,
   gtk_tree_model_get (model,
                       &iter,
                       HD_BACKGROUND_COL_OVI, &is_ovi,
+                      HD_BACKGROUND_COL_OBJECT, &background,
                       -1);
   if (is_ovi)
     {
       hd_utils_open_link (HD_OVI_LINK_BACKGROUNDS);
     }
+  else if (background)
+    {
+      /* Create the cached image of the highlighted background while the
+       * user decides, Done then only links it */
+      priv->prerender_cancellable = g_cancellable_new ();
+      hd_background_prerender_for_view (background,
+                                        get_background_view (dialog),
+                                        priv->prerender_cancellable);
+    }
+
+  if (background)
+    g_object_unref (background);
 }
 
 static void
@@ -169,6 +215,8 @@ hd_change_background_dialog_dispose (GObject *object)
   if (priv->cancellable)
     priv->cancellable = (g_object_unref (priv->cancellable), NULL);
 
+  cancel_prerender (HD_CHANGE_BACKGROUND_DIALOG (object));
+
   G_OBJECT_CLASS (hd_change_background_dialog_parent_class)->dispose (object);
 }
 
@@ -331,15 +379,9 @@ hd_change_background_dialog_response (GtkDialog *dialog,
                                                     TRUE);
           gtk_widget_set_sensitive (GTK_WIDGET (dialog), FALSE);
 
-          if (hd_change_background_dialog_is_portrait () 
-                && hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
-            hd_background_set_for_current_view (background,
-                                                priv->current_view + HD_DESKTOP_VIEWS,
-                                                priv->cancellable);
-          else
-            hd_background_set_for_current_view (background,
-                                                priv->current_view,
-                                                priv->cancellable);
+          hd_background_set_for_current_view (background,
+                                              get_background_view (HD_CHANGE_BACKGROUND_DIALOG (dialog)),
+                                              priv->cancellable);
 
             hd_backgrounds_add_done_cb (hd_backgrounds_get (),
                                         background_set_cb,
@@ -356,6 +398,8 @@ hd_change_background_dialog_response (GtkDialog *dialog,
       if (priv->cancellable)
         g_cancellable_cancel (priv->cancellable);
 
+      cancel_prerender (HD_CHANGE_BACKGROUND_DIALOG (dialog));
+
       gtk_widget_destroy (GTK_WIDGET (dialog));
     }
 }
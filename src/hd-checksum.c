@@ -0,0 +1,199 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "hd-checksum.h"
+
+/* XXH32 with seed 0, see http://cyan4973.github.io/xxHash/ */
+
+#define PRIME32_1 2654435761U
+#define PRIME32_2 2246822519U
+#define PRIME32_3 3266489917U
+#define PRIME32_4 668265263U
+#define PRIME32_5 374761393U
+
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static inline guint32
+read_uint32 (const guchar *p)
+{
+  guint32 value;
+
+  memcpy (&value, p, sizeof (value));
+
+  return GUINT32_FROM_LE (value);
+}
+
+static inline guint32
+xxh32_round (guint32 accumulator,
+             guint32 input)
+{
+  accumulator += input * PRIME32_2;
+  accumulator = ROTL32 (accumulator, 13);
+
+  return accumulator * PRIME32_1;
+}
+
+static void
+process_stripe (HDChecksum   *checksum,
+                const guchar *p)
+{
+  checksum->v[0] = xxh32_round (checksum->v[0], read_uint32 (p));
+  checksum->v[1] = xxh32_round (checksum->v[1], read_uint32 (p + 4));
+  checksum->v[2] = xxh32_round (checksum->v[2], read_uint32 (p + 8));
+  checksum->v[3] = xxh32_round (checksum->v[3], read_uint32 (p + 12));
+}
+
+void
+hd_checksum_init (HDChecksum *checksum)
+{
+  memset (checksum, 0, sizeof (HDChecksum));
+
+  checksum->v[0] = PRIME32_1 + PRIME32_2;
+  checksum->v[1] = PRIME32_2;
+  checksum->v[2] = 0;
+  checksum->v[3] = - PRIME32_1;
+}
+
+void
+hd_checksum_update (HDChecksum *checksum,
+                    const void *data,
+                    gsize       length)
+{
+  const guchar *p = data;
+  const guchar *end = p + length;
+
+  checksum->total_length += length;
+  checksum->large |= length >= 16 || checksum->total_length >= 16;
+
+  /* Not enough for a stripe */
+  if (checksum->buffer_size + length < 16)
+    {
+      memcpy (checksum->buffer + checksum->buffer_size, p, length);
+      checksum->buffer_size += length;
+      return;
+    }
+
+  /* Complete the buffered stripe */
+  if (checksum->buffer_size)
+    {
+      memcpy (checksum->buffer + checksum->buffer_size,
+              p,
+              16 - checksum->buffer_size);
+      process_stripe (checksum, checksum->buffer);
+      p += 16 - checksum->buffer_size;
+      checksum->buffer_size = 0;
+    }
+
+  for (; p + 16 <= end; p += 16)
+    process_stripe (checksum, p);
+
+  if (p < end)
+    {
+      memcpy (checksum->buffer, p, end - p);
+      checksum->buffer_size = end - p;
+    }
+}
+
+guint32
+hd_checksum_digest (HDChecksum *checksum)
+{
+  const guchar *p = checksum->buffer;
+  const guchar *end = p + checksum->buffer_size;
+  guint32 h;
+
+  if (checksum->large)
+    h = ROTL32 (checksum->v[0], 1) + ROTL32 (checksum->v[1], 7) +
+        ROTL32 (checksum->v[2], 12) + ROTL32 (checksum->v[3], 18);
+  else
+    h = checksum->v[2] + PRIME32_5;
+
+  h += checksum->total_length;
+
+  for (; p + 4 <= end; p += 4)
+    {
+      h += read_uint32 (p) * PRIME32_3;
+      h = ROTL32 (h, 17) * PRIME32_4;
+    }
+
+  for (; p < end; p++)
+    {
+      h += (*p) * PRIME32_5;
+      h = ROTL32 (h, 11) * PRIME32_1;
+    }
+
+  h ^= h >> 15;
+  h *= PRIME32_2;
+  h ^= h >> 13;
+  h *= PRIME32_3;
+  h ^= h >> 16;
+
+  return h;
+}
+
+gboolean
+hd_checksum_file (const char    *filename,
+                  guint32       *digest,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  GFile *file;
+  GFileInputStream *stream;
+  HDChecksum checksum;
+  guchar buffer[8192];
+  gssize read_bytes;
+
+  file = g_file_new_for_path (filename);
+  stream = g_file_read (file, cancellable, error);
+  g_object_unref (file);
+
+  if (!stream)
+    return FALSE;
+
+  hd_checksum_init (&checksum);
+
+  do
+    {
+      read_bytes = g_input_stream_read (G_INPUT_STREAM (stream),
+                                        buffer,
+                                        sizeof (buffer),
+                                        cancellable,
+                                        error);
+      if (read_bytes > 0)
+        hd_checksum_update (&checksum, buffer, read_bytes);
+    }
+  while (read_bytes > 0);
+
+  g_object_unref (stream);
+
+  if (read_bytes < 0)
+    return FALSE;
+
+  *digest = hd_checksum_digest (&checksum);
+
+  return TRUE;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_CHECKSUM_H__
+#define __HD_CHECKSUM_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Streaming XXH32 checksum, used to detect torn cached files */
+typedef struct
+{
+  guint32 v[4];
+  guint32 total_length;
+  gboolean large;
+  guchar buffer[16];
+  guint buffer_size;
+} HDChecksum;
+
+void     hd_checksum_init   (HDChecksum    *checksum);
+void     hd_checksum_update (HDChecksum    *checksum,
+                             const void    *data,
+                             gsize          length);
+guint32  hd_checksum_digest (HDChecksum    *checksum);
+
+gboolean hd_checksum_file   (const char    *filename,
+                             guint32       *digest,
+                             GCancellable  *cancellable,
+                             GError       **error);
+
+G_END_DECLS
+
+#endif
@@ -25,23 +25,47 @@
 
 #include <gdk/gdk.h>
 
+#include <unistd.h>
+
 #include "hd-command-thread-pool.h"
 
 #define HD_COMMAND_THREAD_POOL_GET_PRIVATE(object) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((object), HD_TYPE_COMMAND_THREAD_POOL, HDCommandThreadPoolPrivate))
 
+enum
+{
+  PROP_0,
+  PROP_MAX_THREADS
+};
+
 typedef struct
 {
+  HDCommandThreadPool *pool;
+
   HDCommandCallback command;
   gpointer data;
   GDestroyNotify destroy_data;
+
+  /* Changed by hd_command_thread_pool_reprioritize () while queued, read
+   * with g_atomic_int_get () */
+  gint priority;
+  guint64 serial;
+
+  /* Idle commands waiting for this command to finish */
+  GSList *barriers;
 } ThreadCommand;
 
 static void           thread_command_execute (ThreadCommand *thread_command,
                                               gpointer       data);
-static ThreadCommand *thread_command_new     (HDCommandCallback command,
-                                              gpointer          data,
-                                              GDestroyNotify    destroy_data);
+static void           thread_command_finish  (ThreadCommand *thread_command);
+static gint           thread_command_compare (ThreadCommand       *a,
+                                              ThreadCommand       *b,
+                                              gpointer             data);
+static ThreadCommand *thread_command_new     (HDCommandThreadPool *pool,
+                                              gint                 priority,
+                                              HDCommandCallback    command,
+                                              gpointer             data,
+                                              GDestroyNotify       destroy_data);
 static void           thread_command_free    (ThreadCommand *thread_command);
 
 typedef struct
@@ -50,6 +74,9 @@ typedef struct
   GSourceFunc function;
   gpointer data;
   GDestroyNotify destroy_data;
+
+  /* Number of previously pushed commands which are not finished yet */
+  guint pending;
 } IdleCommandData;
 
 static IdleCommandData *idle_command_data_new  (gint           priority,
@@ -62,10 +89,46 @@ static void             idle_command_data_free (IdleCommandData *command_data);
 struct _HDCommandThreadPoolPrivate
 {
   GThreadPool *thread_pool;
+  gint max_threads;
+
+  /* Commands which are pushed but not finished yet. Protected by mutex */
+  GMutex *mutex;
+  GList *commands;
+  guint64 next_serial;
 };
 
 G_DEFINE_TYPE (HDCommandThreadPool, hd_command_thread_pool, G_TYPE_OBJECT);
 
+static gint
+get_number_of_processors (void)
+{
+  long n_processors = sysconf (_SC_NPROCESSORS_ONLN);
+
+  return n_processors > 0 ? n_processors : 1;
+}
+
+static void
+hd_command_thread_pool_constructed (GObject *object)
+{
+  HDCommandThreadPoolPrivate *priv = HD_COMMAND_THREAD_POOL (object)->priv;
+
+  if (G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->constructed)
+    G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->constructed (object);
+
+  /* Follow the number of cores if no explicit size is requested */
+  if (priv->max_threads <= 0)
+    priv->max_threads = get_number_of_processors ();
+
+  priv->thread_pool = g_thread_pool_new ((GFunc) thread_command_execute,
+                                         NULL,
+                                         priv->max_threads,
+                                         FALSE,
+                                         NULL);
+  g_thread_pool_set_sort_function (priv->thread_pool,
+                                   (GCompareDataFunc) thread_command_compare,
+                                   NULL);
+}
+
 static void
 hd_command_thread_pool_dipose (GObject *object)
 {
@@ -82,12 +145,54 @@ hd_command_thread_pool_dipose (GObject *object)
   G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->dispose (object);
 }
 
+static void
+hd_command_thread_pool_finalize (GObject *object)
+{
+  HDCommandThreadPoolPrivate *priv = HD_COMMAND_THREAD_POOL (object)->priv;
+
+  g_mutex_free (priv->mutex);
+
+  G_OBJECT_CLASS (hd_command_thread_pool_parent_class)->finalize (object);
+}
+
+static void
+hd_command_thread_pool_set_property (GObject      *object,
+                                     guint         prop_id,
+                                     const GValue *value,
+                                     GParamSpec   *pspec)
+{
+  HDCommandThreadPoolPrivate *priv = HD_COMMAND_THREAD_POOL (object)->priv;
+
+  switch (prop_id)
+    {
+    case PROP_MAX_THREADS:
+      priv->max_threads = g_value_get_int (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
 static void
 hd_command_thread_pool_class_init (HDCommandThreadPoolClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
+  object_class->constructed = hd_command_thread_pool_constructed;
   object_class->dispose = hd_command_thread_pool_dipose;
+  object_class->finalize = hd_command_thread_pool_finalize;
+  object_class->set_property = hd_command_thread_pool_set_property;
+
+  g_object_class_install_property (object_class,
+                                   PROP_MAX_THREADS,
+                                   g_param_spec_int ("max-threads",
+                                                     "Max threads",
+                                                     "Maximal number of worker threads, 0 to use one per processor",
+                                                     0,
+                                                     G_MAXINT,
+                                                     0,
+                                                     G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
 
   g_type_class_add_private (klass, sizeof (HDCommandThreadPoolPrivate));
 }
@@ -100,11 +205,7 @@ hd_command_thread_pool_init (HDCommandThreadPool *command_thread_pool)
   priv = HD_COMMAND_THREAD_POOL_GET_PRIVATE (command_thread_pool);
   command_thread_pool->priv = priv;
 
-  priv->thread_pool = g_thread_pool_new ((GFunc) thread_command_execute,
-                                         NULL,
-                                         1,
-                                         FALSE,
-                                         NULL);
+  priv->mutex = g_mutex_new ();
 }
 
 static void
@@ -112,16 +213,79 @@ thread_command_execute (ThreadCommand *thread_command,
                         gpointer       data)
 {
   thread_command->command (thread_command->data);
+
+  thread_command_finish (thread_command);
+}
+
+/* Removes the command from the pending ones and frees it */
+static void
+thread_command_finish (ThreadCommand *thread_command)
+{
+  HDCommandThreadPoolPrivate *priv = thread_command->pool->priv;
+  GSList *barriers, *ready = NULL, *l;
+
+  g_mutex_lock (priv->mutex);
+
+  priv->commands = g_list_remove (priv->commands,
+                                  thread_command);
+
+  /* Release the idle commands which waited only for this command */
+  barriers = thread_command->barriers;
+  thread_command->barriers = NULL;
+  for (l = barriers; l; l = l->next)
+    {
+      IdleCommandData *command_data = l->data;
+
+      if (--command_data->pending == 0)
+        ready = g_slist_prepend (ready, command_data);
+    }
+
+  g_mutex_unlock (priv->mutex);
+
+  g_slist_free (barriers);
+
   thread_command_free (thread_command);
+
+  /* Barriers were added in push order, so keep it */
+  ready = g_slist_reverse (ready);
+  for (l = ready; l; l = l->next)
+    {
+      idle_command_execute (l->data);
+      idle_command_data_free (l->data);
+    }
+  g_slist_free (ready);
+}
+
+/* Commands with a lower priority value are executed first, commands with
+ * the same priority in the order they were pushed */
+static gint
+thread_command_compare (ThreadCommand *a,
+                        ThreadCommand *b,
+                        gpointer       data)
+{
+  gint a_priority = g_atomic_int_get (&a->priority);
+  gint b_priority = g_atomic_int_get (&b->priority);
+
+  if (a_priority != b_priority)
+    return a_priority < b_priority ? -1 : 1;
+
+  if (a->serial != b->serial)
+    return a->serial < b->serial ? -1 : 1;
+
+  return 0;
 }
 
 static ThreadCommand *
-thread_command_new (HDCommandCallback command,
-                    gpointer          data,
-                    GDestroyNotify    destroy_data)
+thread_command_new (HDCommandThreadPool *pool,
+                    gint                 priority,
+                    HDCommandCallback    command,
+                    gpointer             data,
+                    GDestroyNotify       destroy_data)
 {
-  ThreadCommand *thread_command = g_slice_new (ThreadCommand);
+  ThreadCommand *thread_command = g_slice_new0 (ThreadCommand);
 
+  thread_command->pool = pool;
+  thread_command->priority = priority;
   thread_command->command = command;
   thread_command->data = data;
   thread_command->destroy_data = destroy_data;
@@ -144,7 +308,24 @@ thread_command_free (ThreadCommand *thread_command)
 HDCommandThreadPool *
 hd_command_thread_pool_new (void)
 {
-  return g_object_new (HD_TYPE_COMMAND_THREAD_POOL, NULL);
+  return hd_command_thread_pool_new_with_max_threads (1);
+}
+
+/* If max_threads is 0 one worker thread per online processor is used */
+HDCommandThreadPool *
+hd_command_thread_pool_new_with_max_threads (gint max_threads)
+{
+  return g_object_new (HD_TYPE_COMMAND_THREAD_POOL,
+                       "max-threads", max_threads,
+                       NULL);
+}
+
+gint
+hd_command_thread_pool_get_max_threads (HDCommandThreadPool *pool)
+{
+  g_return_val_if_fail (HD_IS_COMMAND_THREAD_POOL (pool), 0);
+
+  return pool->priv->max_threads;
 }
 
 void
@@ -152,6 +333,21 @@ hd_command_thread_pool_push (HDCommandThreadPool *pool,
                              HDCommandCallback    command,
                              gpointer             data,
                              GDestroyNotify       destroy_data)
+{
+  hd_command_thread_pool_push_with_priority (pool,
+                                             G_PRIORITY_DEFAULT,
+                                             command,
+                                             data,
+                                             destroy_data);
+}
+
+/* Pending commands with a lower priority value are started first */
+void
+hd_command_thread_pool_push_with_priority (HDCommandThreadPool *pool,
+                                           gint                 priority,
+                                           HDCommandCallback    command,
+                                           gpointer             data,
+                                           GDestroyNotify       destroy_data)
 {
   HDCommandThreadPoolPrivate *priv;
   GError *error = NULL;
@@ -160,13 +356,24 @@ hd_command_thread_pool_push (HDCommandThreadPool *pool,
 
   priv = pool->priv;
 
-  ThreadCommand *thread_command = thread_command_new (command,
+  ThreadCommand *thread_command = thread_command_new (pool,
+                                                      priority,
+                                                      command,
                                                       data,
                                                       destroy_data);
+
+  g_mutex_lock (priv->mutex);
+  thread_command->serial = priv->next_serial++;
+  priv->commands = g_list_prepend (priv->commands,
+                                   thread_command);
+  g_mutex_unlock (priv->mutex);
+
   g_thread_pool_push (priv->thread_pool,
                       thread_command,
                       &error);
 
+  /* Only starting a new worker thread failed, the command is still queued
+   * and run by a running worker or by one started on a later push */
   if (error)
     {
       g_debug ("%s. Error: %s", __FUNCTION__, error->message);
@@ -174,6 +381,51 @@ hd_command_thread_pool_push (HDCommandThreadPool *pool,
     }
 }
 
+/*
+ * Sets the priority of each pending command to the one returned by func
+ * and sorts the queued commands again, for priorities which depend on
+ * state changed after the push. func is called with the pool locked, it
+ * must not push commands.
+ */
+void
+hd_command_thread_pool_reprioritize (HDCommandThreadPool   *pool,
+                                     HDCommandPriorityFunc  func,
+                                     gpointer               user_data)
+{
+  HDCommandThreadPoolPrivate *priv;
+  GList *l;
+
+  g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
+
+  priv = pool->priv;
+
+  g_mutex_lock (priv->mutex);
+
+  for (l = priv->commands; l; l = l->next)
+    {
+      ThreadCommand *thread_command = l->data;
+
+      g_atomic_int_set (&thread_command->priority,
+                        func (thread_command->command,
+                              thread_command->data,
+                              thread_command->priority,
+                              user_data));
+    }
+
+  g_mutex_unlock (priv->mutex);
+
+  /* Setting the sort function sorts the queue again */
+  g_thread_pool_set_sort_function (priv->thread_pool,
+                                   (GCompareDataFunc) thread_command_compare,
+                                   NULL);
+}
+
+/*
+ * Adds function as idle to the main loop as soon as all commands pushed
+ * before are finished. Commands are executed in parallel, so this is done
+ * by registering the idle command at each of the pending commands instead
+ * of queueing it into the thread pool.
+ */
 void
 hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                   gint                 priority,
@@ -181,19 +433,37 @@ hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                   gpointer             data,
                                   GDestroyNotify       destroy_data)
 {
+  HDCommandThreadPoolPrivate *priv;
   IdleCommandData *command_data;
+  GList *l;
 
   g_return_if_fail (HD_IS_COMMAND_THREAD_POOL (pool));
 
+  priv = pool->priv;
+
   command_data = idle_command_data_new (priority,
                                         function,
                                         data,
                                         destroy_data);
 
-  hd_command_thread_pool_push (pool,
-                               (HDCommandCallback) idle_command_execute,
-                               command_data,
-                               (GDestroyNotify) idle_command_data_free);
+  g_mutex_lock (priv->mutex);
+
+  for (l = priv->commands; l; l = l->next)
+    {
+      ThreadCommand *thread_command = l->data;
+
+      thread_command->barriers = g_slist_append (thread_command->barriers,
+                                                 command_data);
+      command_data->pending++;
+    }
+
+  g_mutex_unlock (priv->mutex);
+
+  if (!command_data->pending)
+    {
+      idle_command_execute (command_data);
+      idle_command_data_free (command_data);
+    }
 }
 
 static IdleCommandData *
@@ -202,7 +472,7 @@ idle_command_data_new (gint           priority,
                        gpointer       data,
                        GDestroyNotify destroy_data)
 {
-  IdleCommandData *command_data = g_slice_new (IdleCommandData);
+  IdleCommandData *command_data = g_slice_new0 (IdleCommandData);
 
   command_data->priority = priority;
   command_data->function = function;
@@ -52,14 +52,31 @@ struct _HDCommandThreadPoolClass
 
 typedef void (*HDCommandCallback) (gpointer data);
 
+/* Returns the new priority of a pending command */
+typedef gint (*HDCommandPriorityFunc) (HDCommandCallback command,
+                                       gpointer          data,
+                                       gint              priority,
+                                       gpointer          user_data);
+
 GType                hd_command_thread_pool_get_type  (void);
 
 HDCommandThreadPool *hd_command_thread_pool_new       (void);
+HDCommandThreadPool *hd_command_thread_pool_new_with_max_threads (gint max_threads);
+
+gint                 hd_command_thread_pool_get_max_threads (HDCommandThreadPool *pool);
 
 void                 hd_command_thread_pool_push      (HDCommandThreadPool *pool,
                                                        HDCommandCallback    command,
                                                        gpointer             data,
                                                        GDestroyNotify       destroy_data);
+void                 hd_command_thread_pool_push_with_priority (HDCommandThreadPool *pool,
+                                                                gint                 priority,
+                                                                HDCommandCallback    command,
+                                                                gpointer             data,
+                                                                GDestroyNotify       destroy_data);
+void                 hd_command_thread_pool_reprioritize (HDCommandThreadPool   *pool,
+                                                          HDCommandPriorityFunc  func,
+                                                          gpointer               user_data);
 void                 hd_command_thread_pool_push_idle (HDCommandThreadPool *pool,
                                                        gint                 priority,
                                                        GSourceFunc          function,
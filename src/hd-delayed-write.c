@@ -0,0 +1,106 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "hd-delayed-write.h"
+
+static gboolean
+delayed_write_timeout_cb (HDDelayedWrite *delayed_write)
+{
+  delayed_write->timeout_id = 0;
+
+  hd_delayed_write_flush (delayed_write);
+
+  return FALSE;
+}
+
+void
+hd_delayed_write_init (HDDelayedWrite     *delayed_write,
+                       HDDelayedWriteFunc  write_func,
+                       gpointer            user_data)
+{
+  delayed_write->write_func = write_func;
+  delayed_write->user_data = user_data;
+  delayed_write->timeout_id = 0;
+  delayed_write->dirty = FALSE;
+  delayed_write->suspended = 0;
+}
+
+/* Marks the file as changed and restarts the delay */
+void
+hd_delayed_write_schedule (HDDelayedWrite *delayed_write)
+{
+  delayed_write->dirty = TRUE;
+
+  if (delayed_write->suspended)
+    return;
+
+  if (delayed_write->timeout_id)
+    g_source_remove (delayed_write->timeout_id);
+  delayed_write->timeout_id = g_timeout_add_seconds (HD_DELAYED_WRITE_DELAY,
+                                                     (GSourceFunc) delayed_write_timeout_cb,
+                                                     delayed_write);
+}
+
+/* Writes pending changes now */
+void
+hd_delayed_write_flush (HDDelayedWrite *delayed_write)
+{
+  hd_delayed_write_cancel (delayed_write);
+
+  if (!delayed_write->dirty)
+    return;
+
+  delayed_write->dirty = FALSE;
+
+  delayed_write->write_func (delayed_write->user_data);
+}
+
+/* Stops the delay without writing, the changes stay pending */
+void
+hd_delayed_write_cancel (HDDelayedWrite *delayed_write)
+{
+  if (delayed_write->timeout_id)
+    delayed_write->timeout_id = (g_source_remove (delayed_write->timeout_id), 0);
+}
+
+/* Holds back the delayed writes until hd_delayed_write_resume () is
+ * called as often, changes are still written by explicit flushes */
+void
+hd_delayed_write_suspend (HDDelayedWrite *delayed_write)
+{
+  delayed_write->suspended++;
+
+  hd_delayed_write_cancel (delayed_write);
+}
+
+void
+hd_delayed_write_resume (HDDelayedWrite *delayed_write)
+{
+  g_return_if_fail (delayed_write->suspended > 0);
+
+  if (--delayed_write->suspended == 0 && delayed_write->dirty)
+    hd_delayed_write_schedule (delayed_write);
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_DELAYED_WRITE_H__
+#define __HD_DELAYED_WRITE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Collects the changes of a batch of updates to a file and writes them
+ * at once, HD_DELAYED_WRITE_DELAY seconds after the last change or on an
+ * explicit flush. While suspended only explicit flushes write.
+ */
+
+/* Changes are written after this many seconds without further changes */
+#define HD_DELAYED_WRITE_DELAY 2
+
+typedef void (*HDDelayedWriteFunc) (gpointer user_data);
+
+typedef struct
+{
+  HDDelayedWriteFunc  write_func;
+  gpointer            user_data;
+
+  guint               timeout_id;
+  gboolean            dirty;
+  guint               suspended;
+} HDDelayedWrite;
+
+void hd_delayed_write_init     (HDDelayedWrite     *delayed_write,
+                                HDDelayedWriteFunc  write_func,
+                                gpointer            user_data);
+void hd_delayed_write_schedule (HDDelayedWrite     *delayed_write);
+void hd_delayed_write_flush    (HDDelayedWrite     *delayed_write);
+void hd_delayed_write_cancel   (HDDelayedWrite     *delayed_write);
+void hd_delayed_write_suspend  (HDDelayedWrite     *delayed_write);
+void hd_delayed_write_resume   (HDDelayedWrite     *delayed_write);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "hd-exif.h"
+
+/* Minimal EXIF parser, only what is needed to apply the orientation
+ * of camera images and to find their embedded thumbnail without loading
+ * them through a full EXIF library.
+ */
+
+#define TIFF_HEADER_SIZE 8
+#define IFD_ENTRY_SIZE 12
+
+#define TAG_ORIENTATION 0x0112
+#define TAG_JPEG_INTERCHANGE_FORMAT 0x0201
+#define TAG_JPEG_INTERCHANGE_FORMAT_LENGTH 0x0202
+#define TYPE_SHORT 3
+#define TYPE_LONG 4
+
+typedef struct
+{
+  const guchar *data;
+  gsize length;
+  gboolean big_endian;
+} TiffData;
+
+/* Offsets are computed from values in the file, in 64 bit so they cannot
+ * wrap around where gsize is 32 bit */
+static gboolean
+tiff_get_uint16 (TiffData *tiff,
+                 guint64   offset,
+                 guint    *value)
+{
+  if (offset > tiff->length || tiff->length - offset < 2)
+    return FALSE;
+
+  if (tiff->big_endian)
+    *value = (tiff->data[offset] << 8) | tiff->data[offset + 1];
+  else
+    *value = tiff->data[offset] | (tiff->data[offset + 1] << 8);
+
+  return TRUE;
+}
+
+static gboolean
+tiff_get_uint32 (TiffData *tiff,
+                 guint64   offset,
+                 guint32  *value)
+{
+  guint high, low;
+
+  if (!tiff_get_uint16 (tiff, offset, tiff->big_endian ? &high : &low) ||
+      !tiff_get_uint16 (tiff, offset + 2, tiff->big_endian ? &low : &high))
+    return FALSE;
+
+  *value = (high << 16) | low;
+
+  return TRUE;
+}
+
+/* Reads the TIFF header and returns the offset of IFD0 */
+static gboolean
+tiff_init (TiffData     *tiff,
+           const guchar *data,
+           gsize         length,
+           guint32      *ifd_offset)
+{
+  guint magic;
+
+  tiff->data = data;
+  tiff->length = length;
+  tiff->big_endian = FALSE;
+
+  if (length < TIFF_HEADER_SIZE)
+    return FALSE;
+
+  if (memcmp (data, "MM", 2) == 0)
+    tiff->big_endian = TRUE;
+  else if (memcmp (data, "II", 2) != 0)
+    return FALSE;
+
+  if (!tiff_get_uint16 (tiff, 2, &magic) || magic != 42)
+    return FALSE;
+
+  return tiff_get_uint32 (tiff, 4, ifd_offset);
+}
+
+gboolean
+hd_exif_is_exif_marker (const guchar *data,
+                        gsize         length)
+{
+  return length > HD_EXIF_HEADER_SIZE &&
+         memcmp (data, "Exif\0\0", HD_EXIF_HEADER_SIZE) == 0;
+}
+
+/*
+ * Returns the orientation tag (1-8) from the IFD0 of the TIFF data in an
+ * EXIF APP1 marker (without the "Exif\0\0" header). Returns 1 (top-left)
+ * if there is no valid orientation.
+ */
+guint
+hd_exif_get_orientation (const guchar *data,
+                         gsize         length)
+{
+  TiffData tiff;
+  guint n_entries, i;
+  guint32 ifd_offset;
+
+  if (!tiff_init (&tiff, data, length, &ifd_offset) ||
+      !tiff_get_uint16 (&tiff, ifd_offset, &n_entries))
+    return 1;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      guint64 entry = (guint64) ifd_offset + 2 + (guint64) i * IFD_ENTRY_SIZE;
+      guint tag, type, value;
+
+      if (!tiff_get_uint16 (&tiff, entry, &tag))
+        break;
+
+      if (tag != TAG_ORIENTATION)
+        continue;
+
+      if (!tiff_get_uint16 (&tiff, entry + 2, &type) ||
+          type != TYPE_SHORT ||
+          !tiff_get_uint16 (&tiff, entry + 8, &value))
+        break;
+
+      if (value >= 1 && value <= 8)
+        return value;
+
+      break;
+    }
+
+  return 1;
+}
+
+/*
+ * Finds the JPEG thumbnail in the IFD1 of the TIFF data in an EXIF APP1
+ * marker (without the "Exif\0\0" header). On success offset and
+ * thumbnail_length are set to the position of the JPEG data in data.
+ */
+gboolean
+hd_exif_get_thumbnail (const guchar *data,
+                       gsize         length,
+                       gsize        *offset,
+                       gsize        *thumbnail_length)
+{
+  TiffData tiff;
+  guint n_entries, i;
+  guint32 ifd_offset, jpeg_offset = 0, jpeg_length = 0;
+
+  if (!tiff_init (&tiff, data, length, &ifd_offset) ||
+      !tiff_get_uint16 (&tiff, ifd_offset, &n_entries))
+    return FALSE;
+
+  /* The offset of IFD1 follows the entries of IFD0 */
+  if (!tiff_get_uint32 (&tiff,
+                        (guint64) ifd_offset + 2 + (guint64) n_entries * IFD_ENTRY_SIZE,
+                        &ifd_offset) ||
+      !ifd_offset ||
+      !tiff_get_uint16 (&tiff, ifd_offset, &n_entries))
+    return FALSE;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      guint64 entry = (guint64) ifd_offset + 2 + (guint64) i * IFD_ENTRY_SIZE;
+      guint tag, type;
+      guint32 value;
+
+      if (!tiff_get_uint16 (&tiff, entry, &tag) ||
+          !tiff_get_uint16 (&tiff, entry + 2, &type))
+        return FALSE;
+
+      if (tag != TAG_JPEG_INTERCHANGE_FORMAT &&
+          tag != TAG_JPEG_INTERCHANGE_FORMAT_LENGTH)
+        continue;
+
+      if (type != TYPE_LONG ||
+          !tiff_get_uint32 (&tiff, entry + 8, &value))
+        return FALSE;
+
+      if (tag == TAG_JPEG_INTERCHANGE_FORMAT)
+        jpeg_offset = value;
+      else
+        jpeg_length = value;
+    }
+
+  if (!jpeg_offset || !jpeg_length ||
+      jpeg_offset > length || jpeg_length > length - jpeg_offset)
+    return FALSE;
+
+  *offset = jpeg_offset;
+  *thumbnail_length = jpeg_length;
+
+  return TRUE;
+}
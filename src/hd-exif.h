@@ -0,0 +1,46 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_EXIF_H__
+#define __HD_EXIF_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Size of the "Exif\0\0" header in front of the TIFF data in an APP1 marker */
+#define HD_EXIF_HEADER_SIZE 6
+
+gboolean hd_exif_is_exif_marker   (const guchar *data,
+                                   gsize         length);
+
+guint    hd_exif_get_orientation  (const guchar *data,
+                                   gsize         length);
+
+gboolean hd_exif_get_thumbnail    (const guchar *data,
+                                   gsize         length,
+                                   gsize        *offset,
+                                   gsize        *thumbnail_length);
+
+G_END_DECLS
+
+#endif
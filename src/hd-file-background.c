@@ -48,7 +48,6 @@ typedef struct
 {
   GFile *file;
   guint  view;
-  GCancellable *cancellable;
   gboolean error_dialogs;
   gboolean update_gconf;
 } CommandData;
@@ -61,7 +60,11 @@ static void hd_file_background_set_for_current_view (HDBackground   *background,
                                                      GCancellable   *cancellable);
 static GFile * hd_file_background_get_image_file_for_view (HDBackground *background,
                                                            guint         view);
-static void create_cached_image_command (CommandData *data);
+static void hd_file_background_prerender_for_view (HDBackground   *background,
+                                                   guint           view,
+                                                   GCancellable   *cancellable);
+static void create_cached_image_command (CommandData  *data,
+                                         GCancellable *cancellable);
 
 static void hd_file_background_dispose      (GObject *object);
 static void hd_file_background_get_property (GObject      *object,
@@ -75,7 +78,6 @@ static void hd_file_background_set_property (GObject      *object,
 
 static CommandData* command_data_new  (GFile        *file,
                                        guint         view,
-                                       GCancellable *cancellable,
                                        gboolean      error_dialogs,
                                        gboolean      update_gconf);
 static void         command_data_free (CommandData  *data);
@@ -90,6 +92,7 @@ hd_file_background_class_init (HDFileBackgroundClass *klass)
 
   background_class->set_for_current_view = hd_file_background_set_for_current_view;
   background_class->get_image_file_for_view = hd_file_background_get_image_file_for_view;
+  background_class->prerender_for_view = hd_file_background_prerender_for_view;
 
   object_class->dispose = hd_file_background_dispose;
   object_class->get_property = hd_file_background_get_property;
@@ -130,15 +133,15 @@ hd_file_background_set_for_view_full (HDFileBackground *background,
 
   data = command_data_new (priv->image_file,
                            current_view,
-                           cancellable,
                            error_dialogs,
                            update_gconf);
 
   hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
                                           priv->image_file,
+                                          current_view,
                                           data->error_dialogs,
                                           cancellable,
-                                          (HDCommandCallback) create_cached_image_command,
+                                          (HDCachedImageCommand) create_cached_image_command,
                                           data,
                                           (GDestroyNotify) command_data_free);
 }
@@ -153,21 +156,51 @@ hd_file_background_get_image_file_for_view (HDBackground *background,
 }
 
 static void
-create_cached_image_command (CommandData *data)
+hd_file_background_prerender_for_view (HDBackground *background,
+                                       guint         view,
+                                       GCancellable *cancellable)
+{
+  HDFileBackgroundPrivate *priv = HD_FILE_BACKGROUND (background)->priv;
+
+  hd_backgrounds_add_prerender_cached_image (hd_backgrounds_get (),
+                                             priv->image_file,
+                                             cancellable);
+}
+
+static void
+create_cached_image_command (CommandData  *data,
+                             GCancellable *cancellable)
 {
   HDImageSize screen_size = {HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT};
   GdkPixbuf *pixbuf = NULL;
   char *etag = NULL;
   GError *error = NULL;
 
-  if (g_cancellable_is_cancelled (data->cancellable))
+  if (g_cancellable_is_cancelled (cancellable))
+    goto cleanup;
+
+  /* Reuse the cached image of another view with the same source */
+  if (hd_backgrounds_link_stored_cached_image (hd_backgrounds_get (),
+                                               data->view,
+                                               data->file,
+                                               HD_CACHED_IMAGE_GEOMETRY_SCREEN,
+                                               data->update_gconf,
+                                               cancellable))
     goto cleanup;
 
   pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (data->file,
                                                     &screen_size,
                                                     &etag,
-                                                    data->cancellable,
+                                                    cancellable,
                                                     &error);
+
+  /* Replaced by a newer request or cancelled by the caller */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_error_free (error);
+      goto cleanup;
+    }
+
   if (error)
     {
       char *uri;
@@ -188,7 +221,7 @@ create_cached_image_command (CommandData *data)
   if (!pixbuf)
     goto cleanup;
 
-  if (g_cancellable_is_cancelled (data->cancellable))
+  if (g_cancellable_is_cancelled (cancellable))
     goto cleanup;
 
   hd_backgrounds_save_cached_image (hd_backgrounds_get (),
@@ -198,7 +231,7 @@ create_cached_image_command (CommandData *data)
                                     etag,
                                     data->error_dialogs,
                                     data->update_gconf,
-                                    data->cancellable,
+                                    cancellable,
                                     &error);
 
   if (error)
@@ -318,7 +351,6 @@ hd_file_background_set_property (GObject      *object,
 static CommandData*
 command_data_new  (GFile        *file,
                    guint         view,
-                   GCancellable *cancellable,
                    gboolean      error_dialogs,
                    gboolean      update_gconf)
 {
@@ -326,7 +358,6 @@ command_data_new  (GFile        *file,
 
   data->file = g_object_ref (file);
   data->view = view;
-  data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
 
   data->error_dialogs = error_dialogs;
   data->update_gconf = update_gconf;
@@ -342,9 +373,6 @@ command_data_free (CommandData *data)
 
   g_object_unref (data->file);
 
-  if (data->cancellable)
-    g_object_unref (data->cancellable);
-
   g_slice_free (CommandData, data);
 }
 
@@ -35,6 +35,7 @@
 
 #include <libosso.h>
 
+#include "hd-background-stats.h"
 #include "hd-backgrounds.h"
 #include "hd-edit-mode-menu.h"
 
@@ -228,3 +229,68 @@ hd_hildon_home_dbus_set_background_image (HDHildonHomeDBus      *dbus,
                                          uri);
   dbus_g_method_return (context);
 }
+
+static void
+set_backgrounds_cb (HDBackgrounds         *backgrounds,
+                    GAsyncResult          *result,
+                    DBusGMethodInvocation *context)
+{
+  GError *error = NULL;
+
+  if (hd_backgrounds_set_backgrounds_finish (backgrounds,
+                                             result,
+                                             &error))
+    dbus_g_method_return (context);
+  else
+    {
+      dbus_g_method_return_error (context, error);
+      g_error_free (error);
+    }
+}
+
+/* Sets the backgrounds of an array of (view, uri) pairs as one batch */
+void
+hd_hildon_home_dbus_set_backgrounds (HDHildonHomeDBus      *dbus,
+                                     GPtrArray             *backgrounds,
+                                     DBusGMethodInvocation *context)
+{
+  guint *views;
+  GFile **files;
+  guint i;
+
+  views = g_new0 (guint, backgrounds->len);
+  files = g_new0 (GFile *, backgrounds->len);
+
+  for (i = 0; i < backgrounds->len; i++)
+    {
+      GValueArray *background = g_ptr_array_index (backgrounds, i);
+
+      views[i] = g_value_get_uint (g_value_array_get_nth (background, 0));
+      files[i] = g_file_new_for_uri (g_value_get_string (g_value_array_get_nth (background, 1)));
+    }
+
+  hd_backgrounds_set_backgrounds_async (hd_backgrounds_get (),
+                                        backgrounds->len,
+                                        views,
+                                        files,
+                                        (GAsyncReadyCallback) set_backgrounds_cb,
+                                        context);
+
+  for (i = 0; i < backgrounds->len; i++)
+    g_object_unref (files[i]);
+  g_free (files);
+  g_free (views);
+}
+
+/* Debug method returning the stage timing histograms of the cached
+ * background images */
+void
+hd_hildon_home_dbus_get_background_stats (HDHildonHomeDBus      *dbus,
+                                          DBusGMethodInvocation *context)
+{
+  gchar *stats;
+
+  stats = hd_background_stats_to_string ();
+  dbus_g_method_return (context, stats);
+  g_free (stats);
+}
@@ -60,6 +60,11 @@ void              hd_hildon_home_dbus_show_edit_menu (HDHildonHomeDBus      *hom
 void              hd_hildon_home_dbus_set_background_image (HDHildonHomeDBus      *dbus,
                                                             const char            *uri,
                                                             DBusGMethodInvocation *context);
+void              hd_hildon_home_dbus_set_backgrounds      (HDHildonHomeDBus      *dbus,
+                                                            GPtrArray             *backgrounds,
+                                                            DBusGMethodInvocation *context);
+void              hd_hildon_home_dbus_get_background_stats (HDHildonHomeDBus      *dbus,
+                                                            DBusGMethodInvocation *context);
 
 G_END_DECLS
 
@@ -0,0 +1,388 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+#include "hd-background-stats.h"
+#include "hd-raw-image.h"
+
+#include "hd-image-writer.h"
+
+/*
+ * Encoder which takes the image in blocks of rows, so callers producing
+ * rows incrementally never need the whole image in memory. PNG images are
+ * written with libpng directly, as GdkPixbuf can only save whole pixbufs.
+ */
+
+struct _HDImageWriter
+{
+  GOutputStream *stream;
+  GCancellable *cancellable;
+
+  HDCachedImageFormat format;
+  int width;
+  int height;
+  int n_channels;
+  int rows_written;
+
+#ifdef HAVE_LIBPNG
+  png_structp png;
+  png_infop info;
+#endif
+
+  /* Error of the PNG encoder or the stream */
+  GError *error;
+};
+
+#ifdef HAVE_LIBPNG
+static void
+png_error_cb (png_structp      png,
+              png_const_charp  message)
+{
+  HDImageWriter *writer = png_get_error_ptr (png);
+
+  /* Write errors are already set by png_write_cb */
+  if (!writer->error)
+    g_set_error (&writer->error,
+                 GDK_PIXBUF_ERROR,
+                 GDK_PIXBUF_ERROR_FAILED,
+                 "Error encoding PNG image (%s)",
+                 message);
+
+  longjmp (png_jmpbuf (png), 1);
+}
+
+static void
+png_warning_cb (png_structp      png,
+                png_const_charp  message)
+{
+}
+
+static void
+png_write_cb (png_structp  png,
+              png_bytep    data,
+              png_size_t   length)
+{
+  HDImageWriter *writer = png_get_io_ptr (png);
+  gboolean result;
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_WRITE);
+  result = g_output_stream_write_all (writer->stream,
+                                      data,
+                                      length,
+                                      NULL,
+                                      writer->cancellable,
+                                      &writer->error);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_WRITE);
+
+  if (!result)
+    png_error (png, "Write failed");
+}
+
+static void
+png_flush_cb (png_structp png)
+{
+}
+
+static gboolean
+png_writer_init (HDImageWriter *writer,
+                 gint           compression)
+{
+  writer->png = png_create_write_struct (PNG_LIBPNG_VER_STRING,
+                                         writer,
+                                         png_error_cb,
+                                         png_warning_cb);
+  if (!writer->png)
+    return FALSE;
+
+  writer->info = png_create_info_struct (writer->png);
+  if (!writer->info)
+    return FALSE;
+
+  if (setjmp (png_jmpbuf (writer->png)))
+    return FALSE;
+
+  png_set_write_fn (writer->png,
+                    writer,
+                    png_write_cb,
+                    png_flush_cb);
+
+  if (compression >= 0)
+    png_set_compression_level (writer->png, MIN (compression, 9));
+
+  png_set_IHDR (writer->png,
+                writer->info,
+                writer->width,
+                writer->height,
+                8,
+                writer->n_channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+                PNG_INTERLACE_NONE,
+                PNG_COMPRESSION_TYPE_DEFAULT,
+                PNG_FILTER_TYPE_DEFAULT);
+
+  png_write_info (writer->png, writer->info);
+
+  return TRUE;
+}
+
+static gboolean
+png_writer_write_rows (HDImageWriter *writer,
+                       const guchar  *pixels,
+                       int            rowstride,
+                       int            n_rows)
+{
+  int y;
+
+  if (setjmp (png_jmpbuf (writer->png)))
+    return FALSE;
+
+  for (y = 0; y < n_rows; y++)
+    png_write_row (writer->png, (png_bytep) (pixels + y * rowstride));
+
+  return TRUE;
+}
+
+static gboolean
+png_writer_finish (HDImageWriter *writer)
+{
+  if (setjmp (png_jmpbuf (writer->png)))
+    return FALSE;
+
+  png_write_end (writer->png, writer->info);
+
+  return TRUE;
+}
+#endif
+
+static HDRawImageFormat
+get_raw_image_format (HDCachedImageFormat format)
+{
+  return format == HD_CACHED_IMAGE_FORMAT_ARGB32 ? HD_RAW_IMAGE_FORMAT_ARGB32 :
+                                                   HD_RAW_IMAGE_FORMAT_RGB565;
+}
+
+/* Takes the error of the encoder, or sets a generic one */
+static void
+propagate_writer_error (HDImageWriter  *writer,
+                        GError        **error)
+{
+  if (writer->error)
+    {
+      g_propagate_error (error, writer->error);
+      writer->error = NULL;
+    }
+  else
+    g_set_error_literal (error,
+                         GDK_PIXBUF_ERROR,
+                         GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                         "Insufficient memory to save image");
+}
+
+gboolean
+hd_image_writer_supports_format (HDCachedImageFormat format)
+{
+#ifndef HAVE_LIBPNG
+  if (format == HD_CACHED_IMAGE_FORMAT_PNG)
+    return FALSE;
+#endif
+
+  return TRUE;
+}
+
+/*
+ * Creates a writer for a width x height image with n_channels (3 or 4)
+ * channels and writes the header to stream. compression is the zlib
+ * compression level for PNG or -1 for the default. Returns NULL with
+ * G_IO_ERROR_NOT_SUPPORTED if format cannot be written incrementally.
+ */
+HDImageWriter *
+hd_image_writer_new (GOutputStream        *stream,
+                     HDCachedImageFormat   format,
+                     int                   width,
+                     int                   height,
+                     int                   n_channels,
+                     gint                  compression,
+                     GCancellable         *cancellable,
+                     GError              **error)
+{
+  HDImageWriter *writer;
+  gboolean result;
+
+  g_return_val_if_fail (G_IS_OUTPUT_STREAM (stream), NULL);
+  g_return_val_if_fail (n_channels == 3 || n_channels == 4, NULL);
+
+  if (!hd_image_writer_supports_format (format))
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_SUPPORTED,
+                           "Image format cannot be written incrementally");
+      return NULL;
+    }
+
+  writer = g_slice_new0 (HDImageWriter);
+
+  writer->stream = g_object_ref (stream);
+  writer->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  writer->format = format;
+  writer->width = width;
+  writer->height = height;
+  writer->n_channels = n_channels;
+
+  if (format == HD_CACHED_IMAGE_FORMAT_PNG)
+    {
+#ifdef HAVE_LIBPNG
+      result = png_writer_init (writer, compression);
+#else
+      result = FALSE;
+#endif
+    }
+  else
+    result = hd_raw_image_write_header (stream,
+                                        get_raw_image_format (format),
+                                        width,
+                                        height,
+                                        cancellable,
+                                        &writer->error);
+
+  if (!result)
+    {
+      propagate_writer_error (writer, error);
+      hd_image_writer_free (writer);
+      return NULL;
+    }
+
+  return writer;
+}
+
+gboolean
+hd_image_writer_write_rows (HDImageWriter  *writer,
+                            const guchar   *pixels,
+                            int             rowstride,
+                            int             n_rows,
+                            GError        **error)
+{
+  gboolean result;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (writer->rows_written + n_rows <= writer->height, FALSE);
+
+  if (writer->format == HD_CACHED_IMAGE_FORMAT_PNG)
+    {
+#ifdef HAVE_LIBPNG
+      hd_background_stats_push (HD_BACKGROUND_STAGE_ENCODE);
+      result = png_writer_write_rows (writer,
+                                      pixels,
+                                      rowstride,
+                                      n_rows);
+      hd_background_stats_pop (HD_BACKGROUND_STAGE_ENCODE);
+#else
+      result = FALSE;
+#endif
+    }
+  else
+    result = hd_raw_image_write_rows (writer->stream,
+                                      get_raw_image_format (writer->format),
+                                      writer->width,
+                                      pixels,
+                                      rowstride,
+                                      writer->n_channels,
+                                      n_rows,
+                                      writer->cancellable,
+                                      &writer->error);
+
+  if (!result)
+    {
+      propagate_writer_error (writer, error);
+      return FALSE;
+    }
+
+  writer->rows_written += n_rows;
+
+  return TRUE;
+}
+
+/*
+ * Completes the image after all rows are written. The stream is not closed.
+ */
+gboolean
+hd_image_writer_finish (HDImageWriter  *writer,
+                        GError        **error)
+{
+  g_return_val_if_fail (writer != NULL, FALSE);
+
+  if (writer->rows_written != writer->height)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_FAILED,
+                   "Only %d of %d rows written",
+                   writer->rows_written,
+                   writer->height);
+      return FALSE;
+    }
+
+#ifdef HAVE_LIBPNG
+  if (writer->format == HD_CACHED_IMAGE_FORMAT_PNG)
+    {
+      gboolean result;
+
+      hd_background_stats_push (HD_BACKGROUND_STAGE_ENCODE);
+      result = png_writer_finish (writer);
+      hd_background_stats_pop (HD_BACKGROUND_STAGE_ENCODE);
+
+      if (!result)
+        {
+          propagate_writer_error (writer, error);
+          return FALSE;
+        }
+    }
+#endif
+
+  return TRUE;
+}
+
+void
+hd_image_writer_free (HDImageWriter *writer)
+{
+  if (!writer)
+    return;
+
+#ifdef HAVE_LIBPNG
+  if (writer->png)
+    png_destroy_write_struct (&writer->png, &writer->info);
+#endif
+
+  g_object_unref (writer->stream);
+  if (writer->cancellable)
+    g_object_unref (writer->cancellable);
+  if (writer->error)
+    g_error_free (writer->error);
+
+  g_slice_free (HDImageWriter, writer);
+}
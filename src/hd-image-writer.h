@@ -0,0 +1,56 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_IMAGE_WRITER_H__
+#define __HD_IMAGE_WRITER_H__
+
+#include <gio/gio.h>
+
+#include "hd-backgrounds.h"
+
+G_BEGIN_DECLS
+
+/* Encodes a cached image into a stream row by row */
+typedef struct _HDImageWriter HDImageWriter;
+
+gboolean       hd_image_writer_supports_format (HDCachedImageFormat   format);
+
+HDImageWriter *hd_image_writer_new        (GOutputStream        *stream,
+                                           HDCachedImageFormat   format,
+                                           int                   width,
+                                           int                   height,
+                                           int                   n_channels,
+                                           gint                  compression,
+                                           GCancellable         *cancellable,
+                                           GError              **error);
+gboolean       hd_image_writer_write_rows (HDImageWriter        *writer,
+                                           const guchar         *pixels,
+                                           int                   rowstride,
+                                           int                   n_rows,
+                                           GError              **error);
+gboolean       hd_image_writer_finish     (HDImageWriter        *writer,
+                                           GError              **error);
+void           hd_image_writer_free       (HDImageWriter        *writer);
+
+G_END_DECLS
+
+#endif
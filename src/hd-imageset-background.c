@@ -27,6 +27,7 @@
 #include <glib/gi18n.h>
 #include <gconf/gconf-client.h>
 
+#include "hd-background-catalog.h"
 #include "hd-backgrounds.h"
 #include "hd-desktop.h"
 #include "hd-object-vector.h"
@@ -52,9 +53,27 @@ typedef struct
 {
   GFile *file;
   guint  view;
-  GCancellable *cancellable;
 } CommandData;
 
+typedef struct
+{
+  GSimpleAsyncResult *result;
+  GCancellable       *cancellable;
+} CompleteData;
+
+typedef struct
+{
+  HDImagesetBackground *background;
+  char                 *etag;
+  GCancellable         *cancellable;
+  GAsyncReadyCallback   callback;
+  gpointer              user_data;
+
+  /* Image files of the entry, checked one by one after the .desktop file */
+  HDObjectVector       *image_files;
+  guint                 n_checked;
+} CheckEntryData;
+
 /* folders */
 #define FOLDER_USER_IMAGES "MyDocs", ".images"
 #define FOLDER_SHARE_BACKGROUND "/usr/share/backgrounds"
@@ -73,7 +92,11 @@ static void hd_imageset_background_set_for_current_view (HDBackground   *backgro
                                                          GCancellable   *cancellable);
 static GFile * hd_imageset_background_get_image_file_for_view (HDBackground *background,
                                                                guint         view);
-static void create_cached_image_command (CommandData *data);
+static void hd_imageset_background_prerender_for_view (HDBackground   *background,
+                                                       guint           view,
+                                                       GCancellable   *cancellable);
+static void create_cached_image_command (CommandData  *data,
+                                         GCancellable *cancellable);
 
 static void hd_imageset_background_dispose      (GObject *object);
 static void hd_imageset_background_get_property (GObject      *object,
@@ -95,8 +118,7 @@ static void imageset_loaded (HDImagesetBackground   *background,
                              HDAvailableBackgrounds *backgrounds);
 
 static CommandData* command_data_new  (GFile        *file,
-                                       guint         view,
-                                       GCancellable *cancellable);
+                                       guint         view);
 static void         command_data_free (CommandData  *data);
 
 G_DEFINE_TYPE (HDImagesetBackground, hd_imageset_background, HD_TYPE_BACKGROUND);
@@ -109,6 +131,7 @@ hd_imageset_background_class_init (HDImagesetBackgroundClass *klass)
 
   background_class->set_for_current_view = hd_imageset_background_set_for_current_view;
   background_class->get_image_file_for_view = hd_imageset_background_get_image_file_for_view;
+  background_class->prerender_for_view = hd_imageset_background_prerender_for_view;
 
   object_class->dispose = hd_imageset_background_dispose;
   object_class->get_property = hd_imageset_background_get_property;
@@ -142,21 +165,22 @@ hd_imageset_background_set_for_current_view (HDBackground   *background,
                                                view);
 
       data = command_data_new (image_file,
-                               view,
-                               cancellable);
+                               view);
 
       hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
                                               image_file,
+                                              view,
                                               error_dialogs,
                                               cancellable,
-                                              (HDCommandCallback) create_cached_image_command,
+                                              (HDCachedImageCommand) create_cached_image_command,
                                               data,
                                               (GDestroyNotify) command_data_free);
     }
 }
 
 static void
-create_cached_image_command (CommandData *data)
+create_cached_image_command (CommandData  *data,
+                             GCancellable *cancellable)
 {
   HDImageSize screen_size = {HD_SCREEN_WIDTH, HD_SCREEN_HEIGHT};
   GdkPixbuf *pixbuf = NULL;
@@ -165,14 +189,31 @@ create_cached_image_command (CommandData *data)
 
   gboolean error_dialogs = TRUE, update_gconf = TRUE;
 
-  if (g_cancellable_is_cancelled (data->cancellable))
+  if (g_cancellable_is_cancelled (cancellable))
+    goto cleanup;
+
+  /* Reuse the cached image of another view with the same source */
+  if (hd_backgrounds_link_stored_cached_image (hd_backgrounds_get (),
+                                               data->view,
+                                               data->file,
+                                               HD_CACHED_IMAGE_GEOMETRY_SCREEN,
+                                               update_gconf,
+                                               cancellable))
     goto cleanup;
 
   pixbuf = hd_pixbuf_utils_load_scaled_and_cropped (data->file,
                                                     &screen_size,
                                                     &etag,
-                                                    data->cancellable,
+                                                    cancellable,
                                                     &error);
+
+  /* Replaced by a newer request or cancelled by the caller */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_error_free (error);
+      goto cleanup;
+    }
+
   if (error)
     {
       char *uri;
@@ -193,7 +234,7 @@ create_cached_image_command (CommandData *data)
   if (!pixbuf)
     goto cleanup;
 
-  if (g_cancellable_is_cancelled (data->cancellable))
+  if (g_cancellable_is_cancelled (cancellable))
     goto cleanup;
   
   hd_backgrounds_save_cached_image (hd_backgrounds_get (),
@@ -203,7 +244,7 @@ create_cached_image_command (CommandData *data)
                                     etag,
                                     error_dialogs,
                                     update_gconf,
-                                    data->cancellable,
+                                    cancellable,
                                     &error);
 
   if (error)
@@ -224,6 +265,24 @@ hd_imageset_background_get_image_file_for_view (HDBackground *background,
   return hd_object_vector_at (priv->image_files, view);
 }
 
+/* Only the image of view is prerendered, the images of the other views are
+ * created when the imageset is set */
+static void
+hd_imageset_background_prerender_for_view (HDBackground *background,
+                                           guint         view,
+                                           GCancellable *cancellable)
+{
+  HDImagesetBackgroundPrivate *priv = HD_IMAGESET_BACKGROUND (background)->priv;
+
+  if (view >= hd_object_vector_size (priv->image_files))
+    return;
+
+  hd_backgrounds_add_prerender_cached_image (hd_backgrounds_get (),
+                                             hd_object_vector_at (priv->image_files,
+                                                                  view),
+                                             cancellable);
+}
+
 static void
 hd_imageset_background_init (HDImagesetBackground *background)
 {
@@ -264,73 +323,41 @@ hd_imageset_background_get_available (HDAvailableBackgrounds *backgrounds)
 }
 
 static void
-get_imagesets_from_folder (GFile                  *folder,
-                           HDAvailableBackgrounds *backgrounds)
+imagesets_found (HDObjectVector         *children,
+                 HDAvailableBackgrounds *backgrounds)
 {
-  GFileEnumerator *enumerator;
-  GFileInfo *info;
-  GError *error = NULL;
-
-  enumerator = g_file_enumerate_children (folder,
-                                          G_FILE_ATTRIBUTE_STANDARD_NAME,
-                                          G_FILE_QUERY_INFO_NONE,
-                                          NULL,
-                                          &error);
+  size_t i;
 
-  if (error)
+  for (i = 0; i < hd_object_vector_size (children); i++)
     {
-      char *path = g_file_get_path (folder);
-      g_warning ("%s. Could not enumerate folder %s. %s",
-                 __FUNCTION__,
-                 path,
-                 error->message);
-      g_free (path);
-      g_error_free (error);
-      return;
-    }
+      GFile *desktop_file = hd_object_vector_at (children, i);
+      char *name;
 
-  do
-    {
-      info = g_file_enumerator_next_file (enumerator,
-                                          NULL,
-                                          &error);
-      if (error)
-        {
-          char *path = g_file_get_path (folder);
-          g_warning ("%s. Error enumerating folder %s. %s",
-                     __FUNCTION__,
-                     path,
-                     error->message);
-          g_free (path);
-          g_error_free (error);
-          goto cleanup;
-        }
+      name = g_file_get_basename (desktop_file);
 
-      if (info)
+      if (g_str_has_suffix (name, ".desktop"))
         {
-          const char *name;
-
-          name = g_file_info_get_name (info);
-
-          if (g_str_has_suffix (name, ".desktop"))
-            {
-              HDBackground *background;
-              GFile *desktop_file = g_file_get_child (folder,
-                                                      name);
-              background = hd_imageset_background_new (desktop_file);
-              hd_imageset_background_init_async (HD_IMAGESET_BACKGROUND (background),
-                                                 NULL,
-                                                 (GAsyncReadyCallback) imageset_loaded,
-                                                 backgrounds);
-            }
-
-          g_object_unref (info);
+          HDBackground *background;
+
+          background = hd_imageset_background_new (desktop_file);
+          hd_imageset_background_init_async (HD_IMAGESET_BACKGROUND (background),
+                                             hd_available_backgrounds_get_cancellable (backgrounds),
+                                             (GAsyncReadyCallback) imageset_loaded,
+                                             backgrounds);
         }
+
+      g_free (name);
     }
-  while (info);
+}
 
-cleanup:
-  g_object_unref (enumerator);
+static void
+get_imagesets_from_folder (GFile                  *folder,
+                           HDAvailableBackgrounds *backgrounds)
+{
+  hd_background_catalog_list_folder_async (folder,
+                                           hd_available_backgrounds_get_cancellable (backgrounds),
+                                           (HDBackgroundCatalogFilesFunc) imagesets_found,
+                                           backgrounds);
 }
 
 static char *
@@ -371,6 +398,225 @@ imageset_loaded (HDImagesetBackground   *background,
 
       g_free (label);
     }
+  else
+    {
+      /* The dialog is gone when cancelled */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        hd_available_backgrounds_remove (backgrounds,
+                                         HD_BACKGROUND (background));
+      g_error_free (error);
+    }
+}
+
+/* Takes the ownership of name and image_files */
+static void
+set_imageset (HDImagesetBackground *background,
+              char                 *name,
+              HDObjectVector       *image_files)
+{
+  HDImagesetBackgroundPrivate *priv = background->priv;
+
+  g_free (priv->name);
+  priv->name = name;
+
+  if (priv->image_files)
+    g_object_unref (priv->image_files);
+  priv->image_files = image_files;
+}
+
+static void
+complete_data_free (CompleteData *data)
+{
+  g_object_unref (data->result);
+  if (data->cancellable)
+    g_object_unref (data->cancellable);
+
+  g_slice_free (CompleteData, data);
+}
+
+/* Like g_simple_async_result_complete_in_idle () but fails with
+ * G_IO_ERROR_CANCELLED if cancellable was cancelled in the meantime */
+static gboolean
+complete_in_idle_cb (CompleteData *data)
+{
+  GError *error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (data->cancellable,
+                                            &error))
+    {
+      g_simple_async_result_set_from_error (data->result,
+                                            error);
+      g_error_free (error);
+    }
+
+  g_simple_async_result_complete (data->result);
+
+  return FALSE;
+}
+
+static void
+complete_in_idle (GSimpleAsyncResult *result,
+                  GCancellable       *cancellable)
+{
+  CompleteData *data = g_slice_new0 (CompleteData);
+
+  data->result = g_object_ref (result);
+  if (cancellable)
+    data->cancellable = g_object_ref (cancellable);
+
+  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                   (GSourceFunc) complete_in_idle_cb,
+                   data,
+                   (GDestroyNotify) complete_data_free);
+}
+
+static void
+check_entry_data_free (CheckEntryData *data)
+{
+  g_object_unref (data->background);
+  g_free (data->etag);
+  if (data->cancellable)
+    g_object_unref (data->cancellable);
+  if (data->image_files)
+    g_object_unref (data->image_files);
+
+  g_slice_free (CheckEntryData, data);
+}
+
+/* Parses the .desktop file again, the callback is called again with the
+ * new result */
+static void
+reload_catalog_entry (CheckEntryData *data)
+{
+  GFile *desktop_file = data->background->priv->desktop_file;
+  GSimpleAsyncResult *init_result;
+
+  hd_background_catalog_remove_imageset (desktop_file);
+
+  init_result = g_simple_async_result_new (G_OBJECT (data->background),
+                                           data->callback,
+                                           data->user_data,
+                                           hd_imageset_background_init_async);
+
+  g_file_load_contents_async (desktop_file,
+                              data->cancellable,
+                              (GAsyncReadyCallback) load_desktop_file,
+                              init_result);
+}
+
+static void check_next_image_file (CheckEntryData *data);
+
+static void
+image_file_checked (GFile          *file,
+                    GAsyncResult   *result,
+                    CheckEntryData *data)
+{
+  GFileInfo *info;
+  GError *error = NULL;
+
+  info = g_file_query_info_finish (file,
+                                   result,
+                                   &error);
+
+  if (info)
+    {
+      g_object_unref (info);
+      check_next_image_file (data);
+      return;
+    }
+
+  /* The entry is only stored when all image files exist, so one of them
+   * was removed since */
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    reload_catalog_entry (data);
+
+  g_error_free (error);
+  check_entry_data_free (data);
+}
+
+static void
+check_next_image_file (CheckEntryData *data)
+{
+  if (data->n_checked >= hd_object_vector_size (data->image_files))
+    {
+      check_entry_data_free (data);
+      return;
+    }
+
+  g_file_query_info_async (hd_object_vector_at (data->image_files,
+                                                data->n_checked++),
+                           G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                           G_FILE_QUERY_INFO_NONE,
+                           G_PRIORITY_LOW,
+                           data->cancellable,
+                           (GAsyncReadyCallback) image_file_checked,
+                           data);
+}
+
+static void
+catalog_entry_checked (GFile          *file,
+                       GAsyncResult   *result,
+                       CheckEntryData *data)
+{
+  GFileInfo *info;
+  GError *error = NULL;
+
+  info = g_file_query_info_finish (file,
+                                   result,
+                                   &error);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_error_free (error);
+      goto cleanup;
+    }
+
+  /* Parse the .desktop file again if it was changed or removed */
+  if (!info || g_strcmp0 (g_file_info_get_etag (info), data->etag) != 0)
+    reload_catalog_entry (data);
+  else if (data->image_files)
+    {
+      g_object_unref (info);
+      check_next_image_file (data);
+      return;
+    }
+
+  if (error)
+    g_error_free (error);
+
+cleanup:
+  if (info)
+    g_object_unref (info);
+  check_entry_data_free (data);
+}
+
+static void
+check_catalog_entry (HDImagesetBackground *background,
+                     const char           *etag,
+                     HDObjectVector       *image_files,
+                     GCancellable         *cancellable,
+                     GAsyncReadyCallback   callback,
+                     gpointer              user_data)
+{
+  HDImagesetBackgroundPrivate *priv = background->priv;
+  CheckEntryData *data = g_slice_new0 (CheckEntryData);
+
+  data->background = g_object_ref (background);
+  data->etag = g_strdup (etag);
+  if (image_files)
+    data->image_files = g_object_ref (image_files);
+  if (cancellable)
+    data->cancellable = g_object_ref (cancellable);
+  data->callback = callback;
+  data->user_data = user_data;
+
+  g_file_query_info_async (priv->desktop_file,
+                           G_FILE_ATTRIBUTE_ETAG_VALUE,
+                           G_FILE_QUERY_INFO_NONE,
+                           G_PRIORITY_LOW,
+                           cancellable,
+                           (GAsyncReadyCallback) catalog_entry_checked,
+                           data);
 }
 
 void
@@ -381,12 +627,48 @@ hd_imageset_background_init_async (HDImagesetBackground *background,
 {
   HDImagesetBackgroundPrivate *priv = background->priv;
   GSimpleAsyncResult *result;
+  char *etag, *name;
+  HDObjectVector *image_files;
 
   result = g_simple_async_result_new (G_OBJECT (background),
                                       callback,
                                       user_data,
                                       hd_imageset_background_init_async);
 
+  /* Use the catalog entry at once and check in the background if the
+   * .desktop file changed or the image files were removed since it was
+   * parsed */
+  if (hd_background_catalog_lookup_imageset (priv->desktop_file,
+                                             &etag,
+                                             &name,
+                                             &image_files))
+    {
+      if (name)
+        {
+          set_imageset (background, name, image_files);
+          g_simple_async_result_set_op_res_gboolean (result,
+                                                     TRUE);
+        }
+      else
+        g_simple_async_result_set_error (result,
+                                         G_IO_ERROR,
+                                         G_IO_ERROR_FAILED,
+                                         "Not a valid imageset .desktop file");
+
+      complete_in_idle (result, cancellable);
+      g_object_unref (result);
+
+      check_catalog_entry (background,
+                           etag,
+                           image_files,
+                           cancellable,
+                           callback,
+                           user_data);
+
+      g_free (etag);
+      return;
+    }
+
   g_file_load_contents_async (priv->desktop_file,
                               cancellable,
                               (GAsyncReadyCallback) load_desktop_file,
@@ -418,14 +700,16 @@ load_desktop_file (GFile        *file,
                    GAsyncResult *init_result)
 {
   HDImagesetBackground *background = HD_IMAGESET_BACKGROUND (g_async_result_get_source_object (init_result));
-  HDImagesetBackgroundPrivate *priv = background->priv;
   char *file_contents = NULL;
   gsize file_size;
-  char *etag;
+  char *etag = NULL;
   GKeyFile *key_file = NULL;
   guint i;
   GError *error = NULL;
   char *type = NULL;
+  char *name = NULL;
+  HDObjectVector *image_files = NULL;
+  gboolean add_to_catalog = FALSE;
   g_file_load_contents_finish (file,
                                result,
                                &file_contents,
@@ -439,6 +723,10 @@ load_desktop_file (GFile        *file,
       g_error_free (error);
       goto complete;
     }
+
+  /* Errors below only depend on the contents of the .desktop file, so
+   * they are stored in the catalog, too */
+  add_to_catalog = TRUE;
   
   key_file = g_key_file_new ();
   g_key_file_load_from_data (key_file,
@@ -471,12 +759,13 @@ load_desktop_file (GFile        *file,
                                        G_IO_ERROR,
                                        G_IO_ERROR_FAILED,
                                        "Not a valid imageset .desktop file. Type needs to be Background Image");
+      goto complete;
     }
 
-  priv->name = g_key_file_get_string (key_file,
-                                      G_KEY_FILE_DESKTOP_GROUP,
-                                      G_KEY_FILE_DESKTOP_KEY_NAME,
-                                      &error);
+  name = g_key_file_get_string (key_file,
+                                G_KEY_FILE_DESKTOP_GROUP,
+                                G_KEY_FILE_DESKTOP_KEY_NAME,
+                                &error);
   if (error)
     {
       g_simple_async_result_set_from_error (G_SIMPLE_ASYNC_RESULT (init_result),
@@ -485,6 +774,8 @@ load_desktop_file (GFile        *file,
       goto complete;
     }
 
+  image_files = hd_object_vector_new ();
+
   int max_value = HD_DESKTOP_VIEWS;  
 
   if(hd_backgrounds_is_portrait_wallpaper_enabled (hd_backgrounds_get ()))
@@ -530,7 +821,7 @@ load_desktop_file (GFile        *file,
       if (g_file_query_exists (image_file,
                                NULL))
         {
-          hd_object_vector_push_back (priv->image_files,
+          hd_object_vector_push_back (image_files,
                                       image_file);
           g_object_unref (image_file);
         }
@@ -544,16 +835,41 @@ load_desktop_file (GFile        *file,
                                            path);
           g_object_unref (image_file);
           g_free (path);
+
+          /* The image could still be copied, so do not store it */
+          add_to_catalog = FALSE;
           goto complete;
         }
     }
 
+  if (add_to_catalog && etag)
+    hd_background_catalog_add_imageset (file,
+                                        etag,
+                                        name,
+                                        image_files);
+  add_to_catalog = FALSE;
+
+  set_imageset (background, name, image_files);
+  name = NULL;
+  image_files = NULL;
+
   g_simple_async_result_set_op_res_gboolean (G_SIMPLE_ASYNC_RESULT (init_result),
                                              TRUE);
 
 complete:
+  /* Store the invalid .desktop file */
+  if (add_to_catalog && etag)
+    hd_background_catalog_add_imageset (file,
+                                        etag,
+                                        NULL,
+                                        NULL);
+
   g_free (file_contents);
+  g_free (etag);
   g_free (type);
+  g_free (name);
+  if (image_files)
+    g_object_unref (image_files);
   if (key_file)
     g_key_file_free (key_file);
 
@@ -622,14 +938,12 @@ hd_imageset_background_set_property (GObject      *object,
 
 static CommandData*
 command_data_new  (GFile        *file,
-                   guint         view,
-                   GCancellable *cancellable)
+                   guint         view)
 {
   CommandData *data = g_slice_new0 (CommandData);
 
   data->file = g_object_ref (file);
   data->view = view;
-  data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
 
   return data;
 }
@@ -642,9 +956,6 @@ command_data_free (CommandData *data)
 
   g_object_unref (data->file);
 
-  if (data->cancellable)
-    g_object_unref (data->cancellable);
-
   g_slice_free (CommandData, data);
 }
 
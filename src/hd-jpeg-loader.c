@@ -0,0 +1,513 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <setjmp.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "hd-background-stats.h"
+#include "hd-exif.h"
+
+#include "hd-jpeg-loader.h"
+
+/*
+ * JPEG loader which uses the DCT scaling of libjpeg. Camera images are much
+ * bigger than the background, so decoding them in 1/2, 1/4 or 1/8 of the
+ * size saves most of the IDCT work and memory before the final scaling.
+ */
+
+#define BUFFER_SIZE 8192
+
+/* Number of rows passed at once by hd_jpeg_loader_load_rows */
+#define ROWS_PER_BLOCK 16
+
+typedef struct
+{
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+  GError *error;
+} ErrorManager;
+
+typedef struct
+{
+  struct jpeg_source_mgr pub;
+  GInputStream *stream;
+  GCancellable *cancellable;
+  ErrorManager *error_manager;
+  JOCTET buffer[BUFFER_SIZE];
+} SourceManager;
+
+static void
+error_exit (j_common_ptr cinfo)
+{
+  ErrorManager *error_manager = (ErrorManager *) cinfo->err;
+  char buffer[JMSG_LENGTH_MAX];
+
+  if (!error_manager->error)
+    {
+      cinfo->err->format_message (cinfo, buffer);
+      g_set_error (&error_manager->error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                   "Error interpreting JPEG image file (%s)",
+                   buffer);
+    }
+
+  longjmp (error_manager->setjmp_buffer, 1);
+}
+
+static void
+output_message (j_common_ptr cinfo)
+{
+  /* Do not print libjpeg warnings to stderr */
+}
+
+static void
+init_source (j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+fill_input_buffer (j_decompress_ptr cinfo)
+{
+  SourceManager *src = (SourceManager *) cinfo->src;
+  gssize read_bytes;
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_READ);
+  read_bytes = g_input_stream_read (src->stream,
+                                    src->buffer,
+                                    BUFFER_SIZE,
+                                    src->cancellable,
+                                    &src->error_manager->error);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_READ);
+
+  /* Read errors and cancellation abort the decoding */
+  if (read_bytes < 0)
+    longjmp (src->error_manager->setjmp_buffer, 1);
+
+  /* Insert a fake EOI marker for truncated files */
+  if (read_bytes == 0)
+    {
+      WARNMS (cinfo, JWRN_JPEG_EOF);
+      src->buffer[0] = (JOCTET) 0xFF;
+      src->buffer[1] = (JOCTET) JPEG_EOI;
+      read_bytes = 2;
+    }
+
+  src->pub.next_input_byte = src->buffer;
+  src->pub.bytes_in_buffer = read_bytes;
+
+  return TRUE;
+}
+
+static void
+skip_input_data (j_decompress_ptr cinfo,
+                 long             num_bytes)
+{
+  SourceManager *src = (SourceManager *) cinfo->src;
+
+  if (num_bytes <= 0)
+    return;
+
+  while (num_bytes > (long) src->pub.bytes_in_buffer)
+    {
+      num_bytes -= src->pub.bytes_in_buffer;
+      fill_input_buffer (cinfo);
+    }
+
+  src->pub.next_input_byte += num_bytes;
+  src->pub.bytes_in_buffer -= num_bytes;
+}
+
+static void
+term_source (j_decompress_ptr cinfo)
+{
+}
+
+static guint
+get_orientation (j_decompress_ptr cinfo)
+{
+  jpeg_saved_marker_ptr marker;
+
+  for (marker = cinfo->marker_list; marker; marker = marker->next)
+    {
+      if (marker->marker == JPEG_APP0 + 1 &&
+          hd_exif_is_exif_marker (marker->data, marker->data_length))
+        return hd_exif_get_orientation (marker->data + HD_EXIF_HEADER_SIZE,
+                                        marker->data_length - HD_EXIF_HEADER_SIZE);
+    }
+
+  return 1;
+}
+
+/*
+ * Returns the largest DCT scale denominator for which the decoded image
+ * is still at least as large as size in both directions.
+ */
+static guint
+get_scale_denom (guint        width,
+                 guint        height,
+                 guint        orientation,
+                 HDImageSize *size)
+{
+  double scale;
+  guint denom;
+
+  /* Orientations 5-8 swap width and height */
+  if (orientation >= 5)
+    {
+      guint tmp = width;
+      width = height;
+      height = tmp;
+    }
+
+  scale = MAX (((double) size->width) / width,
+               ((double) size->height) / height);
+
+  for (denom = 8; denom > 1; denom /= 2)
+    if (scale * denom <= 1.)
+      break;
+
+  return denom;
+}
+
+static void
+convert_row (j_decompress_ptr  cinfo,
+             const JSAMPLE    *src,
+             guchar           *dest)
+{
+  JDIMENSION x;
+
+  if (cinfo->out_color_space == JCS_GRAYSCALE)
+    {
+      for (x = 0; x < cinfo->output_width; x++, src++, dest += 3)
+        dest[0] = dest[1] = dest[2] = src[0];
+    }
+  else /* JCS_CMYK */
+    {
+      /* Adobe writes inverted CMYK */
+      for (x = 0; x < cinfo->output_width; x++, src += 4, dest += 3)
+        {
+          guint k = src[3];
+
+          if (cinfo->saw_Adobe_marker)
+            {
+              dest[0] = src[0] * k / 255;
+              dest[1] = src[1] * k / 255;
+              dest[2] = src[2] * k / 255;
+            }
+          else
+            {
+              dest[0] = (255 - src[0]) * (255 - k) / 255;
+              dest[1] = (255 - src[1]) * (255 - k) / 255;
+              dest[2] = (255 - src[2]) * (255 - k) / 255;
+            }
+        }
+    }
+}
+
+/* Sets up decompression from stream, to be called after the setjmp */
+static void
+create_decompress (j_decompress_ptr  cinfo,
+                   ErrorManager     *error_manager,
+                   GInputStream     *stream,
+                   GCancellable     *cancellable)
+{
+  SourceManager *src;
+
+  jpeg_create_decompress (cinfo);
+
+  /* Read directly from the stream */
+  cinfo->src = (struct jpeg_source_mgr *) (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo,
+                                                                      JPOOL_PERMANENT,
+                                                                      sizeof (SourceManager));
+  src = (SourceManager *) cinfo->src;
+  src->pub.init_source = init_source;
+  src->pub.fill_input_buffer = fill_input_buffer;
+  src->pub.skip_input_data = skip_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart;
+  src->pub.term_source = term_source;
+  src->pub.bytes_in_buffer = 0;
+  src->pub.next_input_byte = NULL;
+  src->stream = stream;
+  src->cancellable = cancellable;
+  src->error_manager = error_manager;
+
+  /* Keep the EXIF marker for the orientation */
+  jpeg_save_markers (cinfo, JPEG_APP0 + 1, 0xffff);
+}
+
+static void
+set_out_color_space (j_decompress_ptr cinfo)
+{
+  switch (cinfo->jpeg_color_space)
+    {
+      case JCS_GRAYSCALE:
+        cinfo->out_color_space = JCS_GRAYSCALE;
+        break;
+      case JCS_CMYK:
+      case JCS_YCCK:
+        cinfo->out_color_space = JCS_CMYK;
+        break;
+      default:
+        cinfo->out_color_space = JCS_RGB;
+        break;
+    }
+}
+
+static void
+init_error_manager (j_decompress_ptr  cinfo,
+                    ErrorManager     *error_manager)
+{
+  cinfo->err = jpeg_std_error (&error_manager->pub);
+  error_manager->pub.error_exit = error_exit;
+  error_manager->pub.output_message = output_message;
+  error_manager->error = NULL;
+}
+
+gboolean
+hd_jpeg_loader_is_jpeg (const guchar *data,
+                        gsize         length)
+{
+  return length >= 2 && data[0] == 0xFF && data[1] == 0xD8;
+}
+
+/*
+ * Decodes the JPEG image from stream in the smallest size which covers
+ * size. The EXIF orientation is not applied, but set as "orientation"
+ * option on the returned pixbuf.
+ */
+GdkPixbuf *
+hd_jpeg_loader_load_scaled (GInputStream  *stream,
+                            HDImageSize   *size,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  struct jpeg_decompress_struct cinfo;
+  ErrorManager error_manager;
+  GdkPixbuf * volatile pixbuf = NULL;
+  JSAMPLE * volatile row_buffer = NULL;
+  guint orientation;
+  guchar *pixels;
+  int rowstride;
+
+  init_error_manager (&cinfo, &error_manager);
+
+  if (setjmp (error_manager.setjmp_buffer))
+    {
+      jpeg_destroy_decompress (&cinfo);
+
+      if (pixbuf)
+        g_object_unref (pixbuf);
+      g_free (row_buffer);
+
+      g_propagate_error (error, error_manager.error);
+
+      return NULL;
+    }
+
+  create_decompress (&cinfo,
+                     &error_manager,
+                     stream,
+                     cancellable);
+
+  jpeg_read_header (&cinfo, TRUE);
+
+  orientation = get_orientation (&cinfo);
+
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = get_scale_denom (cinfo.image_width,
+                                       cinfo.image_height,
+                                       orientation,
+                                       size);
+
+  set_out_color_space (&cinfo);
+
+  jpeg_start_decompress (&cinfo);
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+                           FALSE,
+                           8,
+                           cinfo.output_width,
+                           cinfo.output_height);
+  if (!pixbuf)
+    {
+      g_set_error (&error_manager.error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                   "Insufficient memory to load image, try exiting some applications to free memory");
+      longjmp (error_manager.setjmp_buffer, 1);
+    }
+
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  /* RGB is decoded in place, other color spaces need to be converted */
+  if (cinfo.out_color_space != JCS_RGB)
+    row_buffer = g_new (JSAMPLE, cinfo.output_width * cinfo.output_components);
+
+  while (cinfo.output_scanline < cinfo.output_height)
+    {
+      guchar *dest = pixels + cinfo.output_scanline * rowstride;
+      JSAMPROW row = row_buffer ? row_buffer : dest;
+
+      if (cinfo.output_scanline % ROWS_PER_BLOCK == 0 &&
+          g_cancellable_set_error_if_cancelled (cancellable, &error_manager.error))
+        longjmp (error_manager.setjmp_buffer, 1);
+
+      jpeg_read_scanlines (&cinfo, &row, 1);
+
+      if (row_buffer)
+        convert_row (&cinfo, row_buffer, dest);
+    }
+
+  jpeg_finish_decompress (&cinfo);
+  jpeg_destroy_decompress (&cinfo);
+
+  g_free (row_buffer);
+
+  if (orientation != 1)
+    {
+      char *value = g_strdup_printf ("%u", orientation);
+      gdk_pixbuf_set_option (pixbuf, "orientation", value);
+      g_free (value);
+    }
+
+  return pixbuf;
+}
+
+/*
+ * Decodes the JPEG image from stream in the smallest size which covers
+ * size, like hd_jpeg_loader_load_scaled, but passes it in blocks of RGB
+ * rows to rows_func without the whole image in memory. size_func gets the
+ * decoded size and the EXIF orientation, which is not applied, before the
+ * first row.
+ */
+gboolean
+hd_jpeg_loader_load_rows (GInputStream      *stream,
+                          HDImageSize       *size,
+                          HDPixbufSizeFunc   size_func,
+                          HDPixbufRowsFunc   rows_func,
+                          gpointer           user_data,
+                          GCancellable      *cancellable,
+                          GError           **error)
+{
+  struct jpeg_decompress_struct cinfo;
+  ErrorManager error_manager;
+  guchar * volatile block = NULL;
+  JSAMPLE * volatile row_buffer = NULL;
+  guint orientation;
+  int rowstride, y;
+
+  init_error_manager (&cinfo, &error_manager);
+
+  if (setjmp (error_manager.setjmp_buffer))
+    {
+      jpeg_destroy_decompress (&cinfo);
+
+      g_free (block);
+      g_free (row_buffer);
+
+      g_propagate_error (error, error_manager.error);
+
+      return FALSE;
+    }
+
+  create_decompress (&cinfo,
+                     &error_manager,
+                     stream,
+                     cancellable);
+
+  jpeg_read_header (&cinfo, TRUE);
+
+  orientation = get_orientation (&cinfo);
+
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = get_scale_denom (cinfo.image_width,
+                                       cinfo.image_height,
+                                       orientation,
+                                       size);
+
+  set_out_color_space (&cinfo);
+
+  jpeg_calc_output_dimensions (&cinfo);
+
+  if (!size_func (cinfo.output_width,
+                  cinfo.output_height,
+                  orientation,
+                  user_data,
+                  &error_manager.error))
+    longjmp (error_manager.setjmp_buffer, 1);
+
+  jpeg_start_decompress (&cinfo);
+
+  rowstride = cinfo.output_width * 3;
+  block = g_try_malloc (rowstride * ROWS_PER_BLOCK);
+  if (!block)
+    {
+      g_set_error (&error_manager.error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                   "Insufficient memory to load image, try exiting some applications to free memory");
+      longjmp (error_manager.setjmp_buffer, 1);
+    }
+
+  /* RGB is decoded in place, other color spaces need to be converted */
+  if (cinfo.out_color_space != JCS_RGB)
+    row_buffer = g_new (JSAMPLE, cinfo.output_width * cinfo.output_components);
+
+  for (y = 0; cinfo.output_scanline < cinfo.output_height; y = cinfo.output_scanline)
+    {
+      int n_rows = MIN (ROWS_PER_BLOCK, cinfo.output_height - y);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, &error_manager.error))
+        longjmp (error_manager.setjmp_buffer, 1);
+
+      while ((int) cinfo.output_scanline < y + n_rows)
+        {
+          guchar *dest = block + (cinfo.output_scanline - y) * rowstride;
+          JSAMPROW row = row_buffer ? row_buffer : dest;
+
+          jpeg_read_scanlines (&cinfo, &row, 1);
+
+          if (row_buffer)
+            convert_row (&cinfo, row_buffer, dest);
+        }
+
+      if (!rows_func (block, rowstride, y, n_rows, user_data, &error_manager.error))
+        longjmp (error_manager.setjmp_buffer, 1);
+    }
+
+  jpeg_finish_decompress (&cinfo);
+  jpeg_destroy_decompress (&cinfo);
+
+  g_free (block);
+  g_free (row_buffer);
+
+  return TRUE;
+}
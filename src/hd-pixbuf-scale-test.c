@@ -0,0 +1,251 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Compares hd_pixbuf_scale with gdk_pixbuf_scale (GDK_INTERP_BILINEAR),
+ * which it replaces, on generated images. The images are smooth, so the
+ * different fixed point precision and subpixel quantization of the two
+ * only cause small differences. For the EXIF orientations 2-8 the source
+ * is rotated and flipped with gdk-pixbuf before gdk_pixbuf_scale.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "hd-pixbuf-scale.h"
+
+/* Largest allowed difference of a channel value */
+#define MAX_DIFFERENCE 3
+
+typedef struct
+{
+  const char *name;
+  int source_width;
+  int source_height;
+  int destination_width;
+  int destination_height;
+  double offset_x;
+  double offset_y;
+  double scale;
+  guint orientation;
+} ScaleCase;
+
+/* The destination size, offsets and scale are relative to the oriented
+ * source */
+static const ScaleCase cases[] = {
+  { "down",             640,  480, 160,  96,   -8.5,     0.,   .27, 1 },
+  { "up",                40,   30, 160, 100, -10.25,    -5.,   4.3, 1 },
+  { "scale and crop",  1024,  600, 800, 480,   -9.6,     0.,    .8, 1 },
+  { "1xN up",             1,   50,  20, 100,    -9.,   -1.5,    2., 1 },
+  { "1xN down",           1,  400,   8,  40,     0.,    -.5,    .1, 1 },
+  { "Nx1 up",            50,    1, 100,  20,   -1.5,    -9.,    2., 1 },
+  { "Nx1 down",         400,    1,  40,   8,    -.5,     0.,    .1, 1 },
+  { "orientation 2",    640,  480, 160,  96,   -8.5,     0.,   .27, 2 },
+  { "orientation 3",   1024,  600, 800, 480,   -9.6,   -2.5,    .8, 3 },
+  { "orientation 4",    640,  480, 160,  96,     0.,  -6.25,   .27, 4 },
+  { "orientation 5",    480,  640, 160,  96,   -8.5,     0.,   .27, 5 },
+  { "orientation 6",    600, 1024, 800, 480,   -9.6,     0.,    .8, 6 },
+  { "orientation 6 up",  30,   40, 160, 100, -10.25,    -5.,   4.3, 6 },
+  { "orientation 7",    480,  640, 160,  96,    -3.,   -4.5,   .27, 7 },
+  { "orientation 8",    600, 1024, 800, 480,     0.,   -9.6,    .8, 8 }
+};
+
+/* Gradients along x and y in the color channels and a gentle alpha ramp */
+static GdkPixbuf *
+create_source (int      width,
+               int      height,
+               gboolean has_alpha)
+{
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  int rowstride, n_channels, x, y;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8, width, height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      {
+        guchar *p = pixels + y * rowstride + x * n_channels;
+
+        p[0] = 20 + x * 200 / width;
+        p[1] = 20 + y * 200 / height;
+        p[2] = 230 - (x * 100 / width + y * 100 / height);
+        if (has_alpha)
+          p[3] = 160 + (x + y) * 90 / (width + height);
+      }
+
+  return pixbuf;
+}
+
+/* Returns source as shown with the EXIF orientation */
+static GdkPixbuf *
+orient_source (GdkPixbuf *source,
+               guint      orientation)
+{
+  GdkPixbuf *rotated, *oriented;
+
+  switch (orientation)
+    {
+    case 2:
+      return gdk_pixbuf_flip (source, TRUE);
+    case 3:
+      return gdk_pixbuf_rotate_simple (source, GDK_PIXBUF_ROTATE_UPSIDEDOWN);
+    case 4:
+      return gdk_pixbuf_flip (source, FALSE);
+    case 5:
+      rotated = gdk_pixbuf_rotate_simple (source, GDK_PIXBUF_ROTATE_CLOCKWISE);
+      oriented = gdk_pixbuf_flip (rotated, TRUE);
+      g_object_unref (rotated);
+      return oriented;
+    case 6:
+      return gdk_pixbuf_rotate_simple (source, GDK_PIXBUF_ROTATE_CLOCKWISE);
+    case 7:
+      rotated = gdk_pixbuf_rotate_simple (source, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
+      oriented = gdk_pixbuf_flip (rotated, TRUE);
+      g_object_unref (rotated);
+      return oriented;
+    case 8:
+      return gdk_pixbuf_rotate_simple (source, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
+    default:
+      return g_object_ref (source);
+    }
+}
+
+static gboolean
+run_case (const ScaleCase *scale_case,
+          gboolean         has_alpha)
+{
+  GdkPixbuf *source, *oriented, *expected, *result;
+  const guchar *expected_pixels, *result_pixels;
+  int expected_rowstride, result_rowstride, n_channels;
+  int x, y, c, max_difference = 0;
+  GError *error = NULL;
+
+  source = create_source (scale_case->source_width,
+                          scale_case->source_height,
+                          has_alpha);
+  oriented = orient_source (source, scale_case->orientation);
+  expected = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8,
+                             scale_case->destination_width,
+                             scale_case->destination_height);
+  result = gdk_pixbuf_new (GDK_COLORSPACE_RGB, has_alpha, 8,
+                           scale_case->destination_width,
+                           scale_case->destination_height);
+
+  gdk_pixbuf_scale (oriented,
+                    expected,
+                    0, 0,
+                    scale_case->destination_width,
+                    scale_case->destination_height,
+                    scale_case->offset_x,
+                    scale_case->offset_y,
+                    scale_case->scale,
+                    scale_case->scale,
+                    GDK_INTERP_BILINEAR);
+
+  if (!hd_pixbuf_scale (source,
+                        result,
+                        scale_case->offset_x,
+                        scale_case->offset_y,
+                        scale_case->scale,
+                        scale_case->orientation,
+                        NULL,
+                        &error))
+    {
+      g_printerr ("%s (%s): %s\n",
+                  scale_case->name,
+                  has_alpha ? "RGBA" : "RGB",
+                  error->message);
+      g_error_free (error);
+      max_difference = G_MAXINT;
+      goto cleanup;
+    }
+
+  expected_pixels = gdk_pixbuf_get_pixels (expected);
+  expected_rowstride = gdk_pixbuf_get_rowstride (expected);
+  result_pixels = gdk_pixbuf_get_pixels (result);
+  result_rowstride = gdk_pixbuf_get_rowstride (result);
+  n_channels = gdk_pixbuf_get_n_channels (result);
+
+  for (y = 0; y < scale_case->destination_height; y++)
+    for (x = 0; x < scale_case->destination_width; x++)
+      for (c = 0; c < n_channels; c++)
+        {
+          int difference;
+
+          difference = abs (expected_pixels[y * expected_rowstride + x * n_channels + c] -
+                            result_pixels[y * result_rowstride + x * n_channels + c]);
+
+          if (difference > max_difference)
+            {
+              max_difference = difference;
+
+              if (difference > MAX_DIFFERENCE)
+                g_printerr ("%s (%s): pixel %d,%d channel %d differs by %d\n",
+                            scale_case->name,
+                            has_alpha ? "RGBA" : "RGB",
+                            x, y, c,
+                            difference);
+            }
+        }
+
+cleanup:
+  g_object_unref (source);
+  g_object_unref (oriented);
+  g_object_unref (expected);
+  g_object_unref (result);
+
+  g_print ("%-16s %-4s %s\n",
+           scale_case->name,
+           has_alpha ? "RGBA" : "RGB",
+           max_difference <= MAX_DIFFERENCE ? "ok" : "FAIL");
+
+  return max_difference <= MAX_DIFFERENCE;
+}
+
+int
+main (int argc, char **argv)
+{
+  guint i;
+  gboolean success = TRUE;
+
+  g_type_init ();
+
+  for (i = 0; i < G_N_ELEMENTS (cases); i++)
+    {
+      if (!run_case (&cases[i], FALSE))
+        success = FALSE;
+      if (!run_case (&cases[i], TRUE))
+        success = FALSE;
+    }
+
+  return success ? 0 : 1;
+}
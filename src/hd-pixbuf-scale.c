@@ -0,0 +1,726 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "hd-pixbuf-scale.h"
+
+/*
+ * Separable resampling for the backgrounds, equivalent to gdk_pixbuf_scale
+ * with GDK_INTERP_BILINEAR: box filter when scaling down, linear
+ * interpolation when scaling up. Only the destination area is computed, so
+ * cropping is free.
+ *
+ * Source rows are filtered horizontally into 16 bit intermediate rows kept
+ * in a ring buffer, which are then combined vertically into the
+ * destination rows. Weights are 12 bit fixed point, intermediate values
+ * 14 bit (8 bit value << 6). Color channels (and alpha) are filtered
+ * independently.
+ *
+ * The EXIF orientation is applied in the same pass: flips reverse the
+ * filter taps and transposed images are filtered along the source rows
+ * and written into destination columns.
+ *
+ * Source rows are only needed in order and while they are in the ring, so
+ * HDPixbufScaler takes them in blocks from incremental decoders.
+ */
+
+#define WEIGHT_BITS 12
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define INTERMEDIATE_SHIFT 6
+#define VERTICAL_SHIFT (WEIGHT_BITS + WEIGHT_BITS - INTERMEDIATE_SHIFT)
+
+/* Lines between the checks for cancellation, and rows passed at once by
+ * HDPixbufScaler */
+#define LINES_PER_BLOCK 32
+
+/* floor () without libm, for values in the pixbuf range */
+#define FLOOR(x) ((int) ((x) + 65536.) - 65536)
+
+typedef struct
+{
+  int n_taps;
+  int *start;
+  gint16 *weights;
+} Filter;
+
+typedef struct
+{
+  gboolean transpose;
+  gboolean flip_x;
+  gboolean flip_y;
+} Orientation;
+
+/* Transformations from the destination to the source coordinates for the
+ * EXIF orientations 1-8, flips are applied before the transposition */
+static const Orientation orientations[] = {
+  { FALSE, FALSE, FALSE },
+  { FALSE, FALSE, FALSE },
+  { FALSE, TRUE,  FALSE },
+  { FALSE, TRUE,  TRUE  },
+  { FALSE, FALSE, TRUE  },
+  { TRUE,  FALSE, FALSE },
+  { TRUE,  TRUE,  FALSE },
+  { TRUE,  TRUE,  TRUE  },
+  { TRUE,  FALSE, TRUE  }
+};
+
+static void
+filter_init (Filter   *filter,
+             int       destination_size,
+             int       source_size,
+             double    offset,
+             double    scale,
+             gboolean  flip)
+{
+  double *tmp, *taps;
+  int n_taps, x;
+
+  /* Taps before clamping to the source, small sources have fewer */
+  if (scale < 1.)
+    n_taps = FLOOR (1. / scale) + 2;
+  else
+    n_taps = 2;
+  filter->n_taps = MIN (n_taps, source_size);
+
+  filter->start = g_new (int, destination_size);
+  filter->weights = g_new (gint16, destination_size * filter->n_taps);
+
+  tmp = g_new (double, n_taps);
+  taps = g_new (double, filter->n_taps);
+
+  for (x = 0; x < destination_size; x++)
+    {
+      /* Center of the destination pixel in source coordinates */
+      double center = (x + .5 - offset) / scale;
+      gint16 *weights = filter->weights + x * filter->n_taps;
+      int start, clamped_start, i, total, largest;
+      double sum;
+
+      if (scale < 1.)
+        {
+          /* Coverage of the source pixels by the destination pixel */
+          double left = center - .5 / scale;
+          double right = center + .5 / scale;
+
+          start = FLOOR (left);
+
+          for (i = 0; i < n_taps; i++)
+            {
+              double coverage = MIN (right, start + i + 1) - MAX (left, start + i);
+
+              tmp[i] = MAX (coverage, 0.);
+            }
+        }
+      else
+        {
+          double position = center - .5;
+
+          start = FLOOR (position);
+
+          tmp[0] = 1. - (position - start);
+          tmp[1] = position - start;
+        }
+
+      /* Clamp to the source, moving the weights of outside pixels to the
+       * edge pixels */
+      clamped_start = CLAMP (start, 0, source_size - filter->n_taps);
+      memset (taps, 0, filter->n_taps * sizeof (double));
+      for (i = 0; i < n_taps; i++)
+        taps[CLAMP (start + i, 0, source_size - 1) - clamped_start] += tmp[i];
+
+      /* Mirrored source pixels in reverse order */
+      if (flip)
+        {
+          for (i = 0; i < filter->n_taps / 2; i++)
+            {
+              double swap = taps[i];
+              taps[i] = taps[filter->n_taps - 1 - i];
+              taps[filter->n_taps - 1 - i] = swap;
+            }
+          clamped_start = source_size - clamped_start - filter->n_taps;
+        }
+
+      filter->start[x] = clamped_start;
+
+      /* Normalize to fixed point with an exact sum of WEIGHT_ONE */
+      sum = 0;
+      for (i = 0; i < filter->n_taps; i++)
+        sum += taps[i];
+
+      total = 0;
+      largest = 0;
+      for (i = 0; i < filter->n_taps; i++)
+        {
+          weights[i] = sum > 0 ? FLOOR (taps[i] / sum * WEIGHT_ONE + .5) : 0;
+          total += weights[i];
+          if (weights[i] > weights[largest])
+            largest = i;
+        }
+      weights[largest] += WEIGHT_ONE - total;
+    }
+
+  g_free (taps);
+  g_free (tmp);
+}
+
+static void
+filter_free (Filter *filter)
+{
+  g_free (filter->start);
+  g_free (filter->weights);
+}
+
+static void
+horizontal_pass (const guchar *source,
+                 int           n_channels,
+                 const Filter *filter,
+                 int           width,
+                 gint16       *row)
+{
+  const gint16 *weights = filter->weights;
+  int x, c, t;
+
+  for (x = 0; x < width; x++, weights += filter->n_taps)
+    {
+      const guchar *p = source + filter->start[x] * n_channels;
+
+      for (c = 0; c < n_channels; c++)
+        {
+          gint32 sum = 0;
+
+          for (t = 0; t < filter->n_taps; t++)
+            sum += p[t * n_channels + c] * weights[t];
+
+          *row++ = (sum + (1 << (INTERMEDIATE_SHIFT - 1))) >> INTERMEDIATE_SHIFT;
+        }
+    }
+}
+
+#if defined(__SSE2__)
+static int
+vertical_pass_simd (gint16       **rows,
+                    const gint16  *weights,
+                    int            n_taps,
+                    guchar        *destination,
+                    int            n)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m128i lo = _mm_set1_epi32 (1 << (VERTICAL_SHIFT - 1));
+      __m128i hi = lo;
+      __m128i result;
+      int t;
+
+      /* Two taps at once, interleaved for pmaddwd */
+      for (t = 0; t + 1 < n_taps; t += 2)
+        {
+          __m128i a = _mm_loadu_si128 ((const __m128i *) (rows[t] + i));
+          __m128i b = _mm_loadu_si128 ((const __m128i *) (rows[t + 1] + i));
+          __m128i w = _mm_set1_epi32 ((guint16) weights[t] |
+                                      ((guint32) (guint16) weights[t + 1] << 16));
+
+          lo = _mm_add_epi32 (lo, _mm_madd_epi16 (_mm_unpacklo_epi16 (a, b), w));
+          hi = _mm_add_epi32 (hi, _mm_madd_epi16 (_mm_unpackhi_epi16 (a, b), w));
+        }
+
+      if (t < n_taps)
+        {
+          __m128i a = _mm_loadu_si128 ((const __m128i *) (rows[t] + i));
+          __m128i w = _mm_set1_epi32 ((guint16) weights[t]);
+
+          lo = _mm_add_epi32 (lo, _mm_madd_epi16 (_mm_unpacklo_epi16 (a, zero), w));
+          hi = _mm_add_epi32 (hi, _mm_madd_epi16 (_mm_unpackhi_epi16 (a, zero), w));
+        }
+
+      result = _mm_packs_epi32 (_mm_srai_epi32 (lo, VERTICAL_SHIFT),
+                                _mm_srai_epi32 (hi, VERTICAL_SHIFT));
+      result = _mm_packus_epi16 (result, result);
+      _mm_storel_epi64 ((__m128i *) (destination + i), result);
+    }
+
+  return i;
+}
+#elif defined(__ARM_NEON__)
+static int
+vertical_pass_simd (gint16       **rows,
+                    const gint16  *weights,
+                    int            n_taps,
+                    guchar        *destination,
+                    int            n)
+{
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      int32x4_t lo = vdupq_n_s32 (1 << (VERTICAL_SHIFT - 1));
+      int32x4_t hi = lo;
+      int16x8_t result;
+      int t;
+
+      for (t = 0; t < n_taps; t++)
+        {
+          int16x8_t a = vld1q_s16 (rows[t] + i);
+
+          lo = vmlal_n_s16 (lo, vget_low_s16 (a), weights[t]);
+          hi = vmlal_n_s16 (hi, vget_high_s16 (a), weights[t]);
+        }
+
+      result = vcombine_s16 (vqmovn_s32 (vshrq_n_s32 (lo, VERTICAL_SHIFT)),
+                             vqmovn_s32 (vshrq_n_s32 (hi, VERTICAL_SHIFT)));
+      vst1_u8 (destination + i, vqmovun_s16 (result));
+    }
+
+  return i;
+}
+#endif
+
+static void
+vertical_pass (gint16       **rows,
+               const gint16  *weights,
+               int            n_taps,
+               guchar        *destination,
+               int            n)
+{
+  int i = 0, t;
+
+#if defined(__SSE2__) || defined(__ARM_NEON__)
+  i = vertical_pass_simd (rows, weights, n_taps, destination, n);
+#endif
+
+  for (; i < n; i++)
+    {
+      gint32 sum = 1 << (VERTICAL_SHIFT - 1);
+
+      for (t = 0; t < n_taps; t++)
+        sum += rows[t][i] * weights[t];
+
+      destination[i] = CLAMP (sum >> VERTICAL_SHIFT, 0, 255);
+    }
+}
+
+struct _HDPixbufScaler
+{
+  const Orientation *transform;
+
+  /* The inner filter is along the source rows, the outer one selects the
+   * source rows. When transposed source rows are destination columns. */
+  Filter inner;
+  Filter outer;
+  gboolean outer_flip;
+  int inner_size;
+  int outer_size;
+  int n_channels;
+  int line_length;
+
+  /* Intermediate rows of the last used source rows, source row r is
+   * stored in slot r % n_taps */
+  gint16 *ring;
+  gint16 **rows;
+
+  /* Destination column, when transposed */
+  guchar *line;
+
+  /* Destination lines done, in the order of the source rows */
+  int n_lines;
+
+  /* The whole destination, or a block of rows starting at block_y when
+   * the rows are passed to rows_func as they are done */
+  guchar *pixels;
+  int rowstride;
+  int height;
+  gboolean owns_pixels;
+  int block_y;
+
+  HDPixbufRowsFunc rows_func;
+  gpointer user_data;
+  gboolean in_order;
+};
+
+static void
+scaler_init (HDPixbufScaler *scaler,
+             int             source_width,
+             int             source_height,
+             int             n_channels,
+             int             width,
+             int             height,
+             double          offset_x,
+             double          offset_y,
+             double          scale_x,
+             double          scale_y,
+             guint           orientation)
+{
+  const Orientation *transform;
+
+  if (orientation < 1 || orientation >= G_N_ELEMENTS (orientations))
+    orientation = 1;
+  transform = &orientations[orientation];
+
+  memset (scaler, 0, sizeof (HDPixbufScaler));
+
+  scaler->transform = transform;
+  scaler->n_channels = n_channels;
+  scaler->height = height;
+
+  if (transform->transpose)
+    {
+      scaler->inner_size = height;
+      scaler->outer_size = width;
+      scaler->outer_flip = transform->flip_x;
+      filter_init (&scaler->inner, height, source_width,
+                   offset_y, scale_y, transform->flip_y);
+      filter_init (&scaler->outer, width, source_height,
+                   offset_x, scale_x, transform->flip_x);
+      scaler->line = g_new (guchar, height * n_channels);
+    }
+  else
+    {
+      scaler->inner_size = width;
+      scaler->outer_size = height;
+      scaler->outer_flip = transform->flip_y;
+      filter_init (&scaler->inner, width, source_width,
+                   offset_x, scale_x, transform->flip_x);
+      filter_init (&scaler->outer, height, source_height,
+                   offset_y, scale_y, transform->flip_y);
+    }
+
+  scaler->line_length = scaler->inner_size * n_channels;
+
+  scaler->ring = g_new (gint16, scaler->outer.n_taps * scaler->line_length);
+  scaler->rows = g_new (gint16 *, scaler->outer.n_taps);
+}
+
+static void
+scaler_clear (HDPixbufScaler *scaler)
+{
+  g_free (scaler->rows);
+  g_free (scaler->ring);
+  g_free (scaler->line);
+
+  if (scaler->owns_pixels)
+    g_free (scaler->pixels);
+
+  filter_free (&scaler->inner);
+  filter_free (&scaler->outer);
+}
+
+/* Destination line computed as the n-th one. Flipped lines need the source
+ * rows in reverse order, so they are done from the last one. */
+static inline int
+scaler_get_line (HDPixbufScaler *scaler,
+                 int             n)
+{
+  return scaler->outer_flip ? scaler->outer_size - 1 - n : n;
+}
+
+static gboolean
+scaler_flush_block (HDPixbufScaler  *scaler,
+                    int              n_rows,
+                    GError         **error)
+{
+  gboolean result;
+
+  result = scaler->rows_func (scaler->pixels,
+                              scaler->rowstride,
+                              scaler->block_y,
+                              n_rows,
+                              scaler->user_data,
+                              error);
+  scaler->block_y += n_rows;
+
+  return result;
+}
+
+static void
+scaler_compute_line (HDPixbufScaler *scaler,
+                     int             o)
+{
+  Filter *outer = &scaler->outer;
+  int start = outer->start[o], t;
+
+  for (t = 0; t < outer->n_taps; t++)
+    scaler->rows[t] = scaler->ring + ((start + t) % outer->n_taps) * scaler->line_length;
+
+  if (scaler->line)
+    {
+      guchar *column = scaler->pixels + o * scaler->n_channels;
+      int i, c;
+
+      vertical_pass (scaler->rows,
+                     outer->weights + o * outer->n_taps,
+                     outer->n_taps,
+                     scaler->line,
+                     scaler->line_length);
+
+      for (i = 0; i < scaler->inner_size; i++, column += scaler->rowstride)
+        for (c = 0; c < scaler->n_channels; c++)
+          column[c] = scaler->line[i * scaler->n_channels + c];
+    }
+  else
+    vertical_pass (scaler->rows,
+                   outer->weights + o * outer->n_taps,
+                   outer->n_taps,
+                   scaler->pixels + (o - scaler->block_y) * scaler->rowstride,
+                   scaler->line_length);
+}
+
+/*
+ * Filters source row r if it is used and computes the destination lines
+ * which need no later source row. A slot of the ring is only reused for a
+ * row which is past all pending lines, as the lines start at increasing
+ * rows in the order they are computed.
+ */
+static gboolean
+scaler_push_row (HDPixbufScaler  *scaler,
+                 const guchar    *source_row,
+                 int              r,
+                 GError         **error)
+{
+  Filter *outer = &scaler->outer;
+
+  if (scaler->n_lines >= scaler->outer_size ||
+      r < outer->start[scaler_get_line (scaler, scaler->n_lines)])
+    return TRUE;
+
+  horizontal_pass (source_row,
+                   scaler->n_channels,
+                   &scaler->inner,
+                   scaler->inner_size,
+                   scaler->ring + (r % outer->n_taps) * scaler->line_length);
+
+  while (scaler->n_lines < scaler->outer_size)
+    {
+      int o = scaler_get_line (scaler, scaler->n_lines);
+
+      if (outer->start[o] + outer->n_taps - 1 > r)
+        break;
+
+      scaler_compute_line (scaler, o);
+      scaler->n_lines++;
+
+      /* Pass on full blocks and the last one */
+      if (scaler->rows_func && scaler->in_order &&
+          (o - scaler->block_y + 1 == LINES_PER_BLOCK ||
+           o == scaler->outer_size - 1) &&
+          !scaler_flush_block (scaler, o - scaler->block_y + 1, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Scales source by scale and renders it into destination, offset by
+ * offset_x and offset_y (usually negative to crop). orientation is an
+ * EXIF orientation (1-8) applied to source before scaling; offsets and
+ * scale are relative to the oriented source. Both pixbufs must have the
+ * same number of channels. Returns FALSE if cancellable was cancelled,
+ * destination is incomplete then.
+ */
+gboolean
+hd_pixbuf_scale (const GdkPixbuf  *source,
+                 GdkPixbuf        *destination,
+                 double            offset_x,
+                 double            offset_y,
+                 double            scale,
+                 guint             orientation,
+                 GCancellable     *cancellable,
+                 GError          **error)
+{
+  HDPixbufScaler scaler;
+  const guchar *source_pixels;
+  int source_rowstride, source_height, r;
+  gboolean result = TRUE;
+
+  g_return_val_if_fail (gdk_pixbuf_get_n_channels (source) ==
+                        gdk_pixbuf_get_n_channels (destination), FALSE);
+
+  source_pixels = gdk_pixbuf_get_pixels (source);
+  source_rowstride = gdk_pixbuf_get_rowstride (source);
+  source_height = gdk_pixbuf_get_height (source);
+
+  scaler_init (&scaler,
+               gdk_pixbuf_get_width (source),
+               source_height,
+               gdk_pixbuf_get_n_channels (source),
+               gdk_pixbuf_get_width (destination),
+               gdk_pixbuf_get_height (destination),
+               offset_x,
+               offset_y,
+               scale,
+               scale,
+               orientation);
+  scaler.pixels = gdk_pixbuf_get_pixels (destination);
+  scaler.rowstride = gdk_pixbuf_get_rowstride (destination);
+
+  for (r = 0; r < source_height && scaler.n_lines < scaler.outer_size; r++)
+    {
+      if (r % LINES_PER_BLOCK == 0 &&
+          g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          result = FALSE;
+          break;
+        }
+
+      scaler_push_row (&scaler,
+                       source_pixels + r * source_rowstride,
+                       r,
+                       NULL);
+    }
+
+  scaler_clear (&scaler);
+
+  return result;
+}
+
+/*
+ * Creates a scaler which scales like hd_pixbuf_scale, but from source rows
+ * passed in blocks with hd_pixbuf_scaler_push_rows (), for sources which
+ * are decoded incrementally, and with separate horizontal and vertical
+ * scales. The width x height destination is passed to rows_func in blocks
+ * of rows. Without flipped rows (orientations 1 and 2) each block is passed
+ * as soon as it is done and only a few rows are in memory, otherwise the
+ * destination is kept until hd_pixbuf_scaler_finish ().
+ */
+HDPixbufScaler *
+hd_pixbuf_scaler_new (int               source_width,
+                      int               source_height,
+                      int               n_channels,
+                      int               width,
+                      int               height,
+                      double            offset_x,
+                      double            offset_y,
+                      double            scale_x,
+                      double            scale_y,
+                      guint             orientation,
+                      HDPixbufRowsFunc  rows_func,
+                      gpointer          user_data)
+{
+  HDPixbufScaler *scaler = g_slice_new (HDPixbufScaler);
+
+  scaler_init (scaler,
+               source_width,
+               source_height,
+               n_channels,
+               width,
+               height,
+               offset_x,
+               offset_y,
+               scale_x,
+               scale_y,
+               orientation);
+
+  scaler->rows_func = rows_func;
+  scaler->user_data = user_data;
+  scaler->in_order = !scaler->transform->transpose && !scaler->outer_flip;
+
+  scaler->rowstride = width * n_channels;
+  scaler->pixels = g_try_malloc ((gsize) scaler->rowstride *
+                                 (scaler->in_order ? LINES_PER_BLOCK : height));
+  scaler->owns_pixels = TRUE;
+
+  if (!scaler->pixels)
+    {
+      hd_pixbuf_scaler_free (scaler);
+      return NULL;
+    }
+
+  return scaler;
+}
+
+/* Passes the next n_rows source rows, starting at source row y */
+gboolean
+hd_pixbuf_scaler_push_rows (HDPixbufScaler  *scaler,
+                            const guchar    *pixels,
+                            int              rowstride,
+                            int              y,
+                            int              n_rows,
+                            GError         **error)
+{
+  int i;
+
+  for (i = 0; i < n_rows; i++)
+    if (!scaler_push_row (scaler, pixels + i * rowstride, y + i, error))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Passes the rows kept until all source rows were pushed */
+gboolean
+hd_pixbuf_scaler_finish (HDPixbufScaler  *scaler,
+                         GError         **error)
+{
+  if (scaler->n_lines < scaler->outer_size)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Image is incomplete");
+      return FALSE;
+    }
+
+  if (scaler->in_order)
+    return TRUE;
+
+  while (scaler->block_y < scaler->height)
+    {
+      int n_rows = MIN (LINES_PER_BLOCK, scaler->height - scaler->block_y);
+      guchar *block = scaler->pixels + scaler->block_y * scaler->rowstride;
+
+      if (!scaler->rows_func (block,
+                              scaler->rowstride,
+                              scaler->block_y,
+                              n_rows,
+                              scaler->user_data,
+                              error))
+        return FALSE;
+
+      scaler->block_y += n_rows;
+    }
+
+  return TRUE;
+}
+
+void
+hd_pixbuf_scaler_free (HDPixbufScaler *scaler)
+{
+  if (!scaler)
+    return;
+
+  scaler_clear (scaler);
+
+  g_slice_free (HDPixbufScaler, scaler);
+}
@@ -0,0 +1,68 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_PIXBUF_SCALE_H__
+#define __HD_PIXBUF_SCALE_H__
+
+#include <gdk/gdk.h>
+#include <gio/gio.h>
+
+#include "hd-pixbuf-utils.h"
+
+G_BEGIN_DECLS
+
+typedef struct _HDPixbufScaler HDPixbufScaler;
+
+gboolean hd_pixbuf_scale (const GdkPixbuf  *source,
+                          GdkPixbuf        *destination,
+                          double            offset_x,
+                          double            offset_y,
+                          double            scale,
+                          guint             orientation,
+                          GCancellable     *cancellable,
+                          GError          **error);
+
+HDPixbufScaler *hd_pixbuf_scaler_new       (int               source_width,
+                                            int               source_height,
+                                            int               n_channels,
+                                            int               width,
+                                            int               height,
+                                            double            offset_x,
+                                            double            offset_y,
+                                            double            scale_x,
+                                            double            scale_y,
+                                            guint             orientation,
+                                            HDPixbufRowsFunc  rows_func,
+                                            gpointer          user_data);
+gboolean        hd_pixbuf_scaler_push_rows (HDPixbufScaler   *scaler,
+                                            const guchar     *pixels,
+                                            int               rowstride,
+                                            int               y,
+                                            int               n_rows,
+                                            GError          **error);
+gboolean        hd_pixbuf_scaler_finish    (HDPixbufScaler   *scaler,
+                                            GError          **error);
+void            hd_pixbuf_scaler_free      (HDPixbufScaler   *scaler);
+
+G_END_DECLS
+
+#endif
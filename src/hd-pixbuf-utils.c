@@ -24,8 +24,21 @@
 #include <config.h>
 #endif
 
+#include <stdlib.h>
+
+#include "hd-background-stats.h"
+#include "hd-pixbuf-scale.h"
+
 #include "hd-pixbuf-utils.h"
 
+#ifdef HAVE_LIBJPEG
+#include "hd-jpeg-loader.h"
+#endif
+
+#ifdef HAVE_LIBPNG
+#include "hd-png-loader.h"
+#endif
+
 /*
  * Background image should be resized and cropped. That means the image
  * is centered and scaled to make sure the shortest side fit the home 
@@ -73,16 +86,47 @@ size_prepared_cb (GdkPixbufLoader *loader,
   gdk_pixbuf_loader_set_size (loader, image_size.width, image_size.height);
 }
 
+static guint
+get_embedded_orientation (GdkPixbuf *pixbuf)
+{
+  const gchar *value;
+
+  value = gdk_pixbuf_get_option (pixbuf, "orientation");
+  if (!value)
+    return 1;
+
+  return CLAMP (atoi (value), 1, 8);
+}
+
+/*
+ * Scales and crops source to destination_size with the embedded
+ * orientation applied, without a rotated copy of source.
+ */
 static GdkPixbuf *
-scale_and_crop_pixbuf (const GdkPixbuf *source,
-                       HDImageSize     *destination_size)
+scale_and_crop_pixbuf (GdkPixbuf     *source,
+                       HDImageSize   *destination_size,
+                       GCancellable  *cancellable,
+                       GError       **error)
 {
   HDImageSize image_size;
+  guint orientation;
   double scale;
   GdkPixbuf *pixbuf;
+  gboolean result;
 
-  image_size.width = gdk_pixbuf_get_width (source);
-  image_size.height = gdk_pixbuf_get_height (source);
+  orientation = get_embedded_orientation (source);
+
+  /* Orientations 5-8 swap width and height */
+  if (orientation >= 5)
+    {
+      image_size.width = gdk_pixbuf_get_height (source);
+      image_size.height = gdk_pixbuf_get_width (source);
+    }
+  else
+    {
+      image_size.width = gdk_pixbuf_get_width (source);
+      image_size.height = gdk_pixbuf_get_height (source);
+    }
 
   scale = get_scale_for_aspect_ratio (&image_size, destination_size);
 
@@ -92,16 +136,22 @@ scale_and_crop_pixbuf (const GdkPixbuf *source,
                            destination_size->width,
                            destination_size->height);
 
-  gdk_pixbuf_scale (source,
-                    pixbuf,
-                    0, 0,
-                    destination_size->width,
-                    destination_size->height,
-                    - (image_size.width * scale - destination_size->width) / 2,
-                    - (image_size.height * scale - destination_size->height) / 2,
-                    scale,
-                    scale,
-                    GDK_INTERP_BILINEAR);
+  hd_background_stats_push (HD_BACKGROUND_STAGE_SCALE);
+  result = hd_pixbuf_scale (source,
+                            pixbuf,
+                            - (image_size.width * scale - destination_size->width) / 2,
+                            - (image_size.height * scale - destination_size->height) / 2,
+                            scale,
+                            orientation,
+                            cancellable,
+                            error);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_SCALE);
+
+  if (!result)
+    {
+      g_object_unref (pixbuf);
+      return NULL;
+    }
 
   return pixbuf;
 }
@@ -118,11 +168,13 @@ read_from_input_stream_into_pixbuf_loader (GInputStream     *stream,
   /* Parse input stream into the loader */
   do
     {
+      hd_background_stats_push (HD_BACKGROUND_STAGE_READ);
       read_bytes = g_input_stream_read (stream,
                                         buffer,
                                         sizeof (buffer),
                                         cancellable,
                                         error);
+      hd_background_stats_pop (HD_BACKGROUND_STAGE_READ);
       if (read_bytes < 0)
         {
           gdk_pixbuf_loader_close (loader, NULL);
@@ -132,7 +184,8 @@ read_from_input_stream_into_pixbuf_loader (GInputStream     *stream,
       if (!gdk_pixbuf_loader_write (loader,
                                     buffer,
                                     read_bytes,
-                                    error))
+                                    error) ||
+          g_cancellable_set_error_if_cancelled (cancellable, error))
         {
           gdk_pixbuf_loader_close (loader, NULL);
           return FALSE;
@@ -173,16 +226,352 @@ get_etag_from_file_input_stream (GFileInputStream  *stream,
   return TRUE;
 }
 
+#ifdef HAVE_LIBJPEG
+static gboolean
+is_jpeg_stream (GBufferedInputStream *stream,
+                GCancellable         *cancellable)
+{
+  const guchar *data;
+  gsize length;
+
+  /* Read errors are reported by the loader afterwards */
+  if (g_buffered_input_stream_fill (stream, 2, cancellable, NULL) < 0)
+    return FALSE;
+
+  data = g_buffered_input_stream_peek_buffer (stream, &length);
+
+  return hd_jpeg_loader_is_jpeg (data, length);
+}
+#endif
+
+#ifdef HAVE_LIBPNG
+static gboolean
+is_png_stream (GBufferedInputStream *stream,
+               GCancellable         *cancellable)
+{
+  const guchar *data;
+  gsize length;
+
+  /* Read errors are reported by the loader afterwards */
+  if (g_buffered_input_stream_fill (stream, 8, cancellable, NULL) < 0)
+    return FALSE;
+
+  data = g_buffered_input_stream_peek_buffer (stream, &length);
+
+  return hd_png_loader_is_png (data, length);
+}
+#endif
+
+/* Loads file at least as big as needed to cover size */
+static GdkPixbuf *
+load_source (GFile         *file,
+             HDImageSize   *size,
+             char         **etag,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  GFileInputStream *stream = NULL;
+  GInputStream *buffered_stream = NULL;
+  GdkPixbufLoader *loader = NULL;
+  GdkPixbuf *source = NULL;
+
+  /* Open file for read */
+  stream = g_file_read (file, cancellable, error);
+
+  if (!stream)
+    goto cleanup;
+
+  if (!get_etag_from_file_input_stream (stream,
+                                        etag,
+                                        cancellable,
+                                        error))
+    goto cleanup;
+
+  /* Buffer the stream to be able to sniff the image type */
+  buffered_stream = g_buffered_input_stream_new (G_INPUT_STREAM (stream));
+
+#ifdef HAVE_LIBJPEG
+  /* JPEG images are decoded downscaled in the DCT domain */
+  if (is_jpeg_stream (G_BUFFERED_INPUT_STREAM (buffered_stream),
+                      cancellable))
+    {
+      source = hd_jpeg_loader_load_scaled (buffered_stream,
+                                           size,
+                                           cancellable,
+                                           error);
+      if (!source)
+        goto cleanup;
+
+      if (!g_input_stream_close (buffered_stream,
+                                 cancellable,
+                                 error))
+        source = (g_object_unref (source), NULL);
+    }
+  else
+#endif
+    {
+      /* Create pixbuf loader */
+      loader = gdk_pixbuf_loader_new ();
+      g_signal_connect (loader, "size-prepared",
+                        G_CALLBACK (size_prepared_cb),
+                        size);
+
+      if (!read_from_input_stream_into_pixbuf_loader (buffered_stream,
+                                                      loader,
+                                                      cancellable,
+                                                      error))
+        goto cleanup;
+
+      source = gdk_pixbuf_loader_get_pixbuf (loader);
+      if (!source)
+        {
+          g_set_error_literal (error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_FAILED,
+                               "NULL Pixbuf returned from loader");
+          goto cleanup;
+        }
+
+      g_object_ref (source);
+    }
+
+cleanup:
+  if (buffered_stream)
+    g_object_unref (buffered_stream);
+  if (stream)
+    g_object_unref (stream);
+  if (loader)
+    g_object_unref (loader);
+
+  return source;
+}
+
 GdkPixbuf *
 hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
                                          HDImageSize   *size,
                                          char         **etag,
                                          GCancellable  *cancellable,
                                          GError       **error)
+{
+  GdkPixbuf *source, *pixbuf = NULL;
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_DECODE);
+
+  source = load_source (file,
+                        size,
+                        etag,
+                        cancellable,
+                        error);
+
+  /* Set resulting pixbuf */
+  if (source)
+    {
+      pixbuf = scale_and_crop_pixbuf (source,
+                                      size,
+                                      cancellable,
+                                      error);
+      g_object_unref (source);
+    }
+
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_DECODE);
+
+  return pixbuf;
+}
+
+/*
+ * Scales source to fit into size with the aspect ratio kept and the
+ * embedded orientation applied. Smaller images are not scaled up.
+ */
+GdkPixbuf *
+hd_pixbuf_utils_scale_to_fit (GdkPixbuf     *source,
+                              HDImageSize   *size,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  HDImageSize image_size;
+  guint orientation;
+  double scale;
+  GdkPixbuf *pixbuf;
+
+  orientation = get_embedded_orientation (source);
+
+  /* Orientations 5-8 swap width and height */
+  if (orientation >= 5)
+    {
+      image_size.width = gdk_pixbuf_get_height (source);
+      image_size.height = gdk_pixbuf_get_width (source);
+    }
+  else
+    {
+      image_size.width = gdk_pixbuf_get_width (source);
+      image_size.height = gdk_pixbuf_get_height (source);
+    }
+
+  scale = MIN ((double) size->width / image_size.width,
+               (double) size->height / image_size.height);
+  scale = MIN (scale, 1.);
+
+  pixbuf = gdk_pixbuf_new (gdk_pixbuf_get_colorspace (source),
+                           gdk_pixbuf_get_has_alpha (source),
+                           gdk_pixbuf_get_bits_per_sample (source),
+                           MAX (1, (int) (image_size.width * scale + .5)),
+                           MAX (1, (int) (image_size.height * scale + .5)));
+
+  if (!hd_pixbuf_scale (source,
+                        pixbuf,
+                        0, 0,
+                        scale,
+                        orientation,
+                        cancellable,
+                        error))
+    {
+      g_object_unref (pixbuf);
+      return NULL;
+    }
+
+  return pixbuf;
+}
+
+/*
+ * Loads file scaled to fit into size, like a thumbnail. JPEG images are
+ * decoded downscaled in the DCT domain.
+ */
+GdkPixbuf *
+hd_pixbuf_utils_load_scaled (GFile         *file,
+                             HDImageSize   *size,
+                             char         **etag,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  GdkPixbuf *source, *pixbuf = NULL;
+
+  source = load_source (file,
+                        size,
+                        etag,
+                        cancellable,
+                        error);
+
+  if (source)
+    {
+      pixbuf = hd_pixbuf_utils_scale_to_fit (source,
+                                             size,
+                                             cancellable,
+                                             error);
+      g_object_unref (source);
+    }
+
+  return pixbuf;
+}
+
+typedef struct
+{
+  HDImageSize *size;
+  HDPixbufRowsFunc rows_func;
+  gpointer user_data;
+
+  /* NULL if the decoded rows are passed as they are */
+  HDPixbufScaler *scaler;
+} LoadRowsData;
+
+/* Sets up the scale of the decoded image to exactly size */
+static gboolean
+load_rows_size_cb (int            width,
+                   int            height,
+                   guint          orientation,
+                   LoadRowsData  *data,
+                   GError       **error)
+{
+  HDImageSize image_size;
+
+  if (orientation == 1 &&
+      width == data->size->width &&
+      height == data->size->height)
+    return TRUE;
+
+  /* Orientations 5-8 swap width and height */
+  if (orientation >= 5)
+    {
+      image_size.width = height;
+      image_size.height = width;
+    }
+  else
+    {
+      image_size.width = width;
+      image_size.height = height;
+    }
+
+  data->scaler = hd_pixbuf_scaler_new (width,
+                                       height,
+                                       3,
+                                       data->size->width,
+                                       data->size->height,
+                                       0,
+                                       0,
+                                       (double) data->size->width / image_size.width,
+                                       (double) data->size->height / image_size.height,
+                                       orientation,
+                                       data->rows_func,
+                                       data->user_data);
+  if (!data->scaler)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                           "Insufficient memory to load image, try exiting some applications to free memory");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+load_rows_cb (const guchar  *pixels,
+              int            rowstride,
+              int            y,
+              int            n_rows,
+              LoadRowsData  *data,
+              GError       **error)
+{
+  gboolean result;
+
+  if (!data->scaler)
+    return data->rows_func (pixels, rowstride, y, n_rows, data->user_data, error);
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_SCALE);
+  result = hd_pixbuf_scaler_push_rows (data->scaler,
+                                       pixels,
+                                       rowstride,
+                                       y,
+                                       n_rows,
+                                       error);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_SCALE);
+
+  return result;
+}
+
+/*
+ * Decodes file scaled to exactly size and passes the rows in blocks to
+ * rows_func, so the whole image is never in memory. The decoded rows are
+ * scaled as they come, only images with EXIF orientations 3-8 keep the
+ * scaled result until the end. Fails with G_IO_ERROR_NOT_SUPPORTED before
+ * any row is passed if the image cannot be decoded that way, callers
+ * should fall back to hd_pixbuf_utils_load_at_size then.
+ */
+gboolean
+hd_pixbuf_utils_load_rows_at_size (GFile             *file,
+                                   HDImageSize       *size,
+                                   char             **etag,
+                                   HDPixbufRowsFunc   rows_func,
+                                   gpointer           user_data,
+                                   GCancellable      *cancellable,
+                                   GError           **error)
 {
   GFileInputStream *stream = NULL;
-  GdkPixbufLoader *loader = NULL;
-  GdkPixbuf *pixbuf = NULL;
+  GInputStream *buffered_stream = NULL;
+  LoadRowsData data = { size, rows_func, user_data, NULL };
+  gboolean result = FALSE;
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_DECODE);
 
   /* Open file for read */
   stream = g_file_read (file, cancellable, error);
@@ -190,81 +579,201 @@ hd_pixbuf_utils_load_scaled_and_cropped (GFile         *file,
   if (!stream)
     goto cleanup;
 
-  /* Create pixbuf loader */
-  loader = gdk_pixbuf_loader_new ();
-  g_signal_connect (loader, "size-prepared",
-                    G_CALLBACK (size_prepared_cb),
-                    size);
-
   if (!get_etag_from_file_input_stream (stream,
                                         etag,
                                         cancellable,
                                         error))
     goto cleanup;
 
-  if (!read_from_input_stream_into_pixbuf_loader (G_INPUT_STREAM (stream),
-                                                  loader,
-                                                  cancellable,
-                                                  error))
-    goto cleanup;
+  /* Buffer the stream to be able to sniff the image type */
+  buffered_stream = g_buffered_input_stream_new (G_INPUT_STREAM (stream));
+
+#ifdef HAVE_LIBJPEG
+  if (is_jpeg_stream (G_BUFFERED_INPUT_STREAM (buffered_stream),
+                      cancellable))
+    result = hd_jpeg_loader_load_rows (buffered_stream,
+                                       size,
+                                       (HDPixbufSizeFunc) load_rows_size_cb,
+                                       (HDPixbufRowsFunc) load_rows_cb,
+                                       &data,
+                                       cancellable,
+                                       error);
+  else
+#endif
+#ifdef HAVE_LIBPNG
+  if (is_png_stream (G_BUFFERED_INPUT_STREAM (buffered_stream),
+                     cancellable))
+    result = hd_png_loader_load_rows (buffered_stream,
+                                      (HDPixbufSizeFunc) load_rows_size_cb,
+                                      (HDPixbufRowsFunc) load_rows_cb,
+                                      &data,
+                                      cancellable,
+                                      error);
+  else
+#endif
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_SUPPORTED,
+                           "Image cannot be decoded in rows");
+      goto cleanup;
+    }
 
-  /* Set resulting pixbuf */
-  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
-  if (pixbuf)
+  /* Pass the rows kept by the scaler */
+  if (result && data.scaler)
     {
-      GdkPixbuf *rotated = gdk_pixbuf_apply_embedded_orientation (pixbuf);
-      pixbuf = scale_and_crop_pixbuf (rotated, size);
-      g_object_unref (rotated);
+      hd_background_stats_push (HD_BACKGROUND_STAGE_SCALE);
+      result = hd_pixbuf_scaler_finish (data.scaler, error);
+      hd_background_stats_pop (HD_BACKGROUND_STAGE_SCALE);
     }
-  else
-    g_set_error_literal (error,
-                         GDK_PIXBUF_ERROR,
-                         GDK_PIXBUF_ERROR_FAILED,
-                         "NULL Pixbuf returned from loader");
+
+  if (result)
+    result = g_input_stream_close (buffered_stream,
+                                   cancellable,
+                                   error);
 
 cleanup:
+  hd_pixbuf_scaler_free (data.scaler);
+  if (buffered_stream)
+    g_object_unref (buffered_stream);
   if (stream)
     g_object_unref (stream);
-  if (loader)
-    g_object_unref (loader);
 
-  return pixbuf;
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_DECODE);
+
+  return result;
+}
+
+typedef struct
+{
+  GOutputStream *stream;
+  GCancellable *cancellable;
+} SaveToStreamData;
+
+static gboolean
+save_to_output_stream (const gchar       *buffer,
+                       gsize              count,
+                       GError           **error,
+                       SaveToStreamData  *data)
+{
+  gboolean result;
+
+  if (g_cancellable_set_error_if_cancelled (data->cancellable, error))
+    return FALSE;
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_WRITE);
+  result = g_output_stream_write_all (data->stream,
+                                      buffer,
+                                      count,
+                                      NULL,
+                                      data->cancellable,
+                                      error);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_WRITE);
+
+  return result;
+}
+
+/*
+ * Encodes pixbuf directly into stream, without the whole encoded image
+ * in memory. compression is the zlib compression level (0-9) for PNG, or
+ * -1 for the default of the encoder. The stream is not closed.
+ */
+gboolean
+hd_pixbuf_utils_save_to_stream (GOutputStream  *stream,
+                                GdkPixbuf      *pixbuf,
+                                const gchar    *type,
+                                gint            compression,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  SaveToStreamData data;
+  gboolean result;
+
+  data.stream = stream;
+  data.cancellable = cancellable;
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_ENCODE);
+
+  if (compression >= 0 && g_str_equal (type, "png"))
+    {
+      gchar *value = g_strdup_printf ("%d", MIN (compression, 9));
+
+      result = gdk_pixbuf_save_to_callback (pixbuf,
+                                            (GdkPixbufSaveFunc) save_to_output_stream,
+                                            &data,
+                                            type,
+                                            error,
+                                            "compression", value,
+                                            NULL);
+      g_free (value);
+    }
+  else
+    result = gdk_pixbuf_save_to_callback (pixbuf,
+                                          (GdkPixbufSaveFunc) save_to_output_stream,
+                                          &data,
+                                          type,
+                                          error,
+                                          NULL);
+
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_ENCODE);
+
+  return result;
 }
 
 gboolean
 hd_pixbuf_utils_save (GFile         *file,
                       GdkPixbuf     *pixbuf,
                       const gchar   *type,
+                      gint           compression,
                       GCancellable  *cancellable,
                       GError       **error)
 {
-  gchar *buffer = NULL;
-  gsize buffer_size;
+  GFileOutputStream *stream;
   gboolean result;
 
-  if (!gdk_pixbuf_save_to_buffer (pixbuf,
-                                  &buffer,
-                                  &buffer_size,
-                                  type,
-                                  error,
-                                  NULL))
+  stream = g_file_replace (file,
+                           NULL,
+                           FALSE,
+                           G_FILE_CREATE_NONE,
+                           cancellable,
+                           error);
+  if (!stream)
     return FALSE;
 
-  result = g_file_replace_contents (file,
-                                    buffer,
-                                    buffer_size,
-                                    NULL,
-                                    FALSE,
-                                    G_FILE_CREATE_NONE,
-                                    NULL,
+  result = hd_pixbuf_utils_save_to_stream (G_OUTPUT_STREAM (stream),
+                                           pixbuf,
+                                           type,
+                                           compression,
+                                           cancellable,
+                                           error);
+
+  if (result)
+    result = g_output_stream_close (G_OUTPUT_STREAM (stream),
                                     cancellable,
                                     error);
+  else
+    hd_pixbuf_utils_abort_output_stream (G_OUTPUT_STREAM (stream));
 
-  g_free (buffer);
+  g_object_unref (stream);
 
   return result;
 }
 
+/*
+ * Closes a stream returned by g_file_replace without replacing the
+ * original file.
+ */
+void
+hd_pixbuf_utils_abort_output_stream (GOutputStream *stream)
+{
+  GCancellable *cancellable = g_cancellable_new ();
+
+  g_cancellable_cancel (cancellable);
+  g_output_stream_close (stream, cancellable, NULL);
+
+  g_object_unref (cancellable);
+}
+
 static void
 size_prepared_exact_cb (GdkPixbufLoader *loader,
                         gint             width,
@@ -296,6 +805,8 @@ hd_pixbuf_utils_load_at_size (GFile         *file,
   GdkPixbufLoader *loader = NULL;
   GdkPixbuf *pixbuf = NULL;
 
+  hd_background_stats_push (HD_BACKGROUND_STAGE_DECODE);
+
   stream = g_file_read (file, cancellable, error);
 
   if (!stream)
@@ -338,5 +849,7 @@ cleanup:
   if (loader)
     g_object_unref (loader);
 
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_DECODE);
+
   return pixbuf;
 }
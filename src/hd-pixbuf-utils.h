@@ -24,6 +24,7 @@
 #define __HD_BACKGROUND_UTILS_H__
 
 #include <gdk/gdk.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -33,23 +34,69 @@ typedef struct
   int height;
 } HDImageSize;
 
+/* Called with the size of the decoded image and its EXIF orientation before
+ * the first row. Should set error when returning FALSE. */
+typedef gboolean (*HDPixbufSizeFunc) (int            width,
+                                      int            height,
+                                      guint          orientation,
+                                      gpointer       user_data,
+                                      GError       **error);
+
+/* Called with blocks of n_rows RGB rows starting at row y. Should set
+ * error when returning FALSE to abort the loading. */
+typedef gboolean (*HDPixbufRowsFunc) (const guchar  *pixels,
+                                      int            rowstride,
+                                      int            y,
+                                      int            n_rows,
+                                      gpointer       user_data,
+                                      GError       **error);
+
 GdkPixbuf *hd_pixbuf_utils_load_at_size (GFile         *file,
                                          HDImageSize   *size,
                                          char         **etag,
                                          GCancellable  *cancellable,
                                          GError       **error);
 
+gboolean   hd_pixbuf_utils_load_rows_at_size (GFile             *file,
+                                              HDImageSize       *size,
+                                              char             **etag,
+                                              HDPixbufRowsFunc   rows_func,
+                                              gpointer           user_data,
+                                              GCancellable      *cancellable,
+                                              GError           **error);
+
 GdkPixbuf *hd_pixbuf_utils_load_scaled_and_cropped  (GFile         *file,
                                                      HDImageSize   *size,
                                                      char         **etag,
                                                      GCancellable  *cancellable,
                                                      GError       **error);
 
+GdkPixbuf *hd_pixbuf_utils_load_scaled              (GFile         *file,
+                                                     HDImageSize   *size,
+                                                     char         **etag,
+                                                     GCancellable  *cancellable,
+                                                     GError       **error);
+
+GdkPixbuf *hd_pixbuf_utils_scale_to_fit             (GdkPixbuf     *source,
+                                                     HDImageSize   *size,
+                                                     GCancellable  *cancellable,
+                                                     GError       **error);
+
 gboolean   hd_pixbuf_utils_save                     (GFile         *file,
                                                      GdkPixbuf     *pixbuf,
                                                      const gchar   *type,
+                                                     gint           compression,
                                                      GCancellable  *cancellable,
                                                      GError       **error);
+
+gboolean   hd_pixbuf_utils_save_to_stream           (GOutputStream *stream,
+                                                     GdkPixbuf     *pixbuf,
+                                                     const gchar   *type,
+                                                     gint           compression,
+                                                     GCancellable  *cancellable,
+                                                     GError       **error);
+
+void       hd_pixbuf_utils_abort_output_stream      (GOutputStream *stream);
 G_END_DECLS
 
 #endif
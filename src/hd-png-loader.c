@@ -0,0 +1,286 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <png.h>
+
+#include "hd-background-stats.h"
+
+#include "hd-png-loader.h"
+
+/*
+ * PNG loader which passes the rows as libpng decodes them, with the
+ * progressive reader fed from the stream. Only images which can be passed
+ * as final RGB rows are supported: interlaced images are only complete
+ * after the last pass and the alpha channel of transparent ones would be
+ * lost, so they are left to GdkPixbuf.
+ */
+
+#define BUFFER_SIZE 8192
+
+/* Number of rows passed at once by hd_png_loader_load_rows */
+#define ROWS_PER_BLOCK 16
+
+typedef struct
+{
+  png_structp png;
+  png_infop info;
+
+  HDPixbufSizeFunc size_func;
+  HDPixbufRowsFunc rows_func;
+  gpointer user_data;
+
+  /* Rows decoded since the last call of rows_func */
+  guchar *block;
+  int rowstride;
+  int height;
+  int block_y;
+
+  gboolean done;
+
+  /* Error of the PNG decoder, the stream or the callbacks */
+  GError *error;
+} PngLoader;
+
+static void
+png_error_cb (png_structp      png,
+              png_const_charp  message)
+{
+  PngLoader *loader = png_get_error_ptr (png);
+
+  /* Errors of the stream and the callbacks are already set */
+  if (!loader->error)
+    g_set_error (&loader->error,
+                 GDK_PIXBUF_ERROR,
+                 GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                 "Error interpreting PNG image file (%s)",
+                 message);
+
+  longjmp (png_jmpbuf (png), 1);
+}
+
+static void
+png_warning_cb (png_structp      png,
+                png_const_charp  message)
+{
+}
+
+static void
+png_info_cb (png_structp png,
+             png_infop   info)
+{
+  PngLoader *loader = png_get_progressive_ptr (png);
+  png_uint_32 width, height;
+  int bit_depth, color_type, interlace_type;
+
+  png_get_IHDR (png, info,
+                &width, &height,
+                &bit_depth, &color_type, &interlace_type,
+                NULL, NULL);
+
+  if (interlace_type != PNG_INTERLACE_NONE ||
+      (color_type & PNG_COLOR_MASK_ALPHA) ||
+      png_get_valid (png, info, PNG_INFO_tRNS))
+    {
+      g_set_error_literal (&loader->error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_NOT_SUPPORTED,
+                           "Image cannot be decoded in rows");
+      png_error (png, "Not supported");
+    }
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_palette_to_rgb (png);
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+    png_set_expand_gray_1_2_4_to_8 (png);
+  if (color_type == PNG_COLOR_TYPE_GRAY)
+    png_set_gray_to_rgb (png);
+  if (bit_depth == 16)
+    png_set_strip_16 (png);
+
+  png_read_update_info (png, info);
+
+  if (!loader->size_func (width,
+                          height,
+                          1,
+                          loader->user_data,
+                          &loader->error))
+    png_error (png, "Aborted");
+
+  loader->rowstride = width * 3;
+  loader->height = height;
+  loader->block = g_try_malloc (loader->rowstride * ROWS_PER_BLOCK);
+  if (!loader->block)
+    {
+      g_set_error (&loader->error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                   "Insufficient memory to load image, try exiting some applications to free memory");
+      png_error (png, "Out of memory");
+    }
+}
+
+static void
+png_row_cb (png_structp  png,
+            png_bytep    new_row,
+            png_uint_32  row_num,
+            int          pass)
+{
+  PngLoader *loader = png_get_progressive_ptr (png);
+  int n_rows;
+
+  /* Without interlacing each row is passed once, in order */
+  if (!new_row)
+    return;
+
+  memcpy (loader->block + (row_num - loader->block_y) * loader->rowstride,
+          new_row,
+          loader->rowstride);
+
+  n_rows = row_num - loader->block_y + 1;
+  if (n_rows < ROWS_PER_BLOCK && (int) row_num < loader->height - 1)
+    return;
+
+  if (!loader->rows_func (loader->block,
+                          loader->rowstride,
+                          loader->block_y,
+                          n_rows,
+                          loader->user_data,
+                          &loader->error))
+    png_error (png, "Aborted");
+
+  loader->block_y += n_rows;
+}
+
+static void
+png_end_cb (png_structp png,
+            png_infop   info)
+{
+  PngLoader *loader = png_get_progressive_ptr (png);
+
+  loader->done = TRUE;
+}
+
+gboolean
+hd_png_loader_is_png (const guchar *data,
+                      gsize         length)
+{
+  return length >= 8 && !png_sig_cmp ((png_bytep) data, 0, 8);
+}
+
+/*
+ * Decodes the PNG image from stream in blocks of RGB rows and passes them
+ * to rows_func, without the whole image in memory. size_func gets the size
+ * of the image before the first row. Interlaced and transparent images fail
+ * with G_IO_ERROR_NOT_SUPPORTED before any row is decoded.
+ */
+gboolean
+hd_png_loader_load_rows (GInputStream      *stream,
+                         HDPixbufSizeFunc   size_func,
+                         HDPixbufRowsFunc   rows_func,
+                         gpointer           user_data,
+                         GCancellable      *cancellable,
+                         GError           **error)
+{
+  PngLoader *loader;
+  guchar buffer[BUFFER_SIZE];
+  gboolean result = FALSE;
+
+  loader = g_slice_new0 (PngLoader);
+  loader->size_func = size_func;
+  loader->rows_func = rows_func;
+  loader->user_data = user_data;
+
+  loader->png = png_create_read_struct (PNG_LIBPNG_VER_STRING,
+                                        loader,
+                                        png_error_cb,
+                                        png_warning_cb);
+  if (loader->png)
+    loader->info = png_create_info_struct (loader->png);
+
+  if (!loader->info)
+    {
+      g_set_error (&loader->error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                   "Insufficient memory to load image, try exiting some applications to free memory");
+      goto cleanup;
+    }
+
+  if (setjmp (png_jmpbuf (loader->png)))
+    goto cleanup;
+
+  png_set_progressive_read_fn (loader->png,
+                               loader,
+                               png_info_cb,
+                               png_row_cb,
+                               png_end_cb);
+
+  while (!loader->done)
+    {
+      gssize read_bytes;
+
+      hd_background_stats_push (HD_BACKGROUND_STAGE_READ);
+      read_bytes = g_input_stream_read (stream,
+                                        buffer,
+                                        BUFFER_SIZE,
+                                        cancellable,
+                                        &loader->error);
+      hd_background_stats_pop (HD_BACKGROUND_STAGE_READ);
+
+      /* Read errors and cancellation abort the decoding */
+      if (read_bytes < 0)
+        goto cleanup;
+
+      if (read_bytes == 0)
+        {
+          g_set_error_literal (&loader->error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                               "Premature end of PNG image file");
+          goto cleanup;
+        }
+
+      png_process_data (loader->png, loader->info, buffer, read_bytes);
+    }
+
+  result = TRUE;
+
+cleanup:
+  if (loader->png)
+    png_destroy_read_struct (&loader->png,
+                             loader->info ? &loader->info : NULL,
+                             NULL);
+
+  if (loader->error)
+    g_propagate_error (error, loader->error);
+
+  g_free (loader->block);
+  g_slice_free (PngLoader, loader);
+
+  return result;
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_PNG_LOADER_H__
+#define __HD_PNG_LOADER_H__
+
+#include <gdk/gdk.h>
+#include <gio/gio.h>
+
+#include "hd-pixbuf-utils.h"
+
+G_BEGIN_DECLS
+
+gboolean   hd_png_loader_is_png        (const guchar  *data,
+                                        gsize          length);
+
+gboolean   hd_png_loader_load_rows     (GInputStream      *stream,
+                                        HDPixbufSizeFunc   size_func,
+                                        HDPixbufRowsFunc   rows_func,
+                                        gpointer           user_data,
+                                        GCancellable      *cancellable,
+                                        GError           **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+
+#include "hd-background-stats.h"
+#include "hd-raw-image.h"
+
+/* Number of rows converted and written at once */
+#define ROWS_PER_BLOCK 16
+
+struct _HDRawImage
+{
+  GMappedFile *mapped_file;
+  const HDRawImageHeader *header;
+};
+
+/* Multiply and divide by 255 with rounding */
+#define MUL_UN8(a, b) (((a) * (b) + 127) / 255)
+
+static guint
+get_bytes_per_pixel (HDRawImageFormat format)
+{
+  return format == HD_RAW_IMAGE_FORMAT_ARGB32 ? 4 : 2;
+}
+
+static void
+convert_row (const guchar     *src,
+             int               n_channels,
+             int               width,
+             HDRawImageFormat  format,
+             guchar           *dest)
+{
+  int x;
+
+  for (x = 0; x < width; x++, src += n_channels)
+    {
+      guint a = n_channels == 4 ? src[3] : 0xff;
+      guint r = MUL_UN8 (src[0], a);
+      guint g = MUL_UN8 (src[1], a);
+      guint b = MUL_UN8 (src[2], a);
+
+      if (format == HD_RAW_IMAGE_FORMAT_ARGB32)
+        ((guint32 *) dest)[x] = (a << 24) | (r << 16) | (g << 8) | b;
+      else
+        ((guint16 *) dest)[x] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    }
+}
+
+static guint32
+get_stride (HDRawImageFormat format,
+            int              width)
+{
+  /* Rows are 4 byte aligned as cairo expects */
+  return (width * get_bytes_per_pixel (format) + 3) & ~3;
+}
+
+/*
+ * Writes the header page of a width x height image to stream. The rows
+ * need to be written with hd_raw_image_write_rows afterwards.
+ */
+gboolean
+hd_raw_image_write_header (GOutputStream     *stream,
+                           HDRawImageFormat   format,
+                           int                width,
+                           int                height,
+                           GCancellable      *cancellable,
+                           GError           **error)
+{
+  HDRawImageHeader *header;
+  guchar *buffer;
+  guint32 data_offset;
+  gboolean result;
+
+  data_offset = MAX (sysconf (_SC_PAGESIZE), (long) sizeof (HDRawImageHeader));
+
+  buffer = g_malloc0 (data_offset);
+
+  header = (HDRawImageHeader *) buffer;
+  memcpy (header->magic, HD_RAW_IMAGE_MAGIC, sizeof (header->magic));
+  header->version = HD_RAW_IMAGE_VERSION;
+  header->format = format;
+  header->width = width;
+  header->height = height;
+  header->stride = get_stride (format, width);
+  header->data_offset = data_offset;
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_WRITE);
+  result = g_output_stream_write_all (stream,
+                                      buffer,
+                                      data_offset,
+                                      NULL,
+                                      cancellable,
+                                      error);
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_WRITE);
+
+  g_free (buffer);
+
+  return result;
+}
+
+/*
+ * Converts n_rows rows of RGB or RGBA pixels and writes them to stream
+ * in blocks of rows.
+ */
+gboolean
+hd_raw_image_write_rows (GOutputStream     *stream,
+                         HDRawImageFormat   format,
+                         int                width,
+                         const guchar      *pixels,
+                         int                rowstride,
+                         int                n_channels,
+                         int                n_rows,
+                         GCancellable      *cancellable,
+                         GError           **error)
+{
+  guchar *buffer;
+  guint32 stride;
+  gboolean result = TRUE;
+  int y;
+
+  stride = get_stride (format, width);
+
+  hd_background_stats_push (HD_BACKGROUND_STAGE_ENCODE);
+
+  buffer = g_malloc0 (stride * MIN (ROWS_PER_BLOCK, n_rows));
+
+  for (y = 0; result && y < n_rows; y += ROWS_PER_BLOCK)
+    {
+      int n_block_rows = MIN (ROWS_PER_BLOCK, n_rows - y);
+      int i;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          result = FALSE;
+          break;
+        }
+
+      for (i = 0; i < n_block_rows; i++)
+        convert_row (pixels + (y + i) * rowstride,
+                     n_channels,
+                     width,
+                     format,
+                     buffer + i * stride);
+
+      hd_background_stats_push (HD_BACKGROUND_STAGE_WRITE);
+      result = g_output_stream_write_all (stream,
+                                          buffer,
+                                          stride * n_block_rows,
+                                          NULL,
+                                          cancellable,
+                                          error);
+      hd_background_stats_pop (HD_BACKGROUND_STAGE_WRITE);
+    }
+
+  g_free (buffer);
+
+  hd_background_stats_pop (HD_BACKGROUND_STAGE_ENCODE);
+
+  return result;
+}
+
+/*
+ * Writes pixbuf to stream in blocks of rows. The stream is not closed.
+ */
+gboolean
+hd_raw_image_save_to_stream (GOutputStream     *stream,
+                             GdkPixbuf         *pixbuf,
+                             HDRawImageFormat   format,
+                             GCancellable      *cancellable,
+                             GError           **error)
+{
+  int width, height;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+
+  if (!hd_raw_image_write_header (stream,
+                                  format,
+                                  width,
+                                  height,
+                                  cancellable,
+                                  error))
+    return FALSE;
+
+  return hd_raw_image_write_rows (stream,
+                                  format,
+                                  width,
+                                  gdk_pixbuf_get_pixels (pixbuf),
+                                  gdk_pixbuf_get_rowstride (pixbuf),
+                                  gdk_pixbuf_get_n_channels (pixbuf),
+                                  height,
+                                  cancellable,
+                                  error);
+}
+
+HDRawImage *
+hd_raw_image_map (const char  *filename,
+                  GError     **error)
+{
+  GMappedFile *mapped_file;
+  const HDRawImageHeader *header;
+  HDRawImage *image;
+  gsize length;
+
+  mapped_file = g_mapped_file_new (filename, FALSE, error);
+  if (!mapped_file)
+    return NULL;
+
+  length = g_mapped_file_get_length (mapped_file);
+  header = (const HDRawImageHeader *) g_mapped_file_get_contents (mapped_file);
+
+  if (length < sizeof (HDRawImageHeader) ||
+      memcmp (header->magic, HD_RAW_IMAGE_MAGIC, sizeof (header->magic)) ||
+      header->version != HD_RAW_IMAGE_VERSION ||
+      (header->format != HD_RAW_IMAGE_FORMAT_ARGB32 &&
+       header->format != HD_RAW_IMAGE_FORMAT_RGB565) ||
+      header->width == 0 ||
+      header->height == 0 ||
+      header->stride < (guint64) header->width * get_bytes_per_pixel (header->format) ||
+      header->data_offset < sizeof (HDRawImageHeader) ||
+      header->data_offset > length ||
+      (guint64) header->stride * header->height > length - header->data_offset)
+    {
+      g_set_error (error,
+                   GDK_PIXBUF_ERROR,
+                   GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                   "Invalid raw image file '%s'",
+                   filename);
+      g_mapped_file_free (mapped_file);
+      return NULL;
+    }
+
+  image = g_slice_new (HDRawImage);
+  image->mapped_file = mapped_file;
+  image->header = header;
+
+  return image;
+}
+
+const HDRawImageHeader *
+hd_raw_image_get_header (HDRawImage *image)
+{
+  return image->header;
+}
+
+const guchar *
+hd_raw_image_get_data (HDRawImage *image)
+{
+  return ((const guchar *) image->header) + image->header->data_offset;
+}
+
+void
+hd_raw_image_free (HDRawImage *image)
+{
+  g_mapped_file_free (image->mapped_file);
+
+  g_slice_free (HDRawImage, image);
+}
+
+/*
+ * Loads a raw image scaled down to width x height (box filter), reading
+ * the mapped pixels directly. Like gdk_pixbuf_new_from_file_at_scale the
+ * image is fit into width x height when preserving the aspect ratio.
+ */
+GdkPixbuf *
+hd_raw_image_load_at_scale (const char  *filename,
+                            int          width,
+                            int          height,
+                            gboolean     preserve_aspect_ratio,
+                            GError     **error)
+{
+  HDRawImage *image;
+  const HDRawImageHeader *header;
+  const guchar *data;
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  int rowstride, x, y;
+  gboolean argb32;
+
+  image = hd_raw_image_map (filename, error);
+  if (!image)
+    return NULL;
+
+  header = hd_raw_image_get_header (image);
+  data = hd_raw_image_get_data (image);
+  argb32 = header->format == HD_RAW_IMAGE_FORMAT_ARGB32;
+
+  if (preserve_aspect_ratio)
+    {
+      if ((guint64) width * header->height > (guint64) height * header->width)
+        width = MAX (height * header->width / header->height, 1);
+      else
+        height = MAX (width * header->height / header->width, 1);
+    }
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+                           argb32,
+                           8,
+                           width,
+                           height);
+  pixels = gdk_pixbuf_get_pixels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+
+  for (y = 0; y < height; y++)
+    {
+      guint y0 = y * header->height / height;
+      guint y1 = MAX ((y + 1) * header->height / height, y0 + 1);
+      guchar *dest = pixels + y * rowstride;
+
+      for (x = 0; x < width; x++)
+        {
+          guint x0 = x * header->width / width;
+          guint x1 = MAX ((x + 1) * header->width / width, x0 + 1);
+          guint a = 0, r = 0, g = 0, b = 0, n, i, j;
+
+          for (j = y0; j < y1; j++)
+            {
+              const guchar *row = data + j * header->stride;
+
+              for (i = x0; i < x1; i++)
+                {
+                  if (argb32)
+                    {
+                      guint32 pixel = ((const guint32 *) row)[i];
+
+                      a += pixel >> 24;
+                      r += (pixel >> 16) & 0xff;
+                      g += (pixel >> 8) & 0xff;
+                      b += pixel & 0xff;
+                    }
+                  else
+                    {
+                      guint16 pixel = ((const guint16 *) row)[i];
+
+                      r += ((pixel >> 11) & 0x1f) * 255 / 31;
+                      g += ((pixel >> 5) & 0x3f) * 255 / 63;
+                      b += (pixel & 0x1f) * 255 / 31;
+                    }
+                }
+            }
+
+          n = (x1 - x0) * (y1 - y0);
+
+          if (argb32)
+            {
+              /* Unpremultiply */
+              a = a / n;
+              r = a ? MIN (r / n * 255 / a, 255) : 0;
+              g = a ? MIN (g / n * 255 / a, 255) : 0;
+              b = a ? MIN (b / n * 255 / a, 255) : 0;
+
+              *dest++ = r;
+              *dest++ = g;
+              *dest++ = b;
+              *dest++ = a;
+            }
+          else
+            {
+              *dest++ = r / n;
+              *dest++ = g / n;
+              *dest++ = b / n;
+            }
+        }
+    }
+
+  hd_raw_image_free (image);
+
+  return pixbuf;
+}
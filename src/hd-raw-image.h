@@ -0,0 +1,92 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __HD_RAW_IMAGE_H__
+#define __HD_RAW_IMAGE_H__
+
+#include <gdk/gdk.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define HD_RAW_IMAGE_MAGIC "HDRAWIMG"
+#define HD_RAW_IMAGE_VERSION 1
+
+/* Pixels are stored in native byte order */
+typedef enum
+{
+  HD_RAW_IMAGE_FORMAT_ARGB32 = 1, /* premultiplied, like CAIRO_FORMAT_ARGB32 */
+  HD_RAW_IMAGE_FORMAT_RGB565 = 2  /* like CAIRO_FORMAT_RGB16_565 */
+} HDRawImageFormat;
+
+/* The pixel data starts at data_offset, which is page aligned, so the
+ * file can be mapped and used without copying */
+typedef struct
+{
+  gchar   magic[8];
+  guint32 version;
+  guint32 format;
+  guint32 width;
+  guint32 height;
+  guint32 stride;
+  guint32 data_offset;
+} HDRawImageHeader;
+
+typedef struct _HDRawImage HDRawImage;
+
+gboolean                hd_raw_image_save_to_stream (GOutputStream     *stream,
+                                                     GdkPixbuf         *pixbuf,
+                                                     HDRawImageFormat   format,
+                                                     GCancellable      *cancellable,
+                                                     GError           **error);
+
+gboolean                hd_raw_image_write_header   (GOutputStream     *stream,
+                                                     HDRawImageFormat   format,
+                                                     int                width,
+                                                     int                height,
+                                                     GCancellable      *cancellable,
+                                                     GError           **error);
+gboolean                hd_raw_image_write_rows     (GOutputStream     *stream,
+                                                     HDRawImageFormat   format,
+                                                     int                width,
+                                                     const guchar      *pixels,
+                                                     int                rowstride,
+                                                     int                n_channels,
+                                                     int                n_rows,
+                                                     GCancellable      *cancellable,
+                                                     GError           **error);
+
+HDRawImage             *hd_raw_image_map            (const char        *filename,
+                                                     GError           **error);
+const HDRawImageHeader *hd_raw_image_get_header     (HDRawImage        *image);
+const guchar           *hd_raw_image_get_data       (HDRawImage        *image);
+void                    hd_raw_image_free           (HDRawImage        *image);
+
+GdkPixbuf              *hd_raw_image_load_at_scale  (const char        *filename,
+                                                     int                width,
+                                                     int                height,
+                                                     gboolean           preserve_aspect_ratio,
+                                                     GError           **error);
+
+G_END_DECLS
+
+#endif
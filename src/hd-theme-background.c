@@ -26,6 +26,7 @@
 
 #include <glib/gi18n.h>
 
+#include "hd-background-catalog.h"
 #include "hd-backgrounds.h"
 #include "hd-object-vector.h"
 #include "hd-pixbuf-utils.h"
@@ -115,80 +116,47 @@ hd_theme_background_get_available (HDAvailableBackgrounds *backgrounds)
 }
 
 static void
-get_themes_from_themes_dir (GFile                  *themes_dir,
-                            HDAvailableBackgrounds *backgrounds)
+themes_found (HDObjectVector         *children,
+              HDAvailableBackgrounds *backgrounds)
 {
-  GFileEnumerator *enumerator;
-  GFileInfo *info;
-  GError *error = NULL;
-
-  enumerator = g_file_enumerate_children (themes_dir,
-                                          G_FILE_ATTRIBUTE_STANDARD_NAME,
-                                          G_FILE_QUERY_INFO_NONE,
-                                          NULL,
-                                          &error);
+  size_t i;
 
-  if (error)
+  for (i = 0; i < hd_object_vector_size (children); i++)
     {
-      char *path = g_file_get_path (themes_dir);
-      g_warning ("%s. Could not enumerate themes_dir %s. %s",
-                 __FUNCTION__,
-                 path,
-                 error->message);
-      g_free (path);
-      g_error_free (error);
-      return;
-    }
+      GFile *theme_dir = hd_object_vector_at (children, i);
+      char *name;
 
-  do
-    {
-      info = g_file_enumerator_next_file (enumerator,
-                                          NULL,
-                                          &error);
-      if (error)
-        {
-          char *path = g_file_get_path (themes_dir);
-          g_warning ("%s. Error enumerating themes_dir %s. %s",
-                     __FUNCTION__,
-                     path,
-                     error->message);
-          g_free (path);
-          g_error_free (error);
-          goto cleanup;
-        }
+      name = g_file_get_basename (theme_dir);
 
-      if (info)
+      if (g_strcmp0 (name, "default") != 0)
         {
-          const char *name;
-
-          name = g_file_info_get_name (info);
-
-          if (g_strcmp0 (name, "default") != 0)
-            {
-              HDBackground *background;
-              GFile *theme_dir = g_file_get_child (themes_dir, name);
-              GFile *desktop_file = g_file_resolve_relative_path (theme_dir,
-                                                                  "./backgrounds/theme_bg.desktop");
-              GFile *theme_file = g_file_get_child (theme_dir,
-                                                    "index.theme");
-              background = hd_theme_background_new (desktop_file,
-                                                    theme_file);
-              hd_imageset_background_init_async (HD_IMAGESET_BACKGROUND (background),
-                                                 NULL,
-                                                 (GAsyncReadyCallback) theme_loaded,
-                                                 backgrounds);
-              g_object_unref (theme_dir);
-              g_object_unref (desktop_file);
-              g_object_unref (theme_file);
-            }
-
-          g_object_unref (info);
+          HDBackground *background;
+          GFile *desktop_file = g_file_resolve_relative_path (theme_dir,
+                                                              "./backgrounds/theme_bg.desktop");
+          GFile *theme_file = g_file_get_child (theme_dir,
+                                                "index.theme");
+          background = hd_theme_background_new (desktop_file,
+                                                theme_file);
+          hd_imageset_background_init_async (HD_IMAGESET_BACKGROUND (background),
+                                             hd_available_backgrounds_get_cancellable (backgrounds),
+                                             (GAsyncReadyCallback) theme_loaded,
+                                             backgrounds);
+          g_object_unref (desktop_file);
+          g_object_unref (theme_file);
         }
+
+      g_free (name);
     }
-  while (info);
+}
 
-cleanup:
-  g_object_unref (enumerator);
+static void
+get_themes_from_themes_dir (GFile                  *themes_dir,
+                            HDAvailableBackgrounds *backgrounds)
+{
+  hd_background_catalog_list_folder_async (themes_dir,
+                                           hd_available_backgrounds_get_cancellable (backgrounds),
+                                           (HDBackgroundCatalogFilesFunc) themes_found,
+                                           backgrounds);
 }
 
 static GKeyFile *
@@ -357,6 +325,14 @@ theme_loaded (HDImagesetBackground   *background,
         g_object_unref (icon);
       g_free (label);
     }
+  else
+    {
+      /* The dialog is gone when cancelled */
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        hd_available_backgrounds_remove (backgrounds,
+                                         HD_BACKGROUND (background));
+      g_error_free (error);
+    }
 }
 
 static void
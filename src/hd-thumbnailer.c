@@ -0,0 +1,502 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
+
+#include "hd-background-stats.h"
+#include "hd-command-thread-pool.h"
+#include "hd-exif.h"
+
+#include "hd-thumbnailer.h"
+
+/* Maximal number of thumbnails created at once */
+#define THUMBNAILER_MAX_THREADS 2
+
+/* freedesktop.org thumbnail cache */
+#define THUMBNAIL_DIR ".thumbnails"
+#define THUMBNAIL_FLAVOR_NORMAL "normal"
+#define THUMBNAIL_FLAVOR_FAIL "fail", "hildon-home"
+#define THUMBNAIL_SIZE_NORMAL 128
+#define THUMBNAIL_KEY_URI "tEXt::Thumb::URI"
+#define THUMBNAIL_KEY_MTIME "tEXt::Thumb::MTime"
+
+/* The EXIF APP1 marker has to be in the first 64k of a JPEG file */
+#define EXIF_READ_SIZE (64 * 1024 + 64)
+
+#define JPEG_MARKER_SOI 0xd8
+#define JPEG_MARKER_SOS 0xda
+#define JPEG_MARKER_APP1 0xe1
+
+typedef struct
+{
+  GFile *file;
+  HDImageSize size;
+  GCancellable *cancellable;
+  HDThumbnailFunc thumbnail_func;
+  gpointer user_data;
+  GDestroyNotify destroy_data;
+
+  GdkPixbuf *thumbnail;
+} ThumbnailRequest;
+
+static HDCommandThreadPool *pool = NULL;
+
+static char *
+get_thumbnail_path (const char *uri,
+                    gboolean    failed)
+{
+  char *checksum, *name, *path;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, uri, -1);
+  name = g_strconcat (checksum, ".png", NULL);
+
+  if (failed)
+    path = g_build_filename (g_get_home_dir (),
+                             THUMBNAIL_DIR,
+                             THUMBNAIL_FLAVOR_FAIL,
+                             name,
+                             NULL);
+  else
+    path = g_build_filename (g_get_home_dir (),
+                             THUMBNAIL_DIR,
+                             THUMBNAIL_FLAVOR_NORMAL,
+                             name,
+                             NULL);
+
+  g_free (checksum);
+  g_free (name);
+
+  return path;
+}
+
+/* Returns the thumbnail in path if it was created from uri at mtime */
+static GdkPixbuf *
+load_cached_thumbnail (const char *path,
+                       const char *uri,
+                       guint64     mtime)
+{
+  GdkPixbuf *thumbnail;
+  const char *value;
+
+  thumbnail = gdk_pixbuf_new_from_file (path, NULL);
+  if (!thumbnail)
+    return NULL;
+
+  value = gdk_pixbuf_get_option (thumbnail, THUMBNAIL_KEY_MTIME);
+  if (!value || g_ascii_strtoull (value, NULL, 10) != mtime)
+    goto invalid;
+
+  value = gdk_pixbuf_get_option (thumbnail, THUMBNAIL_KEY_URI);
+  if (g_strcmp0 (value, uri) != 0)
+    goto invalid;
+
+  return thumbnail;
+
+invalid:
+  g_object_unref (thumbnail);
+
+  return NULL;
+}
+
+/* Writes the thumbnail to a temporary file which is renamed to path, so
+ * other readers never see a partial thumbnail */
+static void
+save_thumbnail (GdkPixbuf  *thumbnail,
+                const char *path,
+                const char *uri,
+                guint64     mtime)
+{
+  char *dir, *tmp_path, *mtime_value;
+  int fd;
+  GError *error = NULL;
+
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, S_IRUSR | S_IWUSR | S_IXUSR))
+    {
+      g_warning ("%s, Could not make dir %s",
+                 __FUNCTION__,
+                 dir);
+      g_free (dir);
+      return;
+    }
+  g_free (dir);
+
+  tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+  fd = g_mkstemp (tmp_path);
+  if (fd < 0)
+    {
+      g_warning ("%s. Could not create %s",
+                 __FUNCTION__,
+                 tmp_path);
+      g_free (tmp_path);
+      return;
+    }
+  close (fd);
+
+  mtime_value = g_strdup_printf ("%" G_GUINT64_FORMAT, mtime);
+
+  if (gdk_pixbuf_save (thumbnail,
+                       tmp_path,
+                       "png",
+                       &error,
+                       THUMBNAIL_KEY_URI, uri,
+                       THUMBNAIL_KEY_MTIME, mtime_value,
+                       "tEXt::Software", PACKAGE,
+                       NULL))
+    {
+      if (g_rename (tmp_path, path))
+        g_warning ("%s. Could not rename %s",
+                   __FUNCTION__,
+                   tmp_path);
+    }
+  else
+    {
+      g_warning ("%s. Could not save thumbnail. %s",
+                 __FUNCTION__,
+                 error->message);
+      g_error_free (error);
+    }
+
+  g_unlink (tmp_path);
+
+  g_free (mtime_value);
+  g_free (tmp_path);
+}
+
+static GdkPixbuf *
+load_jpeg_data (const guchar *data,
+                gsize         length,
+                guint         orientation)
+{
+  GdkPixbufLoader *loader;
+  GdkPixbuf *pixbuf = NULL;
+
+  loader = gdk_pixbuf_loader_new_with_type ("jpeg", NULL);
+  if (!loader)
+    return NULL;
+
+  if (gdk_pixbuf_loader_write (loader, data, length, NULL) &&
+      gdk_pixbuf_loader_close (loader, NULL))
+    pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+  else
+    gdk_pixbuf_loader_close (loader, NULL);
+
+  if (pixbuf)
+    {
+      g_object_ref (pixbuf);
+
+      /* Applied by hd_pixbuf_utils_scale_to_fit () */
+      if (orientation != 1)
+        {
+          char *value = g_strdup_printf ("%u", orientation);
+          gdk_pixbuf_set_option (pixbuf, "orientation", value);
+          g_free (value);
+        }
+    }
+
+  g_object_unref (loader);
+
+  return pixbuf;
+}
+
+/*
+ * Returns the thumbnail embedded in the EXIF data of a JPEG file, if it is
+ * at least as big as size. Camera images have one of about 160x120.
+ */
+static GdkPixbuf *
+load_exif_thumbnail (GFile        *file,
+                     HDImageSize  *size,
+                     GCancellable *cancellable)
+{
+  GFileInputStream *stream;
+  guchar *data;
+  gsize length, offset = 2;
+  GdkPixbuf *thumbnail = NULL;
+
+  stream = g_file_read (file, cancellable, NULL);
+  if (!stream)
+    return NULL;
+
+  data = g_malloc (EXIF_READ_SIZE);
+
+  if (!g_input_stream_read_all (G_INPUT_STREAM (stream),
+                                data,
+                                EXIF_READ_SIZE,
+                                &length,
+                                cancellable,
+                                NULL) ||
+      length < 4 ||
+      data[0] != 0xff || data[1] != JPEG_MARKER_SOI)
+    goto cleanup;
+
+  /* Walk the markers in front of the image data */
+  while (offset + 4 <= length &&
+         data[offset] == 0xff &&
+         data[offset + 1] != JPEG_MARKER_SOS)
+    {
+      guint marker = data[offset + 1];
+      gsize marker_length = (data[offset + 2] << 8) | data[offset + 3];
+
+      if (marker_length < 2 || offset + 2 + marker_length > length)
+        break;
+
+      if (marker == JPEG_MARKER_APP1 &&
+          hd_exif_is_exif_marker (data + offset + 4, marker_length - 2))
+        {
+          const guchar *tiff = data + offset + 4 + HD_EXIF_HEADER_SIZE;
+          gsize tiff_length = marker_length - 2 - HD_EXIF_HEADER_SIZE;
+          gsize thumbnail_offset, thumbnail_length;
+
+          if (hd_exif_get_thumbnail (tiff,
+                                     tiff_length,
+                                     &thumbnail_offset,
+                                     &thumbnail_length))
+            thumbnail = load_jpeg_data (tiff + thumbnail_offset,
+                                        thumbnail_length,
+                                        hd_exif_get_orientation (tiff,
+                                                                 tiff_length));
+          break;
+        }
+
+      offset += 2 + marker_length;
+    }
+
+  /* Do not scale up small thumbnails, orientations 5-8 swap the sides */
+  if (thumbnail &&
+      MAX (gdk_pixbuf_get_width (thumbnail), gdk_pixbuf_get_height (thumbnail)) <
+      MAX (size->width, size->height))
+    thumbnail = (g_object_unref (thumbnail), NULL);
+
+cleanup:
+  g_free (data);
+  g_object_unref (stream);
+
+  return thumbnail;
+}
+
+/* Creates the normal size thumbnail of file */
+static GdkPixbuf *
+create_thumbnail (GFile         *file,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  HDImageSize normal_size = {THUMBNAIL_SIZE_NORMAL, THUMBNAIL_SIZE_NORMAL};
+  GdkPixbuf *exif_thumbnail, *thumbnail;
+
+  /* The EXIF thumbnail is saved as the normal thumbnail, so it must not be
+   * smaller than that */
+  exif_thumbnail = load_exif_thumbnail (file,
+                                        &normal_size,
+                                        cancellable);
+  if (exif_thumbnail)
+    {
+      thumbnail = hd_pixbuf_utils_scale_to_fit (exif_thumbnail,
+                                                &normal_size,
+                                                cancellable,
+                                                error);
+      g_object_unref (exif_thumbnail);
+
+      return thumbnail;
+    }
+
+  return hd_pixbuf_utils_load_scaled (file,
+                                      &normal_size,
+                                      NULL,
+                                      cancellable,
+                                      error);
+}
+
+/* Returns the normal size thumbnail of file from the cache or creates it */
+static GdkPixbuf *
+get_thumbnail (GFile         *file,
+               GCancellable  *cancellable)
+{
+  GFileInfo *info;
+  guint64 mtime;
+  char *uri, *path = NULL, *fail_path = NULL;
+  GdkPixbuf *thumbnail = NULL, *failed;
+  GError *error = NULL;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            NULL);
+  if (!info)
+    return NULL;
+
+  mtime = g_file_info_get_attribute_uint64 (info,
+                                            G_FILE_ATTRIBUTE_TIME_MODIFIED);
+  g_object_unref (info);
+
+  uri = g_file_get_uri (file);
+
+  path = get_thumbnail_path (uri, FALSE);
+  thumbnail = load_cached_thumbnail (path, uri, mtime);
+  if (thumbnail)
+    goto cleanup;
+
+  /* Do not try again to create a thumbnail which failed before */
+  fail_path = get_thumbnail_path (uri, TRUE);
+  failed = load_cached_thumbnail (fail_path, uri, mtime);
+  if (failed)
+    {
+      g_object_unref (failed);
+      goto cleanup;
+    }
+
+  thumbnail = create_thumbnail (file,
+                                cancellable,
+                                &error);
+
+  if (thumbnail)
+    save_thumbnail (thumbnail, path, uri, mtime);
+  else if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_debug ("%s. Could not create thumbnail of %s. %s",
+               __FUNCTION__,
+               uri,
+               error ? error->message : "");
+
+      failed = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, 1, 1);
+      gdk_pixbuf_fill (failed, 0);
+      save_thumbnail (failed, fail_path, uri, mtime);
+      g_object_unref (failed);
+    }
+
+  if (error)
+    g_error_free (error);
+
+cleanup:
+  g_free (uri);
+  g_free (path);
+  g_free (fail_path);
+
+  return thumbnail;
+}
+
+static void
+thumbnail_request_free (ThumbnailRequest *request)
+{
+  if (request->destroy_data)
+    request->destroy_data (request->user_data);
+
+  g_object_unref (request->file);
+  if (request->cancellable)
+    g_object_unref (request->cancellable);
+  if (request->thumbnail)
+    g_object_unref (request->thumbnail);
+
+  g_slice_free (ThumbnailRequest, request);
+}
+
+static gboolean
+thumbnail_done_idle (ThumbnailRequest *request)
+{
+  if (request->thumbnail &&
+      !g_cancellable_is_cancelled (request->cancellable))
+    request->thumbnail_func (request->thumbnail,
+                             request->user_data);
+
+  return FALSE;
+}
+
+/* Runs in a worker thread */
+static void
+thumbnail_command (ThumbnailRequest *request)
+{
+  /* Keep the thumbnails out of the cached background statistics */
+  hd_background_stats_set_thread_enabled (FALSE);
+
+  if (!g_cancellable_is_cancelled (request->cancellable))
+    {
+      GdkPixbuf *thumbnail;
+
+      thumbnail = get_thumbnail (request->file,
+                                 request->cancellable);
+
+      if (thumbnail)
+        {
+          request->thumbnail = hd_pixbuf_utils_scale_to_fit (thumbnail,
+                                                             &request->size,
+                                                             request->cancellable,
+                                                             NULL);
+          g_object_unref (thumbnail);
+        }
+    }
+
+  hd_background_stats_set_thread_enabled (TRUE);
+
+  /* The request is freed in the main thread, the destroy notify of the
+   * user data may use GTK+ */
+  gdk_threads_add_idle_full (G_PRIORITY_DEFAULT_IDLE,
+                             (GSourceFunc) thumbnail_done_idle,
+                             request,
+                             (GDestroyNotify) thumbnail_request_free);
+}
+
+/*
+ * Requests a thumbnail of file scaled to fit into size. thumbnail_func is
+ * called in the main thread unless creating it failed or cancellable was
+ * cancelled. destroy_data is called with user_data in the main thread in
+ * any case.
+ */
+void
+hd_thumbnailer_request (GFile           *file,
+                        HDImageSize     *size,
+                        GCancellable    *cancellable,
+                        HDThumbnailFunc  thumbnail_func,
+                        gpointer         user_data,
+                        GDestroyNotify   destroy_data)
+{
+  ThumbnailRequest *request;
+
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (size != NULL);
+  g_return_if_fail (thumbnail_func != NULL);
+
+  if (G_UNLIKELY (!pool))
+    pool = hd_command_thread_pool_new_with_max_threads (THUMBNAILER_MAX_THREADS);
+
+  request = g_slice_new0 (ThumbnailRequest);
+  request->file = g_object_ref (file);
+  request->size = *size;
+  if (cancellable)
+    request->cancellable = g_object_ref (cancellable);
+  request->thumbnail_func = thumbnail_func;
+  request->user_data = user_data;
+  request->destroy_data = destroy_data;
+
+  hd_command_thread_pool_push (pool,
+                               (HDCommandCallback) thumbnail_command,
+                               request,
+                               NULL);
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of hildon-home
+ *
+ * Copyright (C) 2010 Nokia Corporation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __HD_THUMBNAILER_H__
+#define __HD_THUMBNAILER_H__
+
+#include <gdk/gdk.h>
+#include <gio/gio.h>
+
+#include "hd-pixbuf-utils.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Thumbnails of background images, created in a small pool of worker
+ * threads and cached in ~/.thumbnails as in the freedesktop.org thumbnail
+ * specification.
+ */
+
+/* Called in the main thread with the thumbnail scaled to fit the
+ * requested size */
+typedef void (*HDThumbnailFunc) (GdkPixbuf *thumbnail,
+                                 gpointer   user_data);
+
+void hd_thumbnailer_request (GFile           *file,
+                             HDImageSize     *size,
+                             GCancellable    *cancellable,
+                             HDThumbnailFunc  thumbnail_func,
+                             gpointer         user_data,
+                             GDestroyNotify   destroy_data);
+
+G_END_DECLS
+
+#endif
@@ -36,6 +36,10 @@
 #define WALLPAPER_WIDTH  (HD_DESKTOP_VIEWS * HD_SCREEN_WIDTH)
 #define WALLPAPER_HEIGHT HD_SCREEN_HEIGHT
 
+/* Geometry of the cached image of a view, see
+ * hd_backgrounds_link_stored_cached_image () */
+#define SLICE_GEOMETRY "wallpaper-slice-%u"
+
 #define QUERY_RDFQ                      "" \
   "<rdfq:Condition>"                       \
   "<rdfq:equals>"                          \
@@ -60,7 +64,6 @@ enum
 typedef struct
 {
   GFile *file;
-  GCancellable *cancellable;
 } CommandData;
 
 #define HD_WALLPAPER_BACKGROUND_GET_PRIVATE(object) \
@@ -71,7 +74,8 @@ static void hd_wallpaper_background_set_for_current_view (HDBackground   *backgr
                                                           GCancellable   *cancellable);
 static GFile *hd_wallpaper_background_get_image_file_for_view (HDBackground *background,
                                                                guint         view);
-static void create_cached_image_command (CommandData *data);
+static void create_cached_image_command (CommandData  *data,
+                                         GCancellable *cancellable);
 
 static void hd_wallpaper_background_dispose      (GObject *object);
 static void hd_wallpaper_background_get_property (GObject      *object,
@@ -83,8 +87,7 @@ static void hd_wallpaper_background_set_property (GObject      *object,
                                                   const GValue *value,
                                                   GParamSpec   *pspec);
 
-static CommandData* command_data_new  (GFile        *file,
-                                       GCancellable *cancellable);
+static CommandData* command_data_new  (GFile        *file);
 static void         command_data_free (CommandData  *data);
 
 G_DEFINE_TYPE (HDWallpaperBackground, hd_wallpaper_background, HD_TYPE_BACKGROUND);
@@ -123,33 +126,262 @@ hd_wallpaper_background_set_for_current_view (HDBackground   *background,
 
   gboolean error_dialogs = TRUE;
  
-  data = command_data_new (priv->file,
-                           cancellable);
+  data = command_data_new (priv->file);
 
   hd_backgrounds_add_create_cached_image (hd_backgrounds_get (),
                                           priv->file,
+                                          HD_BACKGROUNDS_ALL_VIEWS,
                                           error_dialogs,
                                           cancellable,
-                                          (HDCommandCallback) create_cached_image_command,
+                                          (HDCachedImageCommand) create_cached_image_command,
                                           data,
                                           (GDestroyNotify) command_data_free);
 }
 
+/* Writers of the views, filled with the rows of the panorama */
+typedef struct
+{
+  GCancellable *cancellable;
+  gboolean started;
+  /* Views which were taken from the cache store */
+  guint32 stored_views;
+  /* Views whose writer failed, to be created from the whole image */
+  guint32 failed_views;
+  /* Set when the decoding was stopped because all writers failed */
+  gboolean writers_failed;
+  HDCachedImageWriter *writers[HD_DESKTOP_VIEWS];
+} SliceData;
+
+static gboolean
+start_slicing (SliceData  *slice,
+               GError    **error)
+{
+  guint view, n_writers = 0;
+  GError *local_error = NULL;
+
+  gboolean error_dialogs = TRUE;
+
+  for (view = 0; view < HD_DESKTOP_VIEWS; view++)
+    {
+      if (slice->stored_views & (1u << view))
+        continue;
+
+      slice->writers[view] = hd_backgrounds_create_cached_image_writer (hd_backgrounds_get (),
+                                                                        view,
+                                                                        HD_SCREEN_WIDTH,
+                                                                        HD_SCREEN_HEIGHT,
+                                                                        3,
+                                                                        error_dialogs,
+                                                                        slice->cancellable,
+                                                                        &local_error);
+
+      /* The cache format cannot be written in rows */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        {
+          g_propagate_error (error, local_error);
+          return FALSE;
+        }
+
+      if (local_error)
+        g_clear_error (&local_error);
+      else
+        n_writers++;
+    }
+
+  if (!n_writers)
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Could not create any cached image");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Splits a block of panorama rows into the views */
+static gboolean
+slice_rows (const guchar  *pixels,
+            int            rowstride,
+            int            y,
+            int            n_rows,
+            SliceData     *slice,
+            GError       **error)
+{
+  guint view, n_writers = 0;
+  GError *local_error = NULL;
+
+  /* Writers are only created once the image is known to decode in rows */
+  if (!slice->started)
+    {
+      slice->started = TRUE;
+
+      if (!start_slicing (slice, error))
+        return FALSE;
+    }
+
+  for (view = 0; view < HD_DESKTOP_VIEWS; view++)
+    {
+      if (!slice->writers[view])
+        continue;
+
+      /* Only the error of the last failed writer is kept */
+      g_clear_error (&local_error);
+
+      if (hd_cached_image_writer_write_rows (slice->writers[view],
+                                             pixels + view * HD_SCREEN_WIDTH * 3,
+                                             rowstride,
+                                             n_rows,
+                                             &local_error))
+        {
+          n_writers++;
+          continue;
+        }
+
+      g_debug ("%s. Could not write cached image of view %u. %s",
+               __FUNCTION__,
+               view,
+               local_error->message);
+
+      hd_cached_image_writer_free (slice->writers[view]);
+      slice->writers[view] = NULL;
+      slice->failed_views |= 1u << view;
+    }
+
+  /* Do not decode the rest of the image for nothing */
+  if (!n_writers)
+    {
+      slice->writers_failed = TRUE;
+      g_propagate_error (error, local_error);
+      return FALSE;
+    }
+
+  g_clear_error (&local_error);
+
+  return TRUE;
+}
+
+/*
+ * Creates the cached images of all views in a single pass over the decoded
+ * rows of the panorama, so only a few rows are in memory at once. Fails
+ * with G_IO_ERROR_NOT_SUPPORTED if the image or the cache format cannot be
+ * handled in rows. Views whose cached image could not be written are
+ * returned in failed_views, to be retried from the whole image.
+ */
+static gboolean
+create_cached_images_from_rows (CommandData   *data,
+                                guint32        stored_views,
+                                guint32       *failed_views,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+  HDImageSize wallpaper_size = {WALLPAPER_WIDTH, WALLPAPER_HEIGHT};
+  SliceData slice = { 0, };
+  char *etag = NULL;
+  guint view;
+  gboolean result;
+  GError *local_error = NULL;
+
+  gboolean update_gconf = TRUE;
+
+  slice.cancellable = cancellable;
+  slice.stored_views = stored_views;
+
+  result = hd_pixbuf_utils_load_rows_at_size (data->file,
+                                              &wallpaper_size,
+                                              &etag,
+                                              (HDPixbufRowsFunc) slice_rows,
+                                              &slice,
+                                              cancellable,
+                                              error);
+
+  for (view = 0; view < HD_DESKTOP_VIEWS; view++)
+    {
+      if (!slice.writers[view])
+        continue;
+
+      if (result &&
+          !hd_backgrounds_commit_cached_image_writer (hd_backgrounds_get (),
+                                                      slice.writers[view],
+                                                      data->file,
+                                                      etag,
+                                                      update_gconf,
+                                                      cancellable,
+                                                      &local_error))
+        g_clear_error (&local_error);
+
+      hd_cached_image_writer_free (slice.writers[view]);
+    }
+
+  g_free (etag);
+
+  /* A retry only helps if the image itself could be decoded */
+  *failed_views = result || slice.writers_failed ? slice.failed_views : 0;
+
+  return result;
+}
+
 static void
-create_cached_image_command (CommandData *data)
+create_cached_image_command (CommandData  *data,
+                             GCancellable *cancellable)
 {
   HDImageSize wallpaper_size = {WALLPAPER_WIDTH, WALLPAPER_HEIGHT};
   GdkPixbuf *pixbuf;
-  char *etag;
+  char *etag = NULL;
+  guint32 stored_views = 0, failed_views;
   guint view;
   GError *error = NULL;
 
   gboolean error_dialogs = TRUE, update_gconf = TRUE;
 
+  /* Reuse the cached images created before from the same wallpaper */
+  for (view = 0; view < HD_DESKTOP_VIEWS; view++)
+    {
+      char *geometry = g_strdup_printf (SLICE_GEOMETRY, view);
+
+      if (hd_backgrounds_link_stored_cached_image (hd_backgrounds_get (),
+                                                   view,
+                                                   data->file,
+                                                   geometry,
+                                                   update_gconf,
+                                                   cancellable))
+        stored_views |= 1u << view;
+
+      g_free (geometry);
+    }
+
+  if (stored_views == (1u << HD_DESKTOP_VIEWS) - 1)
+    return;
+
+  if (!create_cached_images_from_rows (data,
+                                       stored_views,
+                                       &failed_views,
+                                       cancellable,
+                                       &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        failed_views = ~stored_views & ((1u << HD_DESKTOP_VIEWS) - 1);
+      else if (!failed_views)
+        {
+          g_debug ("%s. Could not create cached images. %s",
+                   __FUNCTION__,
+                   error->message);
+          g_error_free (error);
+          return;
+        }
+
+      g_clear_error (&error);
+    }
+
+  if (!failed_views || g_cancellable_is_cancelled (cancellable))
+    return;
+
+  /* Fall back to slicing the whole decoded image */
   pixbuf = hd_pixbuf_utils_load_at_size (data->file,
                                          &wallpaper_size,
                                          &etag,
-                                         data->cancellable,
+                                         cancellable,
                                          &error);
 
   if (!pixbuf)
@@ -157,11 +389,16 @@ create_cached_image_command (CommandData *data)
 
   for (view = 0; view < HD_DESKTOP_VIEWS; view++)
     {
-      GdkPixbuf *sub = gdk_pixbuf_new_subpixbuf (pixbuf,
-                                                 view * HD_SCREEN_WIDTH,
-                                                 0,
-                                                 HD_SCREEN_WIDTH,
-                                                 HD_SCREEN_HEIGHT);
+      GdkPixbuf *sub;
+
+      if (!(failed_views & (1u << view)))
+        continue;
+
+      sub = gdk_pixbuf_new_subpixbuf (pixbuf,
+                                      view * HD_SCREEN_WIDTH,
+                                      0,
+                                      HD_SCREEN_WIDTH,
+                                      HD_SCREEN_HEIGHT);
 
       hd_backgrounds_save_cached_image (hd_backgrounds_get (),
                                         sub,
@@ -170,7 +407,7 @@ create_cached_image_command (CommandData *data)
                                         etag,
                                         error_dialogs,
                                         update_gconf,
-                                        data->cancellable,
+                                        cancellable,
                                         &error);
 
       if (error)
@@ -182,6 +419,8 @@ create_cached_image_command (CommandData *data)
 cleanup:
   if (pixbuf)
     g_object_unref (pixbuf);
+  if (error)
+    g_error_free (error);
   g_free (etag);
 }
 
@@ -317,13 +556,11 @@ hd_wallpaper_background_set_property (GObject      *object,
 }
 
 static CommandData*
-command_data_new  (GFile        *file,
-                   GCancellable *cancellable)
+command_data_new  (GFile        *file)
 {
   CommandData *data = g_slice_new0 (CommandData);
 
   data->file = g_object_ref (file);
-  data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
 
   return data;
 }
@@ -336,9 +573,6 @@ command_data_free (CommandData *data)
 
   g_object_unref (data->file);
 
-  if (data->cancellable)
-    g_object_unref (data->cancellable);
-
   g_slice_free (CommandData, data);
 }
 
@@ -36,6 +36,7 @@
 #include <signal.h>
 #include <stdlib.h>
 
+#include "hd-background-stats.h"
 #include "hd-backgrounds.h"
 #include "hd-notification-manager.h"
 #include "hd-system-notifications.h"
@@ -77,6 +78,26 @@ signal_handler (int signal)
                    (GSourceFunc)gtk_main_quit, NULL, NULL);
 }
 
+static gboolean
+dump_background_stats (gpointer data)
+{
+  gchar *stats;
+
+  stats = hd_background_stats_to_string ();
+  g_message ("Background stage timings:\n%s", stats);
+  g_free (stats);
+
+  return FALSE;
+}
+
+/* SIGUSR1 dumps the stage timings of the cached background images */
+static void
+dump_stats_signal_handler (int signal)
+{
+  g_idle_add_full (G_PRIORITY_DEFAULT,
+                   dump_background_stats, NULL, NULL);
+}
+
 static void
 load_operator_applet (void)
 {
@@ -337,6 +358,7 @@ main (int argc, char **argv)
   /* Add handler for signals */
   signal (SIGINT,  signal_handler);
   signal (SIGTERM, signal_handler);
+  signal (SIGUSR1, dump_stats_signal_handler);
 
   /* May do waitidle if we're started the first time since boot
    * and not from the terminal. */
@@ -421,6 +443,9 @@ main (int argc, char **argv)
   
   g_rename (HD_HOME_STAMP_FILE, HD_HOME_STAMP_FILE".sav");
 
+  /* Write pending cache info changes */
+  hd_backgrounds_flush_cache_info (hd_backgrounds_get ());
+
   /* We got a signal, flush the database.  How we do it breaks
    * if somebody has taken reference of the nm, but we don't. */
   g_object_unref (hd_notification_manager_get ());